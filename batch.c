@@ -0,0 +1,365 @@
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+
+void batch_init(struct batch *b)
+{
+    memset(b, 0, sizeof(*b));
+    b->total = BATCH_HEADER_LEN;
+    b->fd = -1;
+}
+
+void batch_free(struct batch *b)
+{
+    for (size_t i = 0; i < b->count; ++i) {
+        free(b->entries[i].path);
+        free(b->entries[i].name);
+    }
+    free(b->entries);
+    if (b->fd >= 0)
+        close(b->fd);
+    b->entries = NULL;
+    b->count = b->cap = 0;
+    b->fd = -1;
+}
+
+static int batch_push(struct batch *b, const char *path, const char *name, const struct stat *st)
+{
+    if (strlen(name) >= PATH_MAX - 64) {
+        fprintf(stderr, "Name too long: %s\n", name);
+        return -1;
+    }
+    if (b->count == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        struct batch_entry *entries = realloc(b->entries, cap * sizeof(*entries));
+        if (!entries) {
+            fprintf(stderr, "Insufficient memory for file list\n");
+            return -1;
+        }
+        b->entries = entries;
+        b->cap = cap;
+    }
+    struct batch_entry *e = &b->entries[b->count];
+    e->path = strdup(path);
+    e->name = strdup(name);
+    if (!e->path || !e->name) {
+        fprintf(stderr, "Insufficient memory for file list\n");
+        free(e->path);
+        free(e->name);
+        return -1;
+    }
+    e->mode = st->st_mode;
+    e->size = S_ISREG(st->st_mode) ? (uint64_t)st->st_size : 0;
+    b->total += BATCH_HEADER_LEN + strlen(name) + e->size;
+    b->count++;
+    return 0;
+}
+
+static int batch_walk(struct batch *b, const char *path, const char *name)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Skipping %s, not a file or directory\n", path);
+        return 0;
+    }
+    if (batch_push(b, path, name, &st) < 0)
+        return -1;
+    if (!S_ISDIR(st.st_mode))
+        return 0;
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int res = 0;
+    struct dirent *de;
+    while (!res && (de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        char subpath[PATH_MAX];
+        char subname[PATH_MAX];
+        if (snprintf(subpath, sizeof(subpath), "%s/%s", path, de->d_name) >= PATH_MAX ||
+            snprintf(subname, sizeof(subname), "%s/%s", name, de->d_name) >= PATH_MAX) {
+            fprintf(stderr, "Path too long: %s/%s\n", path, de->d_name);
+            res = -1;
+            break;
+        }
+        res = batch_walk(b, subpath, subname);
+    }
+    closedir(dir);
+    return res;
+}
+
+int batch_add(struct batch *b, const char *path)
+{
+    //name it after where it really is, so "." and "dir/" work too
+    char *real = realpath(path, NULL);
+    if (!real) {
+        fprintf(stderr, "Failed to find %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    const char *name = basename(real);
+    int res = -1;
+    if (!strcmp(name, "/"))
+        fprintf(stderr, "Can't send all of /\n");
+    else
+        res = batch_walk(b, path, name);
+    free(real);
+    return res;
+}
+
+//Header of entry i, or the end marker past the last one. Returns its length.
+static size_t batch_header(const struct batch *b, size_t i, char *hdr)
+{
+    const struct batch_entry *e = i < b->count ? &b->entries[i] : NULL;
+    uint16_t namelen = e ? strlen(e->name) : 0;
+    uint16_t be16 = htobe16(namelen);
+    uint32_t be32 = htobe32(e ? e->mode : 0);
+    uint64_t be64 = htobe64(e ? e->size : 0);
+    memcpy(hdr, &be16, 2);
+    memcpy(&hdr[2], &be32, 4);
+    memcpy(&hdr[6], &be64, 8);
+    if (e)
+        memcpy(&hdr[BATCH_HEADER_LEN], e->name, namelen);
+    return BATCH_HEADER_LEN + namelen;
+}
+
+ssize_t batch_read(void *opaque, char *buf, size_t len, uint64_t at)
+{
+    //the stream is only ever read front to back
+    (void)at;
+    struct batch *b = (struct batch *)opaque;
+    size_t got = 0;
+    while (got < len && b->next <= b->count) {
+        char hdr[BATCH_HEADER_LEN + PATH_MAX];
+        size_t hlen = batch_header(b, b->next, hdr);
+        if (b->pos < hlen) {
+            size_t n = hlen - b->pos < len - got ? hlen - b->pos : len - got;
+            memcpy(&buf[got], &hdr[b->pos], n);
+            b->pos += n;
+            got += n;
+            continue;
+        }
+
+        const struct batch_entry *e = b->next < b->count ? &b->entries[b->next] : NULL;
+        if (e && b->pos < hlen + e->size) {
+            if (b->fd < 0 && (b->fd = open(e->path, O_RDONLY | O_CLOEXEC)) < 0) {
+                fprintf(stderr, "Failed to open %s: %s\n", e->path, strerror(errno));
+                return -1;
+            }
+            uint64_t left = hlen + e->size - b->pos;
+            ssize_t n = read(b->fd, &buf[got], left < len - got ? left : len - got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                fprintf(stderr, "Failed to read %s: %s\n", e->path,
+                        n ? strerror(errno) : "file shrank while sending");
+                return -1;
+            }
+            b->pos += n;
+            got += n;
+            continue;
+        }
+
+        if (b->fd >= 0)
+            close(b->fd);
+        b->fd = -1;
+        b->next++;
+        b->pos = 0;
+    }
+    return got;
+}
+
+void batch_writer_init(struct batch_writer *w, const char *outdir)
+{
+    memset(w, 0, sizeof(*w));
+    w->outdir = outdir;
+    w->fd = -1;
+    w->mask = umask(0);
+    umask(w->mask);
+}
+
+//Names come from the other end, so only accept plain relative paths.
+static int name_valid(const char *name)
+{
+    if (name[0] == '/')
+        return 0;
+    for (const char *c = name; *c;) {
+        size_t l = strcspn(c, "/");
+        if (!l || (l == 1 && c[0] == '.') || (l == 2 && c[0] == '.' && c[1] == '.'))
+            return 0;
+        c += l;
+        if (*c == '/' && !*++c)
+            return 0;
+    }
+    return 1;
+}
+
+//Create the directories leading up to path.
+static int make_parents(const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *c = strchr(&dir[1], '/'); c; c = strchr(c + 1, '/')) {
+        *c = '\0';
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+            return -1;
+        }
+        *c = '/';
+    }
+    return 0;
+}
+
+static int entry_end(struct batch_writer *w)
+{
+    int res = 0;
+    if (w->fd >= 0) {
+        if (close(w->fd) < 0 || rename(w->tmp, w->path) < 0) {
+            fprintf(stderr, "Failed to save %s: %s\n", w->path, strerror(errno));
+            unlink(w->tmp);
+            res = -1;
+        }
+        w->fd = -1;
+    }
+    w->files++;
+    w->hdrlen = 0;
+    w->namelen = w->namegot = 0;
+    return res;
+}
+
+static int entry_start(struct batch_writer *w, uint64_t size)
+{
+    if (!name_valid(w->name) ||
+        snprintf(w->path, sizeof(w->path), "%s/%s", w->outdir, w->name) >= PATH_MAX ||
+        (!S_ISDIR(w->mode) && !S_ISREG(w->mode))) {
+        fprintf(stderr, "Invalid entry %s in batch\n", w->name);
+        return -1;
+    }
+    if (make_parents(w->path) < 0)
+        return -1;
+
+    //directories stay writable by us, so whatever is inside can still be
+    //created
+    if (S_ISDIR(w->mode)) {
+        if (mkdir(w->path, (w->mode & 0777) | 0700) < 0 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create %s: %s\n", w->path, strerror(errno));
+            return -1;
+        }
+        return entry_end(w);
+    }
+
+    char dir[PATH_MAX];
+    char base[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", w->path);
+    snprintf(base, sizeof(base), "%s", w->path);
+    if (snprintf(w->tmp, sizeof(w->tmp), "%s/.%s.XXXXXX", dirname(dir), basename(base)) >= PATH_MAX) {
+        fprintf(stderr, "Invalid entry %s in batch\n", w->name);
+        return -1;
+    }
+    if ((w->fd = mkstemp(w->tmp)) < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", w->tmp, strerror(errno));
+        return -1;
+    }
+    fchmod(w->fd, w->mode & 0777 & ~w->mask);
+    w->left = size;
+    return size ? 0 : entry_end(w);
+}
+
+int batch_write(struct batch_writer *w, const char *data, size_t len)
+{
+    while (len) {
+        if (w->done) {
+            fprintf(stderr, "Data past the end of the batch\n");
+            return -1;
+        }
+
+        if (w->hdrlen < BATCH_HEADER_LEN) {
+            size_t n = BATCH_HEADER_LEN - w->hdrlen < len ? BATCH_HEADER_LEN - w->hdrlen : len;
+            memcpy(&w->hdr[w->hdrlen], data, n);
+            w->hdrlen += n;
+            data += n;
+            len -= n;
+            if (w->hdrlen < BATCH_HEADER_LEN)
+                break;
+            uint16_t be16;
+            uint32_t be32;
+            uint64_t be64;
+            memcpy(&be16, w->hdr, 2);
+            memcpy(&be32, &w->hdr[2], 4);
+            memcpy(&be64, &w->hdr[6], 8);
+            w->namelen = be16toh(be16);
+            w->namegot = 0;
+            w->mode = be32toh(be32);
+            w->left = be64toh(be64);
+            if (!w->namelen)
+                w->done = 1;
+            else if (w->namelen >= PATH_MAX) {
+                fprintf(stderr, "Invalid entry in batch\n");
+                return -1;
+            }
+            continue;
+        }
+
+        if (w->namegot < w->namelen) {
+            size_t n = w->namelen - w->namegot < len ? w->namelen - w->namegot : len;
+            memcpy(&w->name[w->namegot], data, n);
+            w->namegot += n;
+            data += n;
+            len -= n;
+            if (w->namegot < w->namelen)
+                break;
+            w->name[w->namelen] = '\0';
+            if (entry_start(w, w->left) < 0)
+                return -1;
+            continue;
+        }
+
+        //the rest of the file, or as much of it as is here, in one write
+        size_t n = w->left < len ? w->left : len;
+        for (size_t done = 0; done < n;) {
+            ssize_t r = write(w->fd, &data[done], n - done);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0) {
+                fprintf(stderr, "Failed to write %s: %s\n", w->path, strerror(errno));
+                return -1;
+            }
+            done += r;
+        }
+        w->left -= n;
+        data += n;
+        len -= n;
+        if (!w->left && entry_end(w) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int batch_writer_finish(struct batch_writer *w)
+{
+    if (w->fd >= 0) {
+        close(w->fd);
+        unlink(w->tmp);
+        w->fd = -1;
+    }
+    if (!w->done) {
+        fprintf(stderr, "Batch incomplete, got %llu entries\n", (unsigned long long)w->files);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/limits.h>
+
+//Many files and directories sent over one paired connection. The batch is a
+//single stream of entries, each
+//
+//  name length (2 bytes) | mode (4 bytes) | size (8 bytes) | name | data
+//
+//all big endian, with the mode as from stat (file type included) and size
+//bytes of data following regular files only. Names are relative paths using
+//'/', and a directory's entry comes before anything inside it. An entry with
+//an empty name ends the batch. The stream goes through the same block
+//pipeline as a single file's data, so it can be compressed and encrypted.
+#define BATCH_HEADER_LEN 14
+
+struct batch_entry {
+    char *path;           //where send reads it from
+    char *name;           //what receive calls it
+    uint32_t mode;
+    uint64_t size;
+};
+
+//What send reads the stream from, entry by entry.
+struct batch {
+    struct batch_entry *entries;
+    size_t count;
+    size_t cap;
+    uint64_t total;       //length of the whole stream, end marker included
+    //reading position
+    size_t next;          //entry being read
+    uint64_t pos;         //bytes of it (header included) already read
+    int fd;               //the open file of that entry, or -1
+};
+
+void batch_init(struct batch *b);
+void batch_free(struct batch *b);
+
+//Add a file, or a directory and everything under it, named after its last
+//path component. Anything that isn't a regular file or directory is skipped
+//with a warning. Returns 0 or -1.
+int batch_add(struct batch *b, const char *path);
+
+//Read the next len bytes of the stream into buf, filling it from as many
+//entries as fit, so runs of small files go out in large blocks. Files are
+//sent as they were when added, a file that shrank since fails the read.
+//Returns the number of bytes read, short only at the end, or -1.
+ssize_t batch_read(void *b, char *buf, size_t len, uint64_t at);
+
+//Recreates a batch in a directory as the stream arrives.
+struct batch_writer {
+    const char *outdir;
+    char hdr[BATCH_HEADER_LEN];
+    size_t hdrlen;        //bytes of the next header received so far
+    char name[PATH_MAX];
+    size_t namelen;       //length of the name being received
+    size_t namegot;
+    uint32_t mode;
+    uint64_t left;        //data of the current file still to come
+    int fd;               //the current file, written under tmp until complete
+    char tmp[PATH_MAX];
+    char path[PATH_MAX];
+    uint64_t files;
+    int done;             //the end marker arrived
+    mode_t mask;          //our umask, applied to the sender's modes
+};
+
+void batch_writer_init(struct batch_writer *w, const char *outdir);
+
+//Take the next len bytes of the stream. Each file is written under a
+//temporary name and renamed into place once all of its data arrived. Returns
+//0, or -1 on a write error or an entry that doesn't make sense, like a name
+//leaving the output directory.
+int batch_write(struct batch_writer *w, const char *data, size_t len);
+
+//Drop the partly written file, if any. Returns 0 if the whole batch arrived.
+int batch_writer_finish(struct batch_writer *w);
+
+#endif
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+#Aggregate throughput of 1, 2, 3 and 4 clustered relays on this host, started
+#on consecutive ports from the given one with the same node list. The load
+#generator connects every sender and receiver to a random node, so with n
+#nodes about (n-1)/n of the connections are forwarded to the node owning
+#their hash. On one host the nodes share the cores, so this shows what the
+#forwarding hop costs more than how the cluster scales; run the nodes on
+#their own hosts (same -N everywhere) for that.
+#
+#usage: ./bench/cluster.sh [port] [pairs] [size]
+
+port=${1:-19999}
+pairs=${2:-2000}
+size=${3:-1m}
+
+for n in 1 2 3 4; do
+    nodes=""
+    for i in $(seq 0 $((n - 1))); do
+        nodes="$nodes${nodes:+,}localhost:$((port + i))"
+    done
+    pids=""
+    for i in $(seq 0 $((n - 1))); do
+        ./relay -q -N "$nodes" :$((port + i)) > /dev/null 2>&1 &
+        pids="$pids $!"
+    done
+    sleep 0.5
+    echo "$n nodes"
+    ./bench/loadgen -p $pairs -c 256 -s $size "$nodes" | grep -E "pairs|MB/s"
+    kill -INT $pids
+    wait $pids
+done
@@ -0,0 +1,145 @@
+//Connection rate of a running relay: each client thread opens a sender and a
+//receiver under a fresh hash, runs both handshakes, and waits for the relay to
+//pair them and forward the (empty) file. Run it against relays started with a
+//different number of acceptors (relay -a) to see how accept scales.
+//
+//usage: ./bench/connrate <host>:<port> [pairs-per-thread] [threads]
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define HASH_LEN 40
+
+static const uint32_t relay_identity = 0xdeadbeef;
+static const uint32_t sender_identity = 0xadeafbe2;
+static const uint32_t receiver_identity = 0xfacaded2;
+
+static struct sockaddr_in relay_addr;
+
+struct bench_thread {
+    int id;
+    int pairs;
+    int done;
+    pthread_t thread;
+};
+
+static int relay_connect(uint32_t identity, const char *hash)
+{
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0)
+        return -1;
+    if (connect(sd, (struct sockaddr *)&relay_addr, sizeof(relay_addr)) < 0) {
+        close(sd);
+        return -1;
+    }
+    uint32_t response;
+    if (recv(sd, &response, 4, MSG_WAITALL) != 4 || response != relay_identity) {
+        close(sd);
+        return -1;
+    }
+    char hdr[4 + HASH_LEN];
+    memcpy(hdr, &identity, 4);
+    memcpy(&hdr[4], hash, HASH_LEN);
+    if (send(sd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+static int run_pair(int thread, int n)
+{
+    char hash[HASH_LEN];
+    snprintf(hash, sizeof(hash), "%08x%08x%023x", (unsigned)getpid(), thread, n);
+
+    int ssd = relay_connect(sender_identity, hash);
+    if (ssd < 0)
+        return -1;
+    int rsd = relay_connect(receiver_identity, hash);
+    if (rsd < 0) {
+        close(ssd);
+        return -1;
+    }
+
+    char fn[2 + 6] = { 0, 6, 'b', 'e', 'n', 'c', 'h', 0 };
+    int ok = send(ssd, fn, sizeof(fn), 0) == sizeof(fn);
+    close(ssd);
+
+    //the receiver gets the filename and then EOF once the sender's gone
+    char buf[64];
+    size_t got = 0;
+    ssize_t res;
+    while ((res = recv(rsd, buf, sizeof(buf), 0)) > 0)
+        got += res;
+    close(rsd);
+    return ok && got == sizeof(fn) ? 0 : -1;
+}
+
+static void *bench_main(void *opaque)
+{
+    struct bench_thread *t = (struct bench_thread *)opaque;
+    for (int n = 0; n < t->pairs; ++n) {
+        if (run_pair(t->id, n) == 0)
+            t->done++;
+    }
+    return NULL;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || !strchr(argv[1], ':')) {
+        printf("usage: ./bench/connrate <host>:<port> [pairs-per-thread] [threads]\n");
+        exit(1);
+    }
+    int pairs = argc > 2 ? atoi(argv[2]) : 2000;
+    int nthreads = argc > 3 ? atoi(argv[3]) : 8;
+
+    char *host = strdup(argv[1]);
+    char *colon = strchr(host, ':');
+    *colon = '\0';
+    struct hostent *he = gethostbyname(*host ? host : "localhost");
+    if (!he) {
+        fprintf(stderr, "Failed to resolve %s\n", host);
+        exit(1);
+    }
+    relay_addr.sin_family = AF_INET;
+    relay_addr.sin_port = htons(atoi(colon + 1));
+    memcpy(&relay_addr.sin_addr, he->h_addr_list[0], sizeof(relay_addr.sin_addr));
+
+    struct bench_thread *threads = calloc(nthreads, sizeof(struct bench_thread));
+    double start = now_sec();
+    for (int i = 0; i < nthreads; ++i) {
+        threads[i].id = i;
+        threads[i].pairs = pairs;
+        pthread_create(&threads[i].thread, NULL, bench_main, &threads[i]);
+    }
+    int done = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        done += threads[i].done;
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%d threads: %d/%d pairs in %.2fs, %.0f pairs/s (%.0f conn/s)\n",
+           nthreads, done, pairs * nthreads, elapsed, done / elapsed, 2 * done / elapsed);
+    free(threads);
+    free(host);
+    return done == pairs * nthreads ? 0 : 1;
+}
@@ -0,0 +1,865 @@
+//Load generator for a running relay. A few threads each drive many synthetic
+//sender/receiver pairs at once with non-blocking sockets and epoll, so what's
+//measured is the relay rather than process startup. Every pair runs both
+//handshakes, the sender streams its payload and the receiver checks that all
+//of it came through.
+//
+//Pairs are started as soon as there's room under the concurrency cap, or with
+//-r at random (Poisson) arrival times averaging the given rate. -l delays the
+//receiver's connect behind the sender's (a negative lag delays the sender),
+//so senders and receivers both spend time parked. Given the relay's pid the
+//relay's CPU time, open fds and RSS are sampled while the load runs. Pairs
+//that haven't finished after -T seconds (30 by default) count as failed, as
+//do those the relay turns away busy, which are counted on their own too.
+//
+//-e starts that many large "elephant" transfers (1TB unless given a size)
+//in the background, cut off once the measured pairs are done, to see how the
+//relay shares its bandwidth: the pairs' completion times show what the
+//elephants cost small transfers, and Jain's index over the elephants' rates
+//(1 is perfectly fair) how evenly they're served. -q sends the measured pairs
+//with a priority class.
+//
+//Given a comma separated list of relays, say the nodes of a cluster, every
+//connection goes to one of them picked at random, so a pair's sender and
+//receiver usually meet through different nodes.
+//
+//usage: ./bench/loadgen [-p <pairs>] [-c <concurrency>] [-t <threads>]
+//                       [-s <size>[-<max-size>]] [-r <pairs-per-sec>] [-l <lag-ms>]
+//                       [-e <elephants>[x<size>]] [-q bulk|normal|high]
+//                       [-T <timeout-secs>] [-P <relay-pid>] [-j] [-n <name>] [-C <commit>]
+//                       <host>:<port>[,<host>:<port>...]
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+#define HASH_LEN 40
+#define EVENTS 256
+#define IO_BUF (256 * 1024)
+
+static const uint32_t relay_identity = RELAY_IDENTITY;
+static const uint32_t relay_busy = RELAY_BUSY_IDENTITY;
+static const uint32_t sender_identity = SENDER_IDENTITY;
+static const uint32_t receiver_identity = RECEIVER_IDENTITY;
+//The filename field senders send and the receiver should get back, for the
+//measured pairs and the elephants: "bench", and a META_PRIORITY record if
+//the pairs have a class.
+#define FIELD_MAX (2 + 6 + 11)
+static char fields[2][FIELD_MAX];
+static size_t field_len[2];
+
+#define RELAYS_MAX 64
+static struct sockaddr_in relay_addrs[RELAYS_MAX];
+static int nrelays = 0;
+static char payload[IO_BUF];
+
+enum { SENDER, RECEIVER };
+enum { IDLE, CONNECTING, IDENTITY, HEADER, DATA, CLOSED };
+
+struct pair;
+
+struct conn {
+    struct pair *pair;
+    int side;
+    int fd;
+    int state;
+    char buf[FIELD_MAX];
+    size_t got;
+    uint64_t left;        //payload still to send, or to receive
+};
+
+struct pair {
+    struct conn c[2];
+    uint64_t size;
+    int id;
+    uint64_t start_ns;
+    uint64_t handshake_ns;  //when the later side finished its handshake
+    uint64_t pair_ns;       //from then until the receiver heard from the relay
+    uint64_t second_ns;     //when the delayed side connects
+    int second;             //which side is delayed
+    int delayed;            //on the delayed list
+    int open;
+    int failed;
+    int elephant;
+    TAILQ_ENTRY(pair) entries;
+    TAILQ_ENTRY(pair) active;
+};
+
+struct loadgen_thread {
+    int id;
+    pthread_t thread;
+    int epfd;
+    int pairs;            //to run
+    int concurrency;
+    double rate;          //arrivals per second, 0 to keep concurrency pairs going
+    int started;
+    int inflight;
+    int due;              //arrived but waiting for room under the cap
+    uint64_t next_arrival;
+    unsigned int seed;
+    TAILQ_HEAD(, pair) delayed; //waiting for their second side, in start order
+    TAILQ_HEAD(, pair) dead;    //finished, freed at the end of the event batch
+    TAILQ_HEAD(, pair) inflight_list; //in start order, so also in timeout order
+    TAILQ_HEAD(, pair) elephant_list;
+    int elephants;        //to start
+    int elephants_started;
+    char *rbuf;
+    //results
+    int ok;
+    int failed;
+    int busy;             //connections the relay turned away
+    uint64_t bytes;
+    double *pair_ms;      //pairing latency, per completed pair
+    double *total_ms;     //start to finish
+    double *elephant_mbps;
+    int nelephant;
+};
+
+static uint64_t size_min = 65536;
+static uint64_t size_max = 65536;
+static uint64_t elephant_size = 1ULL << 40;
+static long lag_ms = 0;
+static uint64_t timeout_ns = 30 * 1000000000ULL;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void conn_close(struct loadgen_thread *t, struct conn *c)
+{
+    if (c->state == CLOSED)
+        return;
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    c->state = CLOSED;
+    struct pair *p = c->pair;
+    if (--p->open > 0)
+        return;
+
+    //both sides are done with
+    if (p->elephant) {
+        //however far it got
+        uint64_t got = p->size - p->c[RECEIVER].left;
+        t->elephant_mbps[t->nelephant++] = got / ((double)(now_ns() - p->start_ns) / 1e9) / 1e6;
+        TAILQ_REMOVE(&t->elephant_list, p, active);
+        TAILQ_INSERT_TAIL(&t->dead, p, entries);
+        return;
+    }
+    t->inflight--;
+    if (p->failed) {
+        t->failed++;
+    } else {
+        t->pair_ms[t->ok] = (double)p->pair_ns / 1e6;
+        t->total_ms[t->ok] = (double)(now_ns() - p->start_ns) / 1e6;
+        t->ok++;
+        t->bytes += p->size;
+    }
+    if (p->delayed)
+        TAILQ_REMOVE(&t->delayed, p, entries);
+    TAILQ_REMOVE(&t->inflight_list, p, active);
+    TAILQ_INSERT_TAIL(&t->dead, p, entries);
+}
+
+static void conn_fail(struct loadgen_thread *t, struct conn *c)
+{
+    struct pair *p = c->pair;
+    p->failed = 1;
+    //closing one side is enough for the relay to tear the other one down, but
+    //a side that hasn't been paired yet would sit there, so close both
+    for (int i = 0; i < 2; ++i)
+        if (p->c[i].state != CLOSED)
+            conn_close(t, &p->c[i]);
+}
+
+static void conn_open(struct loadgen_thread *t, struct conn *c)
+{
+    c->state = CONNECTING;
+    const struct sockaddr_in *addr = &relay_addrs[nrelays > 1 ? rand_r(&t->seed) % nrelays : 0];
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0 || (connect(c->fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+                      errno != EINPROGRESS)) {
+        conn_fail(t, c);
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        conn_fail(t, c);
+}
+
+static void conn_want(struct loadgen_thread *t, struct conn *c, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void pair_start(struct loadgen_thread *t, int elephant)
+{
+    struct pair *p = calloc(1, sizeof(struct pair));
+    if (!p) {
+        if (!elephant) {
+            t->failed++;
+            t->started++;
+        }
+        return;
+    }
+    if (elephant) {
+        //ids count down from -1, clear of the measured pairs'
+        p->elephant = 1;
+        p->size = elephant_size;
+        p->id = -1 - t->elephants_started++;
+    } else {
+        p->size = size_min;
+        if (size_max > size_min)
+            p->size += (uint64_t)(((double)rand_r(&t->seed) / RAND_MAX) * (size_max - size_min));
+        p->id = t->started;
+    }
+    p->start_ns = now_ns();
+    p->open = 2;
+    for (int i = 0; i < 2; ++i) {
+        p->c[i].pair = p;
+        p->c[i].side = i;
+        p->c[i].fd = -1;
+        p->c[i].state = IDLE;
+        p->c[i].left = p->size;
+    }
+    if (elephant) {
+        TAILQ_INSERT_TAIL(&t->elephant_list, p, active);
+        conn_open(t, &p->c[SENDER]);
+        if (!p->failed)
+            conn_open(t, &p->c[RECEIVER]);
+        return;
+    }
+    t->started++;
+    t->inflight++;
+    TAILQ_INSERT_TAIL(&t->inflight_list, p, active);
+
+    //the first side connects now, the other after the lag. A failed connect
+    //moves the pair to the dead list, where it stays until the next batch.
+    int first = lag_ms >= 0 ? SENDER : RECEIVER;
+    p->second = !first;
+    p->second_ns = p->start_ns + (uint64_t)labs(lag_ms) * 1000000ULL;
+    if (!lag_ms) {
+        conn_open(t, &p->c[first]);
+        if (!p->failed)
+            conn_open(t, &p->c[p->second]);
+        return;
+    }
+    TAILQ_INSERT_TAIL(&t->delayed, p, entries);
+    p->delayed = 1;
+    conn_open(t, &p->c[first]);
+}
+
+//splitmix64, a bijection, so distinct inputs stay distinct
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+//The handshake for one side: identity and hash, senders follow it with the
+//filename field. It's tiny and the socket brand new, so it goes in one send.
+static int send_handshake(struct loadgen_thread *t, struct conn *c)
+{
+    struct pair *p = c->pair;
+    char hdr[4 + HASH_LEN + 1 + FIELD_MAX];
+    memcpy(hdr, c->side == SENDER ? &sender_identity : &receiver_identity, 4);
+    //Unique per pair, from our pid, the thread and the pair's number, and
+    //spread like the PBKDF2 digests real clients send. The relay's table is
+    //indexed by the leading bytes, sequential hashes would all collide.
+    uint64_t key = (uint64_t)getpid() << 40 | (uint64_t)t->id << 32 | (uint32_t)p->id;
+    snprintf(&hdr[4], HASH_LEN + 1, "%016llx%016llx%08x", (unsigned long long)mix(key),
+             (unsigned long long)mix(~key), (unsigned)p->id);
+    size_t len = 4 + HASH_LEN;
+    if (c->side == SENDER) {
+        memcpy(&hdr[len], fields[p->elephant], field_len[p->elephant]);
+        len += field_len[p->elephant];
+    }
+    if (send(c->fd, hdr, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return -1;
+
+    uint64_t now = now_ns();
+    if (p->handshake_ns < now)
+        p->handshake_ns = now;
+    return 0;
+}
+
+static void conn_event(struct loadgen_thread *t, struct conn *c, uint32_t events)
+{
+    struct pair *p = c->pair;
+    ssize_t n = 0;
+
+    switch (c->state) {
+    case CONNECTING: {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            conn_fail(t, c);
+            return;
+        }
+        c->state = IDENTITY;
+        c->got = 0;
+        conn_want(t, c, EPOLLIN);
+        return;
+    }
+    case IDENTITY:
+        n = recv(c->fd, &c->buf[c->got], 4 - c->got, 0);
+        if (n <= 0)
+            break;
+        c->got += n;
+        if (c->got < 4)
+            return;
+        if (!memcmp(c->buf, &relay_busy, 4))
+            t->busy++;
+        if (memcmp(c->buf, &relay_identity, 4) || send_handshake(t, c) < 0) {
+            conn_fail(t, c);
+            return;
+        }
+        c->got = 0;
+        if (c->side == SENDER) {
+            c->state = DATA;
+            conn_want(t, c, EPOLLOUT);
+        } else {
+            c->state = HEADER;
+        }
+        return;
+    case HEADER:
+        n = recv(c->fd, &c->buf[c->got], field_len[p->elephant] - c->got, 0);
+        if (n <= 0)
+            break;
+        //the first byte from the relay means the pair is set up, keep the
+        //latency from the later handshake until now
+        if (!c->got)
+            p->pair_ns = now_ns() - p->handshake_ns;
+        c->got += n;
+        if (c->got < field_len[p->elephant])
+            return;
+        if (memcmp(c->buf, fields[p->elephant], field_len[p->elephant])) {
+            conn_fail(t, c);
+            return;
+        }
+        c->state = DATA;
+        return;
+    case DATA:
+        if (c->side == SENDER) {
+            while (c->left) {
+                n = send(c->fd, payload, c->left < IO_BUF ? c->left : IO_BUF, MSG_NOSIGNAL);
+                if (n < 0)
+                    break;
+                c->left -= n;
+            }
+            if (!c->left) {
+                conn_close(t, c);
+                return;
+            }
+            break;
+        }
+        while ((n = recv(c->fd, t->rbuf, IO_BUF, 0)) > 0) {
+            if ((uint64_t)n > c->left) {
+                conn_fail(t, c);
+                return;
+            }
+            c->left -= n;
+        }
+        if (n == 0) {
+            if (c->left)
+                p->failed = 1;
+            conn_close(t, c);
+            return;
+        }
+        break;
+    }
+    //a read or write came up short
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    conn_fail(t, c);
+}
+
+static void *loadgen_main(void *opaque)
+{
+    struct loadgen_thread *t = (struct loadgen_thread *)opaque;
+    struct epoll_event events[EVENTS];
+    TAILQ_INIT(&t->delayed);
+    TAILQ_INIT(&t->dead);
+    TAILQ_INIT(&t->inflight_list);
+    TAILQ_INIT(&t->elephant_list);
+    t->next_arrival = now_ns();
+    for (int i = 0; i < t->elephants; ++i)
+        pair_start(t, 1);
+
+    while (t->started < t->pairs || t->inflight) {
+        uint64_t now = now_ns();
+
+        //arrivals, either on the clock or whenever a pair finished
+        if (t->rate > 0) {
+            while (t->started + t->due < t->pairs && t->next_arrival <= now) {
+                t->due++;
+                double u = ((double)rand_r(&t->seed) + 1) / ((double)RAND_MAX + 2);
+                t->next_arrival += (uint64_t)(-log(u) / t->rate * 1e9);
+            }
+        } else {
+            t->due = t->pairs - t->started;
+        }
+        while (t->due > 0 && t->inflight < t->concurrency) {
+            t->due--;
+            pair_start(t, 0);
+        }
+
+        //give up on pairs that are taking too long, like a receiver whose
+        //sender the relay turned away
+        while (!TAILQ_EMPTY(&t->inflight_list) &&
+               TAILQ_FIRST(&t->inflight_list)->start_ns + timeout_ns <= now) {
+            struct pair *p = TAILQ_FIRST(&t->inflight_list);
+            conn_fail(t, &p->c[SENDER]);
+        }
+
+        //delayed sides whose time has come
+        while (!TAILQ_EMPTY(&t->delayed) && TAILQ_FIRST(&t->delayed)->second_ns <= now) {
+            struct pair *p = TAILQ_FIRST(&t->delayed);
+            TAILQ_REMOVE(&t->delayed, p, entries);
+            p->delayed = 0;
+            conn_open(t, &p->c[p->second]);
+        }
+        //the pairs failed above
+        while (!TAILQ_EMPTY(&t->dead)) {
+            struct pair *p = TAILQ_FIRST(&t->dead);
+            TAILQ_REMOVE(&t->dead, p, entries);
+            free(p);
+        }
+
+        int timeout = 100;
+        if (!TAILQ_EMPTY(&t->delayed))
+            timeout = (TAILQ_FIRST(&t->delayed)->second_ns - now) / 1000000;
+        if (!TAILQ_EMPTY(&t->inflight_list) &&
+            (TAILQ_FIRST(&t->inflight_list)->start_ns + timeout_ns - now) / 1000000 < (uint64_t)timeout)
+            timeout = (TAILQ_FIRST(&t->inflight_list)->start_ns + timeout_ns - now) / 1000000;
+        if (t->rate > 0 && t->started + t->due < t->pairs && t->next_arrival > now &&
+            (t->next_arrival - now) / 1000000 < (uint64_t)timeout)
+            timeout = (t->next_arrival - now) / 1000000;
+
+        int nfds = epoll_wait(t->epfd, events, EVENTS, timeout);
+        for (int i = 0; i < nfds; ++i) {
+            struct conn *c = (struct conn *)events[i].data.ptr;
+            //a failure on the other side may have closed this one already
+            if (c->state != CLOSED)
+                conn_event(t, c, events[i].events);
+        }
+        while (!TAILQ_EMPTY(&t->dead)) {
+            struct pair *p = TAILQ_FIRST(&t->dead);
+            TAILQ_REMOVE(&t->dead, p, entries);
+            free(p);
+        }
+    }
+    //the elephants are only there as background, cut them off
+    while (!TAILQ_EMPTY(&t->elephant_list))
+        conn_fail(t, &TAILQ_FIRST(&t->elephant_list)->c[SENDER]);
+    while (!TAILQ_EMPTY(&t->dead)) {
+        struct pair *p = TAILQ_FIRST(&t->dead);
+        TAILQ_REMOVE(&t->dead, p, entries);
+        free(p);
+    }
+    return NULL;
+}
+
+//The relay as seen through /proc while the load runs.
+struct relay_sample {
+    pid_t pid;
+    int run;
+    pthread_t thread;
+    double cpu_start;
+    double cpu_end;
+    int peak_fds;
+    long peak_rss_kb;
+};
+
+static double relay_cpu(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    //skip past the command name, it may contain spaces
+    char *s = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (!s || sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void relay_poll(struct relay_sample *r)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", r->pid);
+    DIR *d = opendir(path);
+    if (d) {
+        int n = 0;
+        struct dirent *de;
+        while ((de = readdir(d)))
+            if (de->d_name[0] != '.')
+                n++;
+        closedir(d);
+        if (n > r->peak_fds)
+            r->peak_fds = n;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", r->pid);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        char line[256];
+        long kb;
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "VmRSS: %ld", &kb) == 1 && kb > r->peak_rss_kb)
+                r->peak_rss_kb = kb;
+        fclose(f);
+    }
+}
+
+static void *relay_main(void *opaque)
+{
+    struct relay_sample *r = (struct relay_sample *)opaque;
+    while (__atomic_load_n(&r->run, __ATOMIC_RELAXED)) {
+        relay_poll(r);
+        usleep(50000);
+    }
+    relay_poll(r);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *v, int n, double p)
+{
+    if (!n)
+        return 0;
+    int i = (int)(p / 100 * (n - 1) + 0.5);
+    return v[i];
+}
+
+static uint64_t parse_size(const char *s, char **end)
+{
+    double v = strtod(s, end);
+    switch (**end) {
+    case 'g': case 'G': v *= 1024;  //fall through
+    case 'm': case 'M': v *= 1024;  //fall through
+    case 'k': case 'K': v *= 1024;
+        (*end)++;
+    }
+    return (uint64_t)v;
+}
+
+//Jain's fairness index, 1 when every rate is the same and 1/n when one of
+//them gets everything
+static double jain(const double *v, int n)
+{
+    double sum = 0, sq = 0;
+    for (int i = 0; i < n; ++i) {
+        sum += v[i];
+        sq += v[i] * v[i];
+    }
+    return sq > 0 ? sum * sum / (n * sq) : 0;
+}
+
+static void help(void)
+{
+    printf("usage: ./bench/loadgen [-p <pairs>] [-c <concurrency>] [-t <threads>]\n"
+           "                       [-s <size>[-<max-size>]] [-r <pairs-per-sec>] [-l <lag-ms>]\n"
+           "                       [-e <elephants>[x<size>]] [-q bulk|normal|high]\n"
+           "                       [-T <timeout-secs>] [-P <relay-pid>] [-j] [-n <name>] [-C <commit>]\n"
+           "                       <host>:<port>[,<host>:<port>...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int pairs = 1000;
+    int concurrency = 256;
+    int nthreads = 2;
+    double rate = 0;
+    pid_t relay_pid = 0;
+    int json = 0;
+    const char *name = "loadgen";
+    const char *commit = NULL;
+    int elephants = 0;
+    uint64_t priority = PRIORITY_NORMAL;
+    int opt;
+    char *end;
+    while ((opt = getopt(argc, argv, "p:c:t:s:r:l:e:q:T:P:jn:C:")) != -1) {
+        switch (opt) {
+        case 'p':
+            pairs = atoi(optarg);
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 's':
+            size_min = size_max = parse_size(optarg, &end);
+            if (*end == '-')
+                size_max = parse_size(end + 1, &end);
+            if (*end || size_max < size_min) {
+                help();
+                exit(1);
+            }
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'l':
+            lag_ms = atol(optarg);
+            break;
+        case 'e':
+            elephants = strtol(optarg, &end, 10);
+            if (*end == 'x')
+                elephant_size = parse_size(end + 1, &end);
+            if (*end || elephants < 0 || !elephant_size) {
+                help();
+                exit(1);
+            }
+            break;
+        case 'q':
+            if (!strcmp(optarg, "bulk")) {
+                priority = PRIORITY_BULK;
+            } else if (!strcmp(optarg, "normal")) {
+                priority = PRIORITY_NORMAL;
+            } else if (!strcmp(optarg, "high")) {
+                priority = PRIORITY_HIGH;
+            } else {
+                help();
+                exit(1);
+            }
+            break;
+        case 'T':
+            timeout_ns = (uint64_t)(atof(optarg) * 1e9);
+            break;
+        case 'P':
+            relay_pid = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'n':
+            name = optarg;
+            break;
+        case 'C':
+            commit = optarg;
+            break;
+        default:
+            help();
+            exit(1);
+        }
+    }
+    if (optind != argc - 1 || !strchr(argv[optind], ':') || pairs < 1 || concurrency < 1 ||
+        nthreads < 1) {
+        help();
+        exit(1);
+    }
+    if (nthreads > pairs)
+        nthreads = pairs;
+    if (concurrency < nthreads)
+        concurrency = nthreads;
+
+    char *save = NULL;
+    for (char *host = strtok_r(argv[optind], ",", &save); host;
+         host = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(host, ':');
+        if (!colon || nrelays == RELAYS_MAX) {
+            help();
+            exit(1);
+        }
+        *colon = '\0';
+        struct hostent *he = gethostbyname(*host ? host : "localhost");
+        if (!he) {
+            fprintf(stderr, "Failed to resolve %s\n", host);
+            exit(1);
+        }
+        struct sockaddr_in *addr = &relay_addrs[nrelays++];
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(atoi(colon + 1));
+        memcpy(&addr->sin_addr, he->h_addr_list[0], sizeof(addr->sin_addr));
+    }
+
+    //two sockets per pair in flight
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    for (size_t i = 0; i < sizeof(payload); ++i)
+        payload[i] = i * 2654435761U >> 24;
+
+    //"bench" with its length in front, then the class as a big endian
+    //META_PRIORITY record
+    for (int i = 0; i < 2; ++i) {
+        char *f = fields[i];
+        size_t len = 6;
+        memcpy(&f[2], "bench", 6);
+        if (!i && priority != PRIORITY_NORMAL) {
+            f[2 + len++] = META_PRIORITY;
+            f[2 + len++] = 0;
+            f[2 + len++] = 8;
+            for (int b = 7; b >= 0; --b)
+                f[2 + len++] = priority >> (b * 8);
+        }
+        f[0] = len >> 8;
+        f[1] = len;
+        field_len[i] = 2 + len;
+    }
+
+    struct relay_sample relay = { .pid = relay_pid, .run = 1 };
+    if (relay_pid) {
+        relay.cpu_start = relay_cpu(relay_pid);
+        if (relay.cpu_start < 0) {
+            fprintf(stderr, "Can't read /proc/%d/stat\n", relay_pid);
+            exit(1);
+        }
+        pthread_create(&relay.thread, NULL, relay_main, &relay);
+    }
+
+    struct loadgen_thread *threads = calloc(nthreads, sizeof(struct loadgen_thread));
+    double *pair_ms = calloc(pairs, sizeof(double));
+    double *total_ms = calloc(pairs, sizeof(double));
+    double *elephant_mbps = calloc(elephants + 1, sizeof(double));
+    if (!threads || !pair_ms || !total_ms || !elephant_mbps) {
+        fprintf(stderr, "Insufficient memory\n");
+        exit(1);
+    }
+    uint64_t start = now_ns();
+    int assigned = 0, elephants_assigned = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        struct loadgen_thread *t = &threads[i];
+        t->id = i;
+        t->pairs = pairs / nthreads + (i < pairs % nthreads);
+        t->concurrency = concurrency / nthreads + (i < concurrency % nthreads);
+        t->rate = rate / nthreads;
+        t->seed = i + 1;
+        t->pair_ms = &pair_ms[assigned];
+        t->total_ms = &total_ms[assigned];
+        t->elephants = elephants / nthreads + (i < elephants % nthreads);
+        t->elephant_mbps = &elephant_mbps[elephants_assigned];
+        elephants_assigned += t->elephants;
+        assigned += t->pairs;
+        t->rbuf = malloc(IO_BUF);
+        t->epfd = epoll_create1(0);
+        if (!t->rbuf || t->epfd < 0 || pthread_create(&t->thread, NULL, loadgen_main, t) != 0) {
+            fprintf(stderr, "Failed to start thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    int ok = 0, failed = 0, busy = 0, nelephant = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        struct loadgen_thread *t = &threads[i];
+        pthread_join(t->thread, NULL);
+        //gather the results at the front
+        memmove(&pair_ms[ok], t->pair_ms, t->ok * sizeof(double));
+        memmove(&total_ms[ok], t->total_ms, t->ok * sizeof(double));
+        memmove(&elephant_mbps[nelephant], t->elephant_mbps, t->nelephant * sizeof(double));
+        ok += t->ok;
+        nelephant += t->nelephant;
+        failed += t->failed;
+        busy += t->busy;
+        bytes += t->bytes;
+        close(t->epfd);
+        free(t->rbuf);
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    if (relay_pid) {
+        __atomic_store_n(&relay.run, 0, __ATOMIC_RELAXED);
+        pthread_join(relay.thread, NULL);
+        relay.cpu_end = relay_cpu(relay_pid);
+    }
+
+    qsort(pair_ms, ok, sizeof(double), cmp_double);
+    qsort(total_ms, ok, sizeof(double), cmp_double);
+    double mbps = bytes / elapsed / 1e6;
+    double relay_cpu_s = relay.cpu_end - relay.cpu_start;
+    double cpu_per_gb = bytes ? relay_cpu_s / (bytes / 1e9) : 0;
+    double elephant_total = 0;
+    for (int i = 0; i < nelephant; ++i)
+        elephant_total += elephant_mbps[i];
+
+    if (json) {
+        printf("{\"name\":\"%s\"", name);
+        if (commit)
+            printf(",\"commit\":\"%s\"", commit);
+        printf(",\"pairs\":%d,\"ok\":%d,\"failed\":%d,\"busy\":%d,\"concurrency\":%d,\"threads\":%d"
+               ",\"size_min\":%llu,\"size_max\":%llu,\"rate\":%g,\"lag_ms\":%ld"
+               ",\"seconds\":%.3f,\"pairs_per_sec\":%.1f,\"bytes\":%llu,\"mb_per_sec\":%.1f"
+               ",\"pair_ms_p50\":%.3f,\"pair_ms_p90\":%.3f,\"pair_ms_p99\":%.3f,\"pair_ms_max\":%.3f"
+               ",\"total_ms_p50\":%.3f,\"total_ms_p99\":%.3f",
+               pairs, ok, failed, busy, concurrency, nthreads,
+               (unsigned long long)size_min, (unsigned long long)size_max, rate, lag_ms,
+               elapsed, ok / elapsed, (unsigned long long)bytes, mbps,
+               percentile(pair_ms, ok, 50), percentile(pair_ms, ok, 90),
+               percentile(pair_ms, ok, 99), ok ? pair_ms[ok - 1] : 0,
+               percentile(total_ms, ok, 50), percentile(total_ms, ok, 99));
+        if (relay_pid)
+            printf(",\"relay_cpu_s\":%.3f,\"relay_cpu_s_per_gb\":%.3f"
+                   ",\"relay_peak_fds\":%d,\"relay_peak_rss_kb\":%ld",
+                   relay_cpu_s, cpu_per_gb, relay.peak_fds, relay.peak_rss_kb);
+        if (elephants)
+            printf(",\"elephants\":%d,\"elephant_mb_per_sec\":%.1f,\"elephant_jain\":%.3f",
+                   nelephant, elephant_total, jain(elephant_mbps, nelephant));
+        printf("}\n");
+    } else {
+        printf("%s: %d/%d pairs ok in %.2fs, %.0f pairs/s, %.1f MB/s\n",
+               name, ok, pairs, elapsed, ok / elapsed, mbps);
+        if (busy)
+            printf("  busy         %d connections turned away\n", busy);
+        printf("  pairing ms   p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+               percentile(pair_ms, ok, 50), percentile(pair_ms, ok, 90),
+               percentile(pair_ms, ok, 99), ok ? pair_ms[ok - 1] : 0);
+        printf("  transfer ms  p50 %.3f  p99 %.3f\n",
+               percentile(total_ms, ok, 50), percentile(total_ms, ok, 99));
+        if (relay_pid)
+            printf("  relay        %.2fs cpu (%.3f s/GB), peak %d fds, peak rss %ld KB\n",
+                   relay_cpu_s, cpu_per_gb, relay.peak_fds, relay.peak_rss_kb);
+        if (elephants)
+            printf("  elephants    %d at %.1f MB/s together, Jain's index %.3f\n",
+                   nelephant, elephant_total, jain(elephant_mbps, nelephant));
+    }
+
+    free(pair_ms);
+    free(total_ms);
+    free(elephant_mbps);
+    free(threads);
+    return failed ? 1 : 0;
+}
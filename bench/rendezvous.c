@@ -0,0 +1,178 @@
+//Pairing throughput of the rendezvous table against the tsearch tree the relay
+//used before, with a large number of parked senders.
+//
+//usage: ./bench/rendezvous [pending-entries] [threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <search.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "rendezvous.h"
+
+#define HEX_LEN (RENDEZVOUS_KEY_LEN*2)
+
+struct tree_entry {
+    char *hash;
+};
+
+struct bench_thread {
+    struct rendezvous *rv;
+    struct rendezvous_node *receivers;
+    size_t first;
+    size_t count;
+    size_t matched;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int tree_compare(const void *a, const void *b)
+{
+    const struct tree_entry *ta = (const struct tree_entry *)a;
+    const struct tree_entry *tb = (const struct tree_entry *)b;
+    return strncmp(ta->hash, tb->hash, RENDEZVOUS_KEY_LEN);
+}
+
+static void report(const char *name, const char *op, size_t n, double secs)
+{
+    printf("%-10s %-5s %9zu in %8.3f s  %12.0f ops/s  %8.1f ns/op\n",
+           name, op, n, secs, n / secs, secs * 1e9 / n);
+}
+
+static void bench_tree(unsigned char (*keys)[RENDEZVOUS_KEY_LEN], size_t n)
+{
+    //same shape as the old relay: strdup'd hex hash in a tsearch tree
+    void *root = NULL;
+    struct tree_entry *entries = calloc(n, sizeof(struct tree_entry));
+    char hex[HEX_LEN + 1];
+
+    double start = now();
+    for (size_t i = 0; i < n; ++i) {
+        for (int b = 0; b < RENDEZVOUS_KEY_LEN; ++b)
+            sprintf(&hex[b*2], "%02x", keys[i][b]);
+        entries[i].hash = strdup(hex);
+        tsearch(&entries[i], &root, tree_compare);
+    }
+    report("tree", "park", n, now() - start);
+
+    size_t matched = 0;
+    start = now();
+    for (size_t i = 0; i < n; ++i) {
+        struct tree_entry probe;
+        for (int b = 0; b < RENDEZVOUS_KEY_LEN; ++b)
+            sprintf(&hex[b*2], "%02x", keys[i][b]);
+        probe.hash = hex;
+        void **obj = tfind(&probe, &root, tree_compare);
+        if (obj) {
+            struct tree_entry *match = *(struct tree_entry **)obj;
+            tdelete(match, &root, tree_compare);
+            free(match->hash);
+            matched++;
+        }
+    }
+    report("tree", "pair", n, now() - start);
+    if (matched != n)
+        fprintf(stderr, "tree matched %zu of %zu\n", matched, n);
+    free(entries);
+}
+
+static void *pair_thread(void *opaque)
+{
+    struct bench_thread *bt = (struct bench_thread *)opaque;
+    struct rendezvous_node *match;
+    for (size_t i = bt->first; i < bt->first + bt->count; ++i) {
+        if (rendezvous_pair(bt->rv, &bt->receivers[i], &match) == 1)
+            bt->matched++;
+    }
+    return NULL;
+}
+
+static void bench_table(unsigned char (*keys)[RENDEZVOUS_KEY_LEN], size_t n, int nthreads)
+{
+    struct rendezvous rv;
+    if (rendezvous_init(&rv, n) < 0) {
+        fprintf(stderr, "Failed to allocate rendezvous table\n");
+        exit(1);
+    }
+    struct rendezvous_node *senders = calloc(n, sizeof(struct rendezvous_node));
+    struct rendezvous_node *receivers = calloc(n, sizeof(struct rendezvous_node));
+    for (size_t i = 0; i < n; ++i) {
+        memcpy(senders[i].key, keys[i], RENDEZVOUS_KEY_LEN);
+        senders[i].side = RENDEZVOUS_SENDER;
+        memcpy(receivers[i].key, keys[i], RENDEZVOUS_KEY_LEN);
+        receivers[i].side = RENDEZVOUS_RECEIVER;
+    }
+
+    struct rendezvous_node *match;
+    double start = now();
+    for (size_t i = 0; i < n; ++i) {
+        if (rendezvous_pair(&rv, &senders[i], &match) != 0) {
+            fprintf(stderr, "Failed to park entry %zu\n", i);
+            exit(1);
+        }
+    }
+    report("table", "park", n, now() - start);
+
+    struct bench_thread *threads = calloc(nthreads, sizeof(struct bench_thread));
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    start = now();
+    for (int t = 0; t < nthreads; ++t) {
+        threads[t].rv = &rv;
+        threads[t].receivers = receivers;
+        threads[t].first = n / nthreads * t;
+        threads[t].count = t == nthreads - 1 ? n - threads[t].first : n / nthreads;
+        pthread_create(&tids[t], NULL, pair_thread, &threads[t]);
+    }
+    size_t matched = 0;
+    for (int t = 0; t < nthreads; ++t) {
+        pthread_join(tids[t], NULL);
+        matched += threads[t].matched;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "table/%dt", nthreads);
+    report(name, "pair", n, now() - start);
+    if (matched != n)
+        fprintf(stderr, "table matched %zu of %zu\n", matched, n);
+
+    free(tids);
+    free(threads);
+    free(senders);
+    free(receivers);
+    rendezvous_destroy(&rv);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    int nthreads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+
+    unsigned char (*keys)[RENDEZVOUS_KEY_LEN] = malloc(n * RENDEZVOUS_KEY_LEN);
+    for (size_t off = 0; off < n * RENDEZVOUS_KEY_LEN; ) {
+        long got = syscall(SYS_getrandom, (char *)keys + off, n * RENDEZVOUS_KEY_LEN - off, 0);
+        if (got <= 0) {
+            perror("getrandom");
+            exit(1);
+        }
+        off += got;
+    }
+
+    printf("pairing %zu pending entries\n", n);
+    bench_tree(keys, n);
+    bench_table(keys, n, 1);
+    if (nthreads > 1)
+        bench_table(keys, n, nthreads);
+
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,97 @@
+//Secrets per second from the mapped word index against the old way of opening
+//the dictionary and seeking to random offsets for every secret.
+//
+//usage: ./bench/secret [secrets] [words]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "secret.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t n, double secs)
+{
+    printf("%-10s %9zu in %8.3f s  %12.0f secrets/s  %8.1f us/secret\n",
+           name, n, secs, n / secs, secs * 1e6 / n);
+}
+
+//same shape as the old make_secret
+static char *seek_secret(int num_words)
+{
+    char c = 0;
+    char *words = calloc(num_words + 1, DICT_WORD_MAX + 1);
+    FILE *f = fopen(DICT_PATH, "r");
+    if (!f || fseek(f, 0, SEEK_END) < 0) {
+        fprintf(stderr, "Failed to open %s\n", DICT_PATH);
+        exit(1);
+    }
+    long size = ftell(f);
+    unsigned int seed = 0;
+    syscall(SYS_getrandom, &seed, sizeof(unsigned int), 0);
+    srandom(seed);
+
+    for (int w = 0; w < num_words; ++w) {
+        fseek(f, (long)(size * ((double)random() / RAND_MAX)), SEEK_SET);
+        while (fread(&c, 1, 1, f) == 1 && c != '\n');
+        char *line = NULL;
+        size_t alloced = 0;
+        ssize_t n = getline(&line, &alloced, f);
+        if (n <= 0) {
+            rewind(f);
+            n = getline(&line, &alloced, f);
+        }
+        if (n > 0 && n <= DICT_WORD_MAX + 1) {
+            line[n - 1] = w < num_words - 1 ? '-' : '\0';
+            strncat(words, line, n);
+        }
+        free(line);
+    }
+    fclose(f);
+    return words;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    int num_words = argc > 2 ? atoi(argv[2]) : 4;
+    if (!n || num_words <= 0) {
+        fprintf(stderr, "usage: %s [secrets] [words]\n", argv[0]);
+        return 1;
+    }
+
+    //the first call maps the dictionary and maps or builds the index
+    double start = now();
+    char *first = make_secret(num_words);
+    if (!first)
+        return 1;
+    report("first", 1, now() - start);
+    free(first);
+
+    start = now();
+    for (size_t i = 0; i < n; ++i)
+        free(seek_secret(num_words));
+    report("seek", n, now() - start);
+
+    start = now();
+    for (size_t i = 0; i < n; ++i)
+        free(make_secret(num_words));
+    report("index", n, now() - start);
+
+    start = now();
+    char **secrets = make_secrets(n, num_words);
+    if (!secrets)
+        return 1;
+    report("batch", n, now() - start);
+    free_secrets(secrets, n);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+#Throughput of one file sent through a running relay over 1, 2, 4, 8 and 16
+#streams (send -n). Over loopback this mostly shows the relay spreading the
+#streams over its workers; to see the long fat pipe case add delay first,
+#e.g. tc qdisc add dev lo root netem delay 20ms
+#
+#usage: ./bench/streams.sh <host>:<port> [megabytes]
+
+relay=$1
+mb=${2:-1024}
+dir=$(mktemp -d /tmp/streams-bench-XXXXXX)
+trap 'rm -rf "$dir"' EXIT
+
+dd if=/dev/urandom of="$dir"/in.dat bs=1M count=$mb > /dev/null 2>&1
+mkdir "$dir"/out
+
+for n in 1 2 4 8 16; do
+    rm -f "$dir"/out/in.dat
+    start=$(date +%s.%N)
+    coproc ./send -n $n "$relay" "$dir"/in.dat
+    read -r secret <&"${COPROC[0]}" || { echo "send failed"; exit 1; }
+    ./receive "$relay" "$secret" "$dir"/out || exit 1
+    wait
+    end=$(date +%s.%N)
+    cmp -s "$dir"/in.dat "$dir"/out/in.dat || { echo "$n streams: copy differs"; exit 1; }
+    awk -v n=$n -v mb=$mb -v s=$start -v e=$end \
+        'BEGIN { printf "%2d streams %6d MB   %8.1f MB/s\n", n, mb, mb / (e - s) }'
+done
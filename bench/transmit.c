@@ -0,0 +1,147 @@
+//Throughput and sender cpu time of each of send's transmit paths over
+//loopback. A thread on the other end of the connection just drains the
+//socket. The file is read once up front so every path sends from the page
+//cache. The block paths are timed plain and encrypted with each cipher, their
+//cpu time includes the reader thread doing the encryption, and the encrypted
+//ones are compared against the plain one.
+//
+//usage: ./bench/transmit [file-size-mb] [runs]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "crypt.h"
+#include "transmit.h"
+
+static void *drain(void *opaque)
+{
+    int sd = *(int *)opaque;
+    static char buf[1 << 20];
+    while (recv(sd, buf, sizeof(buf), 0) > 0)
+        ;
+    close(sd);
+    return NULL;
+}
+
+static double ts_sec(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//a connected loopback pair, the far end is drained by its own thread
+static int connect_drained(pthread_t *thread)
+{
+    static int rsd;
+    int lsd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (lsd < 0 || bind(lsd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lsd, 1) < 0 || getsockname(lsd, (struct sockaddr *)&addr, &len) < 0) {
+        perror("Failed to listen on loopback");
+        exit(1);
+    }
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sd < 0 || connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Failed to connect on loopback");
+        exit(1);
+    }
+    rsd = accept(lsd, NULL, NULL);
+    close(lsd);
+    pthread_create(thread, NULL, drain, &rsd);
+    return sd;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 512;
+    int runs = argc > 2 ? atoi(argv[2]) : 3;
+
+    char path[] = "/tmp/transmit-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("Failed to create test file");
+        exit(1);
+    }
+    unlink(path);
+    char *block = malloc(1 << 20);
+    for (size_t i = 0; i < (1 << 20); ++i)
+        block[i] = rand();
+    for (size_t i = 0; i < mb; ++i) {
+        if (write(fd, block, 1 << 20) != 1 << 20) {
+            perror("Failed to write test file");
+            exit(1);
+        }
+    }
+    free(block);
+
+    struct crypt_key keys[CRYPT_CHACHA20 + 1];
+    unsigned char salt[CRYPT_SALT_LEN] = { 0 };
+    for (int c = CRYPT_AES_GCM; c <= CRYPT_CHACHA20; ++c)
+        crypt_derive(&keys[c], c, "bench", salt, mb << 20);
+
+    struct {
+        const char *name;
+        int mode;         //transmit_file mode, or -1 for transmit_blocks
+        int cipher;
+    } rows[] = {
+        { "copy", TRANSMIT_COPY, CRYPT_NONE },
+        { "sendfile", TRANSMIT_SENDFILE, CRYPT_NONE },
+        { "zerocopy", TRANSMIT_ZEROCOPY, CRYPT_NONE },
+        { "blocks", -1, CRYPT_NONE },
+        { "blocks+aes", -1, CRYPT_AES_GCM },
+        { "blocks+chacha", -1, CRYPT_CHACHA20 },
+    };
+    double plain = 0;
+    for (size_t m = 0; m < sizeof(rows) / sizeof(rows[0]); ++m) {
+        int blocks = rows[m].mode < 0;
+        clockid_t clock = blocks ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID;
+        const struct crypt_key *key = rows[m].cipher ? &keys[rows[m].cipher] : NULL;
+        double best = 0, cpu = 0;
+        for (int r = 0; r < runs; ++r) {
+            pthread_t thread;
+            int sd = connect_drained(&thread);
+
+            double start = ts_sec(CLOCK_MONOTONIC);
+            double cstart = ts_sec(clock);
+            ssize_t sent = blocks ?
+                transmit_blocks(sd, fd, 0, mb << 20, 1 << 20, 0, 0, key, 0) :
+                transmit_file(sd, fd, 0, mb << 20, rows[m].mode, NULL, NULL);
+            double elapsed = ts_sec(CLOCK_MONOTONIC) - start;
+            double celapsed = ts_sec(clock) - cstart;
+            close(sd);
+            pthread_join(thread, NULL);
+
+            if (sent != (ssize_t)(mb << 20)) {
+                fprintf(stderr, "%s sent %zd of %zu bytes\n", rows[m].name, sent, mb << 20);
+                exit(1);
+            }
+            double rate = mb / elapsed;
+            if (rate > best) {
+                best = rate;
+                cpu = celapsed;
+            }
+        }
+        printf("%-14s %6zu MB   %8.1f MB/s   %6.3f s sender cpu", rows[m].name, mb, best, cpu);
+        if (blocks && !key)
+            plain = best;
+        else if (key)
+            printf("   %5.1f%% slower than plain", 100 * (1 - best / plain));
+        printf("\n");
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "budget.h"
+#include "log.h"
+
+//kept for the relay itself, a sixteenth of the limit but at least this many
+#define BUDGET_RESERVE 64
+
+static struct budget_limits limits;
+static int used[BUDGET_CLASSES];
+
+//the most the kernel lets a process have open, for a hard limit of infinity
+static rlim_t nr_open(void)
+{
+    unsigned long n = 1048576;
+    FILE *f = fopen("/proc/sys/fs/nr_open", "r");
+    if (f) {
+        if (fscanf(f, "%lu", &n) != 1)
+            n = 1048576;
+        fclose(f);
+    }
+    return n;
+}
+
+void budget_init(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        log_error("Failed to get the file descriptor limit: %s", strerror(errno));
+        rl.rlim_cur = rl.rlim_max = 1024;
+    }
+    rlim_t want = rl.rlim_max == RLIM_INFINITY ? nr_open() : rl.rlim_max;
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < want) {
+        rlim_t was = rl.rlim_cur;
+        rl.rlim_cur = want;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            log_error("Failed to raise the file descriptor limit: %s", strerror(errno));
+        else
+            log_info("raised the file descriptor limit from %llu to %llu",
+                     (unsigned long long)was, (unsigned long long)want);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1 << 30)
+        rl.rlim_cur = 1 << 30;
+
+    limits.nofile = rl.rlim_cur;
+    int reserve = limits.nofile / 16 > BUDGET_RESERVE ? limits.nofile / 16 : BUDGET_RESERVE;
+    limits.usable = limits.nofile > reserve * 2 ? limits.nofile - reserve : limits.nofile / 2;
+    limits.handshakes = limits.usable / 4;
+    limits.pipes = limits.usable / 4 * 3;
+    //two sockets a transfer, and two pipe ends while there's room for them
+    limits.spliced = limits.pipes / 4;
+    limits.transfers = limits.spliced + (limits.usable - limits.spliced * 4) / 2;
+    log_info("fd budget: %d of %d fds for clients, up to %d handshaking, room for %d transfers "
+             "(%d spliced)", limits.usable, limits.nofile, limits.handshakes, limits.transfers,
+             limits.spliced);
+}
+
+void budget_limits(struct budget_limits *l)
+{
+    *l = limits;
+}
+
+void budget_add(int cls, int n)
+{
+    __atomic_add_fetch(&used[cls], n, __ATOMIC_RELAXED);
+}
+
+int budget_used(int cls)
+{
+    return __atomic_load_n(&used[cls], __ATOMIC_RELAXED);
+}
+
+int budget_admit(void)
+{
+    if (budget_used(BUDGET_CONNECTIONS) + budget_used(BUDGET_PIPES) >= limits.usable ||
+        budget_used(BUDGET_HANDSHAKES) >= limits.handshakes)
+        return -1;
+    return 0;
+}
+
+int budget_pipe(void)
+{
+    if (budget_used(BUDGET_CONNECTIONS) + budget_used(BUDGET_PIPES) + 2 > limits.pipes)
+        return -1;
+    return 0;
+}
+
+void budget_close(int fd)
+{
+    if (fd < 0)
+        return;
+    close(fd);
+    budget_add(BUDGET_CONNECTIONS, -1);
+}
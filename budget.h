@@ -0,0 +1,46 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+//File descriptor budget. At startup the relay raises RLIMIT_NOFILE as far as
+//it's allowed and keeps a slice of it for itself (listeners, epoll sets,
+//spool and lag files). The rest is shared by client connections and pipes:
+//new splice pipes are only created while less than three quarters of it is
+//in use, so past that transfers copy through userspace and leave the fds to
+//connections, and new connections are turned away as busy once all of it is
+//in use or a quarter of it is still handshaking. The relay never finds out
+//about its limit from EMFILE, and how many transfers it can hold is a number
+//known up front.
+
+enum budget_class {
+    BUDGET_CONNECTIONS,   //client sockets, whatever they're doing
+    BUDGET_HANDSHAKES,    //of those, still in the handshake
+    BUDGET_PIPES,         //pipe ends, two per pipe
+    BUDGET_CLASSES
+};
+
+struct budget_limits {
+    int nofile;           //RLIMIT_NOFILE once raised
+    int usable;           //shared by connections and pipes
+    int handshakes;       //most connections handshaking at once
+    int pipes;            //new pipes only below this many fds in use
+    int transfers;        //transfers that fit at once
+    int spliced;          //of those, how many get a pipe
+};
+
+//Raise RLIMIT_NOFILE and split it up. Call before anything opens fds for
+//clients.
+void budget_init(void);
+void budget_limits(struct budget_limits *l);
+
+void budget_add(int cls, int n);
+int budget_used(int cls);
+
+//0 if a new connection may be taken, -1 if it should be turned away busy
+int budget_admit(void);
+//0 if a pipe fits, -1 if the transfer should copy instead
+int budget_pipe(void);
+
+//close a client connection and give its fd back
+void budget_close(int fd);
+
+#endif
@@ -0,0 +1,802 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "client.h"
+#include "secret.h"
+#include "transmit.h"
+
+static const uint32_t relayid = RELAY_IDENTITY;
+static const uint32_t relaybusy = RELAY_BUSY_IDENTITY;
+
+#define PIPE_SIZE (1024 * 1024)
+#define IOBUF_SIZE (256 * 1024)
+#define SENDFILE_CHUNK (16 * 1024 * 1024)
+//reads or writes one session gets per wakeup, so a fast transfer can't hold
+//up the others on the loop
+#define PUMP_BUDGET 16
+#define MAX_EVENTS 64
+
+void session_error(struct relay_session *s, const char *fmt, ...)
+{
+    char msg[sizeof(s->error)];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "%s\n", msg);
+    //the first error is the one that counts, the rest follow from it
+    if (!s->error[0])
+        memcpy(s->error, msg, sizeof(msg));
+}
+
+int busy_backoff_ms(int retry)
+{
+    static __thread unsigned int seed;
+    if (!seed)
+        seed = (unsigned int)(uintptr_t)&seed ^ (unsigned int)getpid();
+    int ms = BUSY_BACKOFF_MS << (retry < 10 ? retry : 10);
+    return ms / 2 + rand_r(&seed) % (ms / 2 + 1);
+}
+
+int relay_connect(const struct sockaddr_in *addr, int profile, uint64_t rate)
+{
+    for (int retry = 0;; ++retry) {
+        //Create the network socket and connect to host and port
+        int sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sd < 0) {
+            fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+            return -1;
+        }
+        if (connect(sd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+            fprintf(stderr, "Failed to connect to relay\n");
+            close(sd);
+            return -1;
+        }
+
+        //Let server identify itself
+        uint32_t response = 0;
+        if (recv(sd, &response, 4, MSG_WAITALL) == 4 && response == relayid) {
+            struct tuning t;
+            tuning_apply(sd, profile, rate, &t);
+            return sd;
+        }
+        close(sd);
+        if (response != relaybusy || retry == BUSY_RETRIES) {
+            fprintf(stderr, response == relaybusy ? "Relay is busy\n" :
+                            "Server didn't respond correctly\n");
+            return -1;
+        }
+        usleep(busy_backoff_ms(retry) * 1000);
+    }
+}
+
+struct relay_client *relay_client_new(const char *relay)
+{
+    //Look the host up once, for every session the client runs
+    char *address = strdup(relay);
+    if (!address)
+        return NULL;
+    char *host = strtok(address, ":");
+    char *portstr = strtok(NULL, ":");
+    if (!host || !portstr) {
+        fprintf(stderr, "Invalid host or port\n");
+        free(address);
+        return NULL;
+    }
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || !res) {
+        fprintf(stderr, "Failed getting IP of %s\n", host);
+        free(address);
+        return NULL;
+    }
+
+    struct relay_client *c = calloc(1, sizeof(*c));
+    if (!c) {
+        freeaddrinfo(res);
+        free(address);
+        return NULL;
+    }
+    memcpy(&c->addr, res->ai_addr, sizeof(c->addr));
+    c->addr.sin_port = htons(strtol(portstr, NULL, 10));
+    freeaddrinfo(res);
+    free(address);
+
+    c->epfd = epoll_create1(EPOLL_CLOEXEC);
+    c->evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (c->epfd < 0 || c->evfd < 0 || epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->evfd, &ev) < 0) {
+        fprintf(stderr, "Failed to set up event loop: %s\n", strerror(errno));
+        if (c->epfd >= 0)
+            close(c->epfd);
+        if (c->evfd >= 0)
+            close(c->evfd);
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    TAILQ_INIT(&c->sessions);
+    TAILQ_INIT(&c->ending);
+    return c;
+}
+
+static void session_free(struct relay_session *s)
+{
+    if (s->sending)
+        send_free(s);
+    else
+        receive_free(s);
+    if (s->pipe[0] >= 0) {
+        close(s->pipe[0]);
+        close(s->pipe[1]);
+    }
+    free(s->iobuf);
+    free(s->name);
+    free(s->secret);
+    free(s->hash);
+    free(s);
+}
+
+static void session_watch(struct relay_session *s, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = s };
+    epoll_ctl(s->client->epfd, EPOLL_CTL_MOD, s->sd, &ev);
+}
+
+//Wake the loop to go on with the session from relay_client_run, connecting
+//it once its hash is made or ending it. Called from threads as they finish.
+static void session_post(struct relay_session *s)
+{
+    struct relay_client *c = s->client;
+    pthread_mutex_lock(&c->lock);
+    if (!s->ending) {
+        TAILQ_INSERT_TAIL(&c->ending, s, ending_link);
+        s->ending = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    uint64_t one = 1;
+    if (write(c->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("Failed to wake event loop");
+}
+
+//Release the session's connection and whatever it received into, leaving
+//just the callback.
+static int session_close(struct relay_session *s, int status)
+{
+    struct relay_client *c = s->client;
+    if (s->state == SESSION_THREAD || s->state == SESSION_HASHING) {
+        pthread_join(s->thread, NULL);
+        if (s->state == SESSION_THREAD)
+            status = s->status;
+    } else if (s->sd >= 0) {
+        epoll_ctl(c->epfd, EPOLL_CTL_DEL, s->sd, NULL);
+    }
+    //a plain transfer is only saved once all of it is in
+    if (!s->sending && s->state == SESSION_DATA && receive_finish(s, status < 0) < 0)
+        status = -1;
+    if (s->sd >= 0)
+        close(s->sd);
+    s->sd = -1;
+    pthread_mutex_lock(&c->lock);
+    if (s->ending)
+        TAILQ_REMOVE(&c->ending, s, ending_link);
+    s->ending = 0;
+    pthread_mutex_unlock(&c->lock);
+    TAILQ_REMOVE(&c->sessions, s, link);
+    c->active--;
+    return status;
+}
+
+static void session_end(struct relay_session *s, int status)
+{
+    status = session_close(s, status);
+    if (status < 0 && !s->error[0])
+        snprintf(s->error, sizeof(s->error), "%s", s->cancelled ? "Cancelled" : "Failed");
+    s->status = status;
+    if (s->done)
+        s->done(s, status, s->arg);
+    session_free(s);
+}
+
+static void *session_thread(void *opaque)
+{
+    struct relay_session *s = (struct relay_session *)opaque;
+    if (s->sending)
+        send_thread(s);
+    else
+        receive_thread(s);
+    session_post(s);
+    return NULL;
+}
+
+//Hand the rest of the transfer to the pipelines send and receive use, which
+//block, on a thread of the session's own.
+static void session_thread_start(struct relay_session *s)
+{
+    epoll_ctl(s->client->epfd, EPOLL_CTL_DEL, s->sd, NULL);
+    fcntl(s->sd, F_SETFL, fcntl(s->sd, F_GETFL) & ~O_NONBLOCK);
+    s->state = SESSION_THREAD;
+    if (pthread_create(&s->thread, NULL, session_thread, s) != 0) {
+        s->state = SESSION_IDENTITY;
+        session_error(s, "Failed to start transfer thread");
+        session_end(s, -1);
+    }
+}
+
+//Connect without waiting, the loop picks it up from here. Returns 0 or -1
+//with s->sd closed.
+static int session_connect(struct relay_session *s)
+{
+    struct relay_client *c = s->client;
+    s->sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->sd < 0) {
+        session_error(s, "Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(s->sd, (struct sockaddr *)&c->addr, sizeof(c->addr)) < 0 && errno != EINPROGRESS) {
+        session_error(s, "Failed to connect to relay");
+        close(s->sd);
+        s->sd = -1;
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = s };
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, s->sd, &ev) < 0) {
+        session_error(s, "Failed to watch connection: %s", strerror(errno));
+        close(s->sd);
+        s->sd = -1;
+        return -1;
+    }
+    s->state = SESSION_CONNECTING;
+    return 0;
+}
+
+//The relay turned us away busy. Come back once the backoff is over, with a
+//timer on the loop in place of the connection.
+static int session_backoff(struct relay_session *s)
+{
+    struct relay_client *c = s->client;
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, s->sd, NULL);
+    close(s->sd);
+    s->sd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s->sd < 0)
+        return -1;
+    int ms = busy_backoff_ms(s->retries++);
+    struct itimerspec its = { .it_value = { ms / 1000, (ms % 1000) * 1000000L } };
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = s };
+    if (timerfd_settime(s->sd, 0, &its, NULL) < 0 ||
+        epoll_ctl(c->epfd, EPOLL_CTL_ADD, s->sd, &ev) < 0) {
+        close(s->sd);
+        s->sd = -1;
+        return -1;
+    }
+    s->state = SESSION_BACKOFF;
+    return 0;
+}
+
+//relayclient.h's socket profiles in tuning.h's terms
+static const int tunings[] = {
+    [RELAY_TUNING_AUTO] = TUNING_AUTO,
+    [RELAY_TUNING_LAN] = TUNING_LAN,
+    [RELAY_TUNING_WAN] = TUNING_WAN,
+    [RELAY_TUNING_SMALL] = TUNING_SMALL,
+    [RELAY_TUNING_NONE] = TUNING_NONE,
+};
+#define NTUNINGS (int)(sizeof(tunings) / sizeof(tunings[0]))
+
+int relay_tuning_parse(const char *spec, uint64_t *rate)
+{
+    int profile = tuning_parse(spec, rate);
+    for (int i = 0; profile >= 0 && i < NTUNINGS; ++i)
+        if (tunings[i] == profile)
+            return i;
+    return -1;
+}
+
+//Take the socket options both kinds of session have. Returns 0 or -1.
+static int session_tuning(struct relay_session *s, int tuning, uint64_t link_rate)
+{
+    if (tuning < 0 || tuning >= NTUNINGS) {
+        fprintf(stderr, "Unknown socket profile\n");
+        return -1;
+    }
+    s->tuning = tunings[tuning];
+    s->link_rate = link_rate;
+    return 0;
+}
+
+static void *session_hash_thread(void *opaque)
+{
+    struct relay_session *s = (struct relay_session *)opaque;
+    s->hash = make_hash(s->secret);
+    session_post(s);
+    return NULL;
+}
+
+//The hash is slow on purpose, so it's made on a thread of the session's own
+//rather than holding up the loop, and before the relay's handshake timeout
+//starts. The loop connects once it's done.
+static struct relay_session *session_start(struct relay_client *c, struct relay_session *s)
+{
+    s->state = SESSION_HASHING;
+    if (pthread_create(&s->thread, NULL, session_hash_thread, s) != 0) {
+        fprintf(stderr, "Failed to start hashing thread\n");
+        session_free(s);
+        return NULL;
+    }
+    TAILQ_INSERT_TAIL(&c->sessions, s, link);
+    c->active++;
+    return s;
+}
+
+//The hash is made, carry on connecting.
+static void session_hashed(struct relay_session *s)
+{
+    struct relay_client *c = s->client;
+    pthread_join(s->thread, NULL);
+    s->state = SESSION_CONNECTING;
+    pthread_mutex_lock(&c->lock);
+    TAILQ_REMOVE(&c->ending, s, ending_link);
+    s->ending = 0;
+    pthread_mutex_unlock(&c->lock);
+    if (!s->hash) {
+        session_end(s, -1);
+        return;
+    }
+    if (!s->sending)
+        receive_journal(s);
+    if (session_connect(s) < 0)
+        session_end(s, -1);
+}
+
+static struct relay_session *session_new(struct relay_client *c, relay_done_fn done, void *arg)
+{
+    struct relay_session *s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+    s->client = c;
+    s->sd = -1;
+    s->fd = -1;
+    s->outfd = -1;
+    s->jfd = -1;
+    s->pipe[0] = s->pipe[1] = -1;
+    s->done = done;
+    s->arg = arg;
+    return s;
+}
+
+struct relay_session *relay_send(struct relay_client *c, const struct relay_send_opts *o,
+                                 relay_done_fn done, void *arg)
+{
+    struct relay_session *s = session_new(c, done, arg);
+    if (!s)
+        return NULL;
+    s->sending = 1;
+    if (session_tuning(s, o->tuning, o->link_rate) < 0 || send_prepare(s, o) < 0) {
+        session_free(s);
+        return NULL;
+    }
+    return session_start(c, s);
+}
+
+struct relay_session *relay_receive(struct relay_client *c, const struct relay_receive_opts *o,
+                                    relay_done_fn done, void *arg)
+{
+    struct relay_session *s = session_new(c, done, arg);
+    if (!s)
+        return NULL;
+    if (session_tuning(s, o->tuning, o->link_rate) < 0 || receive_prepare(s, o) < 0) {
+        session_free(s);
+        return NULL;
+    }
+    return session_start(c, s);
+}
+
+//The relay identified itself, send our side of the handshake, or for
+//transfers the loop doesn't move itself, leave the rest to a thread.
+static void session_identified(struct relay_session *s)
+{
+    //the relay answering gave the kernel a round trip time to size for
+    tuning_apply(s->sd, s->tuning, s->link_rate, &s->tuned);
+    tuning_format(&s->tuned, s->tuned_desc, sizeof(s->tuned_desc));
+    if (s->sending) {
+        if (!s->nstreams)
+            s->nstreams = send_auto_streams(s->sd, s->size);
+        if ((uint64_t)s->nstreams > s->size / 4096 + 1)
+            s->nstreams = s->size / 4096 + 1;
+        struct stat st;
+        if (!send_plain(s) || (!s->buf && (fstat(s->fd, &st) < 0 || !S_ISREG(st.st_mode)))) {
+            session_thread_start(s);
+            return;
+        }
+        if (send_header(s) < 0) {
+            session_end(s, -1);
+            return;
+        }
+    } else if (receive_header(s) < 0) {
+        session_end(s, -1);
+        return;
+    }
+    s->state = SESSION_HANDSHAKE;
+    session_watch(s, EPOLLOUT);
+}
+
+//What to read, splice or sendfile at once, the tuned chunk up to most.
+static size_t session_chunk(const struct relay_session *s, size_t most)
+{
+    return s->tuned.chunk && s->tuned.chunk < most ? s->tuned.chunk : most;
+}
+
+//The sender's field arrived, we're paired.
+static void session_paired(struct relay_session *s)
+{
+    if (receive_parse(s) < 0) {
+        session_end(s, -1);
+        return;
+    }
+    if (!receive_plain(s)) {
+        session_thread_start(s);
+        return;
+    }
+    s->state = SESSION_DATA;
+    if (receive_open(s) < 0) {
+        session_end(s, -1);
+        return;
+    }
+    //socket -> pipe -> file without the data reaching userspace, where
+    //there's a file to splice to
+    if (!s->buf && s->seekable && s->mode != RELAY_WRITE_COPY &&
+        pipe2(s->pipe, O_CLOEXEC | O_NONBLOCK) == 0)
+        fcntl(s->pipe[1], F_SETPIPE_SZ, session_chunk(s, PIPE_SIZE));
+    if (s->pipe[0] < 0 && !s->buf && !(s->iobuf = malloc(IOBUF_SIZE))) {
+        session_error(s, "Insufficient memory for receive buffer");
+        session_end(s, -1);
+    }
+}
+
+static int session_copy_mode(struct relay_session *s)
+{
+    close(s->pipe[0]);
+    close(s->pipe[1]);
+    s->pipe[0] = s->pipe[1] = -1;
+    if (s->mode == RELAY_WRITE_SPLICE)
+        fprintf(stderr, "splice not supported here, copying instead\n");
+    if (!s->iobuf && !(s->iobuf = malloc(IOBUF_SIZE))) {
+        session_error(s, "Insufficient memory for receive buffer");
+        return -1;
+    }
+    return 0;
+}
+
+//Move whatever the socket has to the file or buffer. Returns 1 once the
+//sender is done, 0 to wait for more and -1 on error.
+static int receive_pump(struct relay_session *s)
+{
+    for (int budget = PUMP_BUDGET; budget > 0; --budget) {
+        if (s->pipe[0] < 0) {
+            //straight into the caller's buffer, with a byte to spare to
+            //notice the sender has more than fits
+            char spare;
+            char *to = s->buf ? (s->bytes < s->cap ? &s->buf[s->bytes] : &spare) : s->iobuf;
+            size_t room = s->buf ? (s->bytes < s->cap ? s->cap - s->bytes : 1) : IOBUF_SIZE;
+            ssize_t n = recv(s->sd, to, room, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                return 0;
+            if (n < 0) {
+                session_error(s, "Failed to receive: %s", strerror(errno));
+                return -1;
+            }
+            if (n == 0)
+                return 1;
+            if (s->buf && to == &spare) {
+                session_error(s, "More data than fits in the buffer");
+                return -1;
+            }
+            if (s->buf)
+                s->bytes += n;
+            else if (receive_data(s, s->iobuf, n) < 0)
+                return -1;
+            continue;
+        }
+
+        ssize_t n = splice(s->sd, NULL, s->pipe[1], NULL, session_chunk(s, PIPE_SIZE),
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return 0;
+        if (n < 0 && errno == EINVAL && !s->bytes) {
+            //sockets that can't be spliced from just get copied
+            if (session_copy_mode(s) < 0)
+                return -1;
+            continue;
+        }
+        if (n < 0) {
+            session_error(s, "Failed to receive: %s", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+            return 1;
+        while (n) {
+            loff_t pos = s->bytes;
+            ssize_t m = splice(s->pipe[0], NULL, s->fd, &pos, n, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m < 0 && errno == EINVAL) {
+                //the filesystem doesn't take splice, empty the pipe by hand
+                if (!s->iobuf && !(s->iobuf = malloc(IOBUF_SIZE))) {
+                    session_error(s, "Insufficient memory for receive buffer");
+                    return -1;
+                }
+                while (n) {
+                    ssize_t r = read(s->pipe[0], s->iobuf, n < IOBUF_SIZE ? n : IOBUF_SIZE);
+                    if (r <= 0 || receive_data(s, s->iobuf, r) < 0) {
+                        session_error(s, "Failed to write data");
+                        return -1;
+                    }
+                    n -= r;
+                }
+                if (session_copy_mode(s) < 0)
+                    return -1;
+                break;
+            }
+            if (m <= 0) {
+                session_error(s, "Failed to write data: %s", strerror(errno));
+                return -1;
+            }
+            n -= m;
+            s->bytes += m;
+        }
+    }
+    return 0;
+}
+
+//Send as much of the file or buffer as the socket takes. Returns 1 once it
+//all went out, 0 to wait for room and -1 on error.
+static int send_pump(struct relay_session *s)
+{
+    for (int budget = PUMP_BUDGET; budget > 0; --budget) {
+        uint64_t left = s->size - s->bytes;
+        if (!left)
+            return 1;
+        ssize_t n;
+        if (s->buf) {
+            n = send(s->sd, &s->buf[s->bytes], left, MSG_NOSIGNAL);
+        } else {
+            off_t off = s->bytes;
+            size_t chunk = session_chunk(s, SENDFILE_CHUNK);
+            n = sendfile(s->sd, s->fd, &off, left < chunk ? left : chunk);
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return 0;
+        if (n <= 0) {
+            session_error(s, "Failed to send %s: %s", s->name,
+                          n < 0 ? strerror(errno) : "file shrank");
+            return -1;
+        }
+        s->bytes += n;
+    }
+    return 0;
+}
+
+static void session_event(struct relay_session *s)
+{
+    if (s->state == SESSION_BACKOFF) {
+        epoll_ctl(s->client->epfd, EPOLL_CTL_DEL, s->sd, NULL);
+        close(s->sd);
+        if (session_connect(s) < 0)
+            session_end(s, -1);
+        return;
+    }
+
+    if (s->state == SESSION_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(s->sd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            session_error(s, "Failed to connect to relay: %s", strerror(err ? err : errno));
+            session_end(s, -1);
+            return;
+        }
+        s->state = SESSION_IDENTITY;
+        s->hdroff = 0;
+        session_watch(s, EPOLLIN);
+        return;
+    }
+
+    if (s->state == SESSION_IDENTITY) {
+        //Let server identify itself
+        ssize_t n = recv(s->sd, &s->hdr[s->hdroff], 4 - s->hdroff, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n > 0)
+            s->hdroff += n;
+        if (n > 0 && s->hdroff < 4)
+            return;
+        if (n > 0 && !memcmp(s->hdr, &relaybusy, 4) && s->retries < BUSY_RETRIES &&
+            session_backoff(s) == 0)
+            return;
+        if (n > 0 && !memcmp(s->hdr, &relaybusy, 4)) {
+            session_error(s, "Relay is busy");
+            session_end(s, -1);
+            return;
+        }
+        if (n <= 0 || memcmp(s->hdr, &relayid, 4)) {
+            session_error(s, "Server didn't respond correctly");
+            session_end(s, -1);
+            return;
+        }
+        session_identified(s);
+        return;
+    }
+
+    if (s->state == SESSION_HANDSHAKE) {
+        while (s->hdroff < s->hdrlen) {
+            ssize_t n = send(s->sd, &s->hdr[s->hdroff], s->hdrlen - s->hdroff, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                return;
+            if (n < 0) {
+                session_error(s, "Failed to send handshake to relay");
+                session_end(s, -1);
+                return;
+            }
+            s->hdroff += n;
+        }
+        //senders go straight on with the data, the relay holds it until the
+        //receiver turns up. Receivers wait for the sender's field.
+        s->state = s->sending ? SESSION_DATA : SESSION_FIELD;
+        s->fieldgot = 0;
+        session_watch(s, s->sending ? EPOLLOUT : EPOLLIN);
+        return;
+    }
+
+    if (s->state == SESSION_FIELD) {
+        //Receive the filename from the server, along with whatever metadata
+        //the sender put after it
+        for (;;) {
+            size_t want = s->fieldgot < 2 ? 2 - s->fieldgot : 2 + s->fieldlen - s->fieldgot;
+            char *to = s->fieldgot < 2 ? (char *)&s->fieldlen + s->fieldgot :
+                                         &s->field[s->fieldgot - 2];
+            if (!want)
+                break;
+            ssize_t n = recv(s->sd, to, want, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                return;
+            if (n <= 0) {
+                session_error(s, "Failed to read filename from relay");
+                session_end(s, -1);
+                return;
+            }
+            s->fieldgot += n;
+            if (s->fieldgot == 2) {
+                s->fieldlen = ntohs(s->fieldlen);
+                if (!s->fieldlen || s->fieldlen >= PATH_MAX) {
+                    session_error(s, "Failed to read filename from relay");
+                    session_end(s, -1);
+                    return;
+                }
+            }
+        }
+        s->field[s->fieldlen] = '\0';
+        session_paired(s);
+        return;
+    }
+
+    if (s->state == SESSION_DATA) {
+        int res = s->sending ? send_pump(s) : receive_pump(s);
+        if (res)
+            session_end(s, res > 0 ? 0 : -1);
+    }
+}
+
+int relay_client_run(struct relay_client *c, int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(c->epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        perror("Failed to wait for events");
+        return -1;
+    }
+    for (int i = 0; i < n; ++i) {
+        struct relay_session *s = (struct relay_session *)events[i].data.ptr;
+        if (!s) {
+            uint64_t count;
+            while (read(c->evfd, &count, sizeof(count)) > 0)
+                ;
+            continue;
+        }
+        //cancelled sessions are ended below, with the threads that finished
+        if (!s->cancelled)
+            session_event(s);
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&c->lock);
+        struct relay_session *s = TAILQ_FIRST(&c->ending);
+        pthread_mutex_unlock(&c->lock);
+        if (!s)
+            break;
+        if (s->state == SESSION_HASHING && !s->cancelled)
+            session_hashed(s);
+        else
+            session_end(s, s->state == SESSION_THREAD ? s->status : -1);
+    }
+    return c->active;
+}
+
+int relay_client_fd(struct relay_client *c)
+{
+    return c->epfd;
+}
+
+void relay_session_cancel(struct relay_session *s)
+{
+    s->cancelled = 1;
+    //a thread can't be stopped from here, but it gives up once its first
+    //connection goes
+    if (s->state == SESSION_THREAD)
+        shutdown(s->sd, SHUT_RDWR);
+    else
+        session_post(s);
+}
+
+void relay_client_free(struct relay_client *c)
+{
+    struct relay_session *s;
+    while ((s = TAILQ_FIRST(&c->sessions))) {
+        if (s->state == SESSION_THREAD)
+            shutdown(s->sd, SHUT_RDWR);
+        session_close(s, -1);
+        session_free(s);
+    }
+    close(c->epfd);
+    close(c->evfd);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+const char *relay_session_secret(const struct relay_session *s)
+{
+    return s->secret;
+}
+
+const char *relay_session_name(const struct relay_session *s)
+{
+    return s->name ? s->name : "";
+}
+
+uint64_t relay_session_bytes(const struct relay_session *s)
+{
+    return s->bytes;
+}
+
+const char *relay_session_error(const struct relay_session *s)
+{
+    return s->error;
+}
+
+const char *relay_session_tuning(const struct relay_session *s)
+{
+    return s->tuned_desc;
+}
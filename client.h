@@ -0,0 +1,176 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+#include <linux/limits.h>
+
+#include "crypt.h"
+#include "protocol.h"
+#include "relayclient.h"
+#include "tuning.h"
+
+//Internals of librelayclient shared between the event loop (client.c) and
+//the send and receive sides (client_send.c, client_receive.c).
+
+//where a session is on the event loop
+enum session_state {
+    SESSION_HASHING = 0,  //making the hash of the secret on a thread
+    SESSION_CONNECTING,
+    SESSION_IDENTITY,     //waiting for the relay to identify itself
+    SESSION_HANDSHAKE,    //sending our identity, hash and field
+    SESSION_FIELD,        //receivers waiting to be paired and get the field
+    SESSION_DATA,         //plain single stream data moved by the loop
+    SESSION_THREAD,       //handed to a thread of its own
+    SESSION_BACKOFF,      //the relay was busy, sd is a timerfd until we retry
+};
+
+//A busy relay (see RELAY_BUSY_IDENTITY) is tried this many more times,
+//waiting about twice as long each time
+#define BUSY_RETRIES 8
+#define BUSY_BACKOFF_MS 100
+
+//Progress of a chunked transfer, kept in .<hash>.journal next to the partial
+//file while it's incomplete. Each range is the one a stream carries, with how
+//much of it from the start has been verified and synced to disk.
+struct journal_range {
+    uint64_t off;
+    uint64_t len;
+    uint64_t done;
+};
+
+struct journal {
+    char magic[8];
+    uint64_t size;
+    struct journal_range ranges[MAX_STREAMS];
+};
+
+//identity, hash, field length and field of a handshake
+#define HANDSHAKE_MAX (4 + 40 + 2 + PATH_MAX)
+
+struct relay_client {
+    int epfd;
+    int evfd;             //threads finishing and sessions cancelled wake the loop
+    struct sockaddr_in addr;
+    pthread_mutex_t lock;
+    TAILQ_HEAD(, relay_session) sessions;
+    //sessions for relay_client_run to end, or to connect once they're hashed,
+    //under lock
+    TAILQ_HEAD(, relay_session) ending;
+    int active;
+};
+
+struct relay_session {
+    struct relay_client *client;
+    TAILQ_ENTRY(relay_session) link;
+    TAILQ_ENTRY(relay_session) ending_link;
+    int ending;           //on the ending list
+    int sending;
+    int state;
+    int sd;
+    int retries;          //times the relay turned us away busy
+    int tuning;           //socket profile and link rate
+    uint64_t link_rate;
+    struct tuning tuned;  //what the first connection got
+    char tuned_desc[256];
+    relay_done_fn done;
+    void *arg;
+    char *secret;
+    char *hash;           //make_hash of the secret
+    char error[256];
+    int status;
+    int cancelled;
+    pthread_t thread;     //hashing, then the transfer if the loop can't move it
+
+    char *name;
+    uint64_t size;
+    uint64_t bytes;
+    int nstreams;
+    int mode;
+    int codec;
+    int cipher;
+
+    //handshake going out, and the sender's field coming in
+    char hdr[HANDSHAKE_MAX];
+    size_t hdrlen;
+    size_t hdroff;
+    char field[PATH_MAX];
+    uint16_t fieldlen;
+    size_t fieldgot;
+
+    //plain data on the loop, to or from fd or buf
+    int fd;
+    char *buf;
+    size_t cap;
+    int pipe[2];
+    char *iobuf;
+
+    //sending
+    struct batch *batch;
+    int resumable;
+    int fanout;
+    int priority;
+
+    //receiving
+    char *outdir;
+    int ownfd;            //fd is ours to close, a temporary file or memfd
+    int seekable;         //fd takes pwrite, pipes and sockets are written in order
+    int outfd;            //the caller's fd, when it's received into a memfd first
+    uint64_t chunk;
+    int have_size;
+    uint64_t batchlen;
+    int batched;
+    char fullfile[PATH_MAX];
+    char tmpfile[PATH_MAX];
+    char partfile[PATH_MAX];
+    char journalfile[PATH_MAX];
+    struct journal journal;
+    int jfd;
+    int resumed;
+};
+
+//Record why the session failed, and say so on stderr like the rest.
+void session_error(struct relay_session *s, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+//Connect a further stream, blocking, and wait for the relay to identify
+//itself, backing off while it's busy, then tune it for profile. Returns the
+//socket or -1.
+int relay_connect(const struct sockaddr_in *addr, int profile, uint64_t rate);
+//How long to wait before the given retry of a busy relay. Jittered
+//so that clients turned away together don't all come back together.
+int busy_backoff_ms(int retry);
+
+//Pick a stream count from the round trip time over sd.
+int send_auto_streams(int sd, uint64_t size);
+//Set up what to send and check the options fit together. Returns 0 or -1.
+int send_prepare(struct relay_session *s, const struct relay_send_opts *o);
+//Whether the loop can move the data itself, once the stream count is known.
+int send_plain(const struct relay_session *s);
+//Put stream 0's handshake for a plain transfer in s->hdr.
+int send_header(struct relay_session *s);
+//Send everything else, on the session's thread, with stream 0 connected.
+void *send_thread(void *opaque);
+void send_free(struct relay_session *s);
+
+//Set up where to receive to.
+int receive_prepare(struct relay_session *s, const struct relay_receive_opts *o);
+//Load the journal of an earlier attempt, named after the hash once it's made.
+void receive_journal(struct relay_session *s);
+//Put stream 0's handshake in s->hdr.
+int receive_header(struct relay_session *s);
+//Check the sender's field once it arrived. Returns 0 or -1.
+int receive_parse(struct relay_session *s);
+int receive_plain(const struct relay_session *s);
+//Open where the file goes, and save it once it's all there.
+int receive_open(struct relay_session *s);
+//Write the next len bytes of a plain transfer. Returns 0 or -1.
+int receive_data(struct relay_session *s, const char *data, size_t len);
+int receive_finish(struct relay_session *s, int failed);
+//Receive everything else, on the session's thread, with stream 0 paired.
+void *receive_thread(void *opaque);
+void receive_free(struct relay_session *s);
+
+#endif
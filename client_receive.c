@@ -0,0 +1,1088 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "batch.h"
+#include "client.h"
+#include "compress.h"
+#include "secret.h"
+
+static const uint32_t identity = RECEIVER_IDENTITY;
+static const uint32_t resuming = RESUMING_RECEIVER_IDENTITY;
+
+#define PIPE_SIZE (1024 * 1024)
+//size of each of the two write buffers. Every write but the last is a whole
+//buffer, so writes stay large and aligned in the file.
+#define WRITE_CHUNK (1024 * 1024)
+
+//chunked transfers sync the file and record their progress this often
+#define JOURNAL_INTERVAL (64ULL * 1024 * 1024)
+#define JOURNAL_MAGIC "relayjn1"
+
+
+//Two buffers passed back and forth between the receiving thread and a writer
+//thread, so one is filled from the socket while the other goes to disk.
+struct write_stage {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf[2];
+    size_t len[2];
+    int full[2];
+    int done;             //no more buffers coming
+    int failed;           //a write failed, stop receiving
+    int fd;
+    uint64_t off;         //where the next buffer goes in the file
+    //buffers hold one compressed block each, the writer decompresses them
+    //into raw first
+    struct compressor comp;
+    char *raw;
+    //or one encrypted record each, which the writer opens in place before
+    //decompressing
+    struct crypt crypt;
+    int encrypted;
+    //a batch's stream goes to its files instead of fd
+    struct batch_writer *batch;
+};
+
+//One connection through the relay carrying one byte range of the file.
+struct stream {
+    int index;
+    const char *hash;
+    const struct sockaddr_in *addr;
+    int tuning;           //socket profile and link rate for relay_connect
+    uint64_t link_rate;
+    int sd;
+    int fd;
+    int mode;
+    uint64_t size;
+    uint64_t off;
+    uint64_t len;
+    uint64_t total;
+    uint64_t chunk;       //chunk size of a chunked transfer, 0 if not chunked
+    int codec;            //compression the sender used
+    const struct crypt_key *key; //NULL if not encrypted
+    struct journal_range *range; //progress of a chunked transfer
+    int jfd;              //where it's recorded, -1 if it isn't
+    int failed;
+    pthread_t thread;
+};
+
+
+//Write all of buf at off in the file. Returns 0 or -1.
+static int write_at(int fd, const char *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, &buf[done], len - done, off + done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to write data");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+//Turn a compressed block of *len bytes, header included, back into raw data.
+//Returns the data, which is either in the block itself or in raw, and sets
+//*len to its length, or NULL if the block is corrupt.
+static const char *block_data(struct compressor *c, const char *block, char *raw, size_t *len)
+{
+    uint32_t stored, rawlen;
+    int compressed;
+    if (*len < COMPRESS_HEADER_LEN ||
+        compress_header_get(block, c->codec, &stored, &rawlen, &compressed) < 0 ||
+        COMPRESS_HEADER_LEN + stored != *len)
+        return NULL;
+    *len = rawlen;
+    if (!compressed)
+        return &block[COMPRESS_HEADER_LEN];
+    if (decompress_block(c, &block[COMPRESS_HEADER_LEN], stored, 1, raw, rawlen) < 0)
+        return NULL;
+    return raw;
+}
+
+static void *write_stage_main(void *opaque)
+{
+    struct write_stage *ws = (struct write_stage *)opaque;
+    for (int i = 0;; i ^= 1) {
+        pthread_mutex_lock(&ws->lock);
+        while (!ws->full[i] && !ws->done)
+            pthread_cond_wait(&ws->cond, &ws->lock);
+        if (!ws->full[i]) {
+            pthread_mutex_unlock(&ws->lock);
+            break;
+        }
+        pthread_mutex_unlock(&ws->lock);
+
+        const char *data = ws->buf[i];
+        size_t len = ws->len[i];
+        if (ws->encrypted) {
+            char *plain = &ws->buf[i][CRYPT_HEADER_LEN];
+            ssize_t n = crypt_open(&ws->crypt, data, len, ws->off, plain);
+            if (n < 0) {
+                fprintf(stderr, "Record at %llu failed to authenticate\n",
+                        (unsigned long long)ws->off);
+                data = NULL;
+            } else {
+                data = plain;
+                len = n;
+            }
+        }
+        if (data && ws->comp.codec && !(data = block_data(&ws->comp, data, ws->raw, &len)))
+            fprintf(stderr, "Failed to decompress block\n");
+        int failed = !data || (ws->batch ? batch_write(ws->batch, data, len) :
+                                           write_at(ws->fd, data, len, ws->off)) < 0;
+        ws->off += len;
+
+        pthread_mutex_lock(&ws->lock);
+        if (failed)
+            ws->failed = 1;
+        ws->full[i] = 0;
+        pthread_cond_broadcast(&ws->cond);
+        pthread_mutex_unlock(&ws->lock);
+        if (failed)
+            break;
+    }
+    return NULL;
+}
+
+//Read one compressed block, header included, into buf. Returns its raw
+//length, 0 at the end of the stream or -1, and sets *len to the block length.
+static ssize_t recv_block(int sd, char *buf, int codec, size_t *len)
+{
+    ssize_t n = recv(sd, buf, COMPRESS_HEADER_LEN, MSG_WAITALL);
+    if (n == 0)
+        return 0;
+    uint32_t stored, raw;
+    int compressed;
+    if (n != COMPRESS_HEADER_LEN || compress_header_get(buf, codec, &stored, &raw, &compressed) < 0 ||
+        recv(sd, &buf[COMPRESS_HEADER_LEN], stored, MSG_WAITALL) != stored) {
+        fprintf(stderr, "Failed to read compressed block\n");
+        return -1;
+    }
+    *len = COMPRESS_HEADER_LEN + stored;
+    return raw;
+}
+
+//Read one encrypted record, header included, of at most cap bytes into buf.
+//Returns its length, 0 at the end of the stream or -1.
+static ssize_t recv_record(int sd, char *buf, size_t cap)
+{
+    ssize_t n = recv(sd, buf, CRYPT_HEADER_LEN, MSG_WAITALL);
+    if (n == 0)
+        return 0;
+    size_t len = n == CRYPT_HEADER_LEN ? crypt_record_len(buf) + CRYPT_OVERHEAD : 0;
+    if (!len || len > cap ||
+        recv(sd, &buf[CRYPT_HEADER_LEN], len - CRYPT_HEADER_LEN, MSG_WAITALL) !=
+            (ssize_t)(len - CRYPT_HEADER_LEN)) {
+        fprintf(stderr, "Failed to read encrypted record\n");
+        return -1;
+    }
+    return len;
+}
+
+//Receive into one buffer while the other one is being written out, at off +
+//*total onwards in the file, or into the files of batch. Compressed data is
+//received a block per buffer and encrypted data a record per buffer, and the
+//writer opens and decompresses them. Returns 0 once the sender is done, -1 on
+//error.
+static int receive_copy(int sd, int fd, uint64_t off, uint64_t *total, int codec,
+                        const struct crypt_key *key, int stream, struct batch_writer *batch)
+{
+    struct write_stage ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.fd = fd;
+    ws.batch = batch;
+    ws.off = off + *total;
+    size_t bufsize = (codec ? compress_bound(codec, COMPRESS_BLOCK) :
+                      (key ? CRYPT_RECORD_MAX : WRITE_CHUNK)) + (key ? CRYPT_OVERHEAD : 0);
+    if (compressor_init(&ws.comp, codec) < 0) {
+        fprintf(stderr, "%s support isn't built in\n", compress_codec_name(codec));
+        return -1;
+    }
+    if (codec && !(ws.raw = malloc(COMPRESS_BLOCK))) {
+        fprintf(stderr, "Insufficient memory for write buffers\n");
+        return -1;
+    }
+    if (key && crypt_init(&ws.crypt, key, stream, 0) < 0) {
+        free(ws.raw);
+        return -1;
+    }
+    ws.encrypted = key != NULL;
+    pthread_mutex_init(&ws.lock, NULL);
+    pthread_cond_init(&ws.cond, NULL);
+    for (int i = 0; i < 2; ++i) {
+        if (posix_memalign((void **)&ws.buf[i], 4096, bufsize) != 0) {
+            fprintf(stderr, "Insufficient memory for write buffers\n");
+            free(ws.buf[0]);
+            free(ws.raw);
+            return -1;
+        }
+    }
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, write_stage_main, &ws) != 0) {
+        fprintf(stderr, "Failed to start writer thread\n");
+        free(ws.buf[0]);
+        free(ws.buf[1]);
+        free(ws.raw);
+        return -1;
+    }
+
+    int res = 0;
+    int eof = 0;
+    for (int i = 0; !eof; i ^= 1) {
+        pthread_mutex_lock(&ws.lock);
+        while (ws.full[i] && !ws.failed)
+            pthread_cond_wait(&ws.cond, &ws.lock);
+        int failed = ws.failed;
+        pthread_mutex_unlock(&ws.lock);
+        if (failed) {
+            res = -1;
+            break;
+        }
+
+        size_t len = 0;
+        if (key) {
+            ssize_t n = recv_record(sd, ws.buf[i], bufsize);
+            if (n <= 0) {
+                res = n;
+                eof = 1;
+            }
+            len = n > 0 ? n : 0;
+        } else if (codec) {
+            ssize_t raw = recv_block(sd, ws.buf[i], codec, &len);
+            if (raw <= 0) {
+                res = raw;
+                eof = 1;
+                len = 0;
+            }
+            *total += raw > 0 ? raw : 0;
+        }
+        while (!codec && !key && len < WRITE_CHUNK) {
+            ssize_t n = recv(sd, &ws.buf[i][len], WRITE_CHUNK - len, 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                fprintf(stderr, "Fail: %s\n", strerror(errno));
+                res = -1;
+                eof = 1;
+                break;
+            }
+            if (n == 0) {
+                eof = 1;
+                break;
+            }
+            len += n;
+        }
+        if (!codec && !key)
+            *total += len;
+
+        pthread_mutex_lock(&ws.lock);
+        ws.len[i] = len;
+        ws.full[i] = len > 0;
+        pthread_cond_broadcast(&ws.cond);
+        pthread_mutex_unlock(&ws.lock);
+    }
+
+    pthread_mutex_lock(&ws.lock);
+    ws.done = 1;
+    pthread_cond_broadcast(&ws.cond);
+    pthread_mutex_unlock(&ws.lock);
+    pthread_join(writer, NULL);
+    if (ws.failed)
+        res = -1;
+    //how much of an encrypted record is data only the writer knows
+    if (key)
+        *total = ws.off - off;
+
+    pthread_mutex_destroy(&ws.lock);
+    pthread_cond_destroy(&ws.cond);
+    free(ws.buf[0]);
+    free(ws.buf[1]);
+    free(ws.raw);
+    compressor_free(&ws.comp);
+    if (key)
+        crypt_free(&ws.crypt);
+    return res;
+}
+
+//Move data socket -> pipe -> file at off without it ever reaching userspace.
+//Returns 0 once the sender is done, -1 on error and 1 if the file doesn't take
+//splice, in which case whatever was already received has been written and the
+//caller should carry on with receive_copy.
+static int receive_splice(int sd, int fd, uint64_t off, uint64_t *total)
+{
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0)
+        return 1;
+    fcntl(p[1], F_SETPIPE_SZ, PIPE_SIZE);
+    int psize = fcntl(p[1], F_GETPIPE_SZ);
+    if (psize <= 0)
+        psize = 65536;
+
+    int res = 0;
+    for (;;) {
+        ssize_t n = splice(sd, NULL, p[1], NULL, psize, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            //sockets that can't be spliced from just get copied
+            if (errno == EINVAL && !*total) {
+                res = 1;
+                break;
+            }
+            fprintf(stderr, "Fail: %s\n", strerror(errno));
+            res = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        size_t pending = n;
+        while (pending) {
+            loff_t pos = off + *total;
+            ssize_t m = splice(p[0], NULL, fd, &pos, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m < 0 && errno == EINVAL) {
+                //the filesystem doesn't take splice, empty the pipe by hand
+                char buf[65536];
+                while (pending) {
+                    ssize_t r = read(p[0], buf, pending < sizeof(buf) ? pending : sizeof(buf));
+                    if (r <= 0 || pwrite(fd, buf, r, off + *total) != r) {
+                        perror("Failed to write data");
+                        res = -1;
+                        goto out;
+                    }
+                    pending -= r;
+                    *total += r;
+                }
+                res = 1;
+                goto out;
+            }
+            if (m <= 0) {
+                perror("Failed to write data");
+                res = -1;
+                goto out;
+            }
+            pending -= m;
+            *total += m;
+        }
+    }
+
+out:
+    close(p[0]);
+    close(p[1]);
+    return res;
+}
+
+//Identify as a receiver under the hash of the given stream, into out,
+//HANDSHAKE_MAX bytes. If part of the stream's range arrived in an earlier
+//attempt, the relay passes it on so the sender can skip it. Returns the
+//length or -1.
+static int stream_header(const char *secret_hash, int stream, const struct journal_range *resume,
+                         char *out)
+{
+    //Identify us to the relay server as a receiver
+    memcpy(out, resume->done ? &resuming : &identity, 4);
+
+    //Send the secret code hash to pair us with a sender
+    char *hash = make_stream_hash(secret_hash, stream);
+    if (!hash)
+        return -1;
+    memcpy(&out[4], hash, SHA_DIGEST_LENGTH*2);
+    free(hash);
+    int len = 4 + SHA_DIGEST_LENGTH*2;
+
+    if (resume->done) {
+        char *rfield = &out[len + 2];
+        int rlen = 1;
+        rfield[0] = '\0';
+        rlen = meta_put_u64(rfield, rlen, 64, META_OFFSET, resume->off);
+        rlen = meta_put_u64(rfield, rlen, 64, META_LENGTH, resume->done);
+        uint16_t rsize = htons(rlen);
+        memcpy(&out[len], &rsize, 2);
+        len += 2 + rlen;
+    }
+    return len;
+}
+
+//Pair a further stream and read the filename field the sender paired with us
+//sent. The field is NUL terminated in a buffer of PATH_MAX bytes. Returns the
+//field's length or -1.
+static int stream_handshake(int sd, const char *hash, int stream,
+                            const struct journal_range *resume, char *field)
+{
+    char hdr[HANDSHAKE_MAX];
+    int hlen = stream_header(hash, stream, resume, hdr);
+    if (hlen < 0)
+        return -1;
+    if (send(sd, hdr, hlen, MSG_NOSIGNAL) != hlen) {
+        fprintf(stderr, "Failed to send handshake to relay\n");
+        return -1;
+    }
+
+    //Receive the filename from the server, along with whatever metadata the
+    //sender put after it
+    uint16_t fsize = 0;
+    ssize_t len = recv(sd, &fsize, 2, MSG_WAITALL);
+    fsize = ntohs(fsize);
+    if (len != 2 || !fsize || fsize >= PATH_MAX) {
+        fprintf(stderr, "Failed to read filename from relay\n");
+        return -1;
+    }
+    len = recv(sd, field, fsize, MSG_WAITALL);
+    if (len == 0) {
+        fprintf(stderr, "Read 0 from relay...\n");
+        return -1;
+    } else if (len != fsize) {
+        fprintf(stderr, "Failed to read filename from relay\n");
+        return -1;
+    }
+    field[len] = '\0';
+    return len;
+}
+
+//Sync what has been verified so far and record it in the journal.
+static int journal_sync(struct stream *s)
+{
+    s->range->done = s->total;
+    if (s->jfd < 0)
+        return 0;
+    if (fdatasync(s->fd) < 0) {
+        perror("Failed to sync data");
+        return -1;
+    }
+    off_t at = offsetof(struct journal, ranges) + s->index * sizeof(struct journal_range);
+    if (pwrite(s->jfd, s->range, sizeof(*s->range), at) != sizeof(*s->range)) {
+        perror("Failed to write journal");
+        return -1;
+    }
+    return 0;
+}
+
+//Receive a chunked stream, verifying each chunk before it is written and
+//recording progress in the journal as it goes. Returns 0 once the sender is
+//done, -1 on error. s->total ends up as the length verified from the start of
+//the range, including anything received by an earlier attempt.
+static int receive_chunks(struct stream *s)
+{
+    //compressed chunks hold one block each, which can come out a little
+    //larger than the chunk size if it didn't compress, and encrypted ones a
+    //record each, opened in place
+    struct compressor comp;
+    struct crypt cr;
+    if (compressor_init(&comp, s->codec) < 0) {
+        fprintf(stderr, "%s support isn't built in\n", compress_codec_name(s->codec));
+        return -1;
+    }
+    if (s->key && crypt_init(&cr, s->key, s->index, 0) < 0)
+        return -1;
+    size_t cap = (s->codec ? compress_bound(s->codec, s->chunk) : s->chunk) +
+                 (s->key ? CRYPT_OVERHEAD : 0);
+    char *buf = malloc(cap);
+    char *raw = s->codec ? malloc(COMPRESS_BLOCK) : NULL;
+    if (!buf || (s->codec && !raw)) {
+        fprintf(stderr, "Insufficient memory for chunk buffer\n");
+        free(buf);
+        free(raw);
+        if (s->key)
+            crypt_free(&cr);
+        return -1;
+    }
+
+    //Same rule the sender used to pick where to resume, a journal entry for
+    //a different range is stale
+    struct journal_range *r = s->range;
+    if (r->off != s->off || r->done > s->len)
+        r->done = 0;
+    r->off = s->off;
+    r->len = s->len;
+    s->total = r->done;
+    uint64_t synced = s->total;
+
+    int res = 0;
+    for (int first = 1;; first = 0) {
+        char hdr[CHUNK_HEADER_LEN];
+        ssize_t n = recv(s->sd, hdr, sizeof(hdr), MSG_WAITALL);
+        if (n == 0)
+            break;
+        if (n != sizeof(hdr)) {
+            fprintf(stderr, "Failed to read chunk on stream %d\n", s->index);
+            res = -1;
+            break;
+        }
+        uint64_t off, sum;
+        uint32_t len;
+        chunk_header_get(hdr, &off, &len, &sum);
+
+        //the sender may start over anywhere within what we already have
+        if (first && off >= s->off && off - s->off <= s->total) {
+            s->total = off - s->off;
+            if (synced > s->total)
+                synced = s->total;
+        }
+        if (off != s->off + s->total || len > cap) {
+            fprintf(stderr, "Unexpected chunk of %u bytes at %llu on stream %d\n",
+                    len, (unsigned long long)off, s->index);
+            res = -1;
+            break;
+        }
+        if (recv(s->sd, buf, len, MSG_WAITALL) != len) {
+            fprintf(stderr, "Failed to read chunk on stream %d\n", s->index);
+            res = -1;
+            break;
+        }
+        if (chunk_checksum(buf, len) != sum) {
+            fprintf(stderr, "Chunk at %llu failed verification\n", (unsigned long long)off);
+            res = -1;
+            break;
+        }
+        const char *data = buf;
+        size_t rawlen = len;
+        if (s->key) {
+            char *plain = &buf[CRYPT_HEADER_LEN];
+            ssize_t n = crypt_open(&cr, buf, len, off, plain);
+            if (n < 0) {
+                fprintf(stderr, "Chunk at %llu failed to authenticate\n", (unsigned long long)off);
+                res = -1;
+                break;
+            }
+            data = plain;
+            rawlen = n;
+        }
+        if (s->codec && (!(data = block_data(&comp, data, raw, &rawlen)) || rawlen > s->chunk)) {
+            fprintf(stderr, "Failed to decompress chunk at %llu\n", (unsigned long long)off);
+            res = -1;
+            break;
+        }
+        if (rawlen > s->len - s->total) {
+            fprintf(stderr, "Chunk at %llu runs past the end of stream %d\n",
+                    (unsigned long long)off, s->index);
+            res = -1;
+            break;
+        }
+        if (write_at(s->fd, data, rawlen, off) < 0) {
+            res = -1;
+            break;
+        }
+        s->total += rawlen;
+        if (s->total - synced >= JOURNAL_INTERVAL) {
+            if (journal_sync(s) < 0) {
+                res = -1;
+                break;
+            }
+            synced = s->total;
+        }
+    }
+
+    //keep whatever was verified, even if the stream failed
+    if (s->total != synced && journal_sync(s) < 0)
+        res = -1;
+    free(buf);
+    free(raw);
+    compressor_free(&comp);
+    if (s->key)
+        crypt_free(&cr);
+    return res;
+}
+
+//Receive the stream's range into the file. Returns 0 once the sender is done
+//or -1 on error.
+static int receive_range(struct stream *s)
+{
+    if (s->chunk)
+        return receive_chunks(s);
+
+    //compressed and encrypted data has to come through userspace to be
+    //decompressed and opened
+    int transformed = s->codec || s->key;
+    int res = 1;
+    if (s->mode != RELAY_WRITE_COPY && !transformed)
+        res = receive_splice(s->sd, s->fd, s->off, &s->total);
+    if (res > 0) {
+        if (s->mode == RELAY_WRITE_SPLICE && !transformed)
+            fprintf(stderr, "splice not supported here, copying instead\n");
+        res = receive_copy(s->sd, s->fd, s->off, &s->total, s->codec, s->key, s->index, NULL);
+    }
+    return res;
+}
+
+//Receive a batch of len bytes into outdir, recreating its files and
+//directories. Returns 0 once all of it arrived or -1.
+static int receive_batch(int sd, const char *outdir, uint64_t len, int codec,
+                         const struct crypt_key *key)
+{
+    struct batch_writer w;
+    batch_writer_init(&w, outdir);
+    uint64_t total = 0;
+    int res = receive_copy(sd, -1, 0, &total, codec, key, 0, &w);
+    if (batch_writer_finish(&w) < 0)
+        res = -1;
+    if (!res && total != len) {
+        fprintf(stderr, "Batch incomplete, got %llu of %llu bytes\n",
+                (unsigned long long)total, (unsigned long long)len);
+        res = -1;
+    }
+
+    //the files were renamed into place as they completed, sync them all at
+    //once rather than one at a time
+    int dfd = open(outdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0 || syncfs(dfd) < 0) {
+        fprintf(stderr, "Failed to sync %s: %s\n", outdir, strerror(errno));
+        res = -1;
+    }
+    if (dfd >= 0)
+        close(dfd);
+    return res;
+}
+
+//Read a stream's range out of its field and check it fits the file.
+static int stream_range(struct stream *s, const char *field, int len)
+{
+    uint64_t index = 0;
+    if (meta_get_u64(field, len, META_STREAM, &index) < 0 || index != (uint64_t)s->index ||
+        meta_get_u64(field, len, META_OFFSET, &s->off) < 0 ||
+        meta_get_u64(field, len, META_LENGTH, &s->len) < 0 ||
+        s->off > s->size || s->len > s->size - s->off) {
+        fprintf(stderr, "Invalid range for stream %d\n", s->index);
+        return -1;
+    }
+    return 0;
+}
+
+//Streams past the first are connected and paired once the first one has told
+//us how many there are, each on its own thread.
+static void *stream_main(void *opaque)
+{
+    struct stream *s = (struct stream *)opaque;
+    s->failed = 1;
+    char field[PATH_MAX];
+    int len;
+    if ((s->sd = relay_connect(s->addr, s->tuning, s->link_rate)) < 0)
+        return NULL;
+    if ((len = stream_handshake(s->sd, s->hash, s->index, s->range, field)) < 0 ||
+        stream_range(s, field, len) < 0 || receive_range(s) < 0)
+        return NULL;
+    if (s->total != s->len) {
+        fprintf(stderr, "Stream %d incomplete, got %llu of %llu bytes\n", s->index,
+                (unsigned long long)s->total, (unsigned long long)s->len);
+        return NULL;
+    }
+    s->failed = 0;
+    return NULL;
+}
+
+int receive_prepare(struct relay_session *s, const struct relay_receive_opts *o)
+{
+    s->fd = -1;
+    s->outfd = -1;
+    s->jfd = -1;
+    s->mode = o->mode;
+    if (!o->secret) {
+        fprintf(stderr, "Receiving needs the sender's secret\n");
+        return -1;
+    }
+    if (!(s->secret = strdup(o->secret)))
+        return -1;
+    if (!o->outdir && o->buf) {
+        s->buf = o->buf;
+        s->cap = o->cap;
+        return 0;
+    }
+    if (!o->outdir) {
+        s->fd = o->fd;
+        s->seekable = lseek(o->fd, 0, SEEK_CUR) >= 0;
+        return 0;
+    }
+    if (!(s->outdir = strdup(o->outdir)))
+        return -1;
+
+    return 0;
+}
+
+void receive_journal(struct relay_session *s)
+{
+    if (!s->outdir)
+        return;
+    //A chunked transfer that was interrupted left a journal behind, named
+    //after the secret's hash so a receive with the same secret finds it
+    snprintf(s->journalfile, PATH_MAX, "%s/.%s.journal", s->outdir, s->hash);
+    snprintf(s->partfile, PATH_MAX, "%s/.%s.part", s->outdir, s->hash);
+    s->jfd = open(s->journalfile, O_RDWR | O_CLOEXEC);
+    if (s->jfd >= 0 && (read(s->jfd, &s->journal, sizeof(s->journal)) != sizeof(s->journal) ||
+                        memcmp(s->journal.magic, JOURNAL_MAGIC, sizeof(s->journal.magic)))) {
+        fprintf(stderr, "Ignoring invalid journal %s\n", s->journalfile);
+        memset(&s->journal, 0, sizeof(s->journal));
+        close(s->jfd);
+        s->jfd = -1;
+    }
+}
+
+int receive_header(struct relay_session *s)
+{
+    int len = stream_header(s->hash, 0, &s->journal.ranges[0], s->hdr);
+    if (len < 0)
+        return -1;
+    s->hdrlen = len;
+    s->hdroff = 0;
+    return 0;
+}
+
+int receive_parse(struct relay_session *s)
+{
+    //The first stream is paired under the hash of the secret itself, and
+    //tells us the file name, size and how many streams the sender opened
+    const char *field = s->field;
+    int len = s->fieldlen;
+    s->have_size = meta_get_u64(field, len, META_FILE_SIZE, &s->size) == 0;
+    uint64_t nstreams = 1;
+    if (meta_get_u64(field, len, META_STREAMS, &nstreams) == 0 &&
+        (nstreams < 1 || nstreams > MAX_STREAMS || !s->have_size)) {
+        session_error(s, "Invalid stream count %llu", (unsigned long long)nstreams);
+        return -1;
+    }
+    s->nstreams = nstreams;
+    if (meta_get_u64(field, len, META_CHUNK_SIZE, &s->chunk) == 0 &&
+        (!s->chunk || s->chunk > CHUNK_SIZE_MAX || !s->have_size)) {
+        session_error(s, "Invalid chunk size %llu", (unsigned long long)s->chunk);
+        return -1;
+    }
+
+    uint64_t codec = COMPRESS_NONE;
+    if (meta_get_u64(field, len, META_COMPRESSION, &codec) == 0 &&
+        (codec > COMPRESS_ZLIB || !compress_supported(codec))) {
+        session_error(s, "%s compression isn't supported by this receive",
+                      compress_codec_name(codec > COMPRESS_ZLIB ? -1 : (int)codec));
+        return -1;
+    }
+    s->codec = codec;
+
+    //A batch comes over a single plain stream, its length stands in for the
+    //file size
+    s->batched = meta_get_u64(field, len, META_BATCH, &s->batchlen) == 0;
+    if (s->batched && (s->have_size || nstreams != 1 || s->chunk)) {
+        session_error(s, "Invalid batch");
+        return -1;
+    }
+    if (s->batched && !s->outdir) {
+        session_error(s, "Batches can only be received into a directory");
+        return -1;
+    }
+    if (s->batched)
+        s->size = s->batchlen;
+
+    //The key is derived on the transfer's thread, it's slow on purpose
+    uint64_t cipher = CRYPT_NONE;
+    if (meta_get_u64(field, len, META_CIPHER, &cipher) == 0) {
+        uint16_t saltlen = 0;
+        if (cipher == CRYPT_NONE || cipher > CRYPT_CHACHA20) {
+            session_error(s, "%s encryption isn't supported by this receive",
+                          crypt_cipher_name(cipher > CRYPT_CHACHA20 ? -1 : (int)cipher));
+            return -1;
+        }
+        if (!meta_get(field, len, META_SALT, &saltlen) || saltlen != CRYPT_SALT_LEN) {
+            session_error(s, "Invalid encryption salt");
+            return -1;
+        }
+        s->cipher = cipher;
+    }
+
+    //the name ends at the first NUL, the metadata follows
+    if (!(s->name = strdup(field)))
+        return -1;
+    if (!s->batched && s->outdir &&
+        (!*s->name || strchr(s->name, '/') || !strcmp(s->name, ".") || !strcmp(s->name, ".."))) {
+        session_error(s, "Invalid file name %s", s->name);
+        return -1;
+    }
+    if (s->buf && s->have_size && s->size > s->cap) {
+        session_error(s, "%llu bytes don't fit in the buffer", (unsigned long long)s->size);
+        return -1;
+    }
+    return 0;
+}
+
+int receive_plain(const struct relay_session *s)
+{
+    return s->nstreams == 1 && !s->chunk && !s->codec && !s->cipher && !s->batched;
+}
+
+int receive_open(struct relay_session *s)
+{
+    if (!s->outdir) {
+        //Plain data goes straight where it was asked to. Anything else is
+        //written out of order by several threads, so it goes to memory first
+        //unless it's headed for a file anyway.
+        if (receive_plain(s) || (s->fd >= 0 && s->seekable))
+            return 0;
+        s->outfd = s->fd;
+        s->fd = memfd_create("relay-receive", MFD_CLOEXEC);
+        if (s->fd < 0) {
+            session_error(s, "Failed to create receive buffer: %s", strerror(errno));
+            return -1;
+        }
+        s->ownfd = 1;
+        s->seekable = 1;
+        return 0;
+    }
+
+    //Write to a temporary file next to the final one and only rename it into
+    //place once everything arrived, so a failed transfer never leaves behind
+    //a truncated file or the tail of an older one. Chunked transfers write to
+    //a file named after the secret, which is kept along with the journal when
+    //they fail.
+    snprintf(s->fullfile, PATH_MAX, "%s/%s", s->outdir, s->name);
+    if (s->chunk) {
+        snprintf(s->tmpfile, PATH_MAX, "%s", s->partfile);
+        if (s->jfd >= 0 && s->journal.size == s->size)
+            s->fd = open(s->tmpfile, O_RDWR | O_CLOEXEC);
+        if (s->fd >= 0) {
+            s->resumed = 1;
+        } else {
+            if (s->jfd >= 0)
+                close(s->jfd);
+            memset(&s->journal, 0, sizeof(s->journal));
+            memcpy(s->journal.magic, JOURNAL_MAGIC, sizeof(s->journal.magic));
+            s->journal.size = s->size;
+            s->fd = open(s->tmpfile, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            s->jfd = open(s->journalfile, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (s->jfd < 0 || write(s->jfd, &s->journal, sizeof(s->journal)) != sizeof(s->journal)) {
+                session_error(s, "Failed to create %s: %s", s->journalfile, strerror(errno));
+                if (s->fd >= 0)
+                    close(s->fd);
+                s->fd = -1;
+                return -1;
+            }
+        }
+    } else {
+        snprintf(s->tmpfile, PATH_MAX, "%s/.%s.XXXXXX", s->outdir, s->name);
+        s->fd = mkstemp(s->tmpfile);
+        if (s->fd >= 0) {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(s->fd, 0644 & ~mask);
+        }
+    }
+    if (s->fd < 0) {
+        session_error(s, "Failed to open %s: %s", s->tmpfile, strerror(errno));
+        return -1;
+    }
+    s->ownfd = 1;
+    s->seekable = 1;
+
+    //Reserve the whole file up front so the filesystem can lay it out in as
+    //few extents as possible. Not every filesystem supports this. Streams
+    //write their ranges with pwrite, so without it the file would still come
+    //out right, just possibly more fragmented.
+    if (!s->resumed && s->have_size && s->size > 0 && fallocate(s->fd, 0, 0, s->size) < 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+        session_error(s, "Failed to allocate %llu bytes for %s: %s",
+                      (unsigned long long)s->size, s->fullfile, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int receive_data(struct relay_session *s, const char *data, size_t len)
+{
+    if (s->buf) {
+        if (len > s->cap - s->bytes) {
+            session_error(s, "More data than fits in the buffer");
+            return -1;
+        }
+        memcpy(&s->buf[s->bytes], data, len);
+    } else if (s->seekable) {
+        if (write_at(s->fd, data, len, s->bytes) < 0)
+            return -1;
+    } else {
+        for (size_t done = 0; done < len;) {
+            ssize_t n = write(s->fd, &data[done], len - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                perror("Failed to write data");
+                return -1;
+            }
+            done += n;
+        }
+    }
+    s->bytes += len;
+    return 0;
+}
+
+//Hand what was received into memory to the caller's buffer or fd.
+static int receive_unspool(struct relay_session *s)
+{
+    if (s->buf && s->bytes > s->cap) {
+        session_error(s, "%llu bytes don't fit in the buffer", (unsigned long long)s->bytes);
+        return -1;
+    }
+    char *copy = s->buf;
+    char tmp[65536];
+    for (uint64_t off = 0; off < s->bytes;) {
+        size_t want = s->bytes - off;
+        if (!s->buf && want > sizeof(tmp))
+            want = sizeof(tmp);
+        ssize_t n = pread(s->fd, s->buf ? &copy[off] : tmp, want, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            session_error(s, "Failed to read receive buffer");
+            return -1;
+        }
+        if (!s->buf) {
+            for (ssize_t done = 0; done < n;) {
+                ssize_t m = write(s->outfd, &tmp[done], n - done);
+                if (m < 0 && errno == EINTR)
+                    continue;
+                if (m < 0) {
+                    session_error(s, "Failed to write data: %s", strerror(errno));
+                    return -1;
+                }
+                done += m;
+            }
+        }
+        off += n;
+    }
+    return 0;
+}
+
+int receive_finish(struct relay_session *s, int failed)
+{
+    if (!failed && s->have_size && s->bytes != s->size) {
+        session_error(s, "Transfer incomplete, got %llu of %llu bytes",
+                      (unsigned long long)s->bytes, (unsigned long long)s->size);
+        failed = 1;
+    }
+    if (!failed && s->ownfd && !s->outdir && receive_unspool(s) < 0)
+        failed = 1;
+    if (!failed && s->outdir) {
+        if (fdatasync(s->fd) < 0 || rename(s->tmpfile, s->fullfile) < 0) {
+            session_error(s, "Failed to save %s: %s", s->fullfile, strerror(errno));
+            failed = 1;
+        } else if (s->chunk) {
+            unlink(s->journalfile);
+        }
+    }
+    if (failed && s->outdir && s->fd >= 0) {
+        if (s->chunk)
+            fprintf(stderr, "Kept the partial transfer, receive with the same secret to resume\n");
+        else
+            unlink(s->tmpfile);
+    }
+    if (s->ownfd) {
+        close(s->fd);
+        s->fd = -1;
+        s->ownfd = 0;
+    }
+    return failed ? -1 : 0;
+}
+
+void *receive_thread(void *opaque)
+{
+    struct relay_session *s = (struct relay_session *)opaque;
+    s->status = -1;
+
+    //The sender's salt along with the secret gives the key, which also
+    //depends on the size, so a field changed on the way fails the first
+    //record
+    struct crypt_key key;
+    if (s->cipher) {
+        uint16_t saltlen = 0;
+        const char *salt = meta_get(s->field, s->fieldlen, META_SALT, &saltlen);
+        if (crypt_derive(&key, s->cipher, s->secret, (const unsigned char *)salt, s->size) < 0) {
+            session_error(s, "Invalid encryption salt");
+            return NULL;
+        }
+    }
+
+    if (s->batched) {
+        if (receive_batch(s->sd, s->outdir, s->batchlen, s->codec, s->cipher ? &key : NULL) < 0) {
+            session_error(s, "Failed to receive batch");
+            return NULL;
+        }
+        s->bytes = s->batchlen;
+        s->status = 0;
+        return NULL;
+    }
+
+    if (receive_open(s) < 0) {
+        receive_finish(s, 1);
+        return NULL;
+    }
+    struct stream streams[MAX_STREAMS];
+    uint64_t nstreams = s->nstreams;
+    for (uint64_t i = 0; i < nstreams; ++i) {
+        struct stream *st = &streams[i];
+        memset(st, 0, sizeof(*st));
+        st->index = i;
+        st->hash = s->hash;
+        st->addr = &s->client->addr;
+        st->tuning = s->tuning;
+        st->link_rate = s->link_rate;
+        st->sd = i == 0 ? s->sd : -1;
+        st->fd = s->fd;
+        st->mode = s->mode;
+        st->size = s->size;
+        st->len = s->size;
+        st->chunk = s->chunk;
+        st->codec = s->codec;
+        st->key = s->cipher ? &key : NULL;
+        st->range = &s->journal.ranges[i];
+        st->jfd = s->jfd;
+    }
+    if (nstreams > 1 && stream_range(&streams[0], s->field, s->fieldlen) < 0) {
+        receive_finish(s, 1);
+        return NULL;
+    }
+    uint64_t started = 1;
+    for (; started < nstreams; ++started) {
+        if (pthread_create(&streams[started].thread, NULL, stream_main, &streams[started]) != 0) {
+            fprintf(stderr, "Failed to start stream %llu\n", (unsigned long long)started);
+            break;
+        }
+    }
+
+    int failed = started < nstreams;
+    if (!failed && receive_range(&streams[0]) < 0)
+        failed = 1;
+    uint64_t total = streams[0].total;
+    if (nstreams > 1 && total != streams[0].len)
+        failed = 1;
+    for (uint64_t i = 1; i < started; ++i) {
+        pthread_join(streams[i].thread, NULL);
+        if (streams[i].sd >= 0)
+            close(streams[i].sd);
+        failed |= streams[i].failed;
+        total += streams[i].total;
+    }
+    s->bytes = total;
+    if (failed)
+        session_error(s, "Failed to receive %s", s->name);
+    if (receive_finish(s, failed) == 0)
+        s->status = 0;
+    return NULL;
+}
+
+void receive_free(struct relay_session *s)
+{
+    if (s->ownfd)
+        close(s->fd);
+    if (s->jfd >= 0)
+        close(s->jfd);
+    free(s->outdir);
+}
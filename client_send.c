@@ -0,0 +1,453 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "batch.h"
+#include "client.h"
+#include "compress.h"
+#include "secret.h"
+#include "transmit.h"
+
+static const uint32_t identity = SENDER_IDENTITY;
+
+//don't bother splitting off ranges smaller than this
+#define MIN_STREAM_BYTES (64ULL * 1024 * 1024)
+//rate that auto picked stream counts aim for, 10Gbit/s
+#define TARGET_BYTES_PER_SEC (1250ULL * 1000 * 1000)
+//relayclient.h's options in the terms of the modules behind them
+static const int codecs[] = {
+    [RELAY_CODEC_NONE] = COMPRESS_NONE,
+    [RELAY_CODEC_LZ4] = COMPRESS_LZ4,
+    [RELAY_CODEC_ZSTD] = COMPRESS_ZSTD,
+    [RELAY_CODEC_ZLIB] = COMPRESS_ZLIB,
+};
+static const int ciphers[] = {
+    [RELAY_CIPHER_NONE] = CRYPT_NONE,
+    [RELAY_CIPHER_AES_GCM] = CRYPT_AES_GCM,
+    [RELAY_CIPHER_CHACHA20] = CRYPT_CHACHA20,
+};
+static const int modes[] = {
+    [RELAY_SEND_AUTO] = TRANSMIT_AUTO,
+    [RELAY_SEND_SENDFILE] = TRANSMIT_SENDFILE,
+    [RELAY_SEND_ZEROCOPY] = TRANSMIT_ZEROCOPY,
+    [RELAY_SEND_COPY] = TRANSMIT_COPY,
+};
+static const int priorities[] = {
+    [RELAY_PRIORITY_NORMAL] = PRIORITY_NORMAL,
+    [RELAY_PRIORITY_BULK] = PRIORITY_BULK,
+    [RELAY_PRIORITY_HIGH] = PRIORITY_HIGH,
+};
+//the table's entry for v, or -1 if it has none
+#define OPT_MAP(table, v) \
+    ((v) >= 0 && (v) < (int)(sizeof(table) / sizeof(table[0])) ? (table)[v] : -1)
+
+//size of the verified chunks of a resumable transfer
+#define RESUME_CHUNK (1024 * 1024)
+
+//One connection through the relay carrying one byte range of the file.
+struct stream {
+    int index;
+    int count;
+    const char *hash;
+    const struct sockaddr_in *addr;
+    int tuning;           //socket profile and link rate for relay_connect
+    uint64_t link_rate;
+    int sd;
+    const char *base;
+    int fd;
+    const char *buf;      //the data, when it's in memory rather than fd
+    uint64_t size;
+    uint64_t off;
+    uint64_t len;
+    int mode;
+    int resumable;
+    int fanout;
+    int priority;
+    int codec;
+    const struct crypt_key *key;  //NULL if not encrypting
+    const unsigned char *salt;
+    struct batch *batch;  //the files sent instead of fd, NULL if just the one
+    int failed;
+    pthread_t thread;
+};
+
+static int send_all(int sd, const char *buf, size_t len)
+{
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(sd, &buf[off], len - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static ssize_t mem_read(void *src, char *buf, size_t len, uint64_t at)
+{
+    memcpy(buf, (const char *)src + at, len);
+    return len;
+}
+
+//Pick a stream count from the round trip time to the relay. One stream can't
+//go faster than its send buffer per round trip, so use enough of them to
+//reach the target rate, without cutting the file into tiny ranges.
+int send_auto_streams(int sd, uint64_t size)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(sd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return 1;
+
+    unsigned long long wmem = 4 * 1024 * 1024;
+    FILE *f = fopen("/proc/sys/net/ipv4/tcp_wmem", "r");
+    if (f) {
+        unsigned long long lo, def, max;
+        if (fscanf(f, "%llu %llu %llu", &lo, &def, &max) == 3 && max > 0)
+            wmem = max;
+        fclose(f);
+    }
+
+    //tcpi_rtt is in microseconds
+    uint64_t want = (TARGET_BYTES_PER_SEC * info.tcpi_rtt / 1000000 + wmem - 1) / wmem;
+    uint64_t most = size / MIN_STREAM_BYTES;
+    if (want > most)
+        want = most;
+    if (want > MAX_STREAMS)
+        want = MAX_STREAMS;
+    return want < 1 ? 1 : want;
+}
+
+//Identify as a sender under the stream's hash and give the filename field,
+//into out, HANDSHAKE_MAX bytes. Streams past the first have their own hash
+//derived from the secret's so the relay pairs each of them separately. Returns
+//the length or -1.
+static int stream_handshake(const struct stream *s, char *out)
+{
+    //Identify us to the relay server as a sender
+    memcpy(out, &identity, 4);
+
+    //Send the secret code hash to pair us with a receiver. Hash the secret so
+    //we never transmit the secret itself.
+    char *hash = make_stream_hash(s->hash, s->index);
+    if (!hash)
+        return -1;
+    memcpy(&out[4], hash, SHA_DIGEST_LENGTH*2);
+    free(hash);
+
+    //Send the filename, followed by the file size so the receiver can
+    //preallocate it, and which range of the file this stream carries. A
+    //batch has no name, just the length of its stream.
+    char *field = &out[4 + SHA_DIGEST_LENGTH*2 + 2];
+    size_t cap = HANDSHAKE_MAX - (4 + SHA_DIGEST_LENGTH*2 + 2);
+    int len = strlen(s->base) + 1;
+    if (len > PATH_MAX - 128) {
+        fprintf(stderr, "Filename too long\n");
+        return -1;
+    }
+    memcpy(field, s->base, len);
+    len = meta_put_u64(field, len, cap, s->batch ? META_BATCH : META_FILE_SIZE, s->size);
+    if (s->count > 1) {
+        len = meta_put_u64(field, len, cap, META_STREAMS, s->count);
+        len = meta_put_u64(field, len, cap, META_STREAM, s->index);
+        len = meta_put_u64(field, len, cap, META_OFFSET, s->off);
+        len = meta_put_u64(field, len, cap, META_LENGTH, s->len);
+    }
+    if (s->resumable)
+        len = meta_put_u64(field, len, cap, META_CHUNK_SIZE, RESUME_CHUNK);
+    if (s->fanout > 1)
+        len = meta_put_u64(field, len, cap, META_FANOUT, s->fanout);
+    if (s->priority != PRIORITY_NORMAL)
+        len = meta_put_u64(field, len, cap, META_PRIORITY, s->priority);
+    if (s->codec)
+        len = meta_put_u64(field, len, cap, META_COMPRESSION, s->codec);
+    if (s->key) {
+        len = meta_put_u64(field, len, cap, META_CIPHER, s->key->cipher);
+        len = meta_put(field, len, cap, META_SALT, s->salt, CRYPT_SALT_LEN);
+    }
+    uint16_t fsize = htons(len);
+    memcpy(&out[4 + SHA_DIGEST_LENGTH*2], &fsize, 2);
+    return 4 + SHA_DIGEST_LENGTH*2 + 2 + len;
+}
+
+//Once paired, the relay tells senders of chunked transfers how much of this
+//stream's range the receiver already has. Returns the number of bytes to skip
+//or -1.
+static int64_t stream_resume_point(struct stream *s)
+{
+    char field[PATH_MAX];
+    uint16_t fsize = 0;
+    if (recv(s->sd, &fsize, 2, MSG_WAITALL) != 2) {
+        fprintf(stderr, "Failed to read resume point from relay\n");
+        return -1;
+    }
+    fsize = ntohs(fsize);
+    if (!fsize)
+        return 0;
+    if (fsize >= PATH_MAX || recv(s->sd, field, fsize, MSG_WAITALL) != fsize) {
+        fprintf(stderr, "Failed to read resume point from relay\n");
+        return -1;
+    }
+
+    //the receiver's range only counts if it starts where ours does, say the
+    //stream count changed since
+    uint64_t off, len;
+    if (meta_get_u64(field, fsize, META_OFFSET, &off) < 0 ||
+        meta_get_u64(field, fsize, META_LENGTH, &len) < 0 ||
+        off != s->off || len > s->len)
+        return 0;
+    if (len)
+        fprintf(stderr, "Resuming stream %d at %llu of %llu bytes\n", s->index,
+                (unsigned long long)len, (unsigned long long)s->len);
+    return len;
+}
+
+static void *stream_main(void *opaque)
+{
+    struct stream *s = (struct stream *)opaque;
+    s->failed = 1;
+    if (s->sd < 0 && (s->sd = relay_connect(s->addr, s->tuning, s->link_rate)) < 0)
+        return NULL;
+    char hdr[HANDSHAKE_MAX];
+    int hdrlen = stream_handshake(s, hdr);
+    if (hdrlen < 0)
+        return NULL;
+    if (send_all(s->sd, hdr, hdrlen) < 0) {
+        fprintf(stderr, "Failed to send handshake to relay\n");
+        return NULL;
+    }
+
+    //A batch is read file after file into large blocks, which go out the
+    //same way as those of a single file
+    if (s->batch) {
+        ssize_t sent = transmit_stream(s->sd, batch_read, s->batch, 0, s->len, RESUME_CHUNK,
+                                       s->codec, 0, s->key, s->index);
+        s->failed = sent < 0 || (uint64_t)sent != s->len;
+        return NULL;
+    }
+
+    //Chunked, compressed and encrypted transfers go through userspace, with
+    //the file read, compressed and sealed on another thread while the data
+    //goes out. So does data that's in memory already.
+    if (s->resumable || s->codec || s->key || s->buf) {
+        int64_t skip = s->resumable ? stream_resume_point(s) : 0;
+        if (skip < 0)
+            return NULL;
+        ssize_t sent = s->buf ?
+            transmit_stream(s->sd, mem_read, (void *)s->buf, s->off + skip, s->len - skip,
+                            RESUME_CHUNK, s->codec, s->resumable, s->key, s->index) :
+            transmit_blocks(s->sd, s->fd, s->off + skip, s->len - skip,
+                            RESUME_CHUNK, s->codec, s->resumable, s->key, s->index);
+        if (sent < 0 || (uint64_t)sent != s->len - skip) {
+            fprintf(stderr, "Failed to send stream %d\n", s->index);
+            return NULL;
+        }
+        s->failed = 0;
+        return NULL;
+    }
+
+    //Hand the range to the kernel in as few and as large pieces as possible.
+    //sendfile by default, falling back to a read/send loop.
+    ssize_t sent = transmit_file(s->sd, s->fd, s->off, s->len, s->mode, NULL, NULL);
+    if (sent < 0 || (uint64_t)sent != s->len) {
+        fprintf(stderr, "Failed to send stream %d\n", s->index);
+        return NULL;
+    }
+    s->failed = 0;
+    return NULL;
+}
+
+int send_prepare(struct relay_session *s, const struct relay_send_opts *o)
+{
+    if (o->streams < 0 || o->streams > MAX_STREAMS) {
+        fprintf(stderr, "Streams must be between 0 and %d\n", MAX_STREAMS);
+        return -1;
+    }
+    int codec = OPT_MAP(codecs, o->codec);
+    int cipher = OPT_MAP(ciphers, o->cipher);
+    int mode = OPT_MAP(modes, o->mode);
+    int priority = OPT_MAP(priorities, o->priority);
+    if (codec < 0) {
+        fprintf(stderr, "Unknown codec\n");
+        return -1;
+    }
+    if (codec && !compress_supported(codec)) {
+        fprintf(stderr, "%s support isn't built in\n", compress_codec_name(codec));
+        return -1;
+    }
+    if (cipher < 0) {
+        fprintf(stderr, "Unknown cipher\n");
+        return -1;
+    }
+    if (mode < 0) {
+        fprintf(stderr, "Unknown send mode\n");
+        return -1;
+    }
+    if (priority < 0) {
+        fprintf(stderr, "Unknown priority class\n");
+        return -1;
+    }
+    if (o->fanout > 1 && o->resumable) {
+        fprintf(stderr, "Transfers to several receivers can't be resumable\n");
+        return -1;
+    }
+    s->fd = -1;
+    s->nstreams = o->streams;
+    s->resumable = o->resumable;
+    s->fanout = o->fanout;
+    s->priority = priority;
+    s->codec = codec;
+    s->cipher = cipher;
+    s->mode = mode;
+
+    //Directories and several files are walked up front and go as one batch
+    //over a single stream, instead of a connection each
+    if (o->npaths > 0) {
+        if (o->resumable) {
+            fprintf(stderr, "Only single files can be resumable\n");
+            return -1;
+        }
+        if (!(s->batch = malloc(sizeof(*s->batch))))
+            return -1;
+        batch_init(s->batch);
+        for (int i = 0; i < o->npaths; ++i)
+            if (batch_add(s->batch, o->paths[i]) < 0)
+                return -1;
+        s->size = s->batch->total;
+        s->nstreams = 1;
+        s->name = strdup("");
+    } else {
+        if (!o->name || strchr(o->name, '/')) {
+            fprintf(stderr, "A file needs a name without slashes\n");
+            return -1;
+        }
+        s->buf = (char *)o->buf;
+        s->fd = o->buf ? -1 : o->fd;
+        s->size = o->size;
+        s->name = strdup(o->name);
+    }
+
+    //Generate a secret code unless resuming with the old one
+    s->secret = o->secret ? strdup(o->secret) : make_secret(4);
+    return s->secret && s->name ? 0 : -1;
+}
+
+int send_plain(const struct relay_session *s)
+{
+    return s->nstreams == 1 && !s->batch && !s->resumable && !s->codec && !s->cipher &&
+           (s->buf || s->mode == TRANSMIT_AUTO || s->mode == TRANSMIT_SENDFILE);
+}
+
+int send_header(struct relay_session *s)
+{
+    struct stream st;
+    memset(&st, 0, sizeof(st));
+    st.count = 1;
+    st.hash = s->hash;
+    st.base = s->name;
+    st.size = s->size;
+    st.len = s->size;
+    st.fanout = s->fanout;
+    st.priority = s->priority;
+    int len = stream_handshake(&st, s->hdr);
+    if (len < 0)
+        return -1;
+    s->hdrlen = len;
+    s->hdroff = 0;
+    return 0;
+}
+
+void *send_thread(void *opaque)
+{
+    struct relay_session *s = (struct relay_session *)opaque;
+    s->status = -1;
+
+    //The key comes from the secret, which only we and the receiver know, and
+    //a fresh salt so a resent file never reuses a key
+    struct crypt_key key;
+    unsigned char salt[CRYPT_SALT_LEN];
+    if (s->cipher && (RAND_bytes(salt, sizeof(salt)) != 1 ||
+                      crypt_derive(&key, s->cipher, s->secret, salt, s->size) < 0)) {
+        session_error(s, "Failed to set up encryption");
+        return NULL;
+    }
+
+    //Cut the file into page aligned ranges, one per stream. Every stream
+    //but the first runs on its own thread.
+    struct stream streams[MAX_STREAMS];
+    int nstreams = s->nstreams;
+    uint64_t size = s->size;
+    uint64_t per = (size / nstreams + 4095) & ~4095ULL;
+    for (int i = 0; i < nstreams; ++i) {
+        struct stream *st = &streams[i];
+        memset(st, 0, sizeof(*st));
+        st->index = i;
+        st->count = nstreams;
+        st->hash = s->hash;
+        st->addr = &s->client->addr;
+        st->tuning = s->tuning;
+        st->link_rate = s->link_rate;
+        st->sd = i == 0 ? s->sd : -1;
+        st->base = s->name;
+        st->fd = s->fd;
+        st->buf = s->buf;
+        st->size = size;
+        st->off = (uint64_t)i * per < size ? (uint64_t)i * per : size;
+        st->len = i == nstreams - 1 ? size - st->off :
+                  (st->off + per < size ? per : size - st->off);
+        st->mode = s->mode;
+        st->resumable = s->resumable;
+        st->fanout = s->fanout;
+        st->priority = s->priority;
+        st->codec = s->codec;
+        st->key = s->cipher ? &key : NULL;
+        st->salt = salt;
+        st->batch = s->batch;
+    }
+    int started = 1;
+    for (; started < nstreams; ++started) {
+        if (pthread_create(&streams[started].thread, NULL, stream_main, &streams[started]) != 0) {
+            fprintf(stderr, "Failed to start stream %d\n", started);
+            break;
+        }
+    }
+    int failed = started < nstreams;
+    if (!failed) {
+        stream_main(&streams[0]);
+        failed = streams[0].failed;
+    }
+    for (int i = 1; i < started; ++i) {
+        pthread_join(streams[i].thread, NULL);
+        if (streams[i].sd >= 0)
+            close(streams[i].sd);
+        failed |= streams[i].failed;
+    }
+    if (failed) {
+        session_error(s, "Failed to send %s", s->batch ? "batch" : s->name);
+        return NULL;
+    }
+    s->bytes = size;
+    s->status = 0;
+    return NULL;
+}
+
+void send_free(struct relay_session *s)
+{
+    if (s->batch) {
+        batch_free(s->batch);
+        free(s->batch);
+    }
+}
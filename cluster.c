@@ -0,0 +1,558 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/limits.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "budget.h"
+#include "cluster.h"
+#include "log.h"
+#include "pipepool.h"
+#include "protocol.h"
+#include "relay.h"
+#include "stats.h"
+#include "timerwheel.h"
+#include "util.h"
+
+#define CLUSTER_MAX 64
+//points on the ring per node, enough to even out the nodes' shares
+#define CLUSTER_VNODES 128
+#define FORWARD_EVENTS 256
+//rounds a forwarded connection gets per wakeup before the others get a go
+#define FORWARD_BUDGET 16
+//copied at once when the pipe pool has no pipe to splice through
+#define FORWARD_COPY (64 * 1024)
+//identity, hash, field length and field, as the acceptor read them
+#define FORWARD_HS_MAX (4 + 40 + 2 + PATH_MAX)
+
+struct cluster_node {
+    char name[64];
+    struct sockaddr_in addr;
+};
+
+struct ring_point {
+    uint64_t point;
+    int node;
+};
+
+enum forward_state {
+    FORWARD_CONNECTING = 0,  //to the owner
+    FORWARD_IDENTITY,        //waiting for the owner to identify itself
+    FORWARD_HANDSHAKE,       //replaying the client's handshake to it
+    FORWARD_RELAYING,        //splicing both ways
+    FORWARD_DONE,
+};
+
+enum { CLIENT = 0, OWNER = 1 };
+
+//what the epoll events of one side point at
+struct forward_end {
+    struct forward *f;
+    int side;
+};
+
+//A client forwarded to the owner of its hash. What's read from fd[d] waits
+//in direction d's pipe, or buffer without one, to be written to the other
+//side.
+struct forward {
+    int fd[2];
+    int state;
+    int node;
+    struct forward_end end[2];
+    struct relay_pipe *pipe[2];
+    char *buf[2];
+    size_t off[2];
+    size_t pending[2];
+    int eof[2];           //fd[d] has nothing more to read
+    int shut[2];          //and the other side has been told
+    char hs[FORWARD_HS_MAX];
+    size_t hslen;
+    size_t hsoff;
+    uint32_t id;
+    size_t idgot;
+    uint64_t active;
+    struct timer timer;
+    int queued;           //on the ready list
+    LIST_ENTRY(forward) all;
+    STAILQ_ENTRY(forward) incoming_link;
+    TAILQ_ENTRY(forward) ready_link;
+    STAILQ_ENTRY(forward) dead_link;
+};
+
+static struct cluster_node nodes[CLUSTER_MAX];
+static int nnodes = 0;
+static int self = -1;
+static struct ring_point ring[CLUSTER_MAX * CLUSTER_VNODES];
+static int nring = 0;
+
+static int running = 0;
+static int connect_ms;
+static int idle_ms;
+static pthread_t thread;
+static struct loop loop;
+
+//clients handed over by the acceptors
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static STAILQ_HEAD(, forward) incoming = STAILQ_HEAD_INITIALIZER(incoming);
+
+//forwarding thread only
+static struct timer_wheel wheel;
+static uint64_t now = 0;
+static LIST_HEAD(, forward) forwards = LIST_HEAD_INITIALIZER(forwards);
+static TAILQ_HEAD(, forward) ready = TAILQ_HEAD_INITIALIZER(ready);
+static STAILQ_HEAD(, forward) dead = STAILQ_HEAD_INITIALIZER(dead);
+
+//FNV-1a with a splitmix64 finish, so points of similar names spread out
+static uint64_t point_of(const char *name, int vnode)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *c = name; *c; ++c)
+        h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    h ^= (uint64_t)vnode * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static int cmp_point(const void *a, const void *b)
+{
+    const struct ring_point *x = a, *y = b;
+    return x->point < y->point ? -1 : x->point > y->point;
+}
+
+//an address we can bind to is one of ours
+static int is_local(const struct sockaddr_in *addr)
+{
+    int sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+        return 0;
+    struct sockaddr_in a = *addr;
+    a.sin_port = 0;
+    int res = bind(sd, (struct sockaddr *)&a, sizeof(a)) == 0;
+    close(sd);
+    return res;
+}
+
+int cluster_init(const char *list, int port)
+{
+    char *copy = strdup(list);
+    if (!copy) {
+        log_error("Insufficient memory for the node list");
+        return -1;
+    }
+    char *save = NULL;
+    for (char *name = strtok_r(copy, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(name, ':');
+        if (!colon || nnodes == CLUSTER_MAX || strlen(name) >= sizeof(nodes[0].name)) {
+            log_error("Invalid node %s, nodes are host:port and at most %d of them", name,
+                      CLUSTER_MAX);
+            free(copy);
+            return -1;
+        }
+        struct cluster_node *n = &nodes[nnodes];
+        snprintf(n->name, sizeof(n->name), "%s", name);
+        *colon = '\0';
+        struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+        struct addrinfo *res;
+        int err = getaddrinfo(*name ? name : "localhost", colon + 1, &hints, &res);
+        if (err) {
+            log_error("Failed to resolve node %s: %s", n->name, gai_strerror(err));
+            free(copy);
+            return -1;
+        }
+        memcpy(&n->addr, res->ai_addr, sizeof(n->addr));
+        freeaddrinfo(res);
+        if (self < 0 && ntohs(n->addr.sin_port) == port && is_local(&n->addr))
+            self = nnodes;
+        nnodes++;
+    }
+    free(copy);
+    if (self < 0) {
+        log_error("None of the nodes is this relay, on port %d of a local address", port);
+        return -1;
+    }
+
+    for (int i = 0; i < nnodes; ++i) {
+        for (int v = 0; v < CLUSTER_VNODES; ++v) {
+            ring[nring].point = point_of(nodes[i].name, v);
+            ring[nring].node = i;
+            nring++;
+        }
+    }
+    qsort(ring, nring, sizeof(ring[0]), cmp_point);
+    log_info("node %d (%s) of a cluster of %d", self, nodes[self].name, nnodes);
+    return 0;
+}
+
+int cluster_owner(const unsigned char *digest)
+{
+    if (nnodes < 2)
+        return -1;
+    //digests are uniform already, the leading bytes are the key
+    uint64_t key = 0;
+    for (int i = 0; i < 8; ++i)
+        key = key << 8 | digest[i];
+    int lo = 0, hi = nring;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].point < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int node = ring[lo == nring ? 0 : lo].node;
+    return node == self ? -1 : node;
+}
+
+static void ready_add(struct forward *f)
+{
+    if (f->queued)
+        return;
+    f->queued = 1;
+    TAILQ_INSERT_TAIL(&ready, f, ready_link);
+}
+
+//Close both sides. The forward is freed after the event batch, which may
+//still hold events for it.
+static void forward_close(struct forward *f)
+{
+    if (f->state == FORWARD_DONE)
+        return;
+    f->state = FORWARD_DONE;
+    timer_del(&wheel, &f->timer);
+    if (f->queued) {
+        TAILQ_REMOVE(&ready, f, ready_link);
+        f->queued = 0;
+    }
+    LIST_REMOVE(f, all);
+    for (int d = 0; d < 2; ++d) {
+        //closing the sockets also drops them from the epoll set
+        budget_close(f->fd[d]);
+        f->fd[d] = -1;
+        pipe_pool_put(f->pipe[d], f->pending[d] == 0);
+        f->pipe[d] = NULL;
+        free(f->buf[d]);
+        f->buf[d] = NULL;
+    }
+    STAILQ_INSERT_TAIL(&dead, f, dead_link);
+}
+
+static void forward_fail(struct forward *f, const char *why)
+{
+    log_limited(LEVEL_WARN, "Forwarding to node %s failed: %s", nodes[f->node].name, why);
+    stats_inc(STAT_FORWARD_FAILED);
+    forward_close(f);
+}
+
+static void forward_expired(struct timer *t)
+{
+    struct forward *f = (struct forward *)((char *)t - offsetof(struct forward, timer));
+    if (f->state != FORWARD_RELAYING) {
+        forward_fail(f, "timed out");
+        return;
+    }
+    //only checked when the timer fires, rather than re-armed on every chunk
+    if (now - f->active >= (uint64_t)idle_ms) {
+        log_debug("forward to node %s idle, closing it", nodes[f->node].name);
+        forward_close(f);
+        return;
+    }
+    timer_add(&wheel, &f->timer, now, idle_ms - (now - f->active), forward_expired);
+}
+
+//Move what's there in direction d, from fd[d] to the other side. Returns the
+//bytes written on, 0 if it has to wait and -1 on an error.
+static ssize_t forward_move(struct forward *f, int d)
+{
+    int in = f->fd[d], out = f->fd[!d];
+    if (!f->pending[d] && !f->eof[d]) {
+        ssize_t n = f->pipe[d] ?
+            splice(in, NULL, f->pipe[d]->fd[1], NULL, f->pipe[d]->size,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK) :
+            recv(in, f->buf[d], FORWARD_COPY, 0);
+        if (n == 0) {
+            f->eof[d] = 1;
+        } else if (n > 0) {
+            f->pending[d] = n;
+            f->off[d] = 0;
+            if (f->pipe[d])
+                pipe_pool_account(f->pipe[d], in, f->pipe[d]->size, n);
+        } else if (errno != EAGAIN && errno != EINTR) {
+            return -1;
+        }
+    }
+    ssize_t n = 0;
+    if (f->pending[d]) {
+        n = f->pipe[d] ?
+            splice(f->pipe[d]->fd[0], NULL, out, NULL, f->pending[d],
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK) :
+            send(out, &f->buf[d][f->off[d]], f->pending[d], MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        f->pending[d] -= n;
+        f->off[d] += n;
+        stats_add(STAT_FORWARD_BYTES, n);
+    }
+    //pass the end of the stream on, the other direction may still have more
+    if (f->eof[d] && !f->pending[d] && !f->shut[d]) {
+        shutdown(out, SHUT_WR);
+        f->shut[d] = 1;
+    }
+    return n;
+}
+
+//Returns 1 if the forward used up its rounds with more to do, 0 otherwise.
+static int forward_pump(struct forward *f)
+{
+    for (int round = 0; round < FORWARD_BUDGET; ++round) {
+        ssize_t up = forward_move(f, CLIENT);
+        ssize_t down = up < 0 ? 0 : forward_move(f, OWNER);
+        if (up < 0 || down < 0) {
+            forward_fail(f, strerror(errno));
+            return 0;
+        }
+        if (f->shut[CLIENT] && f->shut[OWNER]) {
+            forward_close(f);
+            return 0;
+        }
+        if (!up && !down)
+            return 0;
+        f->active = now;
+    }
+    return 1;
+}
+
+//Get the client's handshake to the owner, then relay. Returns what
+//forward_pump does.
+static int forward_step(struct forward *f)
+{
+    if (f->state == FORWARD_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(f->fd[OWNER], SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            forward_fail(f, strerror(err ? err : errno));
+            return 0;
+        }
+        //woken up by the client before the connect is through
+        struct sockaddr_in peer;
+        len = sizeof(peer);
+        if (getpeername(f->fd[OWNER], (struct sockaddr *)&peer, &len) < 0)
+            return 0;
+        f->state = FORWARD_IDENTITY;
+    }
+    if (f->state == FORWARD_IDENTITY) {
+        ssize_t n = recv(f->fd[OWNER], (char *)&f->id + f->idgot, 4 - f->idgot, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        if (n <= 0) {
+            forward_fail(f, n < 0 ? strerror(errno) : "closed by the node");
+            return 0;
+        }
+        f->idgot += n;
+        if (f->idgot < 4)
+            return 0;
+        if (f->id != RELAY_IDENTITY) {
+            forward_fail(f, f->id == RELAY_BUSY_IDENTITY ? "node is busy" : "not a relay");
+            return 0;
+        }
+        f->state = FORWARD_HANDSHAKE;
+    }
+    if (f->state == FORWARD_HANDSHAKE) {
+        while (f->hsoff < f->hslen) {
+            ssize_t n = send(f->fd[OWNER], &f->hs[f->hsoff], f->hslen - f->hsoff, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                return 0;
+            if (n < 0) {
+                forward_fail(f, strerror(errno));
+                return 0;
+            }
+            f->hsoff += n;
+        }
+        //splice both ways, or copy through buffers when out of pipes
+        for (int d = 0; d < 2; ++d) {
+            f->pipe[d] = pipe_pool_get();
+            if (!f->pipe[d] && !(f->buf[d] = malloc(FORWARD_COPY))) {
+                forward_fail(f, "insufficient memory");
+                return 0;
+            }
+        }
+        f->state = FORWARD_RELAYING;
+        f->active = now;
+        if (idle_ms)
+            timer_add(&wheel, &f->timer, now, idle_ms, forward_expired);
+        else
+            timer_del(&wheel, &f->timer);
+    }
+    if (f->state == FORWARD_RELAYING)
+        return forward_pump(f);
+    return 0;
+}
+
+static int forward_watch(struct forward *f, int side)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &f->end[side];
+    return epoll_ctl(loop.epfd, EPOLL_CTL_ADD, f->fd[side], &ev);
+}
+
+//a client from the acceptors, connect to its owner
+static void forward_begin(struct forward *f)
+{
+    LIST_INSERT_HEAD(&forwards, f, all);
+    timer_add(&wheel, &f->timer, now, connect_ms, forward_expired);
+    f->fd[OWNER] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (f->fd[OWNER] < 0) {
+        forward_fail(f, strerror(errno));
+        return;
+    }
+    budget_add(BUDGET_CONNECTIONS, 1);
+    const struct sockaddr_in *addr = &nodes[f->node].addr;
+    if (connect(f->fd[OWNER], (const struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+        errno != EINPROGRESS) {
+        forward_fail(f, strerror(errno));
+        return;
+    }
+    if (forward_watch(f, CLIENT) < 0 || forward_watch(f, OWNER) < 0) {
+        forward_fail(f, strerror(errno));
+        return;
+    }
+}
+
+static void reap(void)
+{
+    struct forward *f;
+    while ((f = STAILQ_FIRST(&dead))) {
+        STAILQ_REMOVE_HEAD(&dead, dead_link);
+        free(f);
+    }
+}
+
+static void *cluster_main(void *opaque)
+{
+    pid_t tid = syscall(SYS_gettid);
+    log_info("forwarding started as thread %d", tid);
+
+    struct epoll_event events[FORWARD_EVENTS];
+    while (!stop) {
+        now = now_ms();
+        int timeout = TAILQ_EMPTY(&ready) ? timer_wheel_timeout(&wheel, now, 100) : 0;
+        int nfds = loop_wait(&loop, events, FORWARD_EVENTS, timeout);
+        if (nfds < 0)
+            break;
+        now = now_ms();
+        for (int n = 0; n < nfds; n++) {
+            struct forward_end *e = (struct forward_end *)events[n].data.ptr;
+            //closed earlier in the batch
+            if (e->f->state == FORWARD_DONE)
+                continue;
+            if (forward_step(e->f) > 0)
+                ready_add(e->f);
+        }
+
+        //forwards that used up their rounds, once each per loop
+        TAILQ_HEAD(, forward) again = TAILQ_HEAD_INITIALIZER(again);
+        TAILQ_CONCAT(&again, &ready, ready_link);
+        struct forward *f;
+        while ((f = TAILQ_FIRST(&again))) {
+            TAILQ_REMOVE(&again, f, ready_link);
+            f->queued = 0;
+            if (forward_step(f) > 0)
+                ready_add(f);
+        }
+
+        for (;;) {
+            pthread_mutex_lock(&lock);
+            f = STAILQ_FIRST(&incoming);
+            if (f)
+                STAILQ_REMOVE_HEAD(&incoming, incoming_link);
+            pthread_mutex_unlock(&lock);
+            if (!f)
+                break;
+            forward_begin(f);
+        }
+        timer_wheel_advance(&wheel, now);
+        reap();
+    }
+    log_info("forwarding exiting");
+    return NULL;
+}
+
+int cluster_start(int connect, int idle)
+{
+    if (nnodes < 2)
+        return 0;
+    connect_ms = connect;
+    idle_ms = idle;
+    if (loop_init(&loop, "forwarding") < 0)
+        return -1;
+    now = now_ms();
+    timer_wheel_init(&wheel, now);
+
+    if (pthread_create(&thread, NULL, cluster_main, NULL) != 0) {
+        log_error("Failed to start forwarding");
+        return -1;
+    }
+    pthread_setname_np(thread, "forward");
+    running = 1;
+    return 0;
+}
+
+void cluster_forward(int fd, int node, const char *hs, size_t len)
+{
+    struct forward *f = running && len <= FORWARD_HS_MAX ? calloc(1, sizeof(struct forward)) : NULL;
+    if (!f) {
+        log_limited(LEVEL_ERROR, "Failed to forward client to node %s", nodes[node].name);
+        stats_inc(STAT_FORWARD_FAILED);
+        budget_close(fd);
+        return;
+    }
+    f->fd[CLIENT] = fd;
+    f->fd[OWNER] = -1;
+    f->node = node;
+    f->state = FORWARD_CONNECTING;
+    for (int d = 0; d < 2; ++d) {
+        f->end[d].f = f;
+        f->end[d].side = d;
+    }
+    memcpy(f->hs, hs, len);
+    f->hslen = len;
+    stats_inc(STAT_FORWARDED);
+
+    pthread_mutex_lock(&lock);
+    STAILQ_INSERT_TAIL(&incoming, f, incoming_link);
+    pthread_mutex_unlock(&lock);
+    loop_wake(&loop);
+}
+
+void cluster_stop(void)
+{
+    if (!running)
+        return;
+    pthread_join(thread, NULL);
+    running = 0;
+
+    while (!LIST_EMPTY(&forwards))
+        forward_close(LIST_FIRST(&forwards));
+    reap();
+    //handed over after the thread stopped looking
+    struct forward *f;
+    while ((f = STAILQ_FIRST(&incoming))) {
+        STAILQ_REMOVE_HEAD(&incoming, incoming_link);
+        budget_close(f->fd[CLIENT]);
+        free(f);
+    }
+    loop_close(&loop);
+}
@@ -0,0 +1,35 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+
+//Clustered relays. Relays started with the same list of nodes split the
+//sessions between them: a hash's digest is placed on a consistent hash ring
+//with CLUSTER_VNODES points per node, and the node with the next point on the
+//ring owns it. Adding or removing a node only moves the sessions next to its
+//points. A client whose hash a node doesn't own is forwarded: the node
+//connects to the owner, replays the client's handshake to it and splices
+//between the two connections both ways, so clients can connect to any node
+//and the sender and receiver of a session still meet at its owner. One
+//thread moves all of the forwarded connections.
+
+//Take the comma separated host:port list of nodes and find this one in it,
+//the node on port at a local address. Returns 0 on success.
+int cluster_init(const char *nodes, int port);
+
+//The node that owns a digest, or -1 if it's this one or there's no cluster.
+int cluster_owner(const unsigned char *digest);
+
+//Start the forwarding thread. connect_ms bounds getting a client's
+//handshake to its owner, idle_ms how long a forwarded connection may move no
+//data (0 for no limit). Returns 0 on success.
+int cluster_start(int connect_ms, int idle_ms);
+
+//Forward a client whose handshake (the len bytes at hs) is done to the node
+//that owns its hash. Takes the fd, whether or not that works out.
+void cluster_forward(int fd, int node, const char *hs, size_t len);
+
+//stop the thread and close every forwarded connection
+void cluster_stop(void);
+
+#endif
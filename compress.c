@@ -0,0 +1,219 @@
+#include <endian.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "compress.h"
+
+//bytes looked at to guess whether a block is worth compressing
+#define ENTROPY_SAMPLE 4096
+//bits per byte above which a block is sent as is, random data samples at ~7.95
+#define ENTROPY_MAX 7.5
+#define ZSTD_LEVEL 1
+#define ZLIB_LEVEL 1
+
+static const char *codec_names[] = { "none", "lz4", "zstd", "zlib" };
+
+int compress_codec_parse(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof(codec_names) / sizeof(codec_names[0])); ++i)
+        if (!strcmp(name, codec_names[i]))
+            return i;
+    return -1;
+}
+
+const char *compress_codec_name(int codec)
+{
+    return codec >= 0 && codec <= COMPRESS_ZLIB ? codec_names[codec] : "unknown";
+}
+
+int compress_supported(int codec)
+{
+    switch (codec) {
+    case COMPRESS_NONE:
+        return 1;
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4:
+        return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        return 1;
+#endif
+#ifdef HAVE_ZLIB
+    case COMPRESS_ZLIB:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+size_t compress_bound(int codec, size_t len)
+{
+    size_t bound = len;
+    switch (codec) {
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4:
+        bound = LZ4_compressBound(len);
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD:
+        bound = ZSTD_compressBound(len);
+        break;
+#endif
+#ifdef HAVE_ZLIB
+    case COMPRESS_ZLIB:
+        bound = compressBound(len);
+        break;
+#endif
+    }
+    return COMPRESS_HEADER_LEN + (bound > len ? bound : len);
+}
+
+int compressor_init(struct compressor *c, int codec)
+{
+    memset(c, 0, sizeof(*c));
+    c->codec = codec;
+    return compress_supported(codec) ? 0 : -1;
+}
+
+void compressor_free(struct compressor *c)
+{
+#ifdef HAVE_ZSTD
+    if (c->codec == COMPRESS_ZSTD) {
+        ZSTD_freeCCtx(c->cctx);
+        ZSTD_freeDCtx(c->dctx);
+    }
+#endif
+    c->cctx = c->dctx = NULL;
+}
+
+//Shannon entropy of a strided sample of the block, in bits per byte.
+static double sample_entropy(const unsigned char *buf, size_t len)
+{
+    unsigned counts[256] = { 0 };
+    size_t step = len > ENTROPY_SAMPLE ? len / ENTROPY_SAMPLE : 1;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i += step, ++n)
+        counts[buf[i]]++;
+    double e = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (counts[i]) {
+            double p = (double)counts[i] / n;
+            e -= p * log2(p);
+        }
+    }
+    return e;
+}
+
+static void header_put(char *hdr, uint32_t stored, uint32_t raw)
+{
+    stored = htobe32(stored);
+    raw = htobe32(raw);
+    memcpy(hdr, &stored, 4);
+    memcpy(&hdr[4], &raw, 4);
+}
+
+//Returns the compressed length, or 0 if compressing failed or didn't help.
+static size_t codec_compress(struct compressor *c, const char *in, size_t len,
+                             char *out, size_t cap)
+{
+    switch (c->codec) {
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4: {
+        int n = LZ4_compress_default(in, out, len, cap);
+        return n > 0 ? n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        if (!c->cctx && !(c->cctx = ZSTD_createCCtx()))
+            return 0;
+        size_t n = ZSTD_compressCCtx(c->cctx, out, cap, in, len, ZSTD_LEVEL);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    case COMPRESS_ZLIB: {
+        uLongf n = cap;
+        return compress2((Bytef *)out, &n, (const Bytef *)in, len, ZLIB_LEVEL) == Z_OK ? n : 0;
+    }
+#endif
+    }
+    return 0;
+}
+
+size_t compress_block(struct compressor *c, const char *in, size_t len, char *out)
+{
+    char *data = &out[COMPRESS_HEADER_LEN];
+    size_t n = 0;
+    if (c->codec != COMPRESS_NONE && len > 0 &&
+        sample_entropy((const unsigned char *)in, len) <= ENTROPY_MAX)
+        n = codec_compress(c, in, len, data, compress_bound(c->codec, len) - COMPRESS_HEADER_LEN);
+    if (n > 0 && n < len) {
+        header_put(out, n | COMPRESS_FLAG, len);
+        return COMPRESS_HEADER_LEN + n;
+    }
+    header_put(out, len, len);
+    memcpy(data, in, len);
+    return COMPRESS_HEADER_LEN + len;
+}
+
+int compress_header_get(const char *hdr, int codec, uint32_t *stored, uint32_t *raw,
+                        int *compressed)
+{
+    memcpy(stored, hdr, 4);
+    memcpy(raw, &hdr[4], 4);
+    *stored = be32toh(*stored);
+    *raw = be32toh(*raw);
+    *compressed = (*stored & COMPRESS_FLAG) != 0;
+    *stored &= ~COMPRESS_FLAG;
+    if (*raw > COMPRESS_BLOCK ||
+        *stored > compress_bound(codec, *raw) - COMPRESS_HEADER_LEN ||
+        (!*compressed && *stored != *raw))
+        return -1;
+    return 0;
+}
+
+int decompress_block(struct compressor *c, const char *in, uint32_t stored,
+                     int compressed, char *out, uint32_t raw)
+{
+    if (!compressed) {
+        memcpy(out, in, raw);
+        return 0;
+    }
+    switch (c->codec) {
+#ifdef HAVE_LZ4
+    case COMPRESS_LZ4:
+        return LZ4_decompress_safe(in, out, stored, raw) == (int)raw ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESS_ZSTD: {
+        if (!c->dctx && !(c->dctx = ZSTD_createDCtx()))
+            return -1;
+        size_t n = ZSTD_decompressDCtx(c->dctx, out, raw, in, stored);
+        return !ZSTD_isError(n) && n == raw ? 0 : -1;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    case COMPRESS_ZLIB: {
+        uLongf n = raw;
+        return uncompress((Bytef *)out, &n, (const Bytef *)in, stored) == Z_OK && n == raw ? 0 : -1;
+    }
+#endif
+    }
+    return -1;
+}
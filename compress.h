@@ -0,0 +1,62 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Codecs for the optional compression stage between send and receive. Which
+//ones are available depends on the libraries send and receive were built
+//with, the relay never looks at the data.
+enum compress_codec {
+    COMPRESS_NONE = 0,
+    COMPRESS_LZ4,
+    COMPRESS_ZSTD,
+    COMPRESS_ZLIB,
+};
+
+//Compressed data is a sequence of blocks, each of at most COMPRESS_BLOCK raw
+//bytes, preceded by
+//
+//  stored length (4 bytes) | raw length (4 bytes)
+//
+//both big endian. The top bit of the stored length is set if the block is
+//compressed, blocks that wouldn't shrink are stored as they are.
+#define COMPRESS_HEADER_LEN 8
+#define COMPRESS_BLOCK (1024 * 1024)
+#define COMPRESS_FLAG 0x80000000u
+
+//parse "lz4", "zstd", "zlib" or "none", returns -1 if unknown
+int compress_codec_parse(const char *name);
+const char *compress_codec_name(int codec);
+//whether this build has the codec
+int compress_supported(int codec);
+
+//largest block, header included, that len raw bytes can turn into
+size_t compress_bound(int codec, size_t len);
+
+//Per thread codec state.
+struct compressor {
+    int codec;
+    void *cctx;           //created on first use
+    void *dctx;
+};
+
+int compressor_init(struct compressor *c, int codec);
+void compressor_free(struct compressor *c);
+
+//Compress len (at most COMPRESS_BLOCK) bytes of in into a block, header
+//included, in out, which has room for compress_bound bytes. Blocks that a
+//sample of their bytes says are close to random aren't even tried. Returns
+//the block length.
+size_t compress_block(struct compressor *c, const char *in, size_t len, char *out);
+
+//Parse a block header. Returns 0, or -1 if the lengths are out of bounds.
+int compress_header_get(const char *hdr, int codec, uint32_t *stored, uint32_t *raw,
+                        int *compressed);
+
+//Turn the stored bytes of a block back into its raw bytes. Returns 0, or -1
+//if they don't decompress to exactly raw bytes.
+int decompress_block(struct compressor *c, const char *in, uint32_t stored,
+                     int compressed, char *out, uint32_t raw);
+
+#endif
@@ -0,0 +1,122 @@
+#include <endian.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+
+#include "crypt.h"
+
+#define KDF_ITERATIONS 100000
+#define NONCE_LEN 12
+
+static const char *cipher_names[] = { "none", "aes", "chacha" };
+
+int crypt_cipher_parse(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof(cipher_names) / sizeof(cipher_names[0])); ++i)
+        if (!strcmp(name, cipher_names[i]))
+            return i;
+    return -1;
+}
+
+const char *crypt_cipher_name(int cipher)
+{
+    return cipher >= 0 && cipher <= CRYPT_CHACHA20 ? cipher_names[cipher] : "unknown";
+}
+
+int crypt_derive(struct crypt_key *k, int cipher, const char *secret,
+                 const unsigned char *salt, uint64_t size)
+{
+    unsigned char input[CRYPT_SALT_LEN + 8];
+    uint64_t be = htobe64(size);
+    memcpy(input, salt, CRYPT_SALT_LEN);
+    memcpy(&input[CRYPT_SALT_LEN], &be, 8);
+    k->cipher = cipher;
+    if (!PKCS5_PBKDF2_HMAC(secret, strlen(secret), input, sizeof(input), KDF_ITERATIONS,
+                           EVP_sha256(), CRYPT_KEY_LEN, k->key)) {
+        fprintf(stderr, "Failed to derive key\n");
+        return -1;
+    }
+    return 0;
+}
+
+int crypt_init(struct crypt *c, const struct crypt_key *k, uint32_t stream, int encrypt)
+{
+    memset(c, 0, sizeof(*c));
+    c->key = k;
+    c->stream = stream;
+    c->encrypt = encrypt;
+    const EVP_CIPHER *cipher = k->cipher == CRYPT_CHACHA20 ? EVP_chacha20_poly1305()
+                                                           : EVP_aes_256_gcm();
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    //the key schedule is set up once, each record only sets its nonce
+    if (!ctx || !EVP_CipherInit_ex(ctx, cipher, NULL, k->key, NULL, encrypt)) {
+        fprintf(stderr, "Failed to set up %s\n", crypt_cipher_name(k->cipher));
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+    c->ctx = ctx;
+    return 0;
+}
+
+void crypt_free(struct crypt *c)
+{
+    EVP_CIPHER_CTX_free(c->ctx);
+    c->ctx = NULL;
+}
+
+//Set up the next record's nonce and feed its header and offset in as
+//additional data.
+static int record_start(struct crypt *c, const char *hdr, uint64_t off)
+{
+    unsigned char nonce[NONCE_LEN];
+    uint32_t stream = htobe32(c->stream);
+    uint64_t seq = htobe64(c->seq++);
+    memcpy(nonce, &stream, 4);
+    memcpy(&nonce[4], &seq, 8);
+    unsigned char aad[CRYPT_HEADER_LEN + 8];
+    uint64_t be = htobe64(off);
+    memcpy(aad, hdr, CRYPT_HEADER_LEN);
+    memcpy(&aad[CRYPT_HEADER_LEN], &be, 8);
+    int n;
+    return EVP_CipherInit_ex(c->ctx, NULL, NULL, NULL, nonce, c->encrypt) &&
+           EVP_CipherUpdate(c->ctx, NULL, &n, aad, sizeof(aad));
+}
+
+size_t crypt_seal(struct crypt *c, const char *in, size_t len, uint64_t off, char *out)
+{
+    uint32_t be = htobe32(len);
+    memcpy(out, &be, CRYPT_HEADER_LEN);
+    unsigned char *ct = (unsigned char *)&out[CRYPT_HEADER_LEN];
+    int n, m;
+    if (!record_start(c, out, off) ||
+        !EVP_EncryptUpdate(c->ctx, ct, &n, (const unsigned char *)in, len) ||
+        !EVP_EncryptFinal_ex(c->ctx, &ct[n], &m) ||
+        !EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_AEAD_GET_TAG, CRYPT_TAG_LEN, &ct[len])) {
+        fprintf(stderr, "Failed to encrypt\n");
+        return 0;
+    }
+    return CRYPT_OVERHEAD + len;
+}
+
+uint32_t crypt_record_len(const char *hdr)
+{
+    uint32_t be;
+    memcpy(&be, hdr, CRYPT_HEADER_LEN);
+    return be32toh(be);
+}
+
+ssize_t crypt_open(struct crypt *c, const char *rec, size_t reclen, uint64_t off, char *out)
+{
+    if (reclen < CRYPT_OVERHEAD || crypt_record_len(rec) != reclen - CRYPT_OVERHEAD)
+        return -1;
+    size_t len = reclen - CRYPT_OVERHEAD;
+    const unsigned char *ct = (const unsigned char *)&rec[CRYPT_HEADER_LEN];
+    int n, m;
+    if (!record_start(c, rec, off) ||
+        !EVP_DecryptUpdate(c->ctx, (unsigned char *)out, &n, ct, len) ||
+        !EVP_CIPHER_CTX_ctrl(c->ctx, EVP_CTRL_AEAD_SET_TAG, CRYPT_TAG_LEN, (void *)&ct[len]) ||
+        EVP_DecryptFinal_ex(c->ctx, (unsigned char *)&out[n], &m) <= 0)
+        return -1;
+    return len;
+}
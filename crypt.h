@@ -0,0 +1,75 @@
+#ifndef CRYPT_H
+#define CRYPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//End to end encryption between send and receive. The key is derived from the
+//secret, which the relay never sees, so the relay only ever handles
+//ciphertext. The hash it pairs by is stretched just as much (see make_hash),
+//so it's no shortcut to the secret.
+enum crypt_cipher {
+    CRYPT_NONE = 0,
+    CRYPT_AES_GCM,        //AES-256-GCM, AES-NI and PCLMUL where available
+    CRYPT_CHACHA20,       //ChaCha20-Poly1305, for CPUs without AES instructions
+};
+
+//Encrypted data is a sequence of records
+//
+//  length (4 bytes, big endian) | ciphertext (length bytes) | tag (16 bytes)
+//
+//each sealed under the nonce stream index (4 bytes) | record number (8 bytes),
+//with the length and the offset in the file of the record's data (8 bytes,
+//big endian) as additional data, so records can't be cut, reordered or moved
+//between streams or within the file without the tag failing. The data is
+//at most CRYPT_RECORD_MAX bytes, or one compressed block.
+#define CRYPT_HEADER_LEN 4
+#define CRYPT_TAG_LEN 16
+#define CRYPT_OVERHEAD (CRYPT_HEADER_LEN + CRYPT_TAG_LEN)
+#define CRYPT_SALT_LEN 16
+#define CRYPT_KEY_LEN 32
+#define CRYPT_RECORD_MAX (1024 * 1024)
+
+struct crypt_key {
+    int cipher;
+    unsigned char key[CRYPT_KEY_LEN];
+};
+
+//parse "aes", "chacha" or "none", returns -1 if unknown
+int crypt_cipher_parse(const char *name);
+const char *crypt_cipher_name(int cipher);
+
+//Derive the key from the secret, the sender's random salt and the file size
+//with PBKDF2-HMAC-SHA256, so a size changed on the way gives the wrong key.
+//Slow on purpose, so do it once per transfer. Returns 0 on success.
+int crypt_derive(struct crypt_key *k, int cipher, const char *secret,
+                 const unsigned char *salt, uint64_t size);
+
+//Per thread cipher state for one stream, records are numbered from 0.
+struct crypt {
+    const struct crypt_key *key;
+    void *ctx;
+    uint32_t stream;
+    uint64_t seq;
+    int encrypt;
+};
+
+int crypt_init(struct crypt *c, const struct crypt_key *k, uint32_t stream, int encrypt);
+void crypt_free(struct crypt *c);
+
+//Seal len bytes of in, the data at off in the file, into the next record in
+//out, which has room for len + CRYPT_OVERHEAD bytes. in can be where the data
+//goes in the record, CRYPT_HEADER_LEN bytes into out. Returns the record
+//length, or 0 on failure.
+size_t crypt_seal(struct crypt *c, const char *in, size_t len, uint64_t off, char *out);
+
+//ciphertext length of a record from its header
+uint32_t crypt_record_len(const char *hdr);
+
+//Open the next record, header included, for the data at off into out, which
+//can be in place, CRYPT_HEADER_LEN bytes into the record. Returns the
+//plaintext length or -1 if the record doesn't authenticate.
+ssize_t crypt_open(struct crypt *c, const char *rec, size_t reclen, uint64_t off, char *out);
+
+#endif
@@ -0,0 +1,926 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/limits.h>
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "budget.h"
+#include "fanout.h"
+#include "log.h"
+#include "protocol.h"
+#include "spool.h"
+#include "stats.h"
+#include "timerwheel.h"
+#include "util.h"
+
+#define FANOUT_EVENTS 256
+//rounds a session gets per wakeup before the others get a go
+#define FANOUT_BUDGET 16
+//the sender's data is read into a pipe of this size, one chunk at a time
+#define FANOUT_CHUNK (64 * 1024)
+//largest sendfile from the lag file per round
+#define LAG_CHUNK (256 * 1024)
+//most receivers in one session
+#define FANOUT_MAX 256
+//most chunks a receiver's pipe holds, whatever the lag window
+#define FANOUT_RING 256
+#define REGISTRY_BUCKETS 256
+
+enum fanout_state {
+    FANOUT_OPEN = 0,      //waiting for the sender or the receivers
+    FANOUT_RUNNING,       //copying the sender's data out
+    FANOUT_DONE,          //over, the thread is through with it
+};
+
+enum receiver_mode {
+    RCV_DIRECT = 0,       //gets every chunk tee'd into its pipe
+    RCV_LAGGED,           //fell behind, reads on from the lag file
+};
+
+struct fanout_rcv {
+    int fd;
+    int pipe[2];
+    int mode;
+    size_t hdroff;
+    uint64_t sent;        //stream bytes sent on to the receiver
+    uint64_t queued;      //in its pipe, not sent yet
+    //The chunks in its pipe. Each takes at most as many pipe buffers as the
+    //session's pipe has, so one more always fits below maxchunks.
+    uint32_t ring[FANOUT_RING];
+    int rhead;
+    int rcount;
+    uint32_t rdone;       //bytes of the oldest chunk sent
+    int maxchunks;
+};
+
+struct fanout {
+    unsigned char key[RENDEZVOUS_KEY_LEN];
+    char hash[64];
+    int state;
+    //under the lock
+    struct transfer_info *tr; //the sender's, NULL while receivers wait for one
+    int want;             //receivers the sender asked for
+    int opened;           //the thread knows about it
+    int registered;       //in the registry, receivers can join
+    int in_table;         //the sender may still be parked in the table
+    int kicked;           //on the kick list
+    int done;
+    struct fanout_rcv *rcv[FANOUT_MAX];
+    int nrcv;
+    //fanout thread only
+    int infd;
+    int src[2];
+    size_t chunk;         //bytes in the session's pipe
+    int in_eof;
+    uint64_t pos;         //stream bytes read from the sender
+    int lagfd;            //the stream from lag_base on, for lagged receivers
+    uint64_t lag_base;
+    uint64_t lag_len;
+    uint64_t lag_held;    //of the spool cap
+    int nlagged;
+    uint64_t active;
+    uint64_t started_ms;
+    int queued;           //on the ready list
+    char hdr[2 + PATH_MAX];
+    size_t hdrlen;
+    struct timer timer;
+    LIST_ENTRY(fanout) bucket;
+    LIST_ENTRY(fanout) all;
+    STAILQ_ENTRY(fanout) kick_link;
+    TAILQ_ENTRY(fanout) ready_link;
+    STAILQ_ENTRY(fanout) dead_link;
+};
+
+static int running = 0;
+static size_t window;
+static int pair_ms;
+static int idle_ms;
+static struct rendezvous *table;
+static pthread_t thread;
+static struct loop loop;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, fanout) registry[REGISTRY_BUCKETS];
+static LIST_HEAD(, fanout) sessions = LIST_HEAD_INITIALIZER(sessions);
+//sessions for the fanout thread to look at, opened or with new receivers
+static STAILQ_HEAD(, fanout) kicks = STAILQ_HEAD_INITIALIZER(kicks);
+
+//fanout thread only
+static struct timer_wheel wheel;
+static uint64_t now = 0;
+static TAILQ_HEAD(, fanout) ready = TAILQ_HEAD_INITIALIZER(ready);
+static STAILQ_HEAD(, fanout) dead = STAILQ_HEAD_INITIALIZER(dead);
+static int devnull = -1;
+
+static struct fanout_rcv *rcv_new(int fd)
+{
+    struct fanout_rcv *r = calloc(1, sizeof(struct fanout_rcv));
+    if (!r)
+        return NULL;
+    if (pipe2(r->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        free(r);
+        return NULL;
+    }
+    budget_add(BUDGET_PIPES, 2);
+    //The window is what the pipe can hold, as far as the kernel lets us.
+    //Without CAP_SYS_RESOURCE pipes stop at fs.pipe-max-size.
+    for (size_t want = window; want > FANOUT_CHUNK; want /= 2)
+        if (fcntl(r->pipe[1], F_SETPIPE_SZ, want) >= 0)
+            break;
+    int size = fcntl(r->pipe[1], F_GETPIPE_SZ);
+    r->maxchunks = (size > 0 ? size : 65536) / FANOUT_CHUNK;
+    if (r->maxchunks < 1)
+        r->maxchunks = 1;
+    if (r->maxchunks > FANOUT_RING)
+        r->maxchunks = FANOUT_RING;
+    r->fd = fd;
+    return r;
+}
+
+static void rcv_free(struct fanout_rcv *r)
+{
+    budget_close(r->fd);
+    close(r->pipe[0]);
+    close(r->pipe[1]);
+    budget_add(BUDGET_PIPES, -2);
+    free(r);
+}
+
+//the following take the lock held
+
+static void kick_locked(struct fanout *g)
+{
+    if (g->kicked)
+        return;
+    g->kicked = 1;
+    STAILQ_INSERT_TAIL(&kicks, g, kick_link);
+}
+
+static struct fanout *find_locked(const unsigned char *key)
+{
+    struct fanout *g;
+    LIST_FOREACH(g, &registry[(key[0] | key[1] << 8) % REGISTRY_BUCKETS], bucket)
+        if (!memcmp(g->key, key, RENDEZVOUS_KEY_LEN))
+            return g;
+    return NULL;
+}
+
+static struct fanout *session_new_locked(const struct transfer_info *tr)
+{
+    struct fanout *g = calloc(1, sizeof(struct fanout));
+    if (!g) {
+        log_error("Insufficient memory for fanout session");
+        return NULL;
+    }
+    memcpy(g->key, tr->node.key, RENDEZVOUS_KEY_LEN);
+    snprintf(g->hash, sizeof(g->hash), "%s", tr->hash);
+    g->infd = -1;
+    g->src[0] = g->src[1] = -1;
+    g->lagfd = -1;
+    LIST_INSERT_HEAD(&registry[(g->key[0] | g->key[1] << 8) % REGISTRY_BUCKETS], g, bucket);
+    g->registered = 1;
+    LIST_INSERT_HEAD(&sessions, g, all);
+    return g;
+}
+
+static void unregister_locked(struct fanout *g)
+{
+    if (!g->registered)
+        return;
+    LIST_REMOVE(g, bucket);
+    g->registered = 0;
+}
+
+//Take a receiver into a session that hasn't started, unless it has all the
+//receivers it asked for already. Returns 0 or -1.
+static int add_locked(struct fanout *g, int fd)
+{
+    if (g->state != FANOUT_OPEN || g->nrcv == FANOUT_MAX || (g->tr && g->nrcv >= g->want))
+        return -1;
+    struct fanout_rcv *r = rcv_new(fd);
+    if (!r) {
+        log_limited(LEVEL_ERROR, "Failed to set up fanout receiver: %s", strerror(errno));
+        return -1;
+    }
+    g->rcv[g->nrcv++] = r;
+    stats_inc(STAT_FANOUT_RECEIVERS);
+    if (g->opened)
+        kick_locked(g);
+    return 0;
+}
+
+//The sender's info keeps whatever references it has besides the session's.
+static void session_free_locked(struct fanout *g)
+{
+    unregister_locked(g);
+    LIST_REMOVE(g, all);
+    for (int i = 0; i < g->nrcv; ++i)
+        rcv_free(g->rcv[i]);
+    if (g->tr) {
+        g->tr->fanout = NULL;
+        transfer_info_put(g->tr);
+    }
+    free(g);
+}
+
+static void ready_add(struct fanout *g)
+{
+    if (g->queued)
+        return;
+    g->queued = 1;
+    TAILQ_INSERT_TAIL(&ready, g, ready_link);
+}
+
+static void lag_close(struct fanout *g)
+{
+    if (g->lagfd < 0)
+        return;
+    close(g->lagfd);
+    g->lagfd = -1;
+    spool_release(g->lag_held);
+    g->lag_held = 0;
+}
+
+static void rcv_remove(struct fanout *g, int i)
+{
+    struct fanout_rcv *r = g->rcv[i];
+    if (r->mode == RCV_LAGGED && !--g->nlagged)
+        lag_close(g);
+    rcv_free(r);
+    g->rcv[i] = g->rcv[--g->nrcv];
+}
+
+static void rcv_drop(struct fanout *g, int i, const char *why)
+{
+    log_limited(LEVEL_WARN, "Fanout receiver with hash %s %s, dropping it", g->hash, why);
+    stats_inc(STAT_FANOUT_DROPPED);
+    rcv_remove(g, i);
+}
+
+//Over, with or without an error. The session is freed once the loop is
+//through with this batch, and once no receiver is on its way to it.
+static void session_end(struct fanout *g, int failed)
+{
+    timer_del(&wheel, &g->timer);
+    if (g->queued) {
+        TAILQ_REMOVE(&ready, g, ready_link);
+        g->queued = 0;
+    }
+    if (g->state == FANOUT_RUNNING) {
+        stats_inc(STAT_TRANSFERS_FINISHED);
+        if (failed)
+            stats_inc(STAT_TRANSFERS_FAILED);
+        stats_observe(STAT_TRANSFER_TIME, now - g->started_ms);
+        log_debug("fanout with hash %s %s after %llu bytes", g->hash,
+                  failed ? "failed" : "finished", (unsigned long long)g->pos);
+    }
+
+    int put = 0;
+    pthread_mutex_lock(&lock);
+    g->state = FANOUT_DONE;
+    unregister_locked(g);
+    if (g->kicked) {
+        STAILQ_REMOVE(&kicks, g, fanout, kick_link);
+        g->kicked = 0;
+    }
+    if (g->tr && g->in_table && rendezvous_remove(table, &g->tr->node) == 0) {
+        stats_inc(STAT_SENDERS_UNPARKED);
+        g->in_table = 0;
+        put = 1;
+    }
+    while (g->nrcv)
+        rcv_remove(g, 0);
+    pthread_mutex_unlock(&lock);
+    if (put)
+        transfer_info_put(g->tr);
+
+    if (g->infd >= 0)
+        budget_close(g->infd);
+    else if (g->tr)
+        budget_close(g->tr->infd);
+    if (g->tr)
+        g->tr->infd = -1;
+    g->infd = -1;
+    if (g->src[0] >= 0) {
+        close(g->src[0]);
+        close(g->src[1]);
+        budget_add(BUDGET_PIPES, -2);
+        g->src[0] = g->src[1] = -1;
+    }
+    lag_close(g);
+    STAILQ_INSERT_TAIL(&dead, g, dead_link);
+}
+
+static void idle_expired(struct timer *t)
+{
+    struct fanout *g = (struct fanout *)((char *)t - offsetof(struct fanout, timer));
+    if (now < g->active + idle_ms) {
+        timer_add(&wheel, &g->timer, now, g->active + idle_ms - now, idle_expired);
+        return;
+    }
+    log_limited(LEVEL_WARN, "Fanout with hash %s idle for %d seconds, dropping it", g->hash,
+                idle_ms / 1000);
+    stats_inc(STAT_TRANSFERS_IDLE);
+    session_end(g, 1);
+}
+
+static int session_watch(struct fanout *g, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events | EPOLLET;
+    ev.data.ptr = g;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("Failed epoll_ctl on fanout connection (%s)", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//Everyone is in, or as many as showed up in time. Take the sender out of
+//the table if it's still parked there and start copying.
+static void session_start(struct fanout *g)
+{
+    timer_del(&wheel, &g->timer);
+    int put = 0;
+    pthread_mutex_lock(&lock);
+    g->state = FANOUT_RUNNING;
+    unregister_locked(g);
+    if (g->in_table && rendezvous_remove(table, &g->tr->node) == 0) {
+        stats_inc(STAT_SENDERS_UNPARKED);
+        g->in_table = 0;
+        put = 1;
+    }
+    g->infd = g->tr->infd;
+    g->tr->infd = -1;
+    uint16_t len = htons(g->tr->fnlen);
+    memcpy(g->hdr, &len, 2);
+    memcpy(&g->hdr[2], g->tr->filename, g->tr->fnlen);
+    g->hdrlen = 2 + g->tr->fnlen;
+    pthread_mutex_unlock(&lock);
+    if (put)
+        transfer_info_put(g->tr);
+
+    g->started_ms = now;
+    g->active = now;
+    stats_inc(STAT_FANOUTS);
+    stats_inc(STAT_TRANSFERS_STARTED);
+    log_debug("fanout with hash %s to %d receivers", g->hash, g->nrcv);
+    if (pipe2(g->src, O_CLOEXEC | O_NONBLOCK) < 0) {
+        log_limited(LEVEL_ERROR, "Failed to create fanout pipe: %s", strerror(errno));
+        g->src[0] = g->src[1] = -1;
+        session_end(g, 1);
+        return;
+    }
+    budget_add(BUDGET_PIPES, 2);
+    fcntl(g->src[1], F_SETPIPE_SZ, FANOUT_CHUNK);
+    if (session_watch(g, g->infd, EPOLLIN) < 0) {
+        session_end(g, 1);
+        return;
+    }
+    for (int i = 0; i < g->nrcv; ++i) {
+        if (session_watch(g, g->rcv[i]->fd, EPOLLOUT) < 0) {
+            session_end(g, 1);
+            return;
+        }
+    }
+    if (idle_ms)
+        timer_add(&wheel, &g->timer, now, idle_ms, idle_expired);
+    ready_add(g);
+}
+
+static void pair_expired(struct timer *t)
+{
+    struct fanout *g = (struct fanout *)((char *)t - offsetof(struct fanout, timer));
+    pthread_mutex_lock(&lock);
+    int start = g->tr && g->nrcv > 0;
+    int have = g->nrcv, want = g->want;
+    pthread_mutex_unlock(&lock);
+    if (start) {
+        log_limited(LEVEL_WARN, "Fanout with hash %s starting with %d of %d receivers",
+                    g->hash, have, want);
+        session_start(g);
+        return;
+    }
+    log_limited(LEVEL_WARN, "Fanout with hash %s expired waiting for its %s", g->hash,
+                g->tr ? "receivers" : "sender");
+    stats_inc(STAT_PAIRS_EXPIRED);
+    session_end(g, 0);
+}
+
+//opened, or a receiver joined
+static void session_kicked(struct fanout *g)
+{
+    if (g->state != FANOUT_OPEN)
+        return;
+    pthread_mutex_lock(&lock);
+    int full = g->tr && g->nrcv >= g->want;
+    pthread_mutex_unlock(&lock);
+    if (full)
+        session_start(g);
+    else if (!g->timer.pending && pair_ms)
+        timer_add(&wheel, &g->timer, now, pair_ms, pair_expired);
+}
+
+//Send the receiver its header, whatever its pipe holds and, once it lags,
+//the lag file up to what's been read. Returns 1 if anything moved, 0 if not
+//and -1 on error.
+static int rcv_flush(struct fanout *g, struct fanout_rcv *r)
+{
+    int moved = 0;
+    ssize_t n;
+    if (r->hdroff < g->hdrlen) {
+        n = send(r->fd, &g->hdr[r->hdroff], g->hdrlen - r->hdroff, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0)
+            goto check_errno;
+        r->hdroff += n;
+        moved = 1;
+        if (r->hdroff < g->hdrlen)
+            return moved;
+    }
+    while (r->queued) {
+        n = splice(r->pipe[0], NULL, r->fd, NULL, r->queued,
+                   SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if (n <= 0) {
+            if (!n)
+                errno = EPIPE;
+            goto check_errno;
+        }
+        r->queued -= n;
+        r->sent += n;
+        stats_add(STAT_BYTES, n);
+        moved = 1;
+        //retire the chunks that are all out
+        while (n) {
+            uint32_t left = r->ring[r->rhead] - r->rdone;
+            if ((uint64_t)n < left) {
+                r->rdone += n;
+                break;
+            }
+            n -= left;
+            r->rdone = 0;
+            r->rhead = (r->rhead + 1) % FANOUT_RING;
+            r->rcount--;
+        }
+    }
+    for (int round = 0; r->mode == RCV_LAGGED && round < 4; ++round) {
+        uint64_t left = g->lag_base + g->lag_len - r->sent;
+        if (!left)
+            break;
+        off_t off = r->sent - g->lag_base;
+        n = sendfile(r->fd, g->lagfd, &off, left < LAG_CHUNK ? left : LAG_CHUNK);
+        if (n <= 0) {
+            if (!n)
+                errno = EIO;
+            goto check_errno;
+        }
+        r->sent += n;
+        stats_add(STAT_BYTES, n);
+        moved = 1;
+    }
+    return moved;
+
+check_errno:
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return moved;
+    return -1;
+}
+
+//whether the next chunk can be read: a direct receiver has room for it, or
+//only lagged ones are left, which keep up from the lag file at their own pace
+static int can_read(const struct fanout *g)
+{
+    int direct = 0;
+    for (int i = 0; i < g->nrcv; ++i) {
+        if (g->rcv[i]->mode != RCV_DIRECT)
+            continue;
+        if (g->rcv[i]->rcount < g->rcv[i]->maxchunks)
+            return 1;
+        direct = 1;
+    }
+    return !direct;
+}
+
+//The receiver is a window behind, move it to the lag file, which starts at
+//the chunk being handed out if nobody lags yet. Returns 0 or -1 without one.
+static int lag(struct fanout *g, struct fanout_rcv *r)
+{
+    if (g->lagfd < 0) {
+        g->lagfd = spool_tmpfile();
+        if (g->lagfd < 0)
+            return -1;
+        g->lag_base = g->pos;
+        g->lag_len = 0;
+    }
+    r->mode = RCV_LAGGED;
+    g->nlagged++;
+    stats_inc(STAT_FANOUT_LAGGED);
+    log_debug("fanout receiver with hash %s lagging at %llu bytes", g->hash,
+              (unsigned long long)g->pos);
+    return 0;
+}
+
+static void drop_lagged(struct fanout *g, const char *why)
+{
+    for (int i = 0; i < g->nrcv; ) {
+        if (g->rcv[i]->mode == RCV_LAGGED)
+            rcv_drop(g, i, why);
+        else
+            ++i;
+    }
+}
+
+//Append the chunk to the lag file. Returns 0 or -1, leaving whatever it
+//didn't take in the pipe.
+static int lag_append(struct fanout *g)
+{
+    if (spool_reserve(g->lag_held, g->chunk) < 0) {
+        drop_lagged(g, "fell behind with the spool full");
+        return -1;
+    }
+    g->lag_held += g->chunk;
+    loff_t off = g->lag_len;
+    while (g->chunk) {
+        ssize_t m = splice(g->src[0], NULL, g->lagfd, &off, g->chunk, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m < 0 && errno == EINVAL) {
+            //the spool directory doesn't take splice
+            m = read(g->src[0], loop.copybuf, g->chunk < LOOP_COPY_CHUNK ? g->chunk : LOOP_COPY_CHUNK);
+            if (m > 0 && pwrite_all(g->lagfd, loop.copybuf, m, off) < 0)
+                m = -1;
+            if (m > 0)
+                off += m;
+        }
+        if (m <= 0) {
+            drop_lagged(g, "lost its lag file");
+            return -1;
+        }
+        g->chunk -= m;
+        g->lag_len += m;
+    }
+    return 0;
+}
+
+//Hand the chunk in the session's pipe to every receiver and take it out of
+//the pipe, onto the lag file if anyone reads from it. Returns 0 or -1.
+static int distribute(struct fanout *g)
+{
+    size_t n = g->chunk;
+    for (int i = 0; i < g->nrcv; ) {
+        struct fanout_rcv *r = g->rcv[i];
+        if (r->mode == RCV_DIRECT) {
+            ssize_t t = 0;
+            if (r->rcount < r->maxchunks) {
+                t = tee(g->src[0], r->pipe[1], n, SPLICE_F_NONBLOCK);
+                if (t < 0 && errno != EAGAIN) {
+                    rcv_drop(g, i, strerror(errno));
+                    continue;
+                }
+                if (t > 0) {
+                    r->ring[(r->rhead + r->rcount++) % FANOUT_RING] = t;
+                    r->queued += t;
+                }
+            }
+            if ((size_t)(t < 0 ? 0 : t) != n && lag(g, r) < 0) {
+                rcv_drop(g, i, "fell behind");
+                continue;
+            }
+        }
+        ++i;
+    }
+
+    if (g->nlagged && lag_append(g) == 0) {
+        g->pos += n;
+        return 0;
+    }
+    //nobody reads it again, throw it away
+    while (g->chunk) {
+        ssize_t m = splice(g->src[0], NULL, devnull, NULL, g->chunk, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m < 0 && errno == EINVAL)
+            m = read(g->src[0], loop.copybuf, g->chunk < LOOP_COPY_CHUNK ? g->chunk : LOOP_COPY_CHUNK);
+        if (m <= 0) {
+            log_limited(LEVEL_ERROR, "Failed to empty fanout pipe: %s", strerror(errno));
+            return -1;
+        }
+        g->chunk -= m;
+    }
+    g->pos += n;
+    return 0;
+}
+
+//Keep the session moving until nothing can. Returns 1 if it ran out of
+//rounds with more to do, 0 otherwise, including when it ended.
+static int session_pump(struct fanout *g)
+{
+    for (int round = 0; round < FANOUT_BUDGET; ++round) {
+        int moved = 0;
+        for (int i = 0; i < g->nrcv; ) {
+            struct fanout_rcv *r = g->rcv[i];
+            int res = rcv_flush(g, r);
+            if (res < 0) {
+                rcv_drop(g, i, strerror(errno));
+                continue;
+            }
+            moved |= res;
+            if (g->in_eof && !g->chunk && r->hdroff == g->hdrlen && r->sent == g->pos) {
+                //all of it is out
+                rcv_remove(g, i);
+                continue;
+            }
+            ++i;
+        }
+        if (!g->nrcv) {
+            session_end(g, !g->in_eof || g->chunk);
+            return 0;
+        }
+
+        if (g->chunk) {
+            if (distribute(g) < 0) {
+                session_end(g, 1);
+                return 0;
+            }
+            moved = 1;
+        } else if (!g->in_eof && can_read(g)) {
+            ssize_t n = splice(g->infd, NULL, g->src[1], NULL, FANOUT_CHUNK,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                g->chunk = n;
+                moved = 1;
+            } else if (n == 0) {
+                g->in_eof = 1;
+                moved = 1;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_limited(LEVEL_WARN, "Fanout sender with hash %s failed: %s", g->hash,
+                            strerror(errno));
+                session_end(g, 1);
+                return 0;
+            }
+        }
+        if (!moved)
+            return 0;
+        g->active = now;
+    }
+    return 1;
+}
+
+//sessions the loop is through with go once no receiver is on its way to them
+static void reap(void)
+{
+    struct fanout *g;
+    while ((g = STAILQ_FIRST(&dead))) {
+        STAILQ_REMOVE_HEAD(&dead, dead_link);
+        pthread_mutex_lock(&lock);
+        g->done = 1;
+        if (!g->in_table)
+            session_free_locked(g);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+static void *fanout_main(void *opaque)
+{
+    pid_t tid = syscall(SYS_gettid);
+    log_info("fanout started as thread %d", tid);
+
+    struct epoll_event events[FANOUT_EVENTS];
+    while (!stop) {
+        now = now_ms();
+        int timeout = TAILQ_EMPTY(&ready) ? timer_wheel_timeout(&wheel, now, 100) : 0;
+        int nfds = loop_wait(&loop, events, FANOUT_EVENTS, timeout);
+        if (nfds < 0)
+            break;
+        now = now_ms();
+        for (int n = 0; n < nfds; n++) {
+            struct fanout *g = (struct fanout *)events[n].data.ptr;
+            //a session ended earlier in the batch
+            if (g->state != FANOUT_RUNNING)
+                continue;
+            if (session_pump(g) > 0)
+                ready_add(g);
+        }
+
+        //sessions that used up their rounds, once each per loop
+        TAILQ_HEAD(, fanout) again = TAILQ_HEAD_INITIALIZER(again);
+        TAILQ_CONCAT(&again, &ready, ready_link);
+        struct fanout *g;
+        while ((g = TAILQ_FIRST(&again))) {
+            TAILQ_REMOVE(&again, g, ready_link);
+            g->queued = 0;
+            if (session_pump(g) > 0)
+                ready_add(g);
+        }
+
+        for (;;) {
+            pthread_mutex_lock(&lock);
+            g = STAILQ_FIRST(&kicks);
+            if (g) {
+                STAILQ_REMOVE_HEAD(&kicks, kick_link);
+                g->kicked = 0;
+            }
+            pthread_mutex_unlock(&lock);
+            if (!g)
+                break;
+            session_kicked(g);
+        }
+        timer_wheel_advance(&wheel, now);
+        reap();
+    }
+    log_info("fanout exiting");
+    return NULL;
+}
+
+int fanout_start(size_t w, int pair, int idle, struct rendezvous *rv)
+{
+    window = w;
+    pair_ms = pair;
+    idle_ms = idle;
+    table = rv;
+    for (int i = 0; i < REGISTRY_BUCKETS; ++i)
+        LIST_INIT(&registry[i]);
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull < 0) {
+        log_error("Failed to open /dev/null for fanout (%s)", strerror(errno));
+        return -1;
+    }
+    if (loop_init(&loop, "fanout") < 0)
+        return -1;
+    now = now_ms();
+    timer_wheel_init(&wheel, now);
+
+    if (pthread_create(&thread, NULL, fanout_main, NULL) != 0) {
+        log_error("Failed to start fanout");
+        return -1;
+    }
+    pthread_setname_np(thread, "fanout");
+    running = 1;
+    return 0;
+}
+
+int fanout_prepare(struct transfer_info *tr)
+{
+    uint64_t want, chunk;
+    if (!running || meta_get_u64(tr->filename, tr->fnlen, META_FANOUT, &want) < 0 || want < 2)
+        return -1;
+    //every receiver would answer a chunked sender with its own resume point
+    if (meta_get_u64(tr->filename, tr->fnlen, META_CHUNK_SIZE, &chunk) == 0) {
+        log_limited(LEVEL_WARN, "Chunked sender with hash %s can't fan out, pairing it with one receiver",
+                    tr->hash);
+        return -1;
+    }
+    if (want > FANOUT_MAX)
+        want = FANOUT_MAX;
+
+    pthread_mutex_lock(&lock);
+    struct fanout *g = find_locked(tr->node.key);
+    if (g && g->tr) {
+        //another sender has it, the table turns this one away
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    //receivers may be waiting in a lobby already
+    if (!g && !(g = session_new_locked(tr))) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    tr->refs++;
+    g->tr = tr;
+    g->want = want;
+    g->in_table = 1;
+    tr->fanout = g;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+void fanout_open(struct transfer_info *tr)
+{
+    pthread_mutex_lock(&lock);
+    struct fanout *g = tr->fanout;
+    if (g) {
+        g->opened = 1;
+        kick_locked(g);
+    }
+    pthread_mutex_unlock(&lock);
+    loop_wake(&loop);
+}
+
+void fanout_cancel(struct transfer_info *tr)
+{
+    struct fanout *g = tr->fanout;
+    if (!g)
+        return;
+    pthread_mutex_lock(&lock);
+    tr->fanout = NULL;
+    g->tr = NULL;
+    g->want = 0;
+    g->in_table = 0;
+    //a lobby the sender adopted goes on waiting for one
+    if (!g->opened)
+        session_free_locked(g);
+    pthread_mutex_unlock(&lock);
+    transfer_info_put(tr);
+}
+
+void fanout_add(struct transfer_info *tr, struct transfer_info *rcv)
+{
+    pthread_mutex_lock(&lock);
+    struct fanout *g = tr->fanout;
+    g->in_table = 0;
+    if (add_locked(g, rcv->outfd) < 0) {
+        log_limited(LEVEL_WARN, "Fanout with hash %s is already under way, dropping receiver",
+                    g->hash);
+        stats_inc(STAT_PAIRS_FAILED);
+        budget_close(rcv->outfd);
+    }
+    rcv->outfd = -1;
+    //the session ended while the receiver was on its way
+    if (g->done)
+        session_free_locked(g);
+    pthread_mutex_unlock(&lock);
+    loop_wake(&loop);
+}
+
+int fanout_join(struct transfer_info *rcv)
+{
+    if (!running)
+        return -1;
+    pthread_mutex_lock(&lock);
+    struct fanout *g = find_locked(rcv->node.key);
+    int res = g ? add_locked(g, rcv->outfd) : -1;
+    pthread_mutex_unlock(&lock);
+    if (res < 0)
+        return -1;
+    log_debug("receiver with hash %s joined fanout", rcv->hash);
+    rcv->outfd = -1;
+    loop_wake(&loop);
+    return 0;
+}
+
+int fanout_wait(struct transfer_info *rcv)
+{
+    if (!running)
+        return -1;
+    pthread_mutex_lock(&lock);
+    struct fanout *g = find_locked(rcv->node.key);
+    int res = -1;
+    if (g) {
+        res = add_locked(g, rcv->outfd);
+    } else if ((g = session_new_locked(rcv))) {
+        g->opened = 1;
+        if ((res = add_locked(g, rcv->outfd)) < 0)
+            session_free_locked(g);
+    }
+    pthread_mutex_unlock(&lock);
+    if (res < 0)
+        return -1;
+    log_debug("receiver with hash %s waiting for a fanout sender", rcv->hash);
+    rcv->outfd = -1;
+    loop_wake(&loop);
+    return 0;
+}
+
+void fanout_stop(void)
+{
+    if (!running)
+        return;
+    pthread_join(thread, NULL);
+    running = 0;
+
+    //senders still parked are taken out of the table here, rather than being
+    //closed by its drain
+    pthread_mutex_lock(&lock);
+    while (!LIST_EMPTY(&sessions)) {
+        struct fanout *g = LIST_FIRST(&sessions);
+        if (g->tr && g->in_table && rendezvous_remove(table, &g->tr->node) == 0)
+            transfer_info_put(g->tr);
+        if (g->infd >= 0)
+            budget_close(g->infd);
+        else if (g->tr)
+            budget_close(g->tr->infd);
+        if (g->tr)
+            g->tr->infd = -1;
+        if (g->src[0] >= 0) {
+            close(g->src[0]);
+            close(g->src[1]);
+            budget_add(BUDGET_PIPES, -2);
+        }
+        if (g->lagfd >= 0)
+            close(g->lagfd);
+        session_free_locked(g);
+    }
+    pthread_mutex_unlock(&lock);
+
+    loop_close(&loop);
+    close(devnull);
+}
@@ -0,0 +1,53 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stddef.h>
+
+#include "relay.h"
+
+//One to many transfers. A sender whose field asks for N receivers (see
+//META_FANOUT) opens a session under its hash that N receivers with the same
+//hash join, the first of them through the rendezvous table as usual and the
+//rest straight into the session. Once they're all in, or the pairing wait
+//runs out with at least one, the relay splices the sender's data into a pipe
+//once and tee()s every chunk into each receiver's own pipe, which is spliced
+//on to its socket. A receiver that falls a whole lag window behind the
+//others goes on from a file in the spool directory, or is dropped without a
+//spool, so it never holds up the fast ones. One thread moves all of it.
+
+struct fanout;
+
+//Start the fanout thread. window is how far a receiver may fall behind in
+//bytes, pair_ms how long a session waits for its receivers and idle_ms how
+//long it may move no data (0 for no limit). Returns 0 on success.
+int fanout_start(size_t window, int pair_ms, int idle_ms, struct rendezvous *table);
+
+//Set up a session for a sender about to be paired or parked. Returns 0 and
+//sets tr->fanout if its field asks for more than one receiver, -1 if it's an
+//ordinary sender (or the session couldn't be set up).
+int fanout_prepare(struct transfer_info *tr);
+
+//The sender was parked or paired, the session may start. The caller drops
+//the pairing timer, the session expires itself.
+void fanout_open(struct transfer_info *tr);
+
+//The sender couldn't be parked after all, forget the session.
+void fanout_cancel(struct transfer_info *tr);
+
+//A receiver (rcv->outfd) was paired with the sender of a session through the
+//table. Takes the receiver's fd, the caller still puts both infos.
+void fanout_add(struct transfer_info *tr, struct transfer_info *rcv);
+
+//Join a receiver (rcv->outfd) straight into an open session with its hash.
+//Returns 0 if it was taken, -1 to pair it as usual.
+int fanout_join(struct transfer_info *rcv);
+
+//A receiver couldn't be parked because another one already waits under its
+//hash. Keep it in a lobby for a fanout sender to come. Returns 0 if it was
+//taken, -1 if not.
+int fanout_wait(struct transfer_info *rcv);
+
+//stop the thread and close every session, before the table is drained
+void fanout_stop(void);
+
+#endif
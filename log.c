@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+//messages a thread can have waiting for the writer, a power of two
+#define LOG_RING_SLOTS 256
+//longer messages are cut off
+#define LOG_LINE_MAX 256
+//the writer checks the rings this often at most, and at least this often
+//while there's a steady stream of messages
+#define LOG_IDLE_MAX_NS 32000000
+#define LOG_IDLE_MIN_NS 1000000
+
+struct log_msg {
+    int level;
+    int len;
+    char text[LOG_LINE_MAX];
+};
+
+//Single producer, single consumer ring of one thread's messages. The two
+//sides only share head and tail, each on its own cache line.
+struct log_ring {
+    //written by the owning thread
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+    int closed;           //the thread is gone, free the ring once drained
+    //written by the writer
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t dropped_seen;
+    struct log_ring *next;
+    struct log_msg msgs[LOG_RING_SLOTS];
+};
+
+int log_level = LEVEL_INFO;
+
+//Threads push their rings onto the front of the list the first time they log,
+//only the writer ever takes them out.
+static struct log_ring *rings = NULL;
+static __thread struct log_ring *my_ring = NULL;
+static pthread_key_t ring_key;
+static int running = 0;
+static int stopping = 0;
+static pthread_t writer;
+//messages dropped, by the writer's count, plus any that never got a ring
+static uint64_t dropped = 0;
+
+static char outbuf[65536];
+static size_t outlen = 0;
+static int outfd = 1;
+
+static void direct_write(int level, const char *fmt, va_list ap)
+{
+    FILE *f = level <= LEVEL_WARN ? stderr : stdout;
+    vfprintf(f, fmt, ap);
+    fputc('\n', f);
+    fflush(f);
+}
+
+static void ring_exit(void *opaque)
+{
+    struct log_ring *r = (struct log_ring *)opaque;
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *ring_get(void)
+{
+    if (my_ring)
+        return my_ring;
+    struct log_ring *r = aligned_alloc(64, sizeof(struct log_ring));
+    if (!r)
+        return NULL;
+    memset(r, 0, offsetof(struct log_ring, msgs));
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        direct_write(level, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    struct log_ring *r = ring_get();
+    if (!r) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+    uint64_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+    struct log_msg *m = &r->msgs[head % LOG_RING_SLOTS];
+    int n = vsnprintf(m->text, LOG_LINE_MAX, fmt, ap);
+    va_end(ap);
+    m->len = n < 0 ? 0 : n >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : n;
+    m->level = level;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int log_limit_pass(struct log_limit *l, int level)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = ts.tv_sec;
+    uint64_t second = __atomic_load_n(&l->second, __ATOMIC_RELAXED);
+    if (second != now &&
+        __atomic_compare_exchange_n(&l->second, &second, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&l->count, 0, __ATOMIC_RELAXED);
+        unsigned int suppressed = __atomic_exchange_n(&l->suppressed, 0, __ATOMIC_RELAXED);
+        if (suppressed)
+            log_write(level, "(%u similar messages suppressed)", suppressed);
+    }
+    if (__atomic_add_fetch(&l->count, 1, __ATOMIC_RELAXED) <= LOG_BURST)
+        return 1;
+    __atomic_fetch_add(&l->suppressed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void out_flush(void)
+{
+    for (size_t off = 0; off < outlen;) {
+        ssize_t n = write(outfd, &outbuf[off], outlen - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        //nowhere left to complain to
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    outlen = 0;
+}
+
+//lines going to the same fd are batched, switching fds flushes to keep the
+//order when both end up in the same file
+static void out_line(int fd, const char *text, size_t len)
+{
+    if (fd != outfd || outlen + len + 1 > sizeof(outbuf))
+        out_flush();
+    outfd = fd;
+    memcpy(&outbuf[outlen], text, len);
+    outbuf[outlen + len] = '\n';
+    outlen += len + 1;
+}
+
+static size_t ring_drain(struct log_ring *r)
+{
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t n = head - r->tail;
+    for (uint64_t t = r->tail; t != head; ++t) {
+        struct log_msg *m = &r->msgs[t % LOG_RING_SLOTS];
+        out_line(m->level <= LEVEL_WARN ? 2 : 1, m->text, m->len);
+    }
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+
+    uint64_t d = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (d != r->dropped_seen) {
+        char line[128];
+        int len = snprintf(line, sizeof(line), "Log buffer full, dropped %llu messages",
+                           (unsigned long long)(d - r->dropped_seen));
+        out_line(2, line, len);
+        __atomic_fetch_add(&dropped, d - r->dropped_seen, __ATOMIC_RELAXED);
+        r->dropped_seen = d;
+    }
+    return n;
+}
+
+static void ring_unlink(struct log_ring *prev, struct log_ring *r)
+{
+    if (!prev) {
+        struct log_ring *expected = r;
+        if (__atomic_compare_exchange_n(&rings, &expected, r->next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return;
+        //rings were pushed in front of it since, it's further down now
+        for (prev = expected; prev->next != r; prev = prev->next)
+            ;
+    }
+    prev->next = r->next;
+}
+
+static void *writer_main(void *opaque)
+{
+    long idle_ns = LOG_IDLE_MIN_NS;
+    for (;;) {
+        int last = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        size_t n = 0;
+        struct log_ring *prev = NULL;
+        struct log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+        while (r) {
+            //whatever a closed ring holds was queued before it closed
+            int closed = __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+            n += ring_drain(r);
+            struct log_ring *next = r->next;
+            if (closed) {
+                ring_unlink(prev, r);
+                free(r);
+            } else {
+                prev = r;
+            }
+            r = next;
+        }
+        out_flush();
+        if (last)
+            break;
+
+        //back off while there's nothing to write
+        idle_ns = n ? LOG_IDLE_MIN_NS : idle_ns * 2 > LOG_IDLE_MAX_NS ? LOG_IDLE_MAX_NS : idle_ns * 2;
+        struct timespec ts = { 0, idle_ns };
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+int log_start(void)
+{
+    if (pthread_key_create(&ring_key, ring_exit) != 0) {
+        fprintf(stderr, "Failed to create log key\n");
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        fprintf(stderr, "Failed to start log writer\n");
+        return -1;
+    }
+    pthread_setname_np(writer, "log");
+    //so whatever led up to an exit() still gets written
+    atexit(log_stop);
+    return 0;
+}
+
+void log_stop(void)
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return;
+    //from here on messages are written directly, the writer drains the rest
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+}
+
+uint64_t log_dropped(void)
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
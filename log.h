@@ -0,0 +1,67 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+//Relay logging. Each thread formats its messages into its own ring buffer and
+//a background thread writes them out, so logging never takes a lock shared
+//with other threads or waits on the terminal or disk. When a thread's ring is
+//full the message is dropped and counted instead. Errors and warnings go to
+//stderr, the rest to stdout, one line per message.
+
+enum log_level {
+    LEVEL_ERROR,
+    LEVEL_WARN,
+    LEVEL_INFO,
+    LEVEL_DEBUG,          //per connection and per transfer chatter
+};
+
+//Messages above this level are compiled out entirely.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LEVEL_DEBUG
+#endif
+
+//messages above this level are skipped at runtime, LEVEL_INFO by default
+extern int log_level;
+
+#define log_enabled(level) ((level) <= LOG_MAX_LEVEL && (level) <= log_level)
+
+#define log_at(level, ...) do { \
+        if (log_enabled(level)) \
+            log_write(level, __VA_ARGS__); \
+    } while (0)
+
+//For messages a misbehaving client or a flood of connections can trigger at
+//will: each call site gets LOG_BURST messages a second, the rest are counted
+//and reported once the second is over.
+#define LOG_BURST 10
+#define log_limited(level, ...) do { \
+        static struct log_limit log_limit_; \
+        if (log_enabled(level) && log_limit_pass(&log_limit_, level)) \
+            log_write(level, __VA_ARGS__); \
+    } while (0)
+
+#define log_error(...) log_at(LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LEVEL_DEBUG, __VA_ARGS__)
+
+struct log_limit {
+    uint64_t second;
+    unsigned int count;
+    unsigned int suppressed;
+};
+
+//Queue a message, without a trailing newline. Before log_start and after
+//log_stop it is written out directly.
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int log_limit_pass(struct log_limit *l, int level);
+
+//start and stop the writer thread, stopping writes out everything queued
+int log_start(void);
+void log_stop(void);
+
+//messages dropped so far because a ring was full
+uint64_t log_dropped(void);
+
+#endif
@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include "budget.h"
+#include "log.h"
+#include "pipepool.h"
+
+//idle pipes kept around for the next transfer, the rest are closed
+#define POOL_IDLE_MAX 64
+//fills per resize decision
+#define POOL_WINDOW_FILLS 32
+//Grow a pipe when it's filled up more often than once in this many
+//nanoseconds, in other words more than 250 times a second.
+#define POOL_GROW_NS 4000000ULL
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct relay_pipe *idle = NULL;
+static int nidle = 0;
+static int live = 0;
+static int max_live = 0;
+static size_t max_pipe_size = 1048576;
+//what new pipes come with, grown ones are shrunk back to it when idle
+static size_t base_pipe_size = 65536;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void pipe_pool_init(int max_pipes)
+{
+    if (max_pipes <= 0) {
+        //leave at least half of the descriptors for sockets, a pipe costs two
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+            max_pipes = rl.rlim_cur / 4;
+        else
+            max_pipes = 1024;
+    }
+    max_live = max_pipes;
+
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (f) {
+        unsigned long sz;
+        if (fscanf(f, "%lu", &sz) == 1 && sz > 0)
+            max_pipe_size = sz;
+        fclose(f);
+    }
+    log_info("pipe pool holds up to %d pipes of up to %zu bytes", max_live, max_pipe_size);
+}
+
+static struct relay_pipe *pipe_create(void)
+{
+    //past the budget's watermark the fds are left to connections
+    if (budget_pipe() < 0)
+        return NULL;
+    struct relay_pipe *p = calloc(1, sizeof(struct relay_pipe));
+    if (!p)
+        return NULL;
+    if (pipe2(p->fd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        if (errno != EMFILE && errno != ENFILE)
+            log_limited(LEVEL_ERROR, "Failed to create pipe: %s", strerror(errno));
+        free(p);
+        return NULL;
+    }
+    budget_add(BUDGET_PIPES, 2);
+    int sz = fcntl(p->fd[0], F_GETPIPE_SZ);
+    p->size = sz > 0 ? sz : 65536;
+    base_pipe_size = p->size;
+    return p;
+}
+
+static void pipe_free(struct relay_pipe *p)
+{
+    close(p->fd[0]);
+    close(p->fd[1]);
+    budget_add(BUDGET_PIPES, -2);
+    free(p);
+}
+
+struct relay_pipe *pipe_pool_get(void)
+{
+    struct relay_pipe *p = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (idle) {
+        p = idle;
+        idle = p->next;
+        nidle--;
+    } else if (live < max_live) {
+        //count it before creating it so we never overshoot the cap
+        live++;
+        pthread_mutex_unlock(&pool_lock);
+        p = pipe_create();
+        if (p)
+            goto ready;
+        pthread_mutex_lock(&pool_lock);
+        live--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (!p)
+        return NULL;
+
+ready:
+    p->next = NULL;
+    p->window_start = now_ns();
+    p->window_fills = 0;
+    p->window_full = 0;
+    return p;
+}
+
+void pipe_pool_put(struct relay_pipe *p, int empty)
+{
+    if (!p)
+        return;
+    //An idle pipe doesn't need what a busy transfer grew it to, and the next
+    //transfer may not either. A pipe that won't shrink is closed.
+    if (empty && p->size > base_pipe_size) {
+        int sz = fcntl(p->fd[0], F_SETPIPE_SZ, (int)base_pipe_size);
+        if (sz > 0)
+            p->size = sz;
+        else
+            empty = 0;
+    }
+    pthread_mutex_lock(&pool_lock);
+    if (empty && nidle < POOL_IDLE_MAX) {
+        p->next = idle;
+        idle = p;
+        nidle++;
+        p = NULL;
+    } else {
+        live--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (p)
+        pipe_free(p);
+}
+
+void pipe_pool_account(struct relay_pipe *p, int in, size_t want, size_t n)
+{
+    //The pipe was the limit if the splice filled its bytes, or came up short
+    //of what was asked while the socket still had more: TCP splices one
+    //buffer slot per segment, so off loopback a pipe runs out of slots long
+    //before it runs out of bytes. Only pipes that can still grow are asked.
+    int full = n == p->size;
+    int queued;
+    if (!full && n < want && p->size < max_pipe_size &&
+        ioctl(in, FIONREAD, &queued) == 0 && queued > 0)
+        full = 1;
+    p->window_full += full;
+    if (++p->window_fills < POOL_WINDOW_FILLS)
+        return;
+
+    uint64_t now = now_ns();
+    uint64_t elapsed = now - p->window_start;
+    //Only grow a pipe that was filled up on most calls, otherwise the sender
+    //is the limit and a bigger pipe just wastes memory.
+    if (p->window_full * 4 >= p->window_fills * 3 && p->size < max_pipe_size &&
+        (uint64_t)p->window_fills * POOL_GROW_NS > elapsed) {
+        size_t want = p->size * 2;
+        if (want > max_pipe_size)
+            want = max_pipe_size;
+        int sz = fcntl(p->fd[0], F_SETPIPE_SZ, (int)want);
+        if (sz > 0)
+            p->size = sz;
+    }
+    p->window_start = now;
+    p->window_fills = 0;
+    p->window_full = 0;
+}
+
+void pipe_pool_stats(int *nlive, int *nidle_out, int *nmax)
+{
+    pthread_mutex_lock(&pool_lock);
+    *nlive = live;
+    *nidle_out = nidle;
+    *nmax = max_live;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void pipe_pool_destroy(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    while (idle) {
+        struct relay_pipe *p = idle;
+        idle = p->next;
+        pipe_free(p);
+        live--;
+    }
+    nidle = 0;
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,43 @@
+#ifndef PIPEPOOL_H
+#define PIPEPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Relay wide pool of pipes for splice. Pipes are reused across transfers
+//instead of being created and destroyed for each one, and the number alive at
+//once (in use plus idle) is capped so the relay can't run itself out of file
+//descriptors. Callers that get no pipe copy through userspace instead.
+struct relay_pipe {
+    int fd[2];
+    size_t size;          //current pipe capacity, also the splice length
+    //fills since the last resize decision
+    uint64_t window_start;
+    int window_fills;
+    int window_full;
+    struct relay_pipe *next;
+};
+
+//cap the number of live pipes, 0 picks a cap from the file descriptor limit
+void pipe_pool_init(int max_pipes);
+
+//an empty pipe, or NULL if the cap is reached or no pipe could be created
+struct relay_pipe *pipe_pool_get(void);
+
+//give a pipe back. Pipes that may still hold data are closed instead of being
+//handed to the next transfer, grown ones are shrunk back first.
+void pipe_pool_put(struct relay_pipe *p, int empty);
+
+//record a fill of n bytes into the pipe from socket in, which was asked for
+//want. Every so often this looks at how often the pipe has been filling up,
+//in bytes or in buffer slots, and grows it with F_SETPIPE_SZ when transfers
+//keep filling it faster than it can be drained per call.
+void pipe_pool_account(struct relay_pipe *p, int in, size_t want, size_t n);
+
+//pipes alive (in use plus idle), idle ones, and the cap, for the stats
+void pipe_pool_stats(int *nlive, int *nidle, int *nmax);
+
+//close all idle pipes
+void pipe_pool_destroy(void);
+
+#endif
@@ -0,0 +1,105 @@
+#include <endian.h>
+#include <string.h>
+
+#include "protocol.h"
+
+#define META_HEADER 3
+
+int meta_put(char *field, size_t len, size_t cap, int type, const void *value, uint16_t vlen)
+{
+    if (len + META_HEADER + vlen > cap)
+        return -1;
+    field[len] = type;
+    field[len + 1] = vlen >> 8;
+    field[len + 2] = vlen & 0xff;
+    memcpy(&field[len + META_HEADER], value, vlen);
+    return len + META_HEADER + vlen;
+}
+
+int meta_put_u64(char *field, size_t len, size_t cap, int type, uint64_t value)
+{
+    uint64_t be = htobe64(value);
+    return meta_put(field, len, cap, type, &be, sizeof(be));
+}
+
+const char *meta_get(const char *field, size_t len, int type, uint16_t *vlen)
+{
+    //records start right after the name
+    const char *end = memchr(field, '\0', len);
+    if (!end)
+        return NULL;
+    size_t off = end - field + 1;
+    while (off + META_HEADER <= len) {
+        uint16_t l = ((unsigned char)field[off + 1] << 8) | (unsigned char)field[off + 2];
+        if (off + META_HEADER + l > len)
+            return NULL;
+        if ((unsigned char)field[off] == type) {
+            *vlen = l;
+            return &field[off + META_HEADER];
+        }
+        off += META_HEADER + l;
+    }
+    return NULL;
+}
+
+int meta_get_u64(const char *field, size_t len, int type, uint64_t *value)
+{
+    uint16_t vlen;
+    const char *v = meta_get(field, len, type, &vlen);
+    if (!v || vlen != sizeof(uint64_t))
+        return -1;
+    uint64_t be;
+    memcpy(&be, v, sizeof(be));
+    *value = be64toh(be);
+    return 0;
+}
+
+void chunk_header_put(char *hdr, uint64_t off, uint32_t len, uint64_t sum)
+{
+    uint64_t be64 = htobe64(off);
+    memcpy(hdr, &be64, 8);
+    uint32_t be32 = htobe32(len);
+    memcpy(&hdr[8], &be32, 4);
+    be64 = htobe64(sum);
+    memcpy(&hdr[12], &be64, 8);
+}
+
+void chunk_header_get(const char *hdr, uint64_t *off, uint32_t *len, uint64_t *sum)
+{
+    uint64_t be64;
+    memcpy(&be64, hdr, 8);
+    *off = be64toh(be64);
+    uint32_t be32;
+    memcpy(&be32, &hdr[8], 4);
+    *len = be32toh(be32);
+    memcpy(&be64, &hdr[12], 8);
+    *sum = be64toh(be64);
+}
+
+//words summed between reductions, small enough that neither sum can overflow
+#define CHECKSUM_BLOCK 65536
+
+uint64_t chunk_checksum(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t a = 0, b = 0;
+    while (len >= 4) {
+        size_t n = len / 4 < CHECKSUM_BLOCK ? len / 4 : CHECKSUM_BLOCK;
+        len -= n * 4;
+        for (; n; --n, p += 4) {
+            uint32_t w;
+            memcpy(&w, p, 4);
+            a += le32toh(w);
+            b += a;
+        }
+        a %= 0xffffffff;
+        b %= 0xffffffff;
+    }
+    if (len) {
+        uint32_t w = 0;
+        memcpy(&w, p, len);
+        a = (a + le32toh(w)) % 0xffffffff;
+        b = (b + a) % 0xffffffff;
+    }
+    return b << 32 | a;
+}
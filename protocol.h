@@ -0,0 +1,111 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Identities exchanged at the start of every connection, in host byte order.
+#define RELAY_IDENTITY    0xdeadbeef
+//Sent instead of RELAY_IDENTITY by a relay that is out of room for clients,
+//which then closes the connection. Clients back off and try again.
+#define RELAY_BUSY_IDENTITY 0xdeadbee5
+#define SENDER_IDENTITY   0xadeafbe2
+#define RECEIVER_IDENTITY 0xfacaded2
+//A receiver resuming a chunked transfer. Its hash is followed by a field in
+//the same shape as the sender's (see below), with an empty name and the
+//META_OFFSET and META_LENGTH of the range it already has.
+#define RESUMING_RECEIVER_IDENTITY 0xfacadee2
+//Clients from before the routing hash was stretched identified with these.
+//Their hashes never match a current client's, so the relay turns them away
+//straight off rather than leaving them to wait out the pairing timeout.
+#define SENDER_V1_IDENTITY   0xadeafbee
+#define RECEIVER_V1_IDENTITY 0xfacadeed
+#define RESUMING_RECEIVER_V1_IDENTITY 0xfacadeef
+
+//Clients are paired by the hash of the secret: PBKDF2-HMAC-SHA256 of the
+//secret with this label as the salt, 20 bytes of it sent as 39 hex digits and
+//a NUL. It's stretched as much as the cipher key (see crypt.c) under a label
+//of its own, otherwise guessing the few dictionary words of a secret against
+//a plain hash would be a shortcut to the key.
+#define HASH_KDF_LABEL "file-relay routing hash"
+#define HASH_KDF_ITERATIONS 100000
+
+//The sender's filename field (2 byte big endian length, then the field) is the
+//NUL terminated file name followed by optional metadata records:
+//
+//  type (1 byte) | length (2 bytes, big endian) | value
+//
+//The relay forwards the whole field to the receiver untouched, and receivers
+//that don't know about a record (or about records at all) stop reading at the
+//NUL, so new records can be added without breaking anyone.
+enum meta_type {
+    META_FILE_SIZE = 1,   //total file size in bytes, u64 big endian
+    //A file sent over several connections at once. Each one is paired on its
+    //own, streams past the first under the SHA-1 of "<hash>#<stream>" where
+    //hash is the first one's, and carries the byte range given by its offset
+    //and length. All u64.
+    META_STREAMS = 2,
+    META_STREAM = 3,
+    META_OFFSET = 4,
+    META_LENGTH = 5,
+    //The data is sent as chunks of at most this many bytes (u64), see below.
+    //The relay answers such senders with the resuming receiver's field once
+    //they're paired: 2 byte big endian length, then the field, which is
+    //empty if the receiver had nothing to resume.
+    META_CHUNK_SIZE = 6,
+    //The data is compressed with this codec (u64, see compress.h) in blocks,
+    //with chunks each chunk's data is one block
+    META_COMPRESSION = 7,
+    //The data is encrypted with this cipher (u64, see crypt.h) in records,
+    //under a key derived from the secret and the salt (CRYPT_SALT_LEN raw
+    //bytes). Records hold one compressed block each when compressing, with
+    //chunks each chunk's data is one record.
+    META_CIPHER = 8,
+    META_SALT = 9,
+    //Many files sent as one batch (see batch.h) in place of a single file,
+    //with an empty name. The value is the length of the batch stream in
+    //bytes (u64). Batches go over one stream and aren't chunked.
+    META_BATCH = 10,
+    //The same data goes to this many receivers (u64) that all use the
+    //sender's secret. The relay reads it once and copies it to each of them.
+    //Not with chunks, the receivers can't each answer with a resume point.
+    META_FANOUT = 11,
+    //How the relay schedules the transfer against others (u64, enum
+    //priority_class). Without it the transfer is PRIORITY_NORMAL.
+    META_PRIORITY = 12,
+};
+
+enum priority_class {
+    PRIORITY_NORMAL = 0,
+    PRIORITY_BULK,        //backups and the like, gets half the share of normal
+    PRIORITY_HIGH,        //gets twice the share of normal
+};
+
+//most streams a sender opens for one file
+#define MAX_STREAMS 16
+
+//Each chunk of a chunked transfer is preceded by
+//
+//  offset in the file (8 bytes) | length (4 bytes) | checksum (8 bytes)
+//
+//all big endian. Chunks of a stream are sent in order and back to back.
+#define CHUNK_HEADER_LEN 20
+#define CHUNK_SIZE_MAX (16 * 1024 * 1024)
+
+//Append a record to a field currently len bytes long with room for cap.
+//Returns the new length, or -1 if it doesn't fit.
+int meta_put(char *field, size_t len, size_t cap, int type, const void *value, uint16_t vlen);
+int meta_put_u64(char *field, size_t len, size_t cap, int type, uint64_t value);
+
+//Look up a record in a received field. Returns the value and sets *vlen, or
+//NULL if there is no such record.
+const char *meta_get(const char *field, size_t len, int type, uint16_t *vlen);
+//returns 0 and sets *value if the record is there and 8 bytes long
+int meta_get_u64(const char *field, size_t len, int type, uint64_t *value);
+
+void chunk_header_put(char *hdr, uint64_t off, uint32_t len, uint64_t sum);
+void chunk_header_get(const char *hdr, uint64_t *off, uint32_t *len, uint64_t *sum);
+//Fletcher-64 over little endian 32 bit words, the tail padded with zeros
+uint64_t chunk_checksum(const void *buf, size_t len);
+
+#endif
@@ -5,21 +5,41 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
-#include <search.h>
+#include <ctype.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <linux/limits.h>
 #include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <linux/filter.h>
 #include <sys/syscall.h>
+#include <time.h>
+#include <arpa/inet.h>
 #include <openssl/sha.h>
 
-static const uint32_t identity = 0xdeadbeef;
-static const uint32_t sender   = 0xadeafbee;
-static const uint32_t receiver = 0xfacadeed;
-static int lsd = 0; //main socket file descriptor to bind/listen on
-static int stop = 0;
+#include "budget.h"
+#include "cluster.h"
+#include "log.h"
+#include "pipepool.h"
+#include "protocol.h"
+#include "relay.h"
+#include "fanout.h"
+#include "schedule.h"
+#include "spool.h"
+#include "stats.h"
+#include "tuning.h"
+#include "util.h"
+#include "worker.h"
+
+static const uint32_t identity = RELAY_IDENTITY;
+static const uint32_t busy     = RELAY_BUSY_IDENTITY;
+static const uint32_t sender   = SENDER_IDENTITY;
+static const uint32_t receiver = RECEIVER_IDENTITY;
+static const uint32_t resuming = RESUMING_RECEIVER_IDENTITY;
+volatile int stop = 0;
+#ifdef USE_THREAD_PER_TRANSFER
 SLIST_HEAD(join_head, join_entry) join_head = SLIST_HEAD_INITIALIZER(join_head);
 struct join_entry {
     pthread_t thread;
@@ -27,68 +47,121 @@ struct join_entry {
     SLIST_ENTRY(join_entry) entries;
 };
 static pthread_mutex_t join_lock = PTHREAD_MUTEX_INITIALIZER;
-static void *troot = NULL;
+#endif
+static struct rendezvous table;
+
+//timeouts in milliseconds, 0 disables the pairing and idle timeouts
+static int handshake_timeout_ms = 10 * 1000;
+static int pair_timeout_ms = 10 * 60 * 1000;
+static int idle_timeout_ms = 2 * 60 * 1000;
+
+//socket profile for client connections, see tuning.h
+static int tuning_profile = TUNING_AUTO;
+static uint64_t tuning_rate = 0;
+
+#define ACCEPT_BATCH 64
+//identity followed by the hex hash, senders (and resuming receivers) follow
+//that with the filename field
+#define HS_HEADER_LEN (4 + SHA_DIGEST_LENGTH*2)
+
+//Per connection handshake state. Fields are accumulated across as many EPOLLIN
+//events as it takes, so a slow or hostile client can't stall the accept loop
+//and a split packet can't corrupt pairing.
+struct handshake {
+    int fd;
+    struct acceptor *owner;
+    struct timer timer;
+    size_t got;
+    size_t need;
+    char buf[HS_HEADER_LEN + 2 + PATH_MAX];
+    TAILQ_ENTRY(handshake) entries;
+};
+
+//One accept/handshake shard. Each has its own SO_REUSEPORT listener and epoll
+//set, shards only meet in the rendezvous table.
+struct acceptor {
+    int id;
+    int lsd;              //socket file descriptor to bind/listen on
+    int epfd;
+    int spare;            //given up to take a connection and turn it away when out of fds
+    int cpu;              //core the shard is pinned to, -1 if not pinned
+    pthread_t thread;
+    struct epoll_event *events;
+    TAILQ_HEAD(, handshake) handshakes;
+    //handshake and pairing timeouts of the connections accepted here
+    struct timer_wheel wheel;
+};
+static struct acceptor *acceptors = NULL;
+static int nacceptors = 0;
 
 
 void help()
 {
-    printf("usage: ./relay :<port>\n");
+    printf("usage: ./relay [-w <workers>] [-u] [-p <max-pipes>] [-a <acceptors>] [-P]\n"
+           "               [-H <handshake-secs>] [-W <pairing-secs>] [-I <idle-secs>]\n"
+           "               [-D <spool-dir> [-B <spool-MB>] [-Q <quota-MB>] [-M <arena-MB>]\n"
+           "               [-T <spool-secs>]] [-L <lag-KB>]\n"
+           "               [-R <transfer-MB/s>] [-C <client-MB/s>] [-E <egress-MB/s>]\n"
+           "               [-N <host>:<port>[,<host>:<port>...]] [-t <profile>[:<MB/s>]]\n"
+           "               [-S <stats-socket>|[<host>]:<stats-port>] [-v] [-q] :<port>\n");
 }
 
 void interrupt(int sig)
 {
-    shutdown(lsd, SHUT_RDWR);
     stop = 1;
 }
 
-struct transfer_info {
-    char *hash;
-    char *filename;
-    uint16_t fnlen;
-    int infd;
-    int outfd;
-    pthread_t tid;
-    pthread_attr_t tattr;
-};
+int pin_thread(pthread_t thread, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+    if (err) {
+        log_error("Failed to pin thread to cpu %d: %s", cpu, strerror(err));
+        return -1;
+    }
+    return 0;
+}
 
-static void transfer_info_free(struct transfer_info *tr)
+void transfer_info_put(struct transfer_info *tr)
 {
-    if (!tr)
+    if (!tr || __atomic_sub_fetch(&tr->refs, 1, __ATOMIC_ACQ_REL) > 0)
         return;
     if (tr->hash)
         free(tr->hash);
     if (tr->filename)
         free(tr->filename);
+    if (tr->reply)
+        free(tr->reply);
+    free(tr);
 }
 
-static int compare(const void *a, const void *b)
+static struct transfer_info *transfer_info_of(struct rendezvous_node *node)
 {
-    struct transfer_info *ta = (struct transfer_info *)a;
-    struct transfer_info *tb = (struct transfer_info *)b;
-
-    return strncmp(ta->hash, tb->hash, SHA_DIGEST_LENGTH);
+    return (struct transfer_info *)((char *)node - offsetof(struct transfer_info, node));
 }
 
-static void close_unmatched_connections(const void *nodep, const VISIT which, const int depth)
+//The hash arrives as hex (with the last digit cut off by the clients), the
+//rendezvous table is keyed by the raw digest.
+static void hex_to_digest(const char *hex, unsigned char *digest)
 {
-    struct transfer_info *t;
-
-    switch(which) {
-    case preorder:
-        break;
-    case endorder:
-        break;
-    case postorder:
-    case leaf:
-        t = (struct transfer_info *)nodep;
-        close(t->infd);
-        close(t->outfd);
-        transfer_info_free(t);
-        free(t);
-        break;
+    memset(digest, 0, SHA_DIGEST_LENGTH);
+    for (int i = 0; i < SHA_DIGEST_LENGTH*2 && isxdigit((unsigned char)hex[i]); ++i) {
+        int v = isdigit((unsigned char)hex[i]) ? hex[i] - '0' : tolower((unsigned char)hex[i]) - 'a' + 10;
+        digest[i/2] |= i % 2 ? v : v << 4;
     }
 }
 
+static void close_unmatched_connection(struct rendezvous_node *node)
+{
+    struct transfer_info *t = transfer_info_of(node);
+    budget_close(t->infd);
+    budget_close(t->outfd);
+    transfer_info_put(t);
+}
+
+#ifdef USE_THREAD_PER_TRANSFER
 static void join_finished_threads()
 {
     pthread_mutex_lock(&join_lock);
@@ -96,51 +169,76 @@ static void join_finished_threads()
     while (!SLIST_EMPTY(&join_head)) {
         je = SLIST_FIRST(&join_head);
         SLIST_REMOVE_HEAD(&join_head, entries);
-        printf("joining finished thread %d\n", je->tid);
-        fflush(stdout);
+        log_debug("joining finished thread %d", je->tid);
         pthread_join(je->thread, NULL);
         free(je);
     }
     pthread_mutex_unlock(&join_lock);
 }
 
-static int copy_using_splice(int in, int out)
+//Returns -1 without copying anything if the pipe pool is exhausted, so the
+//caller can fall back to the read/write loop. Bytes moved are added to
+//*copied and *failed is set on an error.
+static int copy_using_splice(int in, int out, struct sched_flow *f, uint64_t *copied,
+                             int *failed)
 {
-    int p[2];
-    if (pipe(p) < 0) {
-        perror("Failed to create pipe!");
+    struct relay_pipe *p = pipe_pool_get();
+    if (!p)
         return -1;
-    }
-    ssize_t s = 0;
-    do {
-        s = splice(p[0],
-                   0,
-                   out,
-                   0,
-                   splice(in, 0, p[1], 0, 8192, SPLICE_F_MORE),
-                   SPLICE_F_MORE);
+
+    size_t pending = 0;
+    while (!stop) {
+        ssize_t s;
+        if (!pending) {
+            size_t want = sched_take(f, p->size);
+            s = splice(in, NULL, p->fd[1], NULL, want, SPLICE_F_MORE | SPLICE_F_MOVE);
+            if (s <= 0) {
+                if (s < 0) {
+                    log_limited(LEVEL_WARN, "Splice failed: %s", strerror(errno));
+                    *failed = 1;
+                }
+                break;
+            }
+            pending = s;
+            sched_charge(f, s);
+            pipe_pool_account(p, in, want, s);
+        }
+        s = splice(p->fd[0], NULL, out, NULL, pending, SPLICE_F_MORE | SPLICE_F_MOVE);
         if (s < 0) {
-            perror("Splice failed");
+            log_limited(LEVEL_WARN, "Splice failed: %s", strerror(errno));
+            *failed = 1;
+            break;
         }
-    } while (s > 0 && !stop);
-    close(p[0]);
-    close(p[1]);
+        pending -= s;
+        *copied += s;
+        stats_add(STAT_BYTES, s);
+    }
+    pipe_pool_put(p, pending == 0);
+    return 0;
 }
 
-static size_t copy_using_read_write_loop(int in, int out)
+static size_t copy_using_read_write_loop(int in, int out, struct sched_flow *f, int *failed)
 {
     size_t bytes_copied = 0;
     char cpbuf[8192];
     while (!stop) {
-        ssize_t rres = read(in, &cpbuf[0], 8192);
-        if (!rres)
+        ssize_t rres = read(in, &cpbuf[0], sched_take(f, 8192));
+        if (rres <= 0) {
+            if (rres < 0) {
+                log_limited(LEVEL_WARN, "Read failed: %s", strerror(errno));
+                *failed = 1;
+            }
             break;
+        }
+        sched_charge(f, rres);
         ssize_t wres = write(out, &cpbuf[0], rres);
         if (wres != rres) {
-            fprintf(stderr, "Failed to copy data\n");
+            log_limited(LEVEL_WARN, "Failed to copy data");
+            *failed = 1;
             break;
         }
         bytes_copied += wres;
+        stats_add(STAT_BYTES, wres);
     }
     return bytes_copied;
 }
@@ -153,28 +251,40 @@ void *relay_data(void *opaque)
         return NULL;
 
     if (pair->infd < 0 || pair->outfd < 0 || !pair->hash || !pair->filename) {
-        fprintf(stderr, "Transfer info invalid\n");
+        log_error("Transfer info invalid");
         goto cleanup;
     }
 
     pid_t tid = syscall(SYS_gettid);
-    printf("thread %d started\n", tid);
+    log_debug("thread %d started", tid);
 
+    //the length and the field go out in one segment
     uint16_t fsize = htons(pair->fnlen);
-    send(pair->outfd, &fsize, 2, MSG_NOSIGNAL);
+    send(pair->outfd, &fsize, 2, MSG_NOSIGNAL | MSG_MORE);
     send(pair->outfd, pair->filename, pair->fnlen, MSG_NOSIGNAL);
 
+    uint64_t copied = 0;
+    int failed = 0;
+    struct sched_flow flow;
+    sched_flow_init(&flow, pair, now_ms());
 #ifdef USE_SPLICE
-    copy_using_splice(pair->infd, pair->outfd);
+    //out of pipes, copy through userspace instead
+    if (copy_using_splice(pair->infd, pair->outfd, &flow, &copied, &failed) < 0)
+        copied = copy_using_read_write_loop(pair->infd, pair->outfd, &flow, &failed);
 #else
-    copy_using_read_write_loop(pair->infd, pair->outfd);
+    copied = copy_using_read_write_loop(pair->infd, pair->outfd, &flow, &failed);
 #endif
+    sched_flow_release(&flow);
+    log_debug("thread %d relayed %llu bytes", tid, (unsigned long long)copied);
+    stats_inc(STAT_TRANSFERS_FINISHED);
+    if (failed)
+        stats_inc(STAT_TRANSFERS_FAILED);
+    stats_observe(STAT_TRANSFER_TIME, now_ms() - pair->started_ms);
 
 cleanup:
-    close(pair->infd);
-    close(pair->outfd);
-    transfer_info_free(pair);
-    free(pair);
+    budget_close(pair->infd);
+    budget_close(pair->outfd);
+    transfer_info_put(pair);
 
     //before we exit, join other exited threads to free resources and prevent
     //maxing out system thread count
@@ -188,112 +298,669 @@ cleanup:
     SLIST_INSERT_HEAD(&join_head, je, entries);
     pthread_mutex_unlock(&join_lock);
 
-    printf("thread %d exiting\n", tid);
+    log_debug("thread %d exiting", tid);
 
     return NULL;
 }
+#endif
 
-void handle_client_socket(int csd)
+//cpu is the core the pairing was finished on, or -1 to let the workers share
+static void start_transfer(struct transfer_info *tr, int cpu)
 {
-    printf("Accepted client on fd %d\n", csd);
+    tr->started_ms = now_ms();
+    stats_inc(STAT_TRANSFERS_STARTED);
+#ifdef USE_THREAD_PER_TRANSFER
+    //The handshake ran non blocking, the transfer thread blocks on its
+    //sockets. A transfer that stalls for longer than the idle timeout gets a
+    //timed out read or write and the thread gives up on it.
+    int fds[2] = { tr->infd, tr->outfd };
+    struct timeval idle = { idle_timeout_ms / 1000, (idle_timeout_ms % 1000) * 1000 };
+    for (int i = 0; i < 2; ++i) {
+        int flags = fcntl(fds[i], F_GETFL, 0);
+        fcntl(fds[i], F_SETFL, flags & ~O_NONBLOCK);
+        setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        setsockopt(fds[i], SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+    }
 
-    //Read byte identifier from socket
-    uint32_t response;
-    recv(csd, &response, 4, 0);
-    if (response != sender && response != receiver) {
-        fprintf(stderr, "Client is not a valid sender or receiver\n");
-        close(csd);
+    //spawn new thread
+    pthread_attr_init(&tr->tattr);
+    pthread_attr_setstacksize(&tr->tattr, 2048);
+    pthread_create(&tr->tid, &tr->tattr, relay_data, (void *)tr);
+    //set the thread name so we can identify it easier
+    static char thread_name[16];
+    snprintf(thread_name, 16, "tfd-%d:%d", tr->infd, tr->outfd);
+    thread_name[15] = '\0';
+    pthread_setname_np(tr->tid, thread_name);
+#else
+    //hand the pair over to the data plane workers
+    if (worker_submit(tr, cpu) < 0) {
+        log_error("Failed to hand transfer to a worker");
+        stats_inc(STAT_TRANSFERS_FINISHED);
+        stats_inc(STAT_TRANSFERS_FAILED);
+        budget_close(tr->infd);
+        budget_close(tr->outfd);
+        transfer_info_put(tr);
+    }
+#endif
+}
+
+static void handshake_close(struct acceptor *a, struct handshake *hs)
+{
+    timer_del(&a->wheel, &hs->timer);
+    TAILQ_REMOVE(&a->handshakes, hs, entries);
+    budget_close(hs->fd);
+    budget_add(BUDGET_HANDSHAKES, -1);
+    free(hs);
+}
+
+static void handshake_expired(struct timer *t)
+{
+    struct handshake *hs = (struct handshake *)((char *)t - offsetof(struct handshake, timer));
+    log_limited(LEVEL_WARN, "Handshake on fd %d timed out", hs->fd);
+    stats_inc(STAT_HANDSHAKES_EXPIRED);
+    handshake_close(hs->owner, hs);
+}
+
+static void handshake_start(struct acceptor *a, int csd)
+{
+    log_debug("Accepted client on fd %d", csd);
+    stats_inc(STAT_ACCEPTED);
+
+    //Send our identity first. The socket is brand new so its send buffer is
+    //empty and this never blocks.
+    ssize_t s = send(csd, &identity, 4, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (s != 4) {
+        log_limited(LEVEL_WARN, "Failed to send identity: (%s)", s < 0 ? strerror(errno) : "short send");
+        budget_close(csd);
         return;
     }
 
-    //Read sha hash
-    static char shabuf[SHA_DIGEST_LENGTH*2+1];
-    recv(csd, shabuf, SHA_DIGEST_LENGTH*2, 0);
-    shabuf[SHA_DIGEST_LENGTH*2+1] = '\0';
+    struct handshake *hs = calloc(1, sizeof(struct handshake));
+    if (!hs) {
+        log_error("Insufficient memory for handshake");
+        budget_close(csd);
+        return;
+    }
+    budget_add(BUDGET_HANDSHAKES, 1);
+    hs->fd = csd;
+    hs->owner = a;
+    hs->got = 0;
+    hs->need = 4;
+    timer_add(&a->wheel, &hs->timer, now_ms(), handshake_timeout_ms, handshake_expired);
+    TAILQ_INSERT_TAIL(&a->handshakes, hs, entries);
 
-    static char filebuf[PATH_MAX];
-    static uint16_t fsize = 0;
-    if (response == sender) {
-        printf("got sender with hash %s\n", shabuf);
-
-        //Read incoming filename
-        recv(csd, &fsize, 2, 0);
-        fsize = ntohs(fsize);
-        ssize_t len = recv(csd, filebuf, fsize, 0);
-        if (len != fsize) {
-            fprintf(stderr, "Failed to read filename from sender\n");
-            close(csd);
-            return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = hs;
+    if (epoll_ctl(a->epfd, EPOLL_CTL_ADD, csd, &ev) < 0) {
+        log_error("Failed epoll_ctl on client socket (%s)", strerror(errno));
+        handshake_close(a, hs);
+    }
+}
+
+//Read as much of the handshake as has arrived, never more than the handshake
+//itself since a sender's data follows right behind it. Returns 1 once it's
+//complete, 0 if more is needed and -1 if the client should be dropped.
+static int handshake_read(struct handshake *hs)
+{
+    for (;;) {
+        ssize_t n = recv(hs->fd, &hs->buf[hs->got], hs->need - hs->got, MSG_DONTWAIT);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        if (n == 0)
+            return -1;
+        hs->got += n;
+        if (hs->got < hs->need)
+            continue;
+
+        uint32_t response;
+        memcpy(&response, hs->buf, 4);
+        if (hs->got == 4) {
+            //Read byte identifier from socket
+            if (response == SENDER_V1_IDENTITY || response == RECEIVER_V1_IDENTITY ||
+                response == RESUMING_RECEIVER_V1_IDENTITY) {
+                log_limited(LEVEL_WARN, "Client predates the stretched routing hash, update it");
+                return -1;
+            }
+            if (response != sender && response != receiver && response != resuming) {
+                log_limited(LEVEL_WARN, "Client is not a valid sender or receiver");
+                return -1;
+            }
+            hs->need = HS_HEADER_LEN;
+        } else if (hs->got == HS_HEADER_LEN) {
+            //got the sha hash, senders follow it with the filename
+            if (response == receiver)
+                return 1;
+            hs->need += 2;
+        } else if (hs->got == HS_HEADER_LEN + 2) {
+            uint16_t fsize;
+            memcpy(&fsize, &hs->buf[HS_HEADER_LEN], 2);
+            fsize = ntohs(fsize);
+            if (!fsize || fsize >= PATH_MAX) {
+                log_limited(LEVEL_WARN, "Invalid filename length %u from %s", fsize,
+                            response == sender ? "sender" : "receiver");
+                return -1;
+            }
+            hs->need += fsize;
+        } else {
+            return 1;
         }
-        filebuf[len] = '\0';
     }
-    else if (response == receiver) {
-        printf("got receiver with hash %s\n", shabuf);
+}
+
+//Nobody showed up for the other side in time. The timer holds its own
+//reference, so this is safe even if a thread on another shard paired the info
+//in the meantime, in which case it's just let go.
+static void pair_expired(struct timer *t)
+{
+    struct transfer_info *tr = (struct transfer_info *)((char *)t - offsetof(struct transfer_info, timer));
+    if (rendezvous_remove(&table, &tr->node) == 0) {
+        if (!stop)
+                log_limited(LEVEL_WARN, "%s with hash %s gave up waiting to be paired",
+                            tr->node.side == RENDEZVOUS_SENDER ? "Sender" : "Receiver", tr->hash);
+        stats_inc(tr->node.side == RENDEZVOUS_SENDER ? STAT_SENDERS_UNPARKED : STAT_RECEIVERS_UNPARKED);
+        stats_inc(STAT_PAIRS_EXPIRED);
+        close_unmatched_connection(&tr->node);
     }
+    transfer_info_put(tr);
+}
 
-    //Set the client socket to allow blocking again (in it's own thread)
-    int flags = fcntl(csd, F_GETFL, 0);
-    fcntl(csd, F_GETFL, flags | O_NONBLOCK);
+//Senders of chunked transfers wait for the receiver's field before sending
+//anything, so they know where to resume from. Nothing but our identity has
+//been sent on the sender's socket, so the reply always fits in its send
+//buffer. Others never read it and are left alone, unread data would turn
+//their close into a reset.
+static int send_reply(struct transfer_info *tr, struct transfer_info *rcv)
+{
+    uint64_t chunk;
+    if (meta_get_u64(tr->filename, tr->fnlen, META_CHUNK_SIZE, &chunk) < 0)
+        return 0;
+    char buf[2 + PATH_MAX];
+    uint16_t len = htons(rcv->replen);
+    memcpy(buf, &len, 2);
+    if (rcv->replen)
+        memcpy(&buf[2], rcv->reply, rcv->replen);
+    ssize_t n = send(tr->infd, buf, 2 + rcv->replen, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n != 2 + rcv->replen) {
+        log_limited(LEVEL_WARN, "Failed to send resume point to sender with hash %s", tr->hash);
+        return -1;
+    }
+    return 0;
+}
 
-    static struct transfer_info tr;
-    memset(&tr, 0, sizeof(struct transfer_info));
-    tr.hash = shabuf;
+//the handshake is complete, pair the client up or park it
+static void handshake_done(struct acceptor *a, struct handshake *hs)
+{
+    int csd = hs->fd;
+    uint32_t response;
+    memcpy(&response, hs->buf, 4);
 
-    //if got sha hash, check search tree
-    void **obj = tfind((void *)&tr, &troot, compare);
-    if (obj) {
-        //match found, this should be the receiver
-        struct transfer_info *match = (struct transfer_info *)*obj;
-        if (!tdelete(*obj, &troot, compare)) {
-            fprintf(stderr, "No hash found. Failed to delete node\n");
-            close(csd);
-            return;
-        }
-        if (match->infd < 0) {
-            fprintf(stderr, "Found matching hash but it has a bad fd\n");
-            close(csd);
-            return;
-        }
-        match->outfd = csd;
-        //spawn new thread
-        pthread_attr_init(&match->tattr);
-        pthread_attr_setstacksize(&match->tattr, 2048);
-        pthread_create(&match->tid, &match->tattr, relay_data, (void *)match);
-        //set the thread name so we can identify it easier
-        static char thread_name[16];
-        snprintf(thread_name, 16, "tfd-%d:%d", match->infd, match->outfd);
-        thread_name[15] = '\0';
-        pthread_setname_np(match->tid, thread_name);
+    char shabuf[SHA_DIGEST_LENGTH*2+1];
+    memcpy(shabuf, &hs->buf[4], SHA_DIGEST_LENGTH*2);
+    shabuf[SHA_DIGEST_LENGTH*2] = '\0';
+
+    //the handshake's round trip is what the buffers are sized from
+    struct tuning tuned;
+    tuning_apply(csd, tuning_profile, tuning_rate, &tuned);
+    if (log_enabled(LEVEL_DEBUG)) {
+        char desc[256];
+        tuning_format(&tuned, desc, sizeof(desc));
+        log_debug("socket tuning %s", desc);
+    }
+
+    uint16_t fsize = 0;
+    if (response == sender) {
+        fsize = hs->got - HS_HEADER_LEN - 2;
+        log_debug("got sender with hash %s", shabuf);
+    } else if (response == resuming) {
+        fsize = hs->got - HS_HEADER_LEN - 2;
+        log_debug("got resuming receiver with hash %s", shabuf);
     } else {
-        //not found, this should be the sender
-        struct transfer_info *ntr = calloc(1, sizeof(struct transfer_info));
-        ntr->hash = strdup(shabuf);
-        ntr->filename = strdup(filebuf);
+        log_debug("got receiver with hash %s", shabuf);
+    }
+
+    //the node that owns the hash gets the client, with its handshake as it
+    //came in
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    hex_to_digest(shabuf, digest);
+    int owner = cluster_owner(digest);
+    if (owner >= 0) {
+        log_debug("forwarding hash %s to node %d", shabuf, owner);
+        cluster_forward(csd, owner, hs->buf, hs->got);
+        return;
+    }
+    stats_inc(response == sender ? STAT_SENDERS : STAT_RECEIVERS);
+
+    struct transfer_info *ntr = calloc(1, sizeof(struct transfer_info));
+    if (!ntr) {
+        log_error("Insufficient memory for transfer info");
+        budget_close(csd);
+        return;
+    }
+    ntr->refs = 1;
+    ntr->shard = a->id;
+    ntr->hash = strdup(shabuf);
+    memcpy(ntr->node.key, digest, RENDEZVOUS_KEY_LEN);
+    if (response == sender) {
+        //keep the filename bytes exactly as sent, they're forwarded as is
+        ntr->node.side = RENDEZVOUS_SENDER;
+        ntr->filename = malloc(fsize + 1);
+        if (ntr->filename) {
+            memcpy(ntr->filename, &hs->buf[HS_HEADER_LEN + 2], fsize);
+            ntr->filename[fsize] = '\0';
+        }
         ntr->fnlen = fsize;
         ntr->infd = csd;
         ntr->outfd = -1;
-        obj = tsearch((void *)ntr, &troot, compare);
-        if (!obj) {
-            fprintf(stderr, "Insufficient memory to add hash to binary search tree\n");
-            transfer_info_free(ntr);
-            free(ntr);
-            close(csd);
-            return;
+    } else {
+        ntr->node.side = RENDEZVOUS_RECEIVER;
+        if (response == resuming) {
+            ntr->reply = malloc(fsize);
+            if (ntr->reply)
+                memcpy(ntr->reply, &hs->buf[HS_HEADER_LEN + 2], fsize);
+            ntr->replen = fsize;
+        }
+        ntr->infd = -1;
+        ntr->outfd = csd;
+    }
+    if (!ntr->hash || (response == sender && !ntr->filename) ||
+        (response == resuming && !ntr->reply)) {
+        log_error("Insufficient memory for transfer info");
+        transfer_info_put(ntr);
+        budget_close(csd);
+        return;
+    }
+
+    //Either side may show up first. Whichever does is parked in the table
+    //until the other one arrives with the same hash, possibly on another
+    //shard. The pairing timer is armed up front since the other side can
+    //take the info out of the table the moment it's in.
+    if (pair_timeout_ms) {
+        ntr->refs++;
+        timer_add(&a->wheel, &ntr->timer, now_ms(), pair_timeout_ms, pair_expired);
+    }
+    ntr->parked_ms = now_ms();
+    //Receivers of a fanout session that's waiting for them go straight in
+    if (response == receiver && fanout_join(ntr) == 0) {
+        if (timer_del(&a->wheel, &ntr->timer))
+            transfer_info_put(ntr);
+        transfer_info_put(ntr);
+        return;
+    }
+    //A fanout sender opens its session, and with a spool any other sender
+    //that ends up parked uploads right away. Both are set up before parking
+    //since a receiver can pair with it the moment it's in.
+    if (response == sender && fanout_prepare(ntr) < 0)
+        spool_prepare(ntr);
+    struct rendezvous_node *node;
+    int res = rendezvous_pair(&table, &ntr->node, &node);
+    if (res < 0 && response == receiver && errno == EEXIST && fanout_wait(ntr) == 0) {
+        //another receiver is parked under the hash, this one waits with it
+        //for a fanout sender
+        if (timer_del(&a->wheel, &ntr->timer))
+            transfer_info_put(ntr);
+        transfer_info_put(ntr);
+        return;
+    }
+    if (res < 0) {
+        log_limited(LEVEL_WARN, "Failed to park %s with hash %s: %s",
+                    response == sender ? "sender" : "receiver", shabuf,
+                    errno == EEXIST ? "one is already waiting" : "rendezvous table full");
+        spool_cancel(ntr);
+        fanout_cancel(ntr);
+        if (timer_del(&a->wheel, &ntr->timer))
+            transfer_info_put(ntr);
+        transfer_info_put(ntr);
+        budget_close(csd);
+        stats_inc(STAT_PAIRS_FAILED);
+        return;
+    }
+    if (res == 0) {
+        stats_inc(ntr->node.side == RENDEZVOUS_SENDER ? STAT_SENDERS_PARKED : STAT_RECEIVERS_PARKED);
+        if (ntr->spool || ntr->fanout) {
+            //the spool or the session expires it instead of the pairing timer
+            if (timer_del(&a->wheel, &ntr->timer))
+                transfer_info_put(ntr);
+        }
+        //the spool thread may be done with ntr by the time this returns
+        if (ntr->spool)
+            spool_upload(ntr);
+        else if (ntr->fanout)
+            fanout_open(ntr);
+        return;
+    }
+    spool_cancel(ntr);
+    if (timer_del(&a->wheel, &ntr->timer))
+        transfer_info_put(ntr);
+
+    //Timers on other shards can't be touched from here, those just fire and
+    //find their info already gone from the table.
+    struct transfer_info *match = transfer_info_of(node);
+    stats_inc(match->node.side == RENDEZVOUS_SENDER ? STAT_SENDERS_UNPARKED : STAT_RECEIVERS_UNPARKED);
+    stats_inc(STAT_PAIRS);
+    stats_observe(STAT_PAIR_WAIT, ntr->parked_ms - match->parked_ms);
+    if (match->shard == a->id && timer_del(&a->wheel, &match->timer))
+        transfer_info_put(match);
+
+    struct transfer_info *snd = response == sender ? ntr : match;
+    if (snd->fanout) {
+        //one more receiver for the session, which starts once they're all in
+        fanout_add(snd, snd == ntr ? match : ntr);
+        if (snd == ntr)
+            fanout_open(snd);
+        transfer_info_put(match);
+        transfer_info_put(ntr);
+        return;
+    }
+
+    //the sender's info carries the transfer, the other half just donates its fd
+    struct transfer_info *tr = ntr;
+    if (response == sender) {
+        ntr->outfd = match->outfd;
+    } else {
+        match->outfd = ntr->outfd;
+        tr = match;
+        match = ntr;
+    }
+    if (tr->spool) {
+        //the sender's data is in the spool, or on its way there
+        transfer_info_put(match);
+        spool_serve(tr);
+        return;
+    }
+    if (send_reply(tr, match) < 0) {
+        stats_inc(STAT_PAIRS_FAILED);
+        budget_close(tr->infd);
+        budget_close(tr->outfd);
+        transfer_info_put(match);
+        transfer_info_put(tr);
+        return;
+    }
+    transfer_info_put(match);
+    start_transfer(tr, a->cpu);
+}
+
+//Tell a client there's no room for it and let it go. The identity goes out
+//before it has sent anything, so closing doesn't reset the connection.
+static void refuse(int csd)
+{
+    send(csd, &busy, 4, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(csd);
+    stats_inc(STAT_REFUSED);
+    log_limited(LEVEL_WARN, "Out of file descriptors for clients, turning them away");
+}
+
+//Out of fds altogether, which the budget should have kept us from. Free the
+//spare to take the connection anyway and turn it away, rather than leaving it
+//in the queue to wake us up again and again.
+static void refuse_spare(struct acceptor *a)
+{
+    if (a->spare < 0)
+        return;
+    close(a->spare);
+    int csd = accept4(a->lsd, NULL, NULL, SOCK_NONBLOCK);
+    if (csd >= 0)
+        refuse(csd);
+    a->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static void acceptor_loop(struct acceptor *a)
+{
+    struct sockaddr_in addr;
+    int nfds;
+    while (!stop) {
+        int timeout = timer_wheel_timeout(&a->wheel, now_ms(), 100);
+        nfds = epoll_wait(a->epfd, a->events, MAX_CONNECTIONS, timeout);
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("Failed epoll_wait (%s)", strerror(errno));
+            break;
         }
+        if (nfds > 1)
+            log_debug("Got %d nfds", nfds);
+        for (int n = 0; n < nfds; n++) {
+            struct handshake *hs = (struct handshake *)a->events[n].data.ptr;
+            if (!hs) {
+                //Accept a bounded batch so that a flood of new connections
+                //doesn't starve the handshakes already in progress. The
+                //listen socket is level triggered, we'll be back for the rest.
+                for (int i = 0; i < ACCEPT_BATCH; ++i) {
+                    socklen_t addr_len = sizeof(addr);
+                    int csd = accept4(a->lsd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK);
+                    if (csd < 0) {
+                        if (errno == EMFILE || errno == ENFILE)
+                            refuse_spare(a);
+                        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                            log_limited(LEVEL_ERROR, "Failed to accept client socket: %s", strerror(errno));
+                        break;
+                    }
+                    if (budget_admit() < 0) {
+                        refuse(csd);
+                        continue;
+                    }
+                    budget_add(BUDGET_CONNECTIONS, 1);
+                    handshake_start(a, csd);
+                }
+                continue;
+            }
+
+            int res = handshake_read(hs);
+            if (res < 0) {
+                stats_inc(STAT_HANDSHAKES_FAILED);
+                handshake_close(a, hs);
+            } else if (res > 0) {
+                //the connection belongs to the transfer from here on
+                epoll_ctl(a->epfd, EPOLL_CTL_DEL, hs->fd, NULL);
+                TAILQ_REMOVE(&a->handshakes, hs, entries);
+                timer_del(&a->wheel, &hs->timer);
+                budget_add(BUDGET_HANDSHAKES, -1);
+                handshake_done(a, hs);
+                free(hs);
+            }
+        }
+        timer_wheel_advance(&a->wheel, now_ms());
     }
+
+    while (!TAILQ_EMPTY(&a->handshakes))
+        handshake_close(a, TAILQ_FIRST(&a->handshakes));
+}
+
+static void *acceptor_main(void *opaque)
+{
+    struct acceptor *a = (struct acceptor *)opaque;
+    pid_t tid = syscall(SYS_gettid);
+    log_info("acceptor %d started as thread %d", a->id, tid);
+    acceptor_loop(a);
+    return NULL;
+}
+
+//Create listen socket and bind to it. With more than one shard every
+//listener shares the port through SO_REUSEPORT.
+static int acceptor_listen(struct acceptor *a, int port, int reuseport)
+{
+    a->lsd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (a->lsd < 0) {
+        log_error("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+    //don't let the previous run's TIME_WAIT connections keep us off the port
+    int one = 1;
+    setsockopt(a->lsd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport && setsockopt(a->lsd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        log_error("Failed to set SO_REUSEPORT: %s", strerror(errno));
+        return -1;
+    }
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(a->lsd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_error("Failed to bind to socket: %s", strerror(errno));
+        return -1;
+    }
+    //as many as may be handshaking at once, the kernel caps it at somaxconn
+    struct budget_limits b;
+    budget_limits(&b);
+    if (listen(a->lsd, b.handshakes > MAX_CONNECTIONS ? b.handshakes : MAX_CONNECTIONS) < 0) {
+        log_error("Failed to listen on socket: %s", strerror(errno));
+        return -1;
+    }
+
+    a->epfd = epoll_create1(0);
+    if (a->epfd < 0) {
+        log_error("Failed to create epollfd (%s)", strerror(errno));
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(a->epfd, EPOLL_CTL_ADD, a->lsd, &ev) < 0) {
+        log_error("Failed epoll_ctl (%s)", strerror(errno));
+        return -1;
+    }
+    a->events = calloc(MAX_CONNECTIONS, sizeof(struct epoll_event));
+    if (!a->events) {
+        log_error("Insufficient memory for epoll events");
+        return -1;
+    }
+    a->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    TAILQ_INIT(&a->handshakes);
+    timer_wheel_init(&a->wheel, now_ms());
+    return 0;
+}
+
+//Have the kernel hand each new connection to the listener of the shard pinned
+//to the core that's handling its packets, instead of hashing it to any shard.
+//Listeners are indexed in the order they were bound, which is shard order.
+static void steer_to_cpu(int lsd, int count)
+{
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, count },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { .len = 3, .filter = code };
+    if (setsockopt(lsd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+        log_error("Failed to steer connections by cpu: %s", strerror(errno));
 }
 
 int main(int argc, char *argv[])
 {
     signal(SIGINT, interrupt);
     signal(SIGTERM, interrupt);
+    //splice() into a socket whose peer went away raises it, the error is
+    //handled where it's returned
+    signal(SIGPIPE, SIG_IGN);
+
+    //one data plane worker per core unless told otherwise
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long nworkers = ncpus;
+    int naccept = 1;
+    int pin = 0;
+    int use_uring = 0;
+    int max_pipes = 0;
+    const char *stats_addr = NULL;
+    const char *cluster_nodes = NULL;
+    const char *spool_dir = NULL;
+    struct spool_limits spool = {
+        .max_bytes = 1024ULL << 20,
+        .quota = 256ULL << 20,
+        .arena = 64ULL << 20,
+        .ttl_ms = 24 * 60 * 60 * 1000,
+    };
+    size_t lag_window = 4 * 1024 * 1024;
+    struct sched_limits sched = { 0 };
+    int opt;
+    while ((opt = getopt(argc, argv, "w:up:a:PH:W:I:D:B:Q:M:T:L:R:C:E:N:S:t:vq")) != -1) {
+        switch (opt) {
+        case 'w':
+            nworkers = strtol(optarg, NULL, 10);
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'p':
+            max_pipes = strtol(optarg, NULL, 10);
+            break;
+        case 'a':
+            //0 means one acceptor per core
+            naccept = strtol(optarg, NULL, 10);
+            if (naccept <= 0)
+                naccept = ncpus;
+            break;
+        case 'P':
+            pin = 1;
+            break;
+        case 'H':
+            handshake_timeout_ms = strtol(optarg, NULL, 10) * 1000;
+            if (handshake_timeout_ms <= 0)
+                handshake_timeout_ms = 1000;
+            break;
+        case 'W':
+            pair_timeout_ms = strtol(optarg, NULL, 10) * 1000;
+            break;
+        case 'I':
+            idle_timeout_ms = strtol(optarg, NULL, 10) * 1000;
+            break;
+        case 'D':
+            spool_dir = optarg;
+            break;
+        case 'B':
+            spool.max_bytes = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'Q':
+            spool.quota = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'M':
+            spool.arena = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'T':
+            spool.ttl_ms = strtol(optarg, NULL, 10) * 1000;
+            break;
+        case 'L':
+            lag_window = strtoull(optarg, NULL, 10) << 10;
+            break;
+        case 'R':
+            sched.transfer_rate = strtod(optarg, NULL) * (1 << 20);
+            break;
+        case 'C':
+            sched.client_rate = strtod(optarg, NULL) * (1 << 20);
+            break;
+        case 'E':
+            sched.global_rate = strtod(optarg, NULL) * (1 << 20);
+            break;
+        case 'N':
+            cluster_nodes = optarg;
+            break;
+        case 'S':
+            stats_addr = optarg;
+            break;
+        case 't':
+            tuning_profile = tuning_parse(optarg, &tuning_rate);
+            if (tuning_profile < 0) {
+                help();
+                exit(1);
+            }
+            break;
+        case 'v':
+            log_level = LEVEL_DEBUG;
+            break;
+        case 'q':
+            log_level = LEVEL_WARN;
+            break;
+        default:
+            help();
+            exit(1);
+        }
+    }
 
     //read port from args
-    if (argc != 2) {
+    if (optind != argc - 1) {
         help();
         exit(1);
     }
-    char *address = argv[1];
+    char *address = argv[optind];
     char *portstr = strtok(address, ":");
     if (!portstr) {
         portstr = address;
@@ -303,105 +970,121 @@ int main(int argc, char *argv[])
             portstr = address;
     }
     if (!portstr) {
-        fprintf(stderr, "Invalid input\n");
+        log_error("Invalid input");
         exit(1);
     }
     int port = strtol(portstr, NULL, 10);
 
-    //Create listen socket and bind to it
-    lsd = socket(AF_INET, SOCK_STREAM, 0);
-    if (lsd < 0) {
-        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+    if (log_start() < 0)
         exit(1);
-    }
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-    if (bind(lsd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        fprintf(stderr, "Failed to bind to socket: %s\n", strerror(errno));
+    budget_init();
+    if (cluster_nodes && cluster_init(cluster_nodes, port) < 0)
         exit(1);
-    }
-    if (listen(lsd, MAX_CONNECTIONS) < 0) {
-        fprintf(stderr, "Failed to listen on socket: %s\n", strerror(errno));
-        close(lsd);
+    if (tuning_rate)
+        log_info("client sockets tuned as %s for %.0f MB/s", tuning_name(tuning_profile),
+                 (double)tuning_rate / (1 << 20));
+    else
+        log_info("client sockets tuned as %s", tuning_name(tuning_profile));
+
+    //size the rendezvous table for as many connections as we can have open
+    struct budget_limits budget;
+    budget_limits(&budget);
+    size_t capacity = MAX_CONNECTIONS;
+    if ((size_t)budget.usable > capacity)
+        capacity = budget.usable;
+    if (rendezvous_init(&table, capacity) < 0) {
+        log_error("Failed to allocate rendezvous table");
         exit(1);
     }
 
-    //Accept and handle client connections
-    struct epoll_event ev, events[MAX_CONNECTIONS];
-    int epollfd = epoll_create1(0);
-    if (epollfd < 0) {
-        fprintf(stderr, "Failed to create epollfd (%s)\n", strerror(errno));
-        close(lsd);
+    acceptors = calloc(naccept, sizeof(struct acceptor));
+    if (!acceptors) {
+        log_error("Insufficient memory for acceptors");
         exit(1);
     }
-    ev.events = EPOLLIN;
-    ev.data.fd = lsd;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, lsd, &ev) < 0) {
-        fprintf(stderr, "Failed epoll_ctl (%s)\n", strerror(errno));
-        close(lsd);
-        close(epollfd);
-        exit(1);
+    for (int i = 0; i < naccept; ++i) {
+        struct acceptor *a = &acceptors[i];
+        a->id = i;
+        a->cpu = pin ? i % ncpus : -1;
+        if (acceptor_listen(a, port, naccept > 1) < 0)
+            exit(1);
+        nacceptors++;
     }
+    if (pin && naccept > 1)
+        steer_to_cpu(acceptors[0].lsd, naccept);
 
-    int nfds;
-    while (!stop) {
-        nfds = epoll_wait(epollfd, events, MAX_CONNECTIONS, 100);
-        if (nfds < 0) {
-            if (nfds == EINTR)
-                continue;
-            fprintf(stderr, "Failed epoll_wait (%s)\n", strerror(errno));
-            break;
-        }
-        if (nfds > 1)
-            printf("Got %d nfds\n", nfds);
-        for (int n = 0; n < nfds; n++) {
-            if (events[n].data.fd == lsd) {
-                socklen_t addr_len = sizeof(addr);
-                int csd = accept(lsd, (struct sockaddr *)&addr, &addr_len);
-                if (csd < 0) {
-                    fprintf(stderr, "Failed to accept client socket: %s\n", strerror(errno));
-                    continue;
-                }
+#ifdef USE_SPLICE
+    pipe_pool_init(max_pipes);
+#endif
+
+    sched_init(&sched);
+#ifndef USE_THREAD_PER_TRANSFER
+    if (workers_start(nworkers < 1 ? 1 : nworkers, use_uring, pin, idle_timeout_ms) < 0)
+        exit(1);
+#endif
 
-                //Make our client socket non blocking for the initial send. We
-                //don't ever want to block the listen thread, so if a client
-                //connects and doesn't respond correctly right away just drop
-                //it and wait for a new one.
-                int flags = fcntl(csd, F_GETFL, 0);
-                fcntl(csd, F_GETFL, flags & ~O_NONBLOCK);
+    spool.idle_ms = idle_timeout_ms;
+    if (spool_dir && spool_start(spool_dir, &spool, &table) < 0)
+        exit(1);
+    if (fanout_start(lag_window, pair_timeout_ms, idle_timeout_ms, &table) < 0)
+        exit(1);
+    //a forwarded client may sit parked at its node, quiet, for as long as
+    //the node lets it
+    int forward_idle_ms = pair_timeout_ms > idle_timeout_ms ? pair_timeout_ms : idle_timeout_ms;
+    if (!pair_timeout_ms || !idle_timeout_ms)
+        forward_idle_ms = 0;
+    if (cluster_start(handshake_timeout_ms, forward_idle_ms) < 0)
+        exit(1);
 
-                //Send our identity first
-                ssize_t s = send(csd, &identity, 4, MSG_NOSIGNAL);
-                if (s < 0) {
-                    fprintf(stderr, "Failed to send identity: (%s)\n", strerror(errno));
-                    continue;
-                } else if (s < 4) {
-                    fprintf(stderr, "Failed to send identity\n");
-                    continue;
-                }
+    if (stats_addr && stats_start(stats_addr) < 0)
+        exit(1);
 
-                ev.events = EPOLLIN | EPOLLONESHOT;
-                ev.data.fd = csd;
-                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, csd, &ev) < 0) {
-                    fprintf(stderr, "Failed epoll_ctl on client socket (%s)\n", strerror(errno));
-                    exit(1);
-                }
-            } else {
-                printf("Socket %d got activity\n", events[n].data.fd);
-                handle_client_socket(events[n].data.fd);
-            }
+    //Accept and handle client connections. The main thread runs the first
+    //shard itself.
+    for (int i = 1; i < nacceptors; ++i) {
+        struct acceptor *a = &acceptors[i];
+        if (pthread_create(&a->thread, NULL, acceptor_main, a) != 0) {
+            log_error("Failed to start acceptor %d", i);
+            exit(1);
         }
+        char thread_name[16];
+        snprintf(thread_name, 16, "acceptor-%d", i);
+        pthread_setname_np(a->thread, thread_name);
+        if (a->cpu >= 0)
+            pin_thread(a->thread, a->cpu);
     }
+    if (acceptors[0].cpu >= 0)
+        pin_thread(pthread_self(), acceptors[0].cpu);
+    acceptor_loop(&acceptors[0]);
+    for (int i = 1; i < nacceptors; ++i)
+        pthread_join(acceptors[i].thread, NULL);
+    stats_stop();
 
-    //twalk to iterate over any umatched connections and close them
-    twalk(troot, close_unmatched_connections);
-    tdestroy(troot, free);
+    //close any connections still waiting for the other side
+    for (int i = 0; i < nacceptors; ++i)
+        timer_wheel_flush(&acceptors[i].wheel);
+    cluster_stop();
+    fanout_stop();
+    spool_stop();
+    rendezvous_drain(&table, close_unmatched_connection);
+    rendezvous_destroy(&table);
 
+#ifdef USE_THREAD_PER_TRANSFER
     join_finished_threads();
+#else
+    workers_join();
+#endif
+#ifdef USE_SPLICE
+    pipe_pool_destroy();
+#endif
 
-    close(epollfd);
-    shutdown(lsd, SHUT_RDWR);
-    close(lsd);
+    for (int i = 0; i < nacceptors; ++i) {
+        close(acceptors[i].epfd);
+        close(acceptors[i].lsd);
+        if (acceptors[i].spare >= 0)
+            close(acceptors[i].spare);
+        free(acceptors[i].events);
+    }
+    free(acceptors);
+    log_stop();
 }
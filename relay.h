@@ -0,0 +1,42 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "rendezvous.h"
+#include "timerwheel.h"
+
+//set from the signal handler when the relay should shut down
+extern volatile int stop;
+
+struct spool_entry;
+struct fanout;
+
+struct transfer_info {
+    char *hash;
+    char *filename;
+    uint16_t fnlen;
+    char *reply;          //a resuming receiver's field, for the sender
+    uint16_t replen;
+    int infd;
+    int outfd;
+    pthread_t tid;
+    pthread_attr_t tattr;
+    struct rendezvous_node node;
+    int refs;             //the table or transfer, plus the pairing timer
+    int shard;            //acceptor whose wheel holds the pairing timer
+    struct timer timer;
+    uint64_t parked_ms;   //when the handshake finished and it went to pair up
+    uint64_t started_ms;  //when the transfer started
+    struct spool_entry *spool; //the sender's upload, when it's spooled
+    struct fanout *fanout; //the sender's session, when it goes to many receivers
+};
+
+//drop a reference, the last one frees the info (but never closes its fds)
+void transfer_info_put(struct transfer_info *tr);
+
+//pin a thread to one cpu, returns 0 on success
+int pin_thread(pthread_t thread, int cpu);
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef RELAYCLIENT_H
+#define RELAYCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//librelayclient, the client side of send and receive for programs that move
+//files through a relay without running them.
+//
+//A client resolves the relay once and runs any number of send and receive
+//sessions on one event loop, which the caller drives with relay_client_run,
+//either on its own or from its own loop when relay_client_fd is readable.
+//The hash of the secret, slow on purpose, is made on a thread of the
+//session's own before it connects. Connecting, handshakes, waiting to be
+//paired and the data of plain single stream transfers all happen on that
+//loop without blocking. Transfers that are compressed, encrypted, resumable,
+//spread over several streams or batched go through the same pipelines send
+//and receive use, on a thread of their own once the first connection is up. Either way a session ends with its
+//callback, which is always called from relay_client_run.
+
+struct relay_client;
+struct relay_session;
+
+//Called once when a session is over, status 0 if the transfer completed and
+//-1 if it didn't, see relay_session_error. The session is freed when this
+//returns.
+typedef void (*relay_done_fn)(struct relay_session *s, int status, void *arg);
+
+//A client for the relay at "host:port". Returns NULL if it can't be resolved.
+struct relay_client *relay_client_new(const char *relay);
+//Stops whatever sessions are left, without calling their callbacks.
+void relay_client_free(struct relay_client *c);
+//Readable when relay_client_run has something to do.
+int relay_client_fd(struct relay_client *c);
+//Handle whatever is ready, waiting up to timeout_ms (-1 for as long as it
+//takes) for something to be. Returns the number of sessions still going, or
+//-1 if the loop itself failed.
+int relay_client_run(struct relay_client *c, int timeout_ms);
+
+//How receivers move plain data to a file.
+enum relay_write_mode {
+    RELAY_WRITE_AUTO = 0, //splice, copying if the filesystem can't take it
+    RELAY_WRITE_SPLICE,
+    RELAY_WRITE_COPY,
+};
+
+//How senders hand plain data to the socket.
+enum relay_send_mode {
+    RELAY_SEND_AUTO = 0,  //sendfile, or MSG_ZEROCOPY when there's a transform
+    RELAY_SEND_SENDFILE,
+    RELAY_SEND_ZEROCOPY,
+    RELAY_SEND_COPY,      //plain read/send loop
+};
+
+//Compression on the way out, each codec only if the library was built with it.
+enum relay_codec {
+    RELAY_CODEC_NONE = 0,
+    RELAY_CODEC_LZ4,
+    RELAY_CODEC_ZSTD,
+    RELAY_CODEC_ZLIB,
+};
+
+//End to end encryption under a key derived from the secret.
+enum relay_cipher {
+    RELAY_CIPHER_NONE = 0,
+    RELAY_CIPHER_AES_GCM,
+    RELAY_CIPHER_CHACHA20,
+};
+
+//How the relay schedules a transfer against others.
+enum relay_priority {
+    RELAY_PRIORITY_NORMAL = 0,
+    RELAY_PRIORITY_BULK,  //half the share of normal
+    RELAY_PRIORITY_HIGH,  //twice the share of normal
+};
+
+//Socket profiles for the connections to the relay.
+enum relay_tuning {
+    RELAY_TUNING_AUTO = 0, //lan or wan by the measured round trip time
+    RELAY_TUNING_LAN,     //lan-bulk, large chunks, buffers mostly autotuned
+    RELAY_TUNING_WAN,     //wan-high-bdp, large buffers, unsent data kept low
+    RELAY_TUNING_SMALL,   //many-small-files, no Nagle delay, small chunks
+    RELAY_TUNING_NONE,    //leave the sockets as the kernel made them
+};
+
+//Parse "<profile>[:<MB/s>]", the profile being auto, lan-bulk (or lan),
+//wan-high-bdp (or wan), many-small-files (or small) or none, and the link
+//rate if given into rate (0 otherwise). Returns an enum relay_tuning or -1.
+int relay_tuning_parse(const char *spec, uint64_t *rate);
+
+//What to send, the first of paths, buf or fd that's set.
+struct relay_send_opts {
+    const char *const *paths; //files and directories sent as one batch
+    int npaths;
+    const char *name;     //what the receiver saves buf or fd as
+    const void *buf;      //size bytes of memory,
+    int fd;               //or of this file from its start
+    uint64_t size;
+    const char *secret;   //NULL makes one up, see relay_session_secret
+    int streams;          //connections one file is spread over, 0 picks from
+                          //the round trip time, at most MAX_STREAMS
+    int resumable;        //in verified chunks the receiver can resume
+    int codec;            //enum relay_codec
+    int cipher;           //enum relay_cipher
+    int mode;             //enum relay_send_mode
+    int fanout;           //receivers getting the same data, 0 or 1 for just one
+    int priority;         //enum relay_priority
+    int tuning;           //enum relay_tuning
+    uint64_t link_rate;   //bytes per second to size for, 0 for the profile's
+};
+
+//Where to put what arrives, the first of outdir, buf or fd that's set.
+struct relay_receive_opts {
+    const char *secret;
+    const char *outdir;   //saved under the sender's name, or a batch's names
+    void *buf;            //into memory, failing if more than cap bytes arrive
+    size_t cap;
+    int fd;               //into this file from its start
+    int mode;             //enum relay_write_mode
+    int tuning;           //enum relay_tuning
+    uint64_t link_rate;   //bytes per second to size for, 0 for the profile's
+};
+
+//Start a session. Returns NULL, with the reason on stderr, if the options
+//don't make sense or it couldn't be set up.
+struct relay_session *relay_send(struct relay_client *c, const struct relay_send_opts *o,
+                                 relay_done_fn done, void *arg);
+struct relay_session *relay_receive(struct relay_client *c, const struct relay_receive_opts *o,
+                                    relay_done_fn done, void *arg);
+
+//Give up on a session, its callback runs with status -1 from the next
+//relay_client_run. A transfer already on its own thread stops once its
+//streams notice their connections closing.
+void relay_session_cancel(struct relay_session *s);
+
+//The secret the receiver needs, the one given or made up.
+const char *relay_session_secret(const struct relay_session *s);
+//The name the file is sent under, for receivers once they are paired.
+const char *relay_session_name(const struct relay_session *s);
+//Bytes of data sent or received so far, for plain transfers on the loop, and
+//all of it once the callback runs.
+uint64_t relay_session_bytes(const struct relay_session *s);
+//Why a session failed, empty if it didn't.
+const char *relay_session_error(const struct relay_session *s);
+//What the socket options of the first connection were set to, empty until
+//the relay answered.
+const char *relay_session_tuning(const struct relay_session *s);
+
+#endif
@@ -0,0 +1,235 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "rendezvous.h"
+
+#define RV_SLOTS 3
+//furthest a node can live from its home bucket
+#define RV_MAX_PROBE 64
+#define RV_SPINS 64
+
+//One cache line: a lock, the number of nodes whose home is at or before this
+//bucket but that live past it (probing stops at a bucket where that's zero),
+//and three slots. The tag is eight bytes of the key with the side in the low
+//bit, so the key itself is only compared on a likely match.
+struct rv_bucket {
+    uint32_t lock;
+    uint16_t overflow;
+    uint8_t used;
+    uint8_t pad;
+    uint64_t tags[RV_SLOTS];
+    struct rendezvous_node *nodes[RV_SLOTS];
+} __attribute__((aligned(64)));
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#endif
+}
+
+static void bucket_lock(struct rv_bucket *b)
+{
+    int spins = 0;
+    while (__atomic_exchange_n(&b->lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&b->lock, __ATOMIC_RELAXED)) {
+            //the holder may have been preempted, don't burn its timeslice
+            if (++spins % RV_SPINS == 0)
+                sched_yield();
+            else
+                cpu_relax();
+        }
+    }
+}
+
+static void bucket_unlock(struct rv_bucket *b)
+{
+    __atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+}
+
+static uint64_t key_word(const unsigned char *key, int off)
+{
+    uint64_t v;
+    memcpy(&v, &key[off], sizeof(v));
+    return v;
+}
+
+//Clients pick the digest, so the bucket index is mixed with a random seed to
+//keep anyone from aiming a pile of keys at one run of buckets.
+static size_t home_bucket(const struct rendezvous *rv, const unsigned char *key)
+{
+    uint64_t x = key_word(key, 0) ^ rv->seed;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x & (rv->nbuckets - 1);
+}
+
+static uint64_t node_tag(const struct rendezvous_node *node)
+{
+    return (key_word(node->key, 8) & ~1ULL) | (node->side & 1);
+}
+
+int rendezvous_init(struct rendezvous *rv, size_t capacity)
+{
+    //keep the table at most two thirds full
+    size_t want = capacity / 2 + 1;
+    size_t n = 1;
+    while (n < want)
+        n <<= 1;
+
+    void *mem;
+    size_t bytes = (n + RV_MAX_PROBE) * sizeof(struct rv_bucket);
+    if (posix_memalign(&mem, 64, bytes) != 0)
+        return -1;
+    memset(mem, 0, bytes);
+    rv->buckets = (struct rv_bucket *)mem;
+    rv->nbuckets = n;
+    if (syscall(SYS_getrandom, &rv->seed, sizeof(rv->seed), 0) != sizeof(rv->seed))
+        rv->seed = (uint64_t)(uintptr_t)mem ^ (uint64_t)getpid();
+    return 0;
+}
+
+void rendezvous_destroy(struct rendezvous *rv)
+{
+    free(rv->buckets);
+    rv->buckets = NULL;
+    rv->nbuckets = 0;
+}
+
+static void unlock_range(struct rendezvous *rv, size_t first, size_t last)
+{
+    for (size_t i = first; i <= last; ++i)
+        bucket_unlock(&rv->buckets[i]);
+}
+
+//take slot s of bucket i out of the chain starting at home
+static struct rendezvous_node *take_slot(struct rendezvous *rv, size_t home, size_t i, int s)
+{
+    struct rv_bucket *b = &rv->buckets[i];
+    struct rendezvous_node *node = b->nodes[s];
+    b->nodes[s] = NULL;
+    b->used &= ~(1 << s);
+    for (size_t j = home; j < i; ++j)
+        rv->buckets[j].overflow--;
+    return node;
+}
+
+int rendezvous_pair(struct rendezvous *rv, struct rendezvous_node *node,
+                    struct rendezvous_node **match)
+{
+    size_t home = home_bucket(rv, node->key);
+    uint64_t tag = node_tag(node);
+    uint64_t want = tag ^ 1;
+    size_t free_b = 0;
+    int free_s = -1;
+    size_t i = home;
+    int ret;
+
+    //Everything under this key hangs off the home bucket, so holding its lock
+    //makes the lookup and the insert below one atomic step.
+    bucket_lock(&rv->buckets[i]);
+    for (;;) {
+        struct rv_bucket *b = &rv->buckets[i];
+        for (int s = 0; s < RV_SLOTS; ++s) {
+            if (!(b->used & (1 << s))) {
+                if (free_s < 0) {
+                    free_b = i;
+                    free_s = s;
+                }
+                continue;
+            }
+            if ((b->tags[s] | 1) != (tag | 1) ||
+                memcmp(b->nodes[s]->key, node->key, RENDEZVOUS_KEY_LEN))
+                continue;
+            if (b->tags[s] == want) {
+                *match = take_slot(rv, home, i, s);
+                ret = 1;
+            } else {
+                errno = EEXIST;
+                ret = -1;
+            }
+            goto out;
+        }
+        if (!b->overflow || i + 1 >= home + RV_MAX_PROBE)
+            break;
+        bucket_lock(&rv->buckets[++i]);
+    }
+
+    //nothing to pair with, park it in the first free slot along the chain
+    while (free_s < 0 && i + 1 < home + RV_MAX_PROBE) {
+        struct rv_bucket *b = &rv->buckets[++i];
+        bucket_lock(b);
+        for (int s = 0; s < RV_SLOTS; ++s) {
+            if (!(b->used & (1 << s))) {
+                free_b = i;
+                free_s = s;
+                break;
+            }
+        }
+    }
+    if (free_s < 0) {
+        errno = ENOSPC;
+        ret = -1;
+        goto out;
+    }
+    struct rv_bucket *fb = &rv->buckets[free_b];
+    fb->tags[free_s] = tag;
+    fb->nodes[free_s] = node;
+    fb->used |= 1 << free_s;
+    for (size_t j = home; j < free_b; ++j)
+        rv->buckets[j].overflow++;
+    ret = 0;
+
+out:
+    unlock_range(rv, home, i);
+    return ret;
+}
+
+int rendezvous_remove(struct rendezvous *rv, struct rendezvous_node *node)
+{
+    size_t home = home_bucket(rv, node->key);
+    size_t i = home;
+    int ret = -1;
+
+    bucket_lock(&rv->buckets[i]);
+    for (;;) {
+        struct rv_bucket *b = &rv->buckets[i];
+        for (int s = 0; s < RV_SLOTS; ++s) {
+            if ((b->used & (1 << s)) && b->nodes[s] == node) {
+                take_slot(rv, home, i, s);
+                ret = 0;
+                goto out;
+            }
+        }
+        if (!b->overflow || i + 1 >= home + RV_MAX_PROBE)
+            break;
+        bucket_lock(&rv->buckets[++i]);
+    }
+
+out:
+    unlock_range(rv, home, i);
+    return ret;
+}
+
+void rendezvous_drain(struct rendezvous *rv, void (*fn)(struct rendezvous_node *))
+{
+    for (size_t i = 0; i < rv->nbuckets + RV_MAX_PROBE; ++i) {
+        struct rv_bucket *b = &rv->buckets[i];
+        for (int s = 0; s < RV_SLOTS; ++s) {
+            if (b->used & (1 << s)) {
+                struct rendezvous_node *node = b->nodes[s];
+                b->nodes[s] = NULL;
+                fn(node);
+            }
+        }
+        b->used = 0;
+        b->overflow = 0;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef RENDEZVOUS_H
+#define RENDEZVOUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RENDEZVOUS_KEY_LEN 20 //raw sha1 digest
+
+enum rendezvous_side {
+    RENDEZVOUS_SENDER = 0,
+    RENDEZVOUS_RECEIVER = 1,
+};
+
+//Embedded in whatever the caller wants to park, the table only stores
+//pointers to these.
+struct rendezvous_node {
+    unsigned char key[RENDEZVOUS_KEY_LEN];
+    int side;
+};
+
+struct rv_bucket;
+
+//Rendezvous table keyed by the session digest. Open addressing over cache line
+//sized buckets, each with its own lock, so any number of accept/handshake
+//threads can pair connections at once without a global lock. Buckets are
+//locked in ascending order and the probe sequence never wraps, which keeps
+//operations that overlap on a run of buckets from deadlocking.
+struct rendezvous {
+    struct rv_bucket *buckets;
+    size_t nbuckets;      //home buckets, a power of two
+    uint64_t seed;
+};
+
+//size the table to hold at least capacity parked nodes, returns 0 on success
+int rendezvous_init(struct rendezvous *rv, size_t capacity);
+void rendezvous_destroy(struct rendezvous *rv);
+
+//Pair node with a parked node of the opposite side and the same key. Returns 1
+//and sets *match (which is no longer in the table) if one was waiting,
+//otherwise parks node and returns 0. Returns -1 with errno EEXIST if a node of
+//the same side is already parked under that key, or ENOSPC if the table is
+//full around the key.
+int rendezvous_pair(struct rendezvous *rv, struct rendezvous_node *node,
+                    struct rendezvous_node **match);
+
+//Take a parked node back out of the table. Returns 0 if it was removed, -1 if
+//it wasn't there (for instance because it was already matched).
+int rendezvous_remove(struct rendezvous *rv, struct rendezvous_node *node);
+
+//remove every parked node, calling fn on each. Not safe against concurrent use.
+void rendezvous_drain(struct rendezvous *rv, void (*fn)(struct rendezvous_node *));
+
+#endif
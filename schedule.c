@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "protocol.h"
+#include "schedule.h"
+#include "stats.h"
+#include "util.h"
+
+//bytes a normal transfer may move per turn, halved for bulk and doubled for
+//high priority
+#define SCHED_QUANTUM (512 * 1024)
+//a throttled transfer waits for at least this much rather than trickling
+#define SCHED_MIN_GRANT (16 * 1024)
+#define CLIENT_BUCKETS 1024
+
+struct sched_client {
+    unsigned char addr[16];
+    int refs;
+    struct token_bucket bucket;
+    LIST_ENTRY(sched_client) link;
+};
+
+static struct sched_limits limits;
+//the client and global buckets are shared by all of the workers
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct token_bucket global;
+static LIST_HEAD(, sched_client) clients[CLIENT_BUCKETS];
+
+//a quarter second's worth may go out in one burst
+static void bucket_init(struct token_bucket *b, uint64_t rate, uint64_t now)
+{
+    b->rate = rate;
+    b->burst = rate / 4 > SCHED_MIN_GRANT * 4 ? rate / 4 : SCHED_MIN_GRANT * 4;
+    b->tokens = b->burst;
+    b->last_ms = now;
+}
+
+//How much of want the bucket lets through now. If that's less than it takes
+//to be worth a splice, *wait_ms is raised to when it will be.
+static size_t bucket_allow(struct token_bucket *b, size_t want, uint64_t now, int *wait_ms)
+{
+    if (!b->rate)
+        return want;
+    if (now > b->last_ms) {
+        b->tokens += (int64_t)(b->rate * (now - b->last_ms) / 1000);
+        if (b->tokens > b->burst)
+            b->tokens = b->burst;
+        b->last_ms = now;
+    }
+    if (b->tokens >= (int64_t)want)
+        return want;
+    int64_t need = want < SCHED_MIN_GRANT ? want : SCHED_MIN_GRANT;
+    if (b->tokens < need) {
+        int ms = (need - b->tokens) * 1000 / b->rate + 1;
+        if (ms > *wait_ms)
+            *wait_ms = ms;
+    }
+    return b->tokens > 0 ? b->tokens : 0;
+}
+
+static unsigned int client_hash(const unsigned char *addr)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 16; ++i)
+        h = (h ^ addr[i]) * 16777619u;
+    return h % CLIENT_BUCKETS;
+}
+
+//the sender's address, v4 mapped into v6 so both fit the same key
+static int client_addr(int fd, unsigned char *addr)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if (getpeername(fd, (struct sockaddr *)&ss, &len) < 0)
+        return -1;
+    memset(addr, 0, 16);
+    if (ss.ss_family == AF_INET) {
+        addr[10] = addr[11] = 0xff;
+        memcpy(&addr[12], &((struct sockaddr_in *)&ss)->sin_addr, 4);
+    } else if (ss.ss_family == AF_INET6) {
+        memcpy(addr, &((struct sockaddr_in6 *)&ss)->sin6_addr, 16);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static struct sched_client *client_get(int fd, uint64_t now)
+{
+    unsigned char addr[16];
+    if (client_addr(fd, addr) < 0)
+        return NULL;
+    unsigned int h = client_hash(addr);
+    pthread_mutex_lock(&lock);
+    struct sched_client *c;
+    LIST_FOREACH(c, &clients[h], link)
+        if (!memcmp(c->addr, addr, 16))
+            break;
+    if (!c && (c = calloc(1, sizeof(struct sched_client)))) {
+        memcpy(c->addr, addr, 16);
+        bucket_init(&c->bucket, limits.client_rate, now);
+        LIST_INSERT_HEAD(&clients[h], c, link);
+    }
+    if (c)
+        c->refs++;
+    pthread_mutex_unlock(&lock);
+    if (!c)
+        log_limited(LEVEL_ERROR, "Insufficient memory for client bucket, not capping it");
+    return c;
+}
+
+void sched_init(const struct sched_limits *l)
+{
+    limits = *l;
+    for (int i = 0; i < CLIENT_BUCKETS; ++i)
+        LIST_INIT(&clients[i]);
+    bucket_init(&global, limits.global_rate, now_ms());
+}
+
+void sched_flow_init(struct sched_flow *f, const struct transfer_info *tr, uint64_t now)
+{
+    uint64_t cls;
+    if (meta_get_u64(tr->filename, tr->fnlen, META_PRIORITY, &cls) < 0 || cls > PRIORITY_HIGH)
+        cls = PRIORITY_NORMAL;
+    f->cls = cls;
+    f->quantum = cls == PRIORITY_BULK ? SCHED_QUANTUM / 2 :
+                 cls == PRIORITY_HIGH ? SCHED_QUANTUM * 2 : SCHED_QUANTUM;
+    bucket_init(&f->bucket, limits.transfer_rate, now);
+    f->client = limits.client_rate ? client_get(tr->infd, now) : NULL;
+}
+
+void sched_flow_release(struct sched_flow *f)
+{
+    struct sched_client *c = f->client;
+    if (!c)
+        return;
+    pthread_mutex_lock(&lock);
+    if (!--c->refs) {
+        LIST_REMOVE(c, link);
+        free(c);
+    }
+    pthread_mutex_unlock(&lock);
+    f->client = NULL;
+}
+
+size_t sched_allow(struct sched_flow *f, size_t want, uint64_t now, int *wait_ms)
+{
+    *wait_ms = 0;
+    size_t grant = bucket_allow(&f->bucket, want, now, wait_ms);
+    if (f->client || global.rate) {
+        pthread_mutex_lock(&lock);
+        if (f->client)
+            grant = bucket_allow(&f->client->bucket, grant, now, wait_ms);
+        grant = bucket_allow(&global, grant, now, wait_ms);
+        pthread_mutex_unlock(&lock);
+    }
+    if (*wait_ms) {
+        stats_inc(STAT_THROTTLED);
+        return 0;
+    }
+    return grant;
+}
+
+void sched_charge(struct sched_flow *f, size_t n)
+{
+    if (f->bucket.rate)
+        f->bucket.tokens -= n;
+    if (f->client || global.rate) {
+        pthread_mutex_lock(&lock);
+        if (f->client)
+            f->client->bucket.tokens -= n;
+        if (global.rate)
+            global.tokens -= n;
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+size_t sched_take(struct sched_flow *f, size_t want)
+{
+    for (;;) {
+        int wait_ms;
+        size_t grant = sched_allow(f, want, now_ms(), &wait_ms);
+        if (grant)
+            return grant;
+        struct timespec ts = { wait_ms / 1000, (wait_ms % 1000) * 1000000L };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR && !stop)
+            ;
+        if (stop)
+            return want;
+    }
+}
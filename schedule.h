@@ -0,0 +1,59 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "relay.h"
+
+//Bandwidth scheduling for the data plane. Every transfer gets a quantum of
+//bytes it may move per turn on its worker, scaled by the priority class its
+//sender asked for (see META_PRIORITY), so transfers sharing a worker take
+//turns in weighted round robin and one large transfer can't hold up the
+//small ones. On top of that token buckets cap each transfer, each client
+//(the sender's address) and the relay's egress as a whole.
+
+//rates in bytes per second, 0 for no cap
+struct sched_limits {
+    uint64_t transfer_rate;
+    uint64_t client_rate;
+    uint64_t global_rate;
+};
+
+struct token_bucket {
+    uint64_t rate;
+    int64_t tokens;       //may go negative, the debt is paid off first
+    int64_t burst;
+    uint64_t last_ms;
+};
+
+struct sched_client;
+
+//a transfer's share of the schedule
+struct sched_flow {
+    int cls;              //enum priority_class
+    size_t quantum;       //bytes per turn
+    struct token_bucket bucket;
+    struct sched_client *client;
+};
+
+//set the caps, before any transfer starts
+void sched_init(const struct sched_limits *limits);
+
+//Set up the flow for a transfer, with the class from the sender's field and
+//the client from the sender's address.
+void sched_flow_init(struct sched_flow *f, const struct transfer_info *tr, uint64_t now);
+void sched_flow_release(struct sched_flow *f);
+
+//How many of want bytes the flow may move now. 0 if it has to wait for its
+//buckets, *wait_ms says for how long.
+size_t sched_allow(struct sched_flow *f, size_t want, uint64_t now, int *wait_ms);
+
+//take n bytes that were moved out of the buckets
+void sched_charge(struct sched_flow *f, size_t n);
+
+//Blocking version for the thread per transfer mode: sleeps until some of
+//want may be moved and returns how much.
+size_t sched_take(struct sched_flow *f, size_t want);
+
+#endif
@@ -1,86 +1,307 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <linux/limits.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <linux/random.h>
+#include "protocol.h"
 #include "secret.h"
 
-char *make_secret(int num_words)
+//The dictionary is mapped, along with an index of where each usable word in
+//it starts. The index is built on first use and cached, keyed by the
+//dictionary's size, inode and mtime, so later runs just map it too and
+//picking a word is one uniform random lookup.
+#define INDEX_MAGIC 0x49575246  //"FRWI"
+#define INDEX_VERSION 1
+
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t dict_size;
+    uint64_t dict_ino;
+    int64_t dict_mtime_sec;
+    int64_t dict_mtime_nsec;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+static struct {
+    const char *words;
+    size_t size;
+    const uint32_t *offsets;
+    uint32_t count;
+} dict;
+static pthread_once_t dict_once = PTHREAD_ONCE_INIT;
+
+//random numbers from getrandom, fetched a batch at a time
+struct rng {
+    uint32_t pool[64];
+    size_t left;
+};
+
+static int index_path(char *path, size_t len)
 {
-    char c;
-    char *line;
-    char *words = malloc((num_words + 1)*45);
-    ssize_t line_read;
-    ssize_t line_alloced;
-
-    FILE *f = fopen("/usr/share/dict/words", "r");
-    if (!f) {
-        fprintf(stderr, "Failed to open /usr/share/dict/words\n");
-        return NULL;
+    const char *cache = getenv("XDG_CACHE_HOME");
+    if (cache && *cache)
+        return snprintf(path, len, "%s/file-relay-words.idx", cache) < (int)len ? 0 : -1;
+    const char *home = getenv("HOME");
+    if (!home || !*home)
+        return -1;
+    return snprintf(path, len, "%s/.cache/file-relay-words.idx", home) < (int)len ? 0 : -1;
+}
+
+static void index_header_init(struct index_header *h, const struct stat *st, uint32_t count)
+{
+    memset(h, 0, sizeof(*h));
+    h->magic = INDEX_MAGIC;
+    h->version = INDEX_VERSION;
+    h->dict_size = st->st_size;
+    h->dict_ino = st->st_ino;
+    h->dict_mtime_sec = st->st_mtim.tv_sec;
+    h->dict_mtime_nsec = st->st_mtim.tv_nsec;
+    h->count = count;
+}
+
+//map the cached index if it matches the dictionary
+static int index_map(const char *path, const struct stat *dst)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    struct index_header *h = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*h))
+        h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+        return -1;
+
+    struct index_header want;
+    index_header_init(&want, dst, h->count);
+    if (memcmp(h, &want, sizeof(want)) || !h->count ||
+        (size_t)st.st_size != sizeof(*h) + (size_t)h->count * sizeof(uint32_t)) {
+        munmap(h, st.st_size);
+        return -1;
     }
+    dict.offsets = (const uint32_t *)(h + 1);
+    dict.count = h->count;
+    return 0;
+}
 
-    if (fseek(f, 0, SEEK_END) < 0) {
-        fprintf(stderr, "Failed to seek to end of file\n");
-        return NULL;
+//Build the index, and cache it if possible. Lines that are empty or too long
+//to fit a secret's word are left out.
+static int index_build(const char *path, const struct stat *dst)
+{
+    uint32_t *offsets = NULL;
+    size_t count = 0, cap = 0;
+    for (size_t pos = 0; pos < dict.size;) {
+        const char *nl = memchr(&dict.words[pos], '\n', dict.size - pos);
+        size_t len = nl ? (size_t)(nl - &dict.words[pos]) : dict.size - pos;
+        if (len && len <= DICT_WORD_MAX) {
+            if (count == cap) {
+                cap = cap ? cap * 2 : 65536;
+                uint32_t *o = realloc(offsets, cap * sizeof(uint32_t));
+                if (!o) {
+                    free(offsets);
+                    return -1;
+                }
+                offsets = o;
+            }
+            offsets[count++] = pos;
+        }
+        pos += len + 1;
+    }
+    if (!count) {
+        free(offsets);
+        return -1;
     }
+    dict.offsets = offsets;
+    dict.count = count;
 
-    long size = ftell(f);
+    //written under a temporary name so readers never see half of it
+    char tmp[PATH_MAX + 8];
+    if (!path || snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+        return 0;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    *strrchr(dir, '/') = '\0';
+    mkdir(dir, 0700);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return 0;
+    struct index_header h;
+    index_header_init(&h, dst, count);
+    FILE *f = fdopen(fd, "w");
+    if (!f || fwrite(&h, sizeof(h), 1, f) != 1 ||
+        fwrite(offsets, sizeof(uint32_t), count, f) != count ||
+        fclose(f) != 0 || rename(tmp, path) < 0) {
+        if (!f)
+            close(fd);
+        unlink(tmp);
+    }
+    return 0;
+}
 
-    unsigned int seed = 0;
-    syscall(SYS_getrandom, &seed, sizeof(unsigned int), 0);
-    srandom(seed);
+static void dict_load(void)
+{
+    int fd = open(DICT_PATH, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !st.st_size || st.st_size > UINT32_MAX) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    void *words = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (words == MAP_FAILED)
+        return;
+    dict.words = words;
+    dict.size = st.st_size;
 
-    for (int w = 0; w < num_words; ++w) {
-        //get random and scale to dictionary file size
-        long r = random();
-        double scale = (double)r / RAND_MAX;
-        long seek_pos = (long) (size * scale);
-
-        //seek to random place in the dictionary, read until newline, then get the next line
-        fseek(f, seek_pos, SEEK_SET);
-        while (fread(&c, 1, 1, f) == 1 && c != '\n');
-        if (c != '\n') {
-            fprintf(stderr, "Failed to read from dictionary\n");
-            break;
-        }
+    char path[PATH_MAX];
+    int cached = index_path(path, sizeof(path)) == 0;
+    if ((cached && index_map(path, &st) == 0) || index_build(cached ? path : NULL, &st) == 0)
+        return;
+    munmap(words, st.st_size);
+    dict.words = NULL;
+}
 
-        line = NULL;
-        line_alloced = 0;
-        line_read = getline(&line, &line_alloced, f);
-        if (line_read) {
-            if (w < num_words - 1)
-                line[line_read-1] = '-';
-            else
-                line[line_read-1] = '\0';
-            strncat(words, line, line_read);
+static uint32_t rng_next(struct rng *r)
+{
+    if (!r->left) {
+        size_t got = 0;
+        while (got < sizeof(r->pool)) {
+            ssize_t n = syscall(SYS_getrandom, (char *)r->pool + got, sizeof(r->pool) - got, 0);
+            if (n < 0 && errno != EINTR) {
+                //the kernel predates getrandom, read urandom instead
+                FILE *f = fopen("/dev/urandom", "r");
+                if (!f || fread(r->pool, sizeof(r->pool), 1, f) != 1)
+                    abort();
+                fclose(f);
+                break;
+            }
+            if (n > 0)
+                got += n;
         }
-        free(line);
+        r->left = sizeof(r->pool) / sizeof(uint32_t);
     }
+    return r->pool[--r->left];
+}
 
-    fclose(f);
+//uniform in [0, n), rejecting the top of the range that would favor low values
+static uint32_t rng_below(struct rng *r, uint32_t n)
+{
+    uint32_t min = -n % n;
+    uint32_t x;
+    do {
+        x = rng_next(r);
+    } while (x < min);
+    return x % n;
+}
 
-    char *quote = strstr(words, "'");
-    while (quote != NULL) {
-        quote[0] = 'Q';
-        quote = strstr(words, "'");
+static char *secret_new(struct rng *r, int num_words)
+{
+    char *secret = malloc(num_words * (DICT_WORD_MAX + 1) + 1);
+    if (!secret)
+        return NULL;
+    char *out = secret;
+    for (int w = 0; w < num_words; ++w) {
+        const char *word = &dict.words[dict.offsets[rng_below(r, dict.count)]];
+        const char *end = memchr(word, '\n', &dict.words[dict.size] - word);
+        size_t len = end ? (size_t)(end - word) : (size_t)(&dict.words[dict.size] - word);
+        if (w)
+            *out++ = '-';
+        //no quotes, they'd need escaping on the receiving end's command line
+        for (size_t i = 0; i < len && i < DICT_WORD_MAX; ++i)
+            *out++ = word[i] == '\'' ? 'Q' : word[i];
     }
+    *out = '\0';
+    return secret;
+}
 
-    return words;
+char **make_secrets(int n, int num_words)
+{
+    pthread_once(&dict_once, dict_load);
+    if (!dict.words) {
+        fprintf(stderr, "Failed to load %s\n", DICT_PATH);
+        return NULL;
+    }
+    char **secrets = calloc(n, sizeof(char *));
+    if (!secrets)
+        return NULL;
+    struct rng r = { .left = 0 };
+    for (int i = 0; i < n; ++i) {
+        if (!(secrets[i] = secret_new(&r, num_words))) {
+            free_secrets(secrets, i);
+            secrets = NULL;
+            break;
+        }
+    }
+    //what's left of the pool is as secret as the words
+    explicit_bzero(&r, sizeof(r));
+    return secrets;
 }
 
-char *make_hash(const char *secret)
+void free_secrets(char **secrets, int n)
 {
-    SHA_CTX ctx;
-    SHA1_Init(&ctx);
-    SHA1_Update(&ctx, secret, strlen(secret));
-    unsigned char rawhash[SHA_DIGEST_LENGTH];
-    SHA1_Final(rawhash, &ctx);
+    if (!secrets)
+        return;
+    for (int i = 0; i < n; ++i)
+        free(secrets[i]);
+    free(secrets);
+}
+
+char *make_secret(int num_words)
+{
+    char **one = make_secrets(1, num_words);
+    if (!one)
+        return NULL;
+    char *secret = one[0];
+    free(one);
+    return secret;
+}
 
-    unsigned char *readable_hash = malloc(SHA_DIGEST_LENGTH*2 + 1);
+//hex, the way the relay takes it
+static char *hash_hex(const unsigned char *rawhash)
+{
+    char *readable_hash = malloc(SHA_DIGEST_LENGTH*2 + 1);
+    if (!readable_hash)
+        return NULL;
     for (int i=0; i < SHA_DIGEST_LENGTH; ++i) {
-        sprintf((char*)&(readable_hash[i*2]), "%02x", rawhash[i]);
+        sprintf(&readable_hash[i*2], "%02x", rawhash[i]);
     }
     readable_hash[SHA_DIGEST_LENGTH*2 - 1] = '\0';
 
     return readable_hash;
 }
 
+char *make_hash(const char *secret)
+{
+    unsigned char rawhash[SHA_DIGEST_LENGTH];
+    if (!PKCS5_PBKDF2_HMAC(secret, strlen(secret), (const unsigned char *)HASH_KDF_LABEL,
+                           strlen(HASH_KDF_LABEL), HASH_KDF_ITERATIONS, EVP_sha256(),
+                           SHA_DIGEST_LENGTH, rawhash)) {
+        fprintf(stderr, "Failed to derive hash\n");
+        return NULL;
+    }
+    return hash_hex(rawhash);
+}
+
+char *make_stream_hash(const char *hash, int stream)
+{
+    if (!stream)
+        return strdup(hash);
+    //the secret's hash is already stretched, one more SHA-1 keeps the streams
+    //apart without paying for it again
+    char tagged[SHA_DIGEST_LENGTH*2 + 16];
+    snprintf(tagged, sizeof(tagged), "%s#%d", hash, stream);
+    unsigned char rawhash[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char *)tagged, strlen(tagged), rawhash);
+    return hash_hex(rawhash);
+}
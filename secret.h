@@ -2,6 +2,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define DICT_PATH "/usr/share/dict/words"
+//words longer than this are left out of secrets
+#define DICT_WORD_MAX 44
+
+//num_words dictionary words joined with '-', or NULL without a dictionary
 char *make_secret(int num_words);
+//n secrets at once for tools that start many transfers, free them with
+//free_secrets. NULL without a dictionary.
+char **make_secrets(int n, int num_words);
+void free_secrets(char **secrets, int n);
+//The hash the relay pairs by, as hex. PBKDF2 of the secret (see
+//HASH_KDF_LABEL), slow on purpose so the relay can't get at the secret, and
+//the key derived from it, by trying dictionary words against it. NULL on
+//failure.
 char *make_hash(const char *secret);
-
+//hash for one stream of a multi stream transfer from the secret's make_hash,
+//which is what stream 0 uses
+char *make_stream_hash(const char *hash, int stream);
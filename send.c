@@ -3,42 +3,142 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <netdb.h>
 #include <unistd.h>
 #include <libgen.h>
-#include <openssl/sha.h>
-#include <sys/socket.h>
 #include <sys/stat.h>
-#include <arpa/inet.h>
 
-#include "secret.h"
+#include "relayclient.h"
 
-static const uint32_t identity = 0xadeafbee;
-static const uint32_t relayid  = 0xdeadbeef;
+void help()
+{
+    printf("usage: ./send [-e aes|chacha] [-f <receivers>] [-m auto|sendfile|zerocopy|copy]\n"
+           "              [-n <streams>] [-p bulk|normal|high] [-r] [-s <secret>]\n"
+           "              [-t <profile>[:<MB/s>]] [-v] [-z lz4|zstd|zlib]\n"
+           "              <relay-host>:<relay-port> <file-or-directory>...\n");
+}
 
+static int verbose = 0;
+
+static const char *const ciphers[] = {
+    [RELAY_CIPHER_NONE] = "none",
+    [RELAY_CIPHER_AES_GCM] = "aes",
+    [RELAY_CIPHER_CHACHA20] = "chacha",
+};
+static const char *const modes[] = {
+    [RELAY_SEND_AUTO] = "auto",
+    [RELAY_SEND_SENDFILE] = "sendfile",
+    [RELAY_SEND_ZEROCOPY] = "zerocopy",
+    [RELAY_SEND_COPY] = "copy",
+};
+static const char *const codecs[] = {
+    [RELAY_CODEC_NONE] = "none",
+    [RELAY_CODEC_LZ4] = "lz4",
+    [RELAY_CODEC_ZSTD] = "zstd",
+    [RELAY_CODEC_ZLIB] = "zlib",
+};
+#define PARSE(names, arg) parse(names, sizeof(names) / sizeof(names[0]), arg)
+
+//the index of arg in names, or -1
+static int parse(const char *const *names, int n, const char *arg)
+{
+    for (int i = 0; i < n; ++i)
+        if (!strcmp(arg, names[i]))
+            return i;
+    return -1;
+}
 
-void help()
+static void sent(struct relay_session *s, int status, void *arg)
 {
-    printf("usage: ./send <relay-host>:<relay-port> <file-to-send>\n");
+    if (verbose && relay_session_tuning(s)[0])
+        fprintf(stderr, "socket tuning %s\n", relay_session_tuning(s));
+    *(int *)arg = status < 0;
 }
 
 int main(int argc, char *argv[0])
 {
-    //read host and port from args. would normally use getopt here, but this is
-    //a simple program with no configurable options
-    if (argc != 3) {
-        help();
-        exit(1);
+    //read options, host and port from args
+    int mode = RELAY_SEND_AUTO;
+    int nstreams = 1;
+    int resumable = 0;
+    int fanout = 1;
+    int priority = RELAY_PRIORITY_NORMAL;
+    int codec = RELAY_CODEC_NONE;
+    int cipher = RELAY_CIPHER_NONE;
+    char *secret = NULL;
+    int tuning = RELAY_TUNING_AUTO;
+    uint64_t link_rate = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:f:m:n:p:rs:t:vz:")) != -1) {
+        switch (opt) {
+        case 'e':
+            cipher = PARSE(ciphers, optarg);
+            if (cipher < 0) {
+                help();
+                exit(1);
+            }
+            break;
+        case 'f':
+            //that many receivers all get the file, from one upload
+            fanout = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            mode = PARSE(modes, optarg);
+            if (mode < 0) {
+                help();
+                exit(1);
+            }
+            break;
+        case 'n':
+            //0 picks the number of streams from the round trip time
+            nstreams = strtol(optarg, NULL, 10);
+            break;
+        case 'p':
+            if (!strcmp(optarg, "bulk"))
+                priority = RELAY_PRIORITY_BULK;
+            else if (!strcmp(optarg, "normal"))
+                priority = RELAY_PRIORITY_NORMAL;
+            else if (!strcmp(optarg, "high"))
+                priority = RELAY_PRIORITY_HIGH;
+            else {
+                help();
+                exit(1);
+            }
+            break;
+        case 'r':
+            resumable = 1;
+            break;
+        case 's':
+            //the secret of an interrupted transfer, to resume it
+            secret = strdup(optarg);
+            break;
+        case 't':
+            tuning = relay_tuning_parse(optarg, &link_rate);
+            if (tuning < 0) {
+                help();
+                exit(1);
+            }
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'z':
+            codec = PARSE(codecs, optarg);
+            if (codec < 0) {
+                help();
+                exit(1);
+            }
+            break;
+        default:
+            help();
+            exit(1);
+        }
     }
-    char *address = argv[1];
-    char *filename = strdup(argv[2]);
-    char *host = strtok(address, ":");
-    char *portstr = strtok(NULL, ":");
-    if (!host || !portstr) {
-        fprintf(stderr, "Invalid host or port\n");
+    if (argc - optind < 2) {
+        help();
         exit(1);
     }
-    int port = strtol(portstr, NULL, 10);
+    char *address = argv[optind];
+    char *filename = argv[optind + 1];
 
     //Stat the file to ensure it exists and is readable before bothering with
     //anything else
@@ -48,124 +148,53 @@ int main(int argc, char *argv[0])
         exit(1);
     }
 
-    //Generate a secret code and print it. Note: This is the only output on stdout!
-    char *secret = make_secret(4);
-    printf("%s\n", secret);
-    fflush(stdout);
-
-    //Hash the secret so we never transmit the secret itself
-    char *hash = make_hash(secret);
-
-    //Get the IP of the host if a hostname was provided
-    struct hostent *he;
-    he = gethostbyname(host);
-    if (!he) {
-        fprintf(stderr, "Failed getting IP of %s\n", host);
-        exit(1);
-    }
-    struct in_addr **addr_list;
-    addr_list = (struct in_addr **) he->h_addr_list;
-    in_addr_t host_ip = inet_addr(inet_ntoa(*addr_list[0]));
-
-    //Create the network socket and connect to host and port
-    int sd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sd < 0) {
-        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
-        exit(1);
-    }
-    struct sockaddr_in addr;
-    addr.sin_addr.s_addr = host_ip;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        fprintf(stderr, "Failed to connect to relay\n");
-        exit(1);
-    }
-
-    //Let server identify itself
-    uint32_t response;
-    recv(sd, &response, 4, 0);
-    if (response != relayid) {
-        fprintf(stderr, "Server didn't respond correctly\n");
-        close(sd);
-        exit(1);
-    }
-
-    //Identify us to the relay server as a sender
-    if (send(sd, &identity, 4, 0) != 4) {
-        fprintf(stderr, "Failed to send identifier to relay\n");
-        close(sd);
-        exit(1);
-    }
-
-    //Send the secret code hash to pair us with a receiver
-    if (send(sd, hash, SHA_DIGEST_LENGTH*2, 0) != SHA_DIGEST_LENGTH*2) {
-        fprintf(stderr, "Failed to send hash to relay\n");
-        close(sd);
-        exit(1);
+    struct relay_send_opts o;
+    memset(&o, 0, sizeof(o));
+    o.secret = secret;
+    o.streams = nstreams;
+    o.resumable = resumable;
+    o.fanout = fanout;
+    o.priority = priority;
+    o.codec = codec;
+    o.cipher = cipher;
+    o.mode = mode;
+    o.tuning = tuning;
+    o.link_rate = link_rate;
+
+    //Directories and several files go as one batch over a single stream,
+    //instead of a connection each
+    int fd = -1;
+    if (argc - optind > 2 || S_ISDIR(file_info.st_mode)) {
+        o.paths = (const char *const *)&argv[optind + 1];
+        o.npaths = argc - optind - 1;
+    } else {
+        fd = open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
+            exit(1);
+        }
+        o.fd = fd;
+        o.size = file_info.st_size;
+        o.name = basename(filename);
     }
 
-    //Send the filename
-    char *base = basename(filename);
-    uint16_t len = strlen(base) + 1;
-    uint16_t fsize = htons(len);
-    if (send(sd, &fsize, 2, 0) != 2) {
-        fprintf(stderr, "Failed to send size to relay\n");
-        close(sd);
+    struct relay_client *c = relay_client_new(address);
+    if (!c)
         exit(1);
-    }
-    if (send(sd, base, len, 0) != len) {
-        fprintf(stderr, "Failed to send filename to relay\n");
-        close(sd);
+    int ret = 1;
+    struct relay_session *s = relay_send(c, &o, sent, &ret);
+    if (!s)
         exit(1);
-    }
 
-    //Open the input file
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
-        goto cleanup_exit;
-    }
-
-    //Read and write a small amount (a kernel page size maybe) from the input
-    //file to the output socket.
-    //TODO: We can encrypt the data here with a simple algorithm based on the
-    //shared secret. For each byte, add the uchar value of subsequent
-    //characters in the secret, allowing overflow to wrap back around. The
-    //receiving end would "unwrap" bytes the same way.
-    char cpbuf[8192];
-    while (1) {
-        ssize_t rres = read(fd, cpbuf, 8192);
-        if (rres < 0) {
-            if (errno == EAGAIN) {
-                fprintf(stderr, "EAGAIN\n");
-                continue;
-            } else {
-                fprintf(stderr, "Fail: %s\n", strerror(errno));
-                break;
-            }
-        } else if (rres == 0) {
-            break;
-        }
-        ssize_t wres;
-        ssize_t bw = 0;
-        do {
-            ssize_t wres = send(sd, &cpbuf[bw], rres-bw, 0);
-            if (wres < 0) {
-                perror("Failed to send data");
-                break;
-            } else if (wres == 0) {
-                fprintf(stderr, "Sent nothing...\n");
-            }
-            bw += wres;
-        } while (bw < rres);
-    }
-
-    close(fd);
-cleanup_exit:
-    close(sd);
+    //Print the secret code. Note: This is the only output on stdout!
+    printf("%s\n", relay_session_secret(s));
+    fflush(stdout);
 
-    free(filename);
+    while (relay_client_run(c, -1) > 0)
+        ;
+    relay_client_free(c);
+    if (fd >= 0)
+        close(fd);
     free(secret);
-    free(hash);
+    return ret;
 }
@@ -0,0 +1,771 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/limits.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "budget.h"
+#include "log.h"
+#include "protocol.h"
+#include "spool.h"
+#include "stats.h"
+#include "timerwheel.h"
+#include "util.h"
+
+#define SPOOL_EVENTS 256
+//rounds an upload or download gets per wakeup before the others get a go
+#define SPOOL_BUDGET 16
+//largest splice or sendfile per round, also the size asked of the spool pipe
+#define SPOOL_CHUNK (256 * 1024)
+//an upload's hold on the spool cap grows this much at a time past its size
+#define SPOOL_GROW (1024 * 1024)
+
+enum spool_state {
+    SPOOL_NEW = 0,        //set up, the upload hasn't started
+    SPOOL_FILLING,        //reading the sender's data
+    SPOOL_STORED,         //all in, waiting for the receiver
+    SPOOL_SERVING,        //sending it to the receiver
+};
+
+struct spool_entry {
+    struct transfer_info *tr; //the sender's, with the receiver's fd once paired
+    int state;
+    //under the lock
+    int claimed;          //a receiver was paired with it
+    int failed;           //the upload failed after a receiver was paired with it
+    int stored;           //on a stored list
+    int kicked;           //on the kick list
+    char *slot;           //arena slot holding the data, NULL for a spool file
+    int fd;               //the spool file
+    uint64_t size;        //bytes spooled
+    uint64_t reserved;    //bytes of the spool cap held for the file
+    uint64_t off;         //bytes served
+    uint64_t active;      //last time any data moved
+    uint64_t stored_ms;
+    char hdr[2 + PATH_MAX];
+    size_t hdrlen;
+    size_t hdroff;
+    struct timer idle;
+    LIST_ENTRY(spool_entry) entries;
+    TAILQ_ENTRY(spool_entry) stored_link;
+    STAILQ_ENTRY(spool_entry) kick_link;
+};
+
+static int running = 0;
+static char spool_dir[PATH_MAX];
+static struct spool_limits limits;
+static struct rendezvous *table;
+static pthread_t thread;
+static struct loop loop;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, spool_entry) entries = LIST_HEAD_INITIALIZER(entries);
+//uploads waiting for their receiver, oldest first, in files and in the arena
+static TAILQ_HEAD(stored_list, spool_entry) stored[2] = {
+    TAILQ_HEAD_INITIALIZER(stored[0]), TAILQ_HEAD_INITIALIZER(stored[1]) };
+//entries for the spool thread to look at, started uploads and claimed ones
+static STAILQ_HEAD(, spool_entry) kicks = STAILQ_HEAD_INITIALIZER(kicks);
+static uint64_t used = 0;         //spool cap held
+static uint64_t stored_bytes = 0; //of that, by stored files that can be evicted
+static char *arena = NULL;
+static int *free_slots = NULL;
+static int nfree = 0;
+static int nslots = 0;
+
+//spool thread only
+static struct timer_wheel wheel;
+static uint64_t now = 0;
+static int spool_pipe[2] = { -1, -1 };
+static size_t pipe_size = 0;
+
+//An unlinked file in the spool directory, so nothing is left behind however
+//the relay goes away.
+static int spool_file(void)
+{
+    int fd = open(spool_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0)
+        return fd;
+    //filesystems without O_TMPFILE
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.spool-XXXXXX", spool_dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0)
+        unlink(path);
+    return fd;
+}
+
+//the following take the lock held
+
+static void kick_locked(struct spool_entry *e)
+{
+    if (e->kicked)
+        return;
+    e->kicked = 1;
+    STAILQ_INSERT_TAIL(&kicks, e, kick_link);
+}
+
+static void unstore_locked(struct spool_entry *e)
+{
+    if (!e->stored)
+        return;
+    TAILQ_REMOVE(&stored[e->slot != NULL], e, stored_link);
+    e->stored = 0;
+    if (!e->slot)
+        stored_bytes -= e->reserved;
+}
+
+//give back the entry's share of the spool
+static void entry_release_locked(struct spool_entry *e)
+{
+    unstore_locked(e);
+    LIST_REMOVE(e, entries);
+    used -= e->reserved;
+    e->reserved = 0;
+    if (e->slot)
+        free_slots[nfree++] = (e->slot - arena) / SPOOL_SLOT;
+    e->slot = NULL;
+}
+
+//Free the entry and close its connections. The transfer info keeps the
+//table's reference if it still has one.
+static void entry_free_locked(struct spool_entry *e)
+{
+    entry_release_locked(e);
+    //a receiver may have claimed it in the same round it failed
+    if (e->kicked) {
+        STAILQ_REMOVE(&kicks, e, spool_entry, kick_link);
+        e->kicked = 0;
+    }
+    if (e->fd >= 0)
+        close(e->fd);
+    budget_close(e->tr->infd);
+    budget_close(e->tr->outfd);
+    e->tr->infd = e->tr->outfd = -1;
+    e->tr->spool = NULL;
+    transfer_info_put(e->tr);
+    free(e);
+}
+
+//Drop a stored upload nobody has claimed, unless a receiver was paired with
+//it in the meantime, in which case it's on its way to spool_serve.
+static void evict_locked(struct spool_entry *e, int counter)
+{
+    unstore_locked(e);
+    if (rendezvous_remove(table, &e->tr->node) < 0)
+        return;
+    log_limited(LEVEL_WARN, "Spooled upload with hash %s %s", e->tr->hash,
+                counter == STAT_SPOOL_EXPIRED ? "expired" : "evicted to make room");
+    stats_inc(STAT_SENDERS_UNPARKED);
+    stats_inc(counter);
+    transfer_info_put(e->tr);
+    entry_free_locked(e);
+}
+
+//Hold n more bytes of the spool cap, evicting the oldest stored files to make
+//room if that's enough. Returns 0 or -1.
+static int reserve_locked(uint64_t n)
+{
+    if (used - stored_bytes + n > limits.max_bytes)
+        return -1;
+    while (used + n > limits.max_bytes && !TAILQ_EMPTY(&stored[0]))
+        evict_locked(TAILQ_FIRST(&stored[0]), STAT_SPOOL_EVICTED);
+    if (used + n > limits.max_bytes)
+        return -1;
+    used += n;
+    return 0;
+}
+
+static void entry_free(struct spool_entry *e)
+{
+    pthread_mutex_lock(&lock);
+    entry_free_locked(e);
+    pthread_mutex_unlock(&lock);
+}
+
+//Grow the upload's hold on the spool cap to total bytes, as far as its quota
+//allows. Returns -1 if it can't grow past what it already has.
+static int entry_reserve(struct spool_entry *e, uint64_t total)
+{
+    if (total > limits.quota)
+        total = limits.quota;
+    if (total <= e->size)
+        return -1;
+    if (total <= e->reserved)
+        return 0;
+    pthread_mutex_lock(&lock);
+    int res = reserve_locked(total - e->reserved);
+    if (res == 0)
+        e->reserved = total;
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+static void transfer_done(struct spool_entry *e, int failed)
+{
+    stats_inc(STAT_TRANSFERS_FINISHED);
+    if (failed)
+        stats_inc(STAT_TRANSFERS_FAILED);
+    stats_observe(STAT_TRANSFER_TIME, now - e->tr->started_ms);
+}
+
+//Give up on an upload or a download, the pumps have said why.
+static void entry_fail(struct spool_entry *e)
+{
+    timer_del(&wheel, &e->idle);
+    if (e->state == SPOOL_SERVING) {
+        transfer_done(e, 1);
+        entry_free(e);
+        return;
+    }
+
+    stats_inc(STAT_SPOOL_FAILED);
+    budget_close(e->tr->infd);
+    e->tr->infd = -1;
+    pthread_mutex_lock(&lock);
+    if (e->claimed) {
+        entry_free_locked(e);
+    } else if (rendezvous_remove(table, &e->tr->node) == 0) {
+        stats_inc(STAT_SENDERS_UNPARKED);
+        transfer_info_put(e->tr);
+        entry_free_locked(e);
+    } else {
+        //a receiver was just paired with it, spool_serve kicks it over to go
+        e->failed = 1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void idle_expired(struct timer *t)
+{
+    struct spool_entry *e = (struct spool_entry *)((char *)t - offsetof(struct spool_entry, idle));
+    if (now < e->active + limits.idle_ms) {
+        timer_add(&wheel, &e->idle, now, e->active + limits.idle_ms - now, idle_expired);
+        return;
+    }
+    log_limited(LEVEL_WARN, "%s with hash %s idle for %d seconds, dropping it",
+                e->state == SPOOL_FILLING ? "Upload" : "Spooled download",
+                e->tr->hash, limits.idle_ms / 1000);
+    if (e->state == SPOOL_SERVING)
+        stats_inc(STAT_TRANSFERS_IDLE);
+    entry_fail(e);
+}
+
+static int entry_watch(struct spool_entry *e, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = e;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("Failed epoll_ctl on spooled connection (%s)", strerror(errno));
+        return -1;
+    }
+    e->active = now;
+    if (limits.idle_ms)
+        timer_add(&wheel, &e->idle, now, limits.idle_ms, idle_expired);
+    return 0;
+}
+
+//read and throw away whatever a failed write left in the pipe
+static void pipe_flush(void)
+{
+    while (read(spool_pipe[0], loop.copybuf, LOOP_COPY_CHUNK) > 0)
+        ;
+}
+
+//socket -> pipe -> spool file, the pipe is empty before and after
+static ssize_t splice_in(struct spool_entry *e, int in, size_t want)
+{
+    if (want > pipe_size)
+        want = pipe_size;
+    ssize_t n = splice(in, NULL, spool_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0)
+        return n;
+    loff_t off = e->size;
+    size_t left = n;
+    while (left) {
+        ssize_t m = splice(spool_pipe[0], NULL, e->fd, &off, left, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m < 0 && errno == EINVAL) {
+            //the filesystem doesn't take splice, empty the pipe by hand and
+            //copy from here on
+            while (left) {
+                ssize_t r = read(spool_pipe[0], loop.copybuf, left < LOOP_COPY_CHUNK ? left : LOOP_COPY_CHUNK);
+                if (r <= 0 || pwrite_all(e->fd, loop.copybuf, r, off) < 0)
+                    break;
+                left -= r;
+                off += r;
+            }
+            pipe_flush();
+            close(spool_pipe[0]);
+            close(spool_pipe[1]);
+            spool_pipe[0] = spool_pipe[1] = -1;
+            log_info("Spool directory doesn't support splice, copying instead");
+            return left ? -1 : n;
+        }
+        if (m <= 0) {
+            if (!m)
+                errno = EIO;
+            int err = errno;
+            pipe_flush();
+            errno = err;
+            return -1;
+        }
+        left -= m;
+    }
+    return n;
+}
+
+static ssize_t copy_in(struct spool_entry *e, int in, size_t want)
+{
+    ssize_t n = recv(in, loop.copybuf, want < LOOP_COPY_CHUNK ? want : LOOP_COPY_CHUNK, MSG_DONTWAIT);
+    if (n > 0 && pwrite_all(e->fd, loop.copybuf, n, e->size) < 0)
+        return -1;
+    return n;
+}
+
+//The upload outgrew its arena slot, move it to a file.
+static int spill(struct spool_entry *e)
+{
+    e->fd = spool_file();
+    if (e->fd < 0) {
+        log_limited(LEVEL_WARN, "Failed to create spool file: %s", strerror(errno));
+        return -1;
+    }
+    if (entry_reserve(e, e->size + SPOOL_GROW) < 0) {
+        log_limited(LEVEL_WARN, "Spool full, dropping upload with hash %s", e->tr->hash);
+        return -1;
+    }
+    if (pwrite_all(e->fd, e->slot, e->size, 0) < 0) {
+        log_limited(LEVEL_WARN, "Failed to write spool file: %s", strerror(errno));
+        return -1;
+    }
+    pthread_mutex_lock(&lock);
+    free_slots[nfree++] = (e->slot - arena) / SPOOL_SLOT;
+    e->slot = NULL;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+//Move whatever the sender has into the spool. Returns 1 once it's all in, 0
+//to wait for more and -1 on error.
+static int upload_pump(struct spool_entry *e)
+{
+    int in = e->tr->infd;
+    for (int round = 0; round < SPOOL_BUDGET; ++round) {
+        ssize_t n;
+        if (e->slot && e->size == SPOOL_SLOT && spill(e) < 0)
+            return -1;
+        if (e->slot) {
+            n = recv(in, &e->slot[e->size], SPOOL_SLOT - e->size, MSG_DONTWAIT);
+        } else {
+            if (e->size == e->reserved && entry_reserve(e, e->size + SPOOL_GROW) < 0) {
+                //out of room, which only matters if there's more to come
+                char c;
+                n = recv(in, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+                if (n == 0)
+                    return 1;
+                if (n < 0)
+                    goto check_errno;
+                log_limited(LEVEL_WARN, "Upload with hash %s is over %s, dropping it", e->tr->hash,
+                            e->size >= limits.quota ? "the spool quota" : "what the spool has room for");
+                return -1;
+            }
+            size_t want = e->reserved - e->size < SPOOL_CHUNK ? e->reserved - e->size : SPOOL_CHUNK;
+            n = spool_pipe[0] >= 0 ? splice_in(e, in, want) : copy_in(e, in, want);
+        }
+        if (n < 0)
+            goto check_errno;
+        if (n == 0)
+            return 1;
+        e->size += n;
+        e->active = now;
+        stats_add(STAT_SPOOL_BYTES, n);
+    }
+    return 0;
+
+check_errno:
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return 0;
+    log_limited(LEVEL_WARN, "Spooling upload with hash %s failed: %s", e->tr->hash, strerror(errno));
+    return -1;
+}
+
+//Send the sender's field and then the data to the receiver. Returns 1 once
+//it's all out, 0 to wait for room and -1 on error.
+static int serve_pump(struct spool_entry *e)
+{
+    int out = e->tr->outfd;
+    for (int round = 0; round < SPOOL_BUDGET; ++round) {
+        ssize_t n;
+        if (e->hdroff < e->hdrlen) {
+            n = send(out, &e->hdr[e->hdroff], e->hdrlen - e->hdroff, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0)
+                goto check_errno;
+            e->hdroff += n;
+            continue;
+        }
+        uint64_t left = e->size - e->off;
+        if (!left)
+            return 1;
+        if (e->slot) {
+            n = send(out, &e->slot[e->off], left, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } else {
+            off_t off = e->off;
+            n = sendfile(out, e->fd, &off, left < SPOOL_CHUNK ? left : SPOOL_CHUNK);
+            if (n == 0) {
+                log_limited(LEVEL_WARN, "Spool file for hash %s is short", e->tr->hash);
+                return -1;
+            }
+        }
+        if (n < 0)
+            goto check_errno;
+        e->off += n;
+        e->active = now;
+        stats_add(STAT_BYTES, n);
+    }
+    return 0;
+
+check_errno:
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return 0;
+    log_limited(LEVEL_WARN, "Serving spooled upload with hash %s failed: %s", e->tr->hash,
+                strerror(errno));
+    return -1;
+}
+
+static void upload_start(struct spool_entry *e)
+{
+    e->state = SPOOL_FILLING;
+    if (!e->slot && (e->fd = spool_file()) < 0) {
+        log_limited(LEVEL_WARN, "Failed to create spool file: %s", strerror(errno));
+        entry_fail(e);
+        return;
+    }
+    if (entry_watch(e, e->tr->infd, EPOLLIN) < 0)
+        entry_fail(e);
+}
+
+static void serve_start(struct spool_entry *e)
+{
+    e->state = SPOOL_SERVING;
+    uint16_t len = htons(e->tr->fnlen);
+    memcpy(e->hdr, &len, 2);
+    memcpy(&e->hdr[2], e->tr->filename, e->tr->fnlen);
+    e->hdrlen = 2 + e->tr->fnlen;
+    e->tr->started_ms = now;
+    stats_inc(STAT_TRANSFERS_STARTED);
+    if (entry_watch(e, e->tr->outfd, EPOLLOUT) < 0)
+        entry_fail(e);
+}
+
+static void upload_done(struct spool_entry *e)
+{
+    timer_del(&wheel, &e->idle);
+    budget_close(e->tr->infd);
+    e->tr->infd = -1;
+    e->state = SPOOL_STORED;
+    e->stored_ms = now;
+    stats_inc(STAT_SPOOLED);
+    log_debug("spooled %llu bytes with hash %s%s", (unsigned long long)e->size, e->tr->hash,
+              e->slot ? " in memory" : "");
+
+    pthread_mutex_lock(&lock);
+    //hand back the room the upload didn't use
+    used -= e->reserved - (e->slot ? 0 : e->size);
+    e->reserved = e->slot ? 0 : e->size;
+    int claimed = e->claimed;
+    if (!claimed) {
+        TAILQ_INSERT_TAIL(&stored[e->slot != NULL], e, stored_link);
+        e->stored = 1;
+        if (!e->slot)
+            stored_bytes += e->reserved;
+    }
+    pthread_mutex_unlock(&lock);
+    if (claimed)
+        serve_start(e);
+}
+
+static void serve_done(struct spool_entry *e)
+{
+    timer_del(&wheel, &e->idle);
+    log_debug("served %llu spooled bytes with hash %s", (unsigned long long)e->size, e->tr->hash);
+    transfer_done(e, 0);
+    entry_free(e);
+}
+
+//An upload to start, or a receiver claiming one.
+static void entry_kicked(struct spool_entry *e)
+{
+    if (e->failed) {
+        if (e->claimed)
+            entry_free(e);
+    } else if (e->state == SPOOL_NEW) {
+        upload_start(e);
+    } else if (e->state == SPOOL_STORED && e->claimed) {
+        serve_start(e);
+    }
+}
+
+//uploads nobody came for in time
+static void expire(void)
+{
+    if (!limits.ttl_ms)
+        return;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < 2; ++i) {
+        struct spool_entry *e;
+        while ((e = TAILQ_FIRST(&stored[i])) && e->stored_ms + limits.ttl_ms <= now)
+            evict_locked(e, STAT_SPOOL_EXPIRED);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void *spool_main(void *opaque)
+{
+    pid_t tid = syscall(SYS_gettid);
+    log_info("spool started as thread %d", tid);
+
+    struct epoll_event events[SPOOL_EVENTS];
+    while (!stop) {
+        now = now_ms();
+        int timeout = timer_wheel_timeout(&wheel, now, 100);
+        int nfds = loop_wait(&loop, events, SPOOL_EVENTS, timeout);
+        if (nfds < 0)
+            break;
+        now = now_ms();
+        for (int n = 0; n < nfds; n++) {
+            struct spool_entry *e = (struct spool_entry *)events[n].data.ptr;
+            //Only the entry itself is ever freed while handling its event.
+            //Evicting makes room with stored uploads, which have nothing
+            //left in the epoll set.
+            int filling = e->state == SPOOL_FILLING;
+            int res = filling ? upload_pump(e) : serve_pump(e);
+            if (res < 0)
+                entry_fail(e);
+            else if (res > 0 && filling)
+                upload_done(e);
+            else if (res > 0)
+                serve_done(e);
+        }
+
+        for (;;) {
+            pthread_mutex_lock(&lock);
+            struct spool_entry *e = STAILQ_FIRST(&kicks);
+            if (e) {
+                STAILQ_REMOVE_HEAD(&kicks, kick_link);
+                e->kicked = 0;
+            }
+            pthread_mutex_unlock(&lock);
+            if (!e)
+                break;
+            entry_kicked(e);
+        }
+        expire();
+        timer_wheel_advance(&wheel, now);
+    }
+    log_info("spool exiting");
+    return NULL;
+}
+
+int spool_start(const char *dir, const struct spool_limits *l, struct rendezvous *rv)
+{
+    struct stat st;
+    if (stat(dir, &st) < 0) {
+        log_error("Spool directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        log_error("Spool directory %s isn't a directory", dir);
+        return -1;
+    }
+    snprintf(spool_dir, sizeof(spool_dir), "%s", dir);
+    limits = *l;
+    table = rv;
+
+    nslots = limits.arena / SPOOL_SLOT;
+    if (nslots) {
+        arena = mmap(NULL, (size_t)nslots * SPOOL_SLOT, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        free_slots = malloc(nslots * sizeof(int));
+        if (arena == MAP_FAILED || !free_slots) {
+            log_error("Insufficient memory for the spool arena");
+            return -1;
+        }
+        //hand out the low slots first
+        for (int i = nslots - 1; i >= 0; --i)
+            free_slots[nfree++] = i;
+    }
+    if (loop_init(&loop, "spool") < 0)
+        return -1;
+    //without a pipe uploads are copied through userspace
+    if (pipe2(spool_pipe, O_CLOEXEC | O_NONBLOCK) == 0) {
+        fcntl(spool_pipe[1], F_SETPIPE_SZ, SPOOL_CHUNK);
+        int size = fcntl(spool_pipe[1], F_GETPIPE_SZ);
+        pipe_size = size > 0 ? size : 65536;
+    }
+    now = now_ms();
+    timer_wheel_init(&wheel, now);
+
+    if (pthread_create(&thread, NULL, spool_main, NULL) != 0) {
+        log_error("Failed to start spool");
+        return -1;
+    }
+    pthread_setname_np(thread, "spool");
+    running = 1;
+    log_info("spooling to %s, %llu MB in all, %llu MB per upload, %d arena slots", spool_dir,
+             (unsigned long long)(limits.max_bytes >> 20), (unsigned long long)(limits.quota >> 20),
+             nslots);
+    return 0;
+}
+
+int spool_prepare(struct transfer_info *tr)
+{
+    if (!running)
+        return -1;
+    uint64_t size;
+    //chunked senders wait for the receiver's field before sending anything
+    if (meta_get_u64(tr->filename, tr->fnlen, META_CHUNK_SIZE, &size) == 0)
+        return -1;
+    //a stream of a larger file carries its range, a batch its stream length
+    if (meta_get_u64(tr->filename, tr->fnlen, META_LENGTH, &size) < 0 &&
+        meta_get_u64(tr->filename, tr->fnlen, META_BATCH, &size) < 0 &&
+        meta_get_u64(tr->filename, tr->fnlen, META_FILE_SIZE, &size) < 0)
+        size = 0;
+    if (size > limits.quota) {
+        log_limited(LEVEL_WARN, "Upload with hash %s is over the spool quota, it waits for its receiver",
+                    tr->hash);
+        return -1;
+    }
+
+    struct spool_entry *e = calloc(1, sizeof(struct spool_entry));
+    if (!e) {
+        log_error("Insufficient memory for spool entry");
+        return -1;
+    }
+    e->tr = tr;
+    e->fd = -1;
+    pthread_mutex_lock(&lock);
+    if (size <= SPOOL_SLOT && nfree) {
+        e->slot = &arena[(size_t)free_slots[--nfree] * SPOOL_SLOT];
+    } else if (reserve_locked(size) == 0) {
+        e->reserved = size;
+    } else {
+        pthread_mutex_unlock(&lock);
+        free(e);
+        log_limited(LEVEL_WARN, "Spool full, upload with hash %s waits for its receiver", tr->hash);
+        return -1;
+    }
+    LIST_INSERT_HEAD(&entries, e, entries);
+    pthread_mutex_unlock(&lock);
+    tr->refs++;
+    tr->spool = e;
+    return 0;
+}
+
+void spool_upload(struct transfer_info *tr)
+{
+    //a receiver may have claimed it already, and the upload failed
+    pthread_mutex_lock(&lock);
+    if (tr->spool)
+        kick_locked(tr->spool);
+    pthread_mutex_unlock(&lock);
+    loop_wake(&loop);
+}
+
+void spool_cancel(struct transfer_info *tr)
+{
+    struct spool_entry *e = tr->spool;
+    if (!e)
+        return;
+    pthread_mutex_lock(&lock);
+    entry_release_locked(e);
+    pthread_mutex_unlock(&lock);
+    free(e);
+    tr->spool = NULL;
+    transfer_info_put(tr);
+}
+
+void spool_serve(struct transfer_info *tr)
+{
+    struct spool_entry *e = tr->spool;
+    pthread_mutex_lock(&lock);
+    unstore_locked(e);
+    e->claimed = 1;
+    kick_locked(e);
+    pthread_mutex_unlock(&lock);
+    loop_wake(&loop);
+    transfer_info_put(tr);
+}
+
+int spool_tmpfile(void)
+{
+    return running ? spool_file() : -1;
+}
+
+int spool_reserve(uint64_t held, uint64_t n)
+{
+    if (!running || held + n > limits.quota)
+        return -1;
+    pthread_mutex_lock(&lock);
+    int res = reserve_locked(n);
+    pthread_mutex_unlock(&lock);
+    return res;
+}
+
+void spool_release(uint64_t n)
+{
+    pthread_mutex_lock(&lock);
+    used -= n;
+    pthread_mutex_unlock(&lock);
+}
+
+void spool_stats(uint64_t *bytes, uint64_t *max, int *slots, int *n)
+{
+    pthread_mutex_lock(&lock);
+    *bytes = used;
+    *max = running ? limits.max_bytes : 0;
+    *slots = nslots - nfree;
+    *n = nslots;
+    pthread_mutex_unlock(&lock);
+}
+
+void spool_stop(void)
+{
+    if (!running)
+        return;
+    pthread_join(thread, NULL);
+    running = 0;
+
+    //uploads still parked are taken out of the table here, rather than being
+    //closed by its drain
+    pthread_mutex_lock(&lock);
+    while (!LIST_EMPTY(&entries)) {
+        struct spool_entry *e = LIST_FIRST(&entries);
+        if (!e->claimed && !e->failed && rendezvous_remove(table, &e->tr->node) == 0)
+            transfer_info_put(e->tr);
+        entry_free_locked(e);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (spool_pipe[0] >= 0) {
+        close(spool_pipe[0]);
+        close(spool_pipe[1]);
+    }
+    loop_close(&loop);
+    if (arena)
+        munmap(arena, (size_t)nslots * SPOOL_SLOT);
+    free(free_slots);
+}
@@ -0,0 +1,62 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdint.h>
+
+#include "relay.h"
+
+//Store and forward. With a spool, a sender that gets parked because its
+//receiver isn't there yet uploads right away instead of holding its connection
+//open, and stays parked in the rendezvous table under the spool's own expiry.
+//A receiver pairing with it later is served from the spool. Uploads small
+//enough to fit a slot of a fixed memory arena are kept there, the rest are
+//spliced into unlinked files in the spool directory and served with sendfile.
+//One thread moves all of it.
+
+struct spool_limits {
+    uint64_t max_bytes;   //cap on the spool files, all uploads together
+    uint64_t quota;       //most a single upload may spool
+    uint64_t arena;       //size of the memory arena
+    int ttl_ms;           //how long an upload waits for its receiver, 0 forever
+    int idle_ms;          //uploads and downloads moving no data are dropped, 0 never
+};
+
+//small uploads take one arena slot each
+#define SPOOL_SLOT (64 * 1024)
+
+//Start the spool thread, keeping files in dir. Returns 0 on success.
+int spool_start(const char *dir, const struct spool_limits *limits, struct rendezvous *table);
+
+//Set up spooling for a sender that's about to be parked, holding room for the
+//size its field announces. Returns 0 and sets tr->spool if the spool takes it,
+//-1 if it should wait for its receiver as usual (no spool, a chunked transfer
+//that needs the receiver's answer first, over quota or the spool is full).
+int spool_prepare(struct transfer_info *tr);
+
+//The sender was parked, start the upload. The caller drops the pairing timer,
+//the spool expires the upload itself.
+void spool_upload(struct transfer_info *tr);
+
+//The sender was paired or couldn't be parked after all, forget the spooling.
+void spool_cancel(struct transfer_info *tr);
+
+//A receiver (tr->outfd) was paired with a spooled sender. Takes over the
+//reference the table held and serves the receiver once the upload is in.
+void spool_serve(struct transfer_info *tr);
+
+//For others keeping data in the spool directory, fanout sessions' lag files:
+//an unlinked file in it, -1 without a spool.
+int spool_tmpfile(void);
+//Hold n more bytes of the spool cap for a file already holding held, within
+//the per upload quota. Returns 0 or -1.
+int spool_reserve(uint64_t held, uint64_t n);
+//give back n bytes held with spool_reserve
+void spool_release(uint64_t n);
+
+//spool file bytes held and the cap, arena slots in use and in total, for the stats
+void spool_stats(uint64_t *bytes, uint64_t *max, int *slots, int *nslots);
+
+//stop the thread and drop everything spooled, before the table is drained
+void spool_stop(void);
+
+#endif
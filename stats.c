@@ -0,0 +1,355 @@
+#include <dirent.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "budget.h"
+#include "log.h"
+#include "pipepool.h"
+#include "relay.h"
+#include "spool.h"
+#include "stats.h"
+#include "util.h"
+
+//Threads take slots in the order they first record something. The long lived
+//acceptors and workers come first and get one each, short lived transfer
+//threads (with USE_THREAD_PER_TRANSFER) end up sharing, which is why updates
+//are still atomic adds, just ones that never contend in the common case.
+#define STATS_SLOTS 64
+
+struct stats_slot {
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t buckets[STAT_HISTOGRAMS][STATS_BUCKETS];
+    uint64_t sum[STAT_HISTOGRAMS];
+} __attribute__((aligned(64)));
+
+static struct stats_slot slots[STATS_SLOTS];
+static unsigned int next_slot = 0;
+static __thread struct stats_slot *my_slot = NULL;
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[STAT_COUNTERS] = {
+    { "relay_connections_accepted_total", "Connections accepted" },
+    { "relay_connections_refused_total", "Connections turned away busy for lack of file descriptors" },
+    { "relay_handshakes_failed_total", "Connections dropped during the handshake" },
+    { "relay_handshakes_expired_total", "Handshakes that timed out" },
+    { "relay_senders_total", "Senders that completed the handshake" },
+    { "relay_receivers_total", "Receivers that completed the handshake" },
+    { "relay_senders_parked_total", "Senders parked to wait for their receiver" },
+    { "relay_receivers_parked_total", "Receivers parked to wait for their sender" },
+    { "relay_senders_unparked_total", "Parked senders that stopped waiting" },
+    { "relay_receivers_unparked_total", "Parked receivers that stopped waiting" },
+    { "relay_pairs_total", "Senders and receivers paired up" },
+    { "relay_pairs_expired_total", "Connections that gave up waiting to be paired" },
+    { "relay_pairs_failed_total", "Connections that couldn't be parked or started" },
+    { "relay_transfers_started_total", "Transfers handed to the data plane" },
+    { "relay_transfers_finished_total", "Transfers finished, including failed ones" },
+    { "relay_transfers_failed_total", "Transfers that ended with an error" },
+    { "relay_transfers_idle_total", "Transfers dropped for moving no data" },
+    { "relay_bytes_total", "Bytes relayed from senders to receivers" },
+    { "relay_spooled_total", "Uploads stored in the spool" },
+    { "relay_spool_failed_total", "Uploads dropped before they were all in the spool" },
+    { "relay_spool_evicted_total", "Spooled uploads evicted to make room" },
+    { "relay_spool_expired_total", "Spooled uploads nobody came for in time" },
+    { "relay_spool_bytes_total", "Bytes uploaded into the spool" },
+    { "relay_fanouts_total", "One to many transfers started" },
+    { "relay_fanout_receivers_total", "Receivers taken into fanout sessions" },
+    { "relay_fanout_lagged_total", "Fanout receivers that fell behind onto the lag file" },
+    { "relay_fanout_dropped_total", "Fanout receivers dropped before the end" },
+    { "relay_throttled_total", "Times a transfer had to wait for its bandwidth caps" },
+    { "relay_forwarded_total", "Clients forwarded to the cluster node owning their hash" },
+    { "relay_forwards_failed_total", "Forwarded clients that couldn't be passed on to their node" },
+    { "relay_forwarded_bytes_total", "Bytes moved both ways for forwarded clients" },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} histogram_info[STAT_HISTOGRAMS] = {
+    { "relay_pair_wait_seconds", "Time parked connections waited for the other side" },
+    { "relay_transfer_seconds", "Time from pairing to the end of a transfer" },
+};
+
+static struct stats_slot *slot(void)
+{
+    if (!my_slot)
+        my_slot = &slots[__atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % STATS_SLOTS];
+    return my_slot;
+}
+
+void stats_add(int counter, uint64_t n)
+{
+    __atomic_fetch_add(&slot()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stats_observe(int histogram, uint64_t ms)
+{
+    int b = ms ? 64 - __builtin_clzll(ms) : 0;
+    if (b >= STATS_BUCKETS)
+        b = STATS_BUCKETS - 1;
+    struct stats_slot *s = slot();
+    __atomic_fetch_add(&s->buckets[histogram][b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->sum[histogram], ms, __ATOMIC_RELAXED);
+}
+
+static void stats_collect(struct stats_slot *total)
+{
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < STATS_SLOTS; ++i) {
+        struct stats_slot *s = &slots[i];
+        for (int c = 0; c < STAT_COUNTERS; ++c)
+            total->counters[c] += __atomic_load_n(&s->counters[c], __ATOMIC_RELAXED);
+        for (int h = 0; h < STAT_HISTOGRAMS; ++h) {
+            for (int b = 0; b < STATS_BUCKETS; ++b)
+                total->buckets[h][b] += __atomic_load_n(&s->buckets[h][b], __ATOMIC_RELAXED);
+            total->sum[h] += __atomic_load_n(&s->sum[h], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static int lsd = -1;
+static int http = 0;
+static char sockpath[108];
+static pthread_t thread;
+//bytes per second over the last sampling interval, only touched by the
+//stats thread
+static double byte_rate = 0;
+static uint64_t rate_bytes = 0;
+static uint64_t rate_ms = 0;
+
+static int open_fds(void)
+{
+    DIR *d = opendir("/proc/self/fd");
+    if (!d)
+        return -1;
+    int n = 0;
+    struct dirent *de;
+    while ((de = readdir(d)))
+        if (de->d_name[0] != '.')
+            n++;
+    closedir(d);
+    //not counting the one opendir used
+    return n - 1;
+}
+
+static void gauge(FILE *f, const char *name, const char *help, double value)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %.15g\n", name, help, name, name, value);
+}
+
+static void stats_write(FILE *f)
+{
+    struct stats_slot t;
+    stats_collect(&t);
+    uint64_t *c = t.counters;
+
+    for (int i = 0; i < STAT_COUNTERS; ++i)
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[i].name,
+                counter_info[i].help, counter_info[i].name, counter_info[i].name,
+                (unsigned long long)c[i]);
+
+    gauge(f, "relay_transfers_active", "Transfers in progress",
+          c[STAT_TRANSFERS_STARTED] - c[STAT_TRANSFERS_FINISHED]);
+    gauge(f, "relay_senders_waiting", "Senders waiting for their receiver",
+          c[STAT_SENDERS_PARKED] - c[STAT_SENDERS_UNPARKED]);
+    gauge(f, "relay_receivers_waiting", "Receivers waiting for their sender",
+          c[STAT_RECEIVERS_PARKED] - c[STAT_RECEIVERS_UNPARKED]);
+    gauge(f, "relay_bytes_per_second", "Bytes relayed per second, over the last second",
+          byte_rate);
+    struct rlimit rl;
+    gauge(f, "relay_open_fds", "File descriptors open", open_fds());
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+        gauge(f, "relay_max_fds", "File descriptor limit",
+              rl.rlim_cur == RLIM_INFINITY ? -1 : (double)rl.rlim_cur);
+    struct budget_limits b;
+    budget_limits(&b);
+    gauge(f, "relay_fd_budget", "File descriptors shared by client connections and pipes",
+          b.usable);
+    gauge(f, "relay_fd_budget_connections", "Client connections open",
+          budget_used(BUDGET_CONNECTIONS));
+    gauge(f, "relay_fd_budget_handshakes", "Client connections still handshaking",
+          budget_used(BUDGET_HANDSHAKES));
+    gauge(f, "relay_fd_budget_pipes", "Pipe ends open for splice, tee and fanout",
+          budget_used(BUDGET_PIPES));
+    gauge(f, "relay_transfer_capacity", "Transfers the fd budget holds at once", b.transfers);
+    int live, idle, max;
+    pipe_pool_stats(&live, &idle, &max);
+    gauge(f, "relay_pipes_live", "Pipes in the splice pool, in use or idle", live);
+    gauge(f, "relay_pipes_idle", "Idle pipes kept for the next transfer", idle);
+    gauge(f, "relay_pipes_max", "Most pipes the pool may hold", max);
+    uint64_t spooled, spool_max;
+    int slots, nslots;
+    spool_stats(&spooled, &spool_max, &slots, &nslots);
+    gauge(f, "relay_spool_bytes", "Spool file space held by uploads", spooled);
+    gauge(f, "relay_spool_max_bytes", "Most spool file space uploads may hold", spool_max);
+    gauge(f, "relay_spool_slots_used", "Memory arena slots holding small uploads", slots);
+    gauge(f, "relay_spool_slots", "Slots in the memory arena", nslots);
+    fprintf(f, "# HELP relay_log_dropped_total Log messages dropped because a buffer was full\n"
+            "# TYPE relay_log_dropped_total counter\nrelay_log_dropped_total %llu\n",
+            (unsigned long long)log_dropped());
+
+    for (int h = 0; h < STAT_HISTOGRAMS; ++h) {
+        const char *name = histogram_info[h].name;
+        fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[h].help, name);
+        uint64_t count = 0;
+        for (int b = 0; b < STATS_BUCKETS; ++b) {
+            count += t.buckets[h][b];
+            if (b < STATS_BUCKETS - 1)
+                fprintf(f, "%s_bucket{le=\"%.15g\"} %llu\n", name, (double)(1ULL << b) / 1000,
+                        (unsigned long long)count);
+        }
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+        fprintf(f, "%s_sum %.15g\n%s_count %llu\n", name, (double)t.sum[h] / 1000, name,
+                (unsigned long long)count);
+    }
+}
+
+static void stats_serve(int csd)
+{
+    //HTTP clients get a response header, after whatever request they sent.
+    //Nobody waits long for it.
+    if (http) {
+        struct timeval tv = { 1, 0 };
+        setsockopt(csd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char req[4096];
+        if (recv(csd, req, sizeof(req), 0) <= 0)
+            return;
+    }
+
+    char *body = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&body, &len);
+    if (!f)
+        return;
+    stats_write(f);
+    fclose(f);
+
+    char hdr[128];
+    int hlen = http ? snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\n\r\n", len) : 0;
+    if (send(csd, hdr, hlen, MSG_NOSIGNAL | MSG_MORE) == hlen)
+        send(csd, body, len, MSG_NOSIGNAL);
+    free(body);
+}
+
+static void *stats_main(void *opaque)
+{
+    rate_ms = now_ms();
+    while (!stop) {
+        struct pollfd pfd = { lsd, POLLIN, 0 };
+        int n = poll(&pfd, 1, 1000);
+
+        uint64_t now = now_ms();
+        if (now - rate_ms >= 1000) {
+            struct stats_slot t;
+            stats_collect(&t);
+            byte_rate = (double)(t.counters[STAT_BYTES] - rate_bytes) * 1000 / (now - rate_ms);
+            rate_bytes = t.counters[STAT_BYTES];
+            rate_ms = now;
+        }
+
+        if (n > 0) {
+            int csd = accept(lsd, NULL, NULL);
+            if (csd >= 0) {
+                stats_serve(csd);
+                close(csd);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int stats_listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Stats socket path too long");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(sockpath, path);
+    //a socket left behind by an earlier run
+    unlink(path);
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0 || bind(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_error("Failed to bind stats socket %s: %s", path, strerror(errno));
+        if (sd >= 0)
+            close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+//host defaults to localhost, the stats aren't meant for the world
+static int stats_listen_tcp(const char *addr)
+{
+    char host[256] = "127.0.0.1";
+    const char *port = strrchr(addr, ':');
+    if (port && port != addr)
+        snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+    port = port ? port + 1 : addr;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err) {
+        log_error("Invalid stats address %s: %s", addr, gai_strerror(err));
+        return -1;
+    }
+    int sd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (sd >= 0)
+        setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (sd < 0 || bind(sd, res->ai_addr, res->ai_addrlen) < 0) {
+        log_error("Failed to bind stats port %s: %s", addr, strerror(errno));
+        if (sd >= 0)
+            close(sd);
+        sd = -1;
+    }
+    freeaddrinfo(res);
+    return sd;
+}
+
+int stats_start(const char *addr)
+{
+    http = !strchr(addr, '/');
+    lsd = http ? stats_listen_tcp(addr) : stats_listen_unix(addr);
+    if (lsd < 0)
+        return -1;
+    if (listen(lsd, 16) < 0 || pthread_create(&thread, NULL, stats_main, NULL) != 0) {
+        log_error("Failed to start stats server");
+        close(lsd);
+        lsd = -1;
+        return -1;
+    }
+    pthread_setname_np(thread, "stats");
+    log_info("serving stats on %s", addr);
+    return 0;
+}
+
+void stats_stop(void)
+{
+    if (lsd < 0)
+        return;
+    pthread_join(thread, NULL);
+    close(lsd);
+    lsd = -1;
+    if (!http)
+        unlink(sockpath);
+}
@@ -0,0 +1,69 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+//Relay counters and latency histograms. Every thread updates its own cache
+//line sized slot, so collecting them never makes threads wait on each other
+//or bounce a shared line between cores. Scrapes add the slots up.
+
+enum stats_counter {
+    STAT_ACCEPTED,            //connections accepted
+    STAT_REFUSED,             //turned away busy, out of fds for clients
+    STAT_HANDSHAKES_FAILED,   //dropped during the handshake
+    STAT_HANDSHAKES_EXPIRED,  //handshake timed out
+    STAT_SENDERS,             //completed handshakes, by side
+    STAT_RECEIVERS,
+    STAT_SENDERS_PARKED,      //parked in the rendezvous table to wait
+    STAT_RECEIVERS_PARKED,
+    STAT_SENDERS_UNPARKED,    //taken out of the table again, paired or not
+    STAT_RECEIVERS_UNPARKED,
+    STAT_PAIRS,
+    STAT_PAIRS_EXPIRED,       //gave up waiting for the other side
+    STAT_PAIRS_FAILED,        //couldn't be parked or started
+    STAT_TRANSFERS_STARTED,
+    STAT_TRANSFERS_FINISHED,
+    STAT_TRANSFERS_FAILED,    //of the finished ones, with an error
+    STAT_TRANSFERS_IDLE,      //of the failed ones, dropped for being idle
+    STAT_BYTES,               //data relayed from senders to receivers
+    STAT_SPOOLED,             //uploads stored in the spool
+    STAT_SPOOL_FAILED,        //uploads dropped before all of it was in
+    STAT_SPOOL_EVICTED,       //stored uploads dropped to make room
+    STAT_SPOOL_EXPIRED,       //stored uploads nobody came for in time
+    STAT_SPOOL_BYTES,         //data uploaded into the spool
+    STAT_FANOUTS,             //one to many transfers started
+    STAT_FANOUT_RECEIVERS,    //receivers taken into fanout sessions
+    STAT_FANOUT_LAGGED,       //of those, moved to the lag file
+    STAT_FANOUT_DROPPED,      //of those, dropped before the end
+    STAT_THROTTLED,           //times a transfer waited for its bandwidth caps
+    STAT_FORWARDED,           //clients forwarded to the node owning their hash
+    STAT_FORWARD_FAILED,      //of those, forwards that failed
+    STAT_FORWARD_BYTES,       //bytes moved for forwarded clients, both ways
+    STAT_COUNTERS
+};
+
+enum stats_histogram {
+    STAT_PAIR_WAIT,           //from parking to being paired, in ms
+    STAT_TRANSFER_TIME,       //from start to finish, in ms
+    STAT_HISTOGRAMS
+};
+
+//bucket i counts values under 2^i ms, the last one everything else
+#define STATS_BUCKETS 24
+
+//Add n to a counter in the calling thread's slot.
+void stats_add(int counter, uint64_t n);
+static inline void stats_inc(int counter)
+{
+    stats_add(counter, 1);
+}
+//Record a value in ms in a histogram.
+void stats_observe(int histogram, uint64_t ms);
+
+//Serve the stats as Prometheus text on addr, a Unix socket path (anything
+//with a '/') or [host]:port for HTTP. Also samples the byte rate once a
+//second. Returns 0 if the server thread started.
+int stats_start(const char *addr);
+void stats_stop(void);
+
+#endif
@@ -21,6 +21,10 @@ fi
 red='\033[0;31m'
 green='\033[0;32m'
 reset='\x1b[0m'
+#what raw clients in python make the routing hash with, HASH_KDF_LABEL and
+#HASH_KDF_ITERATIONS in protocol.h
+hash_kdf_label="file-relay routing hash"
+hash_kdf_iterations=100000
 
 function cleanup_exit {
     if pgrep relay ; then
@@ -47,7 +51,9 @@ function run_tests {
     if [[ $generate_test_data -gt 0 ]]; then
         rm -rf "$testdir"
     else
-        rm -rf "$testdir"/out "$testdir"/{secrets.txt,relay.log}
+        rm -rf "$testdir"/out "$testdir"/resumed "$testdir"/coded "$testdir"/batch \
+            "$testdir"/spool "$testdir"/spooled "$testdir"/fanout "$testdir"/cluster \
+            "$testdir"/{secrets.txt,coded.txt,batch.txt,spool.txt,fanout.txt,cluster.txt,relay*.log}
     fi
     mkdir -p "$testdir"/in "$testdir"/out
     passed=1
@@ -104,6 +110,219 @@ function run_tests {
             passed=0
         fi
     done
+
+    #a resumable transfer whose sender dies part way, slowed down by a proxy
+    #in front of the relay, then resumed with the same secret
+    echo "Running interrupted resumable send..."
+    big="$testdir"/in/test_$testcount.dat
+    slowport=$(( port + 5 ))
+    secret="resume-$port"
+    mkdir -p "$testdir"/resumed
+    python3 - $slowport $port <<'PYEOF' &
+import socket, sys, threading, time
+#forwards to the relay at about 2MB/s each way
+def pump(src, dst):
+    try:
+        while True:
+            data = src.recv(16384)
+            if not data:
+                break
+            dst.sendall(data)
+            time.sleep(len(data) / (2 << 20))
+    except OSError:
+        pass
+    for sd in (src, dst):
+        try:
+            sd.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+listener = socket.create_server(('127.0.0.1', int(sys.argv[1])))
+while True:
+    client, _ = listener.accept()
+    relay = socket.create_connection(('127.0.0.1', int(sys.argv[2])))
+    for src, dst in ((client, relay), (relay, client)):
+        threading.Thread(target=pump, args=(src, dst), daemon=True).start()
+PYEOF
+    proxypid=$!
+    sleep 1
+    ./send -r -s "$secret" localhost:$slowport "$big" > /dev/null &
+    sendpid=$!
+    ./receive localhost:$port "$secret" "$testdir"/resumed &
+    recvpid=$!
+    sleep 2
+    kill -9 $sendpid 2> /dev/null || true
+    wait $sendpid $recvpid || true
+    kill $proxypid
+    if [[ -e "$testdir"/resumed/test_$testcount.dat || -z "$(ls -A "$testdir"/resumed)" ]]; then
+        echo -e "${red}Interrupted transfer left no partial file${reset}"
+        passed=0
+    fi
+    ./send -r -s "$secret" localhost:$port "$big" > /dev/null &
+    sendpid=$!
+    ./receive localhost:$port "$secret" "$testdir"/resumed
+    wait $sendpid
+    if ! cmp -s "$big" "$testdir"/resumed/test_$testcount.dat; then
+        echo -e "${red}Resumed copy failed${reset}"
+        passed=0
+    fi
+    if [[ $passed -gt 0 ]]; then
+        echo -e "Resume passed"
+    fi
+
+    #encrypted with each cipher, and compressed with whichever codecs send was
+    #built with, also encrypted and in chunks
+    echo "Running compressed and encrypted sends..."
+    mkdir -p "$testdir"/coded
+    coded=("-e aes" "-e chacha -n 3")
+    for codec in lz4 zstd zlib; do
+        if [[ -f /usr/include/$codec.h ]]; then
+            coded+=("-z $codec" "-z $codec -r" "-z $codec -e chacha -r")
+        fi
+    done
+    for opts in "${coded[@]}"; do
+        rm -rf "$testdir"/coded/* "$testdir"/coded.txt
+        ./send $opts localhost:$port "$big" > "$testdir"/coded.txt &
+        pids="$!"
+        while [[ ! -s "$testdir"/coded.txt ]] && kill -0 $pids 2> /dev/null; do
+            sleep 1
+        done
+        ./receive localhost:$port "$(cat "$testdir"/coded.txt)" "$testdir"/coded
+        wait $pids
+        if ! cmp -s "$big" "$testdir"/coded/test_$testcount.dat; then
+            echo -e "${red}Copy failed with $opts${reset}"
+            passed=0
+        fi
+    done
+    if [[ $passed -gt 0 ]]; then
+        echo -e "Compression and encryption passed"
+    fi
+
+    #send the whole input directory again as one batch
+    echo "Running batch send..."
+    mkdir -p "$testdir"/batch
+    ./send localhost:$port "$testdir"/in > "$testdir"/batch.txt &
+    sendpid=$!
+    while [[ ! -s "$testdir"/batch.txt ]]; do
+        sleep 1
+    done
+    ./receive localhost:$port "$(head -1 "$testdir"/batch.txt)" "$testdir"/batch
+    wait $sendpid
+    if diff -r "$testdir"/in "$testdir"/batch/in > /dev/null; then
+        echo -e "Batch passed"
+    else
+        echo -e "${red}Batch failed${reset}"
+        passed=0
+    fi
+
+    #a relay with a spool takes the upload, so the sender is done before its
+    #receiver even starts
+    echo "Running spooled sends..."
+    spoolport=$(( port + 4 ))
+    mkdir -p "$testdir"/spool "$testdir"/spooled
+    ./relay -D "$testdir"/spool :$spoolport > "$testdir"/relay-spool.log 2>&1 &
+    spoolpid=$!
+    sleep 1
+    for y in 1 $testcount; do
+        ./send localhost:$spoolport "$testdir"/in/test_$y.dat > "$testdir"/spool.txt
+        ./receive localhost:$spoolport "$(cat "$testdir"/spool.txt)" "$testdir"/spooled
+        if ! cmp -s "$testdir"/in/test_$y.dat "$testdir"/spooled/test_$y.dat; then
+            echo -e "${red}Spooled copy failed: $y${reset}"
+            passed=0
+        fi
+    done
+    #senders that reset their upload just as their receiver claims it
+    python3 - localhost $spoolport "$hash_kdf_label" $hash_kdf_iterations <<'PYEOF'
+import hashlib, socket, struct, sys
+def hello(identity, secret):
+    sd = socket.create_connection((sys.argv[1], int(sys.argv[2])))
+    digest = hashlib.pbkdf2_hmac('sha256', secret.encode(), sys.argv[3].encode(),
+                                 int(sys.argv[4]), 20).hex()[:39] + '\0'
+    sd.sendall(struct.pack('=I', identity) + digest.encode())
+    return sd
+for n in range(20):
+    secret = 'spool-reset-%d' % n
+    field = b'reset.dat\0' + struct.pack('>BHQ', 1, 8, 1 << 24)
+    sender = hello(0xadeafbe2, secret)
+    sender.sendall(struct.pack('>H', len(field)) + field + bytes(256 * 1024))
+    receiver = hello(0xfacaded2, secret)
+    sender.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+    sender.close()
+    receiver.settimeout(1)
+    try:
+        while receiver.recv(65536):
+            pass
+    except OSError:
+        pass
+    receiver.close()
+PYEOF
+    if ! kill -0 $spoolpid 2> /dev/null; then
+        echo -e "${red}Spool relay died on a reset upload${reset}"
+        passed=0
+    fi
+    if [[ $passed -gt 0 ]]; then
+        echo -e "Spool passed"
+    fi
+
+    #one upload copied to three receivers, through the spool relay so one
+    #falling behind goes on from a lag file rather than being dropped
+    echo "Running fanout send..."
+    rm -f "$testdir"/fanout.txt
+    ./send -f 3 localhost:$spoolport "$big" > "$testdir"/fanout.txt &
+    pids="$!"
+    while [[ ! -s "$testdir"/fanout.txt ]] && kill -0 $pids 2> /dev/null; do
+        sleep 1
+    done
+    for n in 1 2 3; do
+        mkdir -p "$testdir"/fanout/$n
+        ./receive localhost:$spoolport "$(cat "$testdir"/fanout.txt)" "$testdir"/fanout/$n &
+        pids="$pids $!"
+    done
+    wait $pids
+    for n in 1 2 3; do
+        if ! cmp -s "$big" "$testdir"/fanout/$n/test_$testcount.dat; then
+            echo -e "${red}Fanout copy failed: $n${reset}"
+            passed=0
+        fi
+    done
+    if [[ $passed -gt 0 ]]; then
+        echo -e "Fanout passed"
+    fi
+
+    #two more relays make a cluster of three; send through one node, receive
+    #through another, whichever of them owns each hash
+    echo "Running cluster sends..."
+    nodes="localhost:$(( port + 1 )),localhost:$(( port + 2 )),localhost:$(( port + 3 ))"
+    for n in 1 2 3; do
+        ./relay -N "$nodes" :$(( port + n )) > "$testdir"/relay-$n.log 2>&1 &
+    done
+    sleep 1
+    mkdir -p "$testdir"/cluster
+    rm -f "$testdir"/cluster.txt
+    clustercount=$(( testcount < 20 ? testcount : 20 ))
+    pids=""
+    for y in $(seq 1 $clustercount); do
+        ./send localhost:$(( port + 1 + y % 3 )) "$testdir"/in/test_$y.dat >> "$testdir"/cluster.txt &
+        pids="$pids $!"
+    done
+    while [[ $(wc -l < "$testdir"/cluster.txt) -lt $clustercount ]]; do
+        sleep 1
+    done
+    y=0
+    for secret in $(cat "$testdir"/cluster.txt); do
+        y=$(( y + 1 ))
+        ./receive localhost:$(( port + 1 + (y + 1) % 3 )) "$secret" "$testdir"/cluster &
+        pids="$pids $!"
+    done
+    wait $pids
+    for y in $(seq 1 $clustercount); do
+        if ! cmp -s "$testdir"/in/test_$y.dat "$testdir"/cluster/test_$y.dat; then
+            echo -e "${red}Cluster copy failed: $y${reset}"
+            passed=0
+        fi
+    done
+    if [[ $passed -gt 0 ]]; then
+        echo -e "Cluster passed"
+    fi
 }
 
 run_tests
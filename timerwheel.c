@@ -0,0 +1,146 @@
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+static inline uint64_t ms_to_tick(uint64_t ms)
+{
+    return ms / TIMER_TICK_MS;
+}
+
+//Put t in the slot its expiry falls in, relative to the current tick. Anything
+//further out than the top level can reach waits in the last slot of the top
+//level and gets re-filed once it comes around.
+static void timer_file(struct timer_wheel *w, struct timer *t)
+{
+    //only a cascade can hand us a timer that's due this very tick, and it
+    //does so right before the tick's slot runs
+    uint64_t expires = t->expires;
+    if (expires < w->tick)
+        expires = w->tick;
+    uint64_t delta = expires - w->tick;
+
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= 1ULL << (TIMER_SLOT_BITS * (level + 1)))
+        level++;
+    uint64_t span = 1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS);
+    if (delta >= span)
+        expires = w->tick + span - 1;
+
+    int slot = (expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+    LIST_INSERT_HEAD(&w->slots[level][slot], t, entries);
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now)
+{
+    memset(w, 0, sizeof(*w));
+    w->tick = ms_to_tick(now);
+    for (int l = 0; l < TIMER_LEVELS; ++l)
+        for (int s = 0; s < TIMER_SLOTS; ++s)
+            LIST_INIT(&w->slots[l][s]);
+}
+
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t now, uint64_t ms, timer_fn fn)
+{
+    timer_del(w, t);
+    //round up so a timer never fires early
+    t->expires = ms_to_tick(now + ms + TIMER_TICK_MS - 1);
+    if (t->expires <= w->tick)
+        t->expires = w->tick + 1;
+    t->fn = fn;
+    t->pending = 1;
+    w->count++;
+    timer_file(w, t);
+}
+
+int timer_del(struct timer_wheel *w, struct timer *t)
+{
+    if (!t->pending)
+        return 0;
+    LIST_REMOVE(t, entries);
+    t->pending = 0;
+    w->count--;
+    return 1;
+}
+
+//move every timer in the slot that just came up in level one level down
+static void timer_cascade(struct timer_wheel *w, int level)
+{
+    int slot = (w->tick >> (TIMER_SLOT_BITS * level)) & SLOT_MASK;
+    struct timer_slot list = w->slots[level][slot];
+    LIST_INIT(&w->slots[level][slot]);
+    if (list.lh_first)
+        list.lh_first->entries.le_prev = &list.lh_first;
+
+    struct timer *t;
+    while ((t = LIST_FIRST(&list))) {
+        LIST_REMOVE(t, entries);
+        timer_file(w, t);
+    }
+}
+
+static void timer_run_slot(struct timer_wheel *w, int slot)
+{
+    struct timer *t;
+    while ((t = LIST_FIRST(&w->slots[0][slot]))) {
+        LIST_REMOVE(t, entries);
+        t->pending = 0;
+        w->count--;
+        t->fn(t);
+    }
+}
+
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now)
+{
+    uint64_t target = ms_to_tick(now);
+    while (w->tick < target) {
+        //nothing to run, skip straight ahead
+        if (!w->count) {
+            w->tick = target;
+            break;
+        }
+        w->tick++;
+        //at each wrap of a level pull the next slot of the level above down
+        for (int l = 1; l < TIMER_LEVELS; ++l) {
+            if (w->tick & ((1ULL << (TIMER_SLOT_BITS * l)) - 1))
+                break;
+            timer_cascade(w, l);
+        }
+        timer_run_slot(w, w->tick & SLOT_MASK);
+    }
+}
+
+int timer_wheel_timeout(const struct timer_wheel *w, uint64_t now, int max)
+{
+    if (!w->count)
+        return max;
+
+    //the next occupied level 0 slot, or the next cascade if that comes first
+    uint64_t next = (w->tick | SLOT_MASK) + 1;
+    for (uint64_t t = w->tick + 1; t < next; ++t) {
+        if (!LIST_EMPTY(&w->slots[0][t & SLOT_MASK])) {
+            next = t;
+            break;
+        }
+    }
+    uint64_t at = next * TIMER_TICK_MS;
+    if (at <= now)
+        return 0;
+    return at - now < (uint64_t)max ? (int)(at - now) : max;
+}
+
+void timer_wheel_flush(struct timer_wheel *w)
+{
+    for (int l = 0; l < TIMER_LEVELS; ++l) {
+        for (int s = 0; s < TIMER_SLOTS; ++s) {
+            struct timer *t;
+            while ((t = LIST_FIRST(&w->slots[l][s]))) {
+                LIST_REMOVE(t, entries);
+                t->pending = 0;
+                w->count--;
+                t->fn(t);
+            }
+        }
+    }
+}
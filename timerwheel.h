@@ -0,0 +1,54 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define TIMER_TICK_MS 10      //resolution of the wheel
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+struct timer;
+typedef void (*timer_fn)(struct timer *t);
+
+//Embedded in whatever needs a timeout. A timer belongs to one wheel and is
+//only touched by the thread that owns that wheel.
+struct timer {
+    uint64_t expires;     //in ticks
+    timer_fn fn;
+    int pending;
+    LIST_ENTRY(timer) entries;
+};
+
+//Hierarchical timer wheel (Varghese & Lauck). Level 0 has one slot per tick,
+//every level above it covers a whole rotation of the one below per slot, so
+//4 levels of 64 slots reach about 46 hours at 10ms ticks. Adding and removing
+//a timer is O(1); timers in an upper level are moved down a level once their
+//slot comes up, at most once per level.
+struct timer_wheel {
+    uint64_t tick;        //last tick that has been processed
+    int count;
+    LIST_HEAD(timer_slot, timer) slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+//now is the current time in milliseconds on any monotonic clock
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+//arm t to call fn once the clock passes now + ms, re-arming a pending timer
+//moves it
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t now, uint64_t ms, timer_fn fn);
+
+//disarm t, returns 1 if it was pending
+int timer_del(struct timer_wheel *w, struct timer *t);
+
+//run every timer that expired by now. Callbacks may add and remove timers.
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now);
+
+//milliseconds until the wheel next needs to be advanced, at most max
+int timer_wheel_timeout(const struct timer_wheel *w, uint64_t now, int max);
+
+//run every pending timer regardless of when it expires, for shutdown
+void timer_wheel_flush(struct timer_wheel *w);
+
+#endif
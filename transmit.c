@@ -0,0 +1,496 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "compress.h"
+#include "crypt.h"
+#include "protocol.h"
+#include "transmit.h"
+
+//older libc and kernel headers don't know about zerocopy sends yet
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+//Chunks start small so a short file doesn't pay for a big buffer, and double
+//every time one goes through whole.
+#define CHUNK_MIN (64 * 1024)
+#define CHUNK_MAX (1024 * 1024)
+#define SENDFILE_CHUNK_MAX (16 * 1024 * 1024)
+//zerocopy buffers in flight, a buffer can't be reused until the kernel says
+//it's done with it
+#define ZC_BUFS 8
+
+static const char *mode_names[] = { "auto", "sendfile", "zerocopy", "copy" };
+
+int transmit_mode_parse(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof(mode_names) / sizeof(mode_names[0])); ++i)
+        if (!strcmp(name, mode_names[i]))
+            return i;
+    return -1;
+}
+
+const char *transmit_mode_name(int mode)
+{
+    return mode >= 0 && mode <= TRANSMIT_COPY ? mode_names[mode] : "unknown";
+}
+
+static int send_all(int sd, const char *buf, size_t len, int flags)
+{
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(sd, &buf[off], len - off, flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static size_t min_size(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+static ssize_t transmit_copy(int sd, int fd, off_t off, size_t len,
+                             transmit_fn transform, void *arg)
+{
+    char *buf = malloc(CHUNK_MAX);
+    if (!buf) {
+        fprintf(stderr, "Insufficient memory for send buffer\n");
+        return -1;
+    }
+    size_t chunk = CHUNK_MIN;
+    ssize_t total = 0;
+    while ((size_t)total < len) {
+        ssize_t n = pread(fd, buf, min_size(chunk, len - total), off + total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to read file");
+            total = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        if (transform)
+            transform(buf, n, arg);
+        if (send_all(sd, buf, n, 0) < 0) {
+            perror("Failed to send data");
+            total = -1;
+            break;
+        }
+        total += n;
+        if ((size_t)n == chunk && chunk < CHUNK_MAX)
+            chunk *= 2;
+    }
+    free(buf);
+    return total;
+}
+
+//Returns -2 if sendfile can't be used on this file or socket at all, so the
+//caller can fall back before anything was sent.
+static ssize_t transmit_sendfile(int sd, int fd, off_t off, size_t len)
+{
+    size_t chunk = CHUNK_MIN * 4;
+    ssize_t total = 0;
+    while ((size_t)total < len) {
+        off_t pos = off + total;
+        ssize_t n = sendfile(sd, fd, &pos, min_size(chunk, len - total));
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            if (!total && (errno == EINVAL || errno == ENOSYS))
+                return -2;
+            perror("Failed to sendfile data");
+            return -1;
+        }
+        if (n == 0)
+            break;
+        total += n;
+        if ((size_t)n == chunk && chunk < SENDFILE_CHUNK_MAX)
+            chunk *= 2;
+    }
+    return total;
+}
+
+struct zc_state {
+    uint32_t next_id;     //id the kernel gives the next zerocopy send
+    uint32_t done;        //every id before this one has completed
+    int copied;           //the kernel had to copy anyway
+};
+
+//Collect zerocopy completions from the socket error queue, waiting for at
+//least one if block is set. Completions come back as ranges of send ids, in
+//order for TCP.
+static int zc_reap(int sd, struct zc_state *zc, int block)
+{
+    if (block) {
+        //the error queue shows up as POLLERR, which is always reported
+        struct pollfd pfd = { sd, 0, 0 };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+    }
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+                continue;
+            //ee_info..ee_data is the range of ids that completed
+            if ((int32_t)(serr->ee_data + 1 - zc->done) > 0)
+                zc->done = serr->ee_data + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied = 1;
+        }
+    }
+}
+
+static int zc_pending(const struct zc_state *zc, uint32_t id)
+{
+    return (int32_t)(zc->done - id) <= 0;
+}
+
+//The data has to pass through userspace anyway (to be transformed), so at
+//least skip the copy into the socket buffer. Each buffer remembers the id of
+//the last send that used it and is only refilled once that id has completed.
+static ssize_t transmit_zerocopy(int sd, int fd, off_t off, size_t len,
+                                 transmit_fn transform, void *arg)
+{
+    int one = 1;
+    if (setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+        return -2;
+
+    char *mem = malloc((size_t)ZC_BUFS * CHUNK_MAX);
+    if (!mem) {
+        fprintf(stderr, "Insufficient memory for send buffers\n");
+        return -1;
+    }
+    uint32_t last_id[ZC_BUFS];
+    int busy[ZC_BUFS] = { 0 };
+    struct zc_state zc = { 0, 0, 0 };
+    int flags = MSG_ZEROCOPY;
+    size_t chunk = CHUNK_MIN;
+    ssize_t total = 0;
+
+    for (int b = 0;; b = (b + 1) % ZC_BUFS) {
+        char *buf = &mem[(size_t)b * CHUNK_MAX];
+        while (busy[b] && zc_pending(&zc, last_id[b])) {
+            if (zc_reap(sd, &zc, 1) < 0) {
+                perror("Failed to reap zerocopy completions");
+                total = -1;
+                goto out;
+            }
+        }
+        busy[b] = 0;
+
+        //On loopback and some devices the kernel copies the data after all,
+        //at which point the bookkeeping only costs us
+        if (zc.copied && flags) {
+            fprintf(stderr, "Kernel is copying zerocopy sends, falling back to copies\n");
+            flags = 0;
+        }
+
+        if ((size_t)total >= len)
+            break;
+        ssize_t n = pread(fd, buf, min_size(chunk, len - total), off + total);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to read file");
+            total = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        if (transform)
+            transform(buf, n, arg);
+
+        size_t sent = 0;
+        while (sent < (size_t)n) {
+            ssize_t s = send(sd, &buf[sent], n - sent, flags | MSG_NOSIGNAL);
+            if (s < 0) {
+                if (errno == EINTR)
+                    continue;
+                //out of option memory for notifications, wait for some
+                if (errno == ENOBUFS && flags) {
+                    if (zc_reap(sd, &zc, 1) < 0)
+                        break;
+                    continue;
+                }
+                break;
+            }
+            sent += s;
+            if (flags) {
+                last_id[b] = zc.next_id++;
+                busy[b] = 1;
+            }
+        }
+        if (sent < (size_t)n) {
+            perror("Failed to send data");
+            total = -1;
+            break;
+        }
+        total += n;
+        if ((size_t)n == chunk && chunk < CHUNK_MAX)
+            chunk *= 2;
+        zc_reap(sd, &zc, 0);
+    }
+
+out:
+    //the kernel may still be reading from the buffers
+    while (zc.next_id && zc_pending(&zc, zc.next_id - 1))
+        if (zc_reap(sd, &zc, 1) < 0)
+            break;
+    free(mem);
+    return total;
+}
+
+ssize_t transmit_file(int sd, int fd, off_t off, size_t len, int mode,
+                      transmit_fn transform, void *arg)
+{
+    //we read the range front to back exactly once
+    posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+
+    if (mode == TRANSMIT_AUTO)
+        mode = transform ? TRANSMIT_ZEROCOPY : TRANSMIT_SENDFILE;
+    //sendfile never lets us touch the data
+    if (mode == TRANSMIT_SENDFILE && transform)
+        mode = TRANSMIT_ZEROCOPY;
+
+    ssize_t res = -2;
+    if (mode == TRANSMIT_SENDFILE)
+        res = transmit_sendfile(sd, fd, off, len);
+    else if (mode == TRANSMIT_ZEROCOPY)
+        res = transmit_zerocopy(sd, fd, off, len, transform, arg);
+    if (res != -2)
+        return res;
+    if (mode != TRANSMIT_COPY)
+        fprintf(stderr, "%s not supported here, copying instead\n", transmit_mode_name(mode));
+    return transmit_copy(sd, fd, off, len, transform, arg);
+}
+
+//Blocks in flight between the thread reading (and compressing) the file and
+//the one sending them, so the two overlap.
+#define PIPELINE_BUFS 4
+
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf[PIPELINE_BUFS];
+    size_t len[PIPELINE_BUFS];   //bytes in the buffer, as they go out
+    size_t raw[PIPELINE_BUFS];   //bytes of the file they stand for
+    uint64_t sum[PIPELINE_BUFS];
+    int full[PIPELINE_BUFS];
+    int done;                    //no more buffers coming
+    int failed;                  //reading the file failed
+    int stop;                    //sending failed, stop reading
+    transmit_read read;
+    void *src;
+    uint64_t off;
+    size_t total;
+    size_t block;
+    int codec;
+    int framed;
+    const struct crypt_key *key;
+    uint32_t stream;
+};
+
+static void *pipeline_fill(void *opaque)
+{
+    struct pipeline *p = (struct pipeline *)opaque;
+    struct compressor c;
+    struct crypt cr;
+    compressor_init(&c, p->codec);
+    int failed = p->key && crypt_init(&cr, p->key, p->stream, 1) < 0;
+    //the file is read into raw when it still has to be compressed, and
+    //compressed into mid when it also has to be sealed into the buffer.
+    //Uncompressed data is sealed in place, right where its record goes.
+    char *raw = p->codec ? malloc(p->block) : NULL;
+    char *mid = p->codec && p->key ? malloc(compress_bound(p->codec, p->block)) : NULL;
+    failed |= (p->codec && !raw) || (p->codec && p->key && !mid);
+
+    size_t done = 0;
+    for (int i = 0; !failed && done < p->total; i = (i + 1) % PIPELINE_BUFS) {
+        pthread_mutex_lock(&p->lock);
+        while (p->full[i] && !p->stop)
+            pthread_cond_wait(&p->cond, &p->lock);
+        int stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+            break;
+
+        char *dst = raw ? raw : &p->buf[i][p->key ? CRYPT_HEADER_LEN : 0];
+        ssize_t n = p->read(p->src, dst, min_size(p->block, p->total - done), p->off + done);
+        if (n < 0)
+            failed = 1;
+        if (n <= 0)
+            break;
+        const char *data = dst;
+        size_t len = n;
+        if (p->codec) {
+            char *out = p->key ? mid : p->buf[i];
+            len = compress_block(&c, raw, n, out);
+            data = out;
+        }
+        if (p->key && !(len = crypt_seal(&cr, data, len, p->off + done, p->buf[i]))) {
+            failed = 1;
+            break;
+        }
+        //the checksum covers the bytes as they go out
+        uint64_t sum = p->framed ? chunk_checksum(p->buf[i], len) : 0;
+
+        pthread_mutex_lock(&p->lock);
+        p->len[i] = len;
+        p->raw[i] = n;
+        p->sum[i] = sum;
+        p->full[i] = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+        done += n;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    p->failed = failed;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    free(raw);
+    free(mid);
+    compressor_free(&c);
+    if (p->key)
+        crypt_free(&cr);
+    return NULL;
+}
+
+static ssize_t file_read(void *src, char *buf, size_t len, uint64_t at)
+{
+    ssize_t n;
+    do {
+        n = pread(*(int *)src, buf, len, at);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        perror("Failed to read file");
+    return n;
+}
+
+ssize_t transmit_blocks(int sd, int fd, off_t off, size_t len, size_t block, int codec,
+                        int framed, const struct crypt_key *key, uint32_t stream)
+{
+    posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+    return transmit_stream(sd, file_read, &fd, off, len, block, codec, framed, key, stream);
+}
+
+ssize_t transmit_stream(int sd, transmit_read read, void *src, uint64_t off, size_t len,
+                        size_t block, int codec, int framed, const struct crypt_key *key,
+                        uint32_t stream)
+{
+    struct pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.read = read;
+    p.src = src;
+    p.off = off;
+    p.total = len;
+    p.block = codec ? min_size(block, COMPRESS_BLOCK) : block;
+    if (key)
+        p.block = min_size(p.block, CRYPT_RECORD_MAX);
+    p.codec = codec;
+    p.framed = framed;
+    p.key = key;
+    p.stream = stream;
+    size_t bufsize = (codec ? compress_bound(codec, p.block) : p.block) +
+                     (key ? CRYPT_OVERHEAD : 0);
+    for (int i = 0; i < PIPELINE_BUFS; ++i) {
+        if (!(p.buf[i] = malloc(bufsize))) {
+            fprintf(stderr, "Insufficient memory for send buffers\n");
+            for (int j = 0; j < i; ++j)
+                free(p.buf[j]);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    ssize_t total = -1;
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, pipeline_fill, &p) != 0) {
+        fprintf(stderr, "Failed to start reader thread\n");
+        goto out;
+    }
+
+    total = 0;
+    for (int i = 0;; i = (i + 1) % PIPELINE_BUFS) {
+        pthread_mutex_lock(&p.lock);
+        while (!p.full[i] && !p.done)
+            pthread_cond_wait(&p.cond, &p.lock);
+        int full = p.full[i];
+        int failed = p.failed;
+        pthread_mutex_unlock(&p.lock);
+        if (!full) {
+            if (failed)
+                total = -1;
+            break;
+        }
+
+        char hdr[CHUNK_HEADER_LEN];
+        chunk_header_put(hdr, off + total, p.len[i], p.sum[i]);
+        if ((framed && send_all(sd, hdr, sizeof(hdr), MSG_MORE) < 0) ||
+            send_all(sd, p.buf[i], p.len[i], 0) < 0) {
+            perror("Failed to send data");
+            total = -1;
+            break;
+        }
+        total += p.raw[i];
+
+        pthread_mutex_lock(&p.lock);
+        p.full[i] = 0;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = 1;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+    pthread_join(reader, NULL);
+
+out:
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.cond);
+    for (int i = 0; i < PIPELINE_BUFS; ++i)
+        free(p.buf[i]);
+    return total;
+}
@@ -0,0 +1,53 @@
+#ifndef TRANSMIT_H
+#define TRANSMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//How send moves file data into the socket.
+enum transmit_mode {
+    TRANSMIT_AUTO = 0,    //sendfile, or MSG_ZEROCOPY when there's a transform
+    TRANSMIT_SENDFILE,    //page cache straight to the socket
+    TRANSMIT_ZEROCOPY,    //read into userspace, send with MSG_ZEROCOPY
+    TRANSMIT_COPY,        //plain read/send loop
+};
+
+//Called on each chunk before it's sent, for changing the data in place.
+//Forces one of the paths that go through userspace.
+typedef void (*transmit_fn)(char *buf, size_t len, void *arg);
+
+//parse "sendfile", "zerocopy", "copy" or "auto", returns -1 if unknown
+int transmit_mode_parse(const char *name);
+const char *transmit_mode_name(int mode);
+
+//Send len bytes of fd starting at off over the connected socket sd, without
+//moving the file offset, so several ranges of one file can go out at once.
+//Paths the kernel or file don't support fall back to the next one down,
+//ending with the read/send loop. Returns the number of bytes sent, which is
+//short if the file shrank, or -1 on error.
+ssize_t transmit_file(int sd, int fd, off_t off, size_t len, int mode,
+                      transmit_fn transform, void *arg);
+
+struct crypt_key;
+
+//Like transmit_file, but always through userspace, with the file read (and
+//compressed with codec, see compress.h, then sealed into a record under key as
+//stream, see crypt.h) block by block on a separate thread while the previous
+//blocks are being sent. With framed every block is a chunk preceded by its
+//offset, length and checksum (see protocol.h), so the receiver can verify and
+//resume. Returns the number of file bytes sent.
+ssize_t transmit_blocks(int sd, int fd, off_t off, size_t len, size_t block, int codec,
+                        int framed, const struct crypt_key *key, uint32_t stream);
+
+//Reads the next len bytes of a stream into buf, at is where they start.
+//Returns the number read, short only at the end, or -1.
+typedef ssize_t (*transmit_read)(void *src, char *buf, size_t len, uint64_t at);
+
+//transmit_blocks for data that doesn't come straight from a file, len bytes
+//read from src, with off where the stream starts.
+ssize_t transmit_stream(int sd, transmit_read read, void *src, uint64_t off, size_t len,
+                        size_t block, int codec, int framed, const struct crypt_key *key,
+                        uint32_t stream);
+
+#endif
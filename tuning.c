@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "tuning.h"
+
+//auto takes paths with a shorter round trip than this for a LAN
+#define AUTO_LAN_RTT_US 2000
+#define CHUNK_MAX (16 * 1024 * 1024)
+//dead peers, parked clients in particular, are noticed in about two minutes
+#define KEEPALIVE_IDLE 60
+#define KEEPALIVE_INTVL 10
+#define KEEPALIVE_CNT 6
+
+static const struct {
+    const char *name;
+    const char *alias;
+    uint64_t rate;        //link rate the buffers are sized for, bytes/s
+    size_t chunk_min;
+    int nodelay;          //small writes go out without waiting for acks
+    int lowat;            //keep at most a chunk unsent in the socket
+} profiles[] = {
+    [TUNING_AUTO] = { "auto", "auto", 0, 0, 0, 0 },
+    [TUNING_LAN] = { "lan-bulk", "lan", 1250000000, 1024 * 1024, 0, 0 },
+    [TUNING_WAN] = { "wan-high-bdp", "wan", 1250000000, 1024 * 1024, 0, 1 },
+    [TUNING_SMALL] = { "many-small-files", "small", 125000000, 64 * 1024, 1, 0 },
+    [TUNING_NONE] = { "none", "none", 0, 0, 0, 0 },
+};
+
+//buffer limits, read once
+static struct {
+    long wmem_auto;       //tcp_wmem and tcp_rmem maximum, autotuning's reach
+    long rmem_auto;
+    long wmem_max;        //net.core limits for setting them by hand
+    long rmem_max;
+} limits;
+static pthread_once_t limits_once = PTHREAD_ONCE_INIT;
+
+static long read_sysctl(const char *path, int field, long dflt)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return dflt;
+    long v[3];
+    int n = fscanf(f, "%ld %ld %ld", &v[0], &v[1], &v[2]);
+    fclose(f);
+    return n > field && v[field] > 0 ? v[field] : dflt;
+}
+
+static void read_limits(void)
+{
+    limits.wmem_auto = read_sysctl("/proc/sys/net/ipv4/tcp_wmem", 2, 4 * 1024 * 1024);
+    limits.rmem_auto = read_sysctl("/proc/sys/net/ipv4/tcp_rmem", 2, 6 * 1024 * 1024);
+    limits.wmem_max = read_sysctl("/proc/sys/net/core/wmem_max", 0, 212992);
+    limits.rmem_max = read_sysctl("/proc/sys/net/core/rmem_max", 0, 212992);
+}
+
+int tuning_parse(const char *spec, uint64_t *rate)
+{
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    *rate = 0;
+    if (colon) {
+        char *end;
+        double mbs = strtod(colon + 1, &end);
+        if (end == colon + 1 || *end || mbs <= 0)
+            return -1;
+        *rate = mbs * (1 << 20);
+    }
+    for (int i = 0; i < (int)(sizeof(profiles) / sizeof(profiles[0])); ++i)
+        if ((strlen(profiles[i].name) == len && !strncmp(spec, profiles[i].name, len)) ||
+            (strlen(profiles[i].alias) == len && !strncmp(spec, profiles[i].alias, len)))
+            return i;
+    return -1;
+}
+
+const char *tuning_name(int profile)
+{
+    return profile >= 0 && profile <= TUNING_NONE ? profiles[profile].name : "unknown";
+}
+
+//Give one direction want bytes of buffer. Setting it turns autotuning off,
+//so it's only done when that gets more than autotuning would. The kernel
+//doubles what it's asked for, for its bookkeeping, up to twice the core
+//limit. Returns the size the kernel reports, or 0 if left alone.
+static int size_buffer(int sd, int opt, uint64_t want, long autotune, long core_max,
+                       int *capped)
+{
+    if (want <= (uint64_t)autotune)
+        return 0;
+    uint64_t get = want;
+    if (get > (uint64_t)core_max * 2) {
+        get = (uint64_t)core_max * 2;
+        *capped = 1;
+    }
+    if (get <= (uint64_t)autotune)
+        return 0;
+    int val = get / 2;
+    if (setsockopt(sd, SOL_SOCKET, opt, &val, sizeof(val)) < 0)
+        return 0;
+    socklen_t len = sizeof(val);
+    if (getsockopt(sd, SOL_SOCKET, opt, &val, &len) < 0)
+        return 0;
+    return val;
+}
+
+void tuning_apply(int sd, int profile, uint64_t rate, struct tuning *t)
+{
+    memset(t, 0, sizeof(*t));
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(sd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+        t->rtt_us = info.tcpi_rtt;
+    if (profile == TUNING_AUTO)
+        profile = t->rtt_us >= AUTO_LAN_RTT_US ? TUNING_WAN : TUNING_LAN;
+    t->profile = profile;
+    if (profile == TUNING_NONE)
+        return;
+    pthread_once(&limits_once, read_limits);
+
+    t->rate = rate ? rate : profiles[profile].rate;
+    //a stream only ever has one buffer's worth in flight per round trip,
+    //twice the bandwidth-delay product leaves room for the application
+    //falling behind
+    uint64_t bdp = t->rate * t->rtt_us / 1000000;
+    t->want = bdp * 2;
+    t->sndbuf = size_buffer(sd, SO_SNDBUF, t->want, limits.wmem_auto, limits.wmem_max,
+                            &t->capped);
+    t->rcvbuf = size_buffer(sd, SO_RCVBUF, t->want, limits.rmem_auto, limits.rmem_max,
+                            &t->capped);
+
+    t->chunk = bdp < profiles[profile].chunk_min ? profiles[profile].chunk_min :
+               bdp > CHUNK_MAX ? CHUNK_MAX : bdp;
+    if (profiles[profile].lowat) {
+        //the socket only reads as writable once less than this is unsent, so
+        //a large send buffer holds what's in flight rather than a queue
+        t->lowat = t->chunk;
+        if (setsockopt(sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &t->lowat, sizeof(t->lowat)) < 0)
+            t->lowat = 0;
+    }
+    if (profiles[profile].nodelay) {
+        int one = 1;
+        if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0)
+            t->nodelay = 1;
+    }
+
+    int one = 1, idle = KEEPALIVE_IDLE, intvl = KEEPALIVE_INTVL, cnt = KEEPALIVE_CNT;
+    if (setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) == 0) {
+        setsockopt(sd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(sd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+        setsockopt(sd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+        t->keepalive = KEEPALIVE_IDLE;
+    }
+}
+
+static const char *size_str(uint64_t n, char *buf, size_t len)
+{
+    if (n >= 1024 * 1024)
+        snprintf(buf, len, "%.1fMB", (double)n / (1024 * 1024));
+    else
+        snprintf(buf, len, "%lluKB", (unsigned long long)n / 1024);
+    return buf;
+}
+
+void tuning_format(const struct tuning *t, char *buf, size_t len)
+{
+    if (t->profile == TUNING_NONE) {
+        snprintf(buf, len, "none: kernel defaults");
+        return;
+    }
+    char want[16], snd[16], rcv[16], lowat[16], chunk[16], keepalive[16];
+    snprintf(keepalive, sizeof(keepalive), "%ds", t->keepalive);
+    snprintf(buf, len,
+             "%s: rtt %.2fms, %.2fGbit/s needs %s of buffer, sndbuf %s, rcvbuf %s%s, "
+             "notsent_lowat %s, chunk %s, nodelay %s, keepalive %s",
+             tuning_name(t->profile), t->rtt_us / 1000.0, (double)t->rate * 8 / 1e9,
+             size_str(t->want, want, sizeof(want)),
+             t->sndbuf ? size_str(t->sndbuf, snd, sizeof(snd)) : "auto",
+             t->rcvbuf ? size_str(t->rcvbuf, rcv, sizeof(rcv)) : "auto",
+             t->capped ? " (capped by net.core.wmem_max/rmem_max)" : "",
+             t->lowat ? size_str(t->lowat, lowat, sizeof(lowat)) : "off",
+             size_str(t->chunk, chunk, sizeof(chunk)), t->nodelay ? "on" : "off",
+             t->keepalive ? keepalive : "off");
+}
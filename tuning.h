@@ -0,0 +1,51 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Socket tuning shared by the relay, send and receive. A connection is tuned
+//once it's up and the kernel has a round trip time for it: the buffers are
+//sized for twice the bandwidth-delay product of the profile's link rate (or
+//the one given) at that RTT, and so is the chunk callers read, splice and
+//sendfile in. Buffers are left to the kernel's autotuning whenever that
+//already reaches far enough (up to the tcp_wmem and tcp_rmem maximum),
+//since setting them turns it off, and set explicitly, as far as
+//net.core.wmem_max and rmem_max allow, only when the path needs more.
+enum tuning_profile {
+    TUNING_AUTO = 0,      //lan-bulk or wan-high-bdp by the measured RTT
+    TUNING_LAN,           //lan-bulk, large chunks, buffers mostly autotuned
+    TUNING_WAN,           //wan-high-bdp, large buffers, unsent data kept low
+    TUNING_SMALL,         //many-small-files, no Nagle delay, small chunks
+    TUNING_NONE,          //leave the sockets as the kernel made them
+};
+
+//What tuning_apply did to a connection.
+struct tuning {
+    int profile;          //what auto came out as
+    uint32_t rtt_us;      //0 if the kernel didn't say
+    uint64_t rate;        //bytes per second the buffers are sized for
+    uint64_t want;        //the buffer size that rate needs at that RTT
+    int sndbuf;           //as the kernel reports them, 0 left to autotuning
+    int rcvbuf;
+    int capped;           //want is more than the kernel lets us set
+    int lowat;            //TCP_NOTSENT_LOWAT, 0 if not set
+    int nodelay;
+    int keepalive;        //idle seconds before probing, 0 if off
+    size_t chunk;         //for reads, splices and sendfiles, 0 for the default
+};
+
+//Parse "<profile>[:<MB/s>]", the profile being auto, lan-bulk (or lan),
+//wan-high-bdp (or wan), many-small-files (or small) or none, and the link
+//rate if given into rate (0 otherwise). Returns -1 if unknown.
+int tuning_parse(const char *spec, uint64_t *rate);
+const char *tuning_name(int profile);
+
+//Tune the connected socket sd for profile, sizing for rate bytes per second
+//(0 for the profile's own). Fills t with what was applied.
+void tuning_apply(int sd, int profile, uint64_t rate, struct tuning *t);
+
+//One line saying what was applied, for reporting.
+void tuning_format(const struct tuning *t, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,135 @@
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(r, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(p));
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_sz > r->sq_ring_sz)
+            r->sq_ring_sz = r->cq_ring_sz;
+        r->cq_ring_sz = r->sq_ring_sz;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = (char *)r->sq_ring;
+    char *cq = (char *)r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    {
+        int err = errno;
+        uring_exit(r);
+        errno = err;
+    }
+    return -1;
+}
+
+void uring_exit(struct uring *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_sz);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED)
+        munmap(r->sq_ring, r->sq_ring_sz);
+    if (r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(struct uring));
+    r->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries) {
+        //full, push what we have to the kernel and try again
+        if (uring_submit(r, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sqe_tail - head >= r->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sqe_tail++;
+    return sqe;
+}
+
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+    //the sq array just maps ring slots one to one onto the sqe array
+    unsigned tail = *r->sq_tail;
+    while (tail != r->sqe_tail) {
+        r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+        tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR && !wait_nr);
+    if (ret < 0 && errno == EINTR)
+        return 0;
+    return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
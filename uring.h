@@ -0,0 +1,48 @@
+#ifndef URING_H
+#define URING_H
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+
+//Minimal io_uring wrapper on top of the raw syscalls, just enough for the relay
+//workers to batch their socket operations. We don't depend on liburing since
+//none of the distributions we build on ship it by default.
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;    //next sqe handed out, published on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_sz;
+    void *cq_ring;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+};
+
+//returns 0 on success, -1 with errno set if io_uring isn't available
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+
+//get a zeroed submission entry, submitting queued entries first if the
+//submission queue is full. Returns NULL only if that fails too.
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+
+//submit everything queued and wait for at least wait_nr completions
+int uring_submit(struct uring *r, unsigned wait_nr);
+
+//next completion or NULL, uring_cqe_seen releases it back to the kernel
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+#endif
+
+#endif
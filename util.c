@@ -0,0 +1,89 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "util.h"
+
+uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int pwrite_all(int fd, const char *buf, size_t len, off_t off)
+{
+    while (len) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+int loop_init(struct loop *l, const char *name)
+{
+    l->name = name;
+    l->copybuf = malloc(LOOP_COPY_CHUNK);
+    l->epfd = epoll_create1(EPOLL_CLOEXEC);
+    l->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!l->copybuf || l->epfd < 0 || l->evfd < 0) {
+        log_error("Failed to set up %s (%s)", name, strerror(errno));
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->evfd, &ev) < 0) {
+        log_error("Failed epoll_ctl on %s eventfd (%s)", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void loop_wake(struct loop *l)
+{
+    uint64_t one = 1;
+    if (write(l->evfd, &one, sizeof(one)) < 0)
+        log_error("Failed to wake %s: %s", l->name, strerror(errno));
+}
+
+int loop_wait(struct loop *l, struct epoll_event *events, int max, int timeout_ms)
+{
+    int nfds = epoll_wait(l->epfd, events, max, timeout_ms);
+    if (nfds < 0) {
+        if (errno == EINTR)
+            return 0;
+        log_error("Failed epoll_wait in %s (%s)", l->name, strerror(errno));
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < nfds; ++i) {
+        if (events[i].data.ptr) {
+            events[n++] = events[i];
+            continue;
+        }
+        uint64_t count;
+        while (read(l->evfd, &count, sizeof(count)) > 0)
+            ;
+    }
+    return n;
+}
+
+void loop_close(struct loop *l)
+{
+    close(l->evfd);
+    close(l->epfd);
+    free(l->copybuf);
+    l->evfd = l->epfd = -1;
+    l->copybuf = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+
+//the monotonic clock in milliseconds, what timer wheels and rates run on
+uint64_t now_ms(void);
+
+//Write all len bytes of buf at off, through short writes and EINTR. Returns
+//0 or -1.
+int pwrite_all(int fd, const char *buf, size_t len, off_t off);
+
+//What the relay's service threads, such as the spool's, move their data
+//with: an epoll set of their own, and an eventfd in it (with a NULL data.ptr)
+//that other threads wake them through once they've handed over work under
+//the thread's lock.
+#define LOOP_COPY_CHUNK 65536
+
+struct loop {
+    const char *name;     //for the logs
+    int epfd;
+    int evfd;
+    char *copybuf;        //LOOP_COPY_CHUNK bytes for the thread to copy through
+};
+
+//Set up the epoll set and eventfd. Returns 0, or -1 having logged why.
+int loop_init(struct loop *l, const char *name);
+//from any thread, have the loop's thread look at its handed over work
+void loop_wake(struct loop *l);
+//Wait up to timeout_ms for events, into events. Returns how many there are,
+//the wakeup left out, 0 if interrupted and -1 if the epoll set failed.
+int loop_wait(struct loop *l, struct epoll_event *events, int max, int timeout_ms);
+void loop_close(struct loop *l);
+
+#endif
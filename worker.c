@@ -0,0 +1,840 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/limits.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "budget.h"
+#include "log.h"
+#include "pipepool.h"
+#include "schedule.h"
+#include "stats.h"
+#include "uring.h"
+#include "util.h"
+#include "worker.h"
+
+#define WORKER_EVENTS 256
+//number of splice (or read/write) rounds a transfer gets before yielding to
+//the other transfers on the same worker, it yields sooner once it has moved
+//its scheduling quantum
+#define TRANSFER_BUDGET 16
+#define COPY_CHUNK 8192
+
+struct transfer {
+    struct transfer_info *info;
+    struct worker *owner;
+    struct relay_pipe *pipe; //NULL when copying through buf instead
+    char *buf;
+    size_t bufoff;
+    size_t pending;       //bytes read from infd not yet written to outfd
+    char hdr[2 + PATH_MAX];
+    size_t hdrlen;
+    size_t hdroff;
+    int in_eof;
+    int bid;              //io_uring provided buffer in use, -1 if none
+    int op;               //io_uring operation in flight
+    int queued;           //on the ready list
+    int dead;             //finished, freed at the end of the event batch
+    uint64_t active;      //last time any data moved
+    uint64_t bytes;       //relayed to the receiver so far
+    int failed;
+    struct timer idle;
+    struct sched_flow sched;
+    struct timer throttle; //waiting for its bandwidth caps
+    LIST_ENTRY(transfer) entries;
+    TAILQ_ENTRY(transfer) ready;
+};
+
+struct worker {
+    int id;
+    int epfd;
+    int evfd;             //wakes the worker when new transfers are queued
+    pthread_t thread;
+    pthread_mutex_t lock;
+    STAILQ_HEAD(, transfer_req) incoming;
+    LIST_HEAD(, transfer) transfers;
+    TAILQ_HEAD(transfer_list, transfer) readyq;
+    struct timer_wheel wheel; //idle timeouts
+    uint64_t now;         //milliseconds, updated once per loop
+    int use_uring;
+#ifdef HAVE_IO_URING
+    struct uring ring;
+    char *bufs;           //provided buffers shared by all of the transfers
+    struct __kernel_timespec tick;
+#endif
+};
+
+struct transfer_req {
+    struct transfer_info *info;
+    STAILQ_ENTRY(transfer_req) entries;
+};
+
+static struct worker *workers = NULL;
+static int nworkers = 0;
+static unsigned int next_worker = 0;
+static int idle_timeout_ms = 0;
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void transfer_close(struct worker *w, struct transfer *t)
+{
+    if (t->dead)
+        return;
+    t->dead = 1;
+    timer_del(&w->wheel, &t->idle);
+    timer_del(&w->wheel, &t->throttle);
+    sched_flow_release(&t->sched);
+    if (t->queued) {
+        TAILQ_REMOVE(&w->readyq, t, ready);
+        t->queued = 0;
+    }
+    LIST_REMOVE(t, entries);
+    //closing the sockets also drops them from the epoll set
+    budget_close(t->info->infd);
+    budget_close(t->info->outfd);
+    //a pipe that still holds data from a failed transfer can't be reused
+    pipe_pool_put(t->pipe, t->pending == 0);
+    if (!w->use_uring)
+        free(t->buf);
+    stats_inc(STAT_TRANSFERS_FINISHED);
+    if (t->failed)
+        stats_inc(STAT_TRANSFERS_FAILED);
+    stats_observe(STAT_TRANSFER_TIME, now_ms() - t->info->started_ms);
+    transfer_info_put(t->info);
+}
+
+static void transfer_unthrottle(struct timer *timer);
+
+//Move data from infd to outfd until the kernel tells us to wait or the budget
+//runs out. Returns 1 if there is more to do right away, 0 if waiting on a
+//socket or the bandwidth caps and -1 once the transfer is finished (or
+//failed).
+static int transfer_pump(struct transfer *t, uint64_t now)
+{
+    int in = t->info->infd;
+    int out = t->info->outfd;
+    size_t turn = 0;
+    ssize_t n;
+
+    for (int round = 0; round < TRANSFER_BUDGET; ++round) {
+        //the filename header for the receiver goes out before any data
+        if (t->hdroff < t->hdrlen) {
+            n = send(out, &t->hdr[t->hdroff], t->hdrlen - t->hdroff,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0)
+                goto check_errno;
+            t->hdroff += n;
+            t->active = now;
+            continue;
+        }
+
+        //drain whatever is sitting in the pipe (or buffer) first. A partial
+        //drain just leaves the rest pending for the next EPOLLOUT.
+        if (t->pending) {
+            if (t->pipe)
+                n = splice(t->pipe->fd[0], NULL, out, NULL, t->pending,
+                           SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+            else
+                n = send(out, &t->buf[t->bufoff], t->pending,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0)
+                goto check_errno;
+            t->pending -= n;
+            t->bufoff += n;
+            t->bytes += n;
+            stats_add(STAT_BYTES, n);
+            t->active = now;
+            continue;
+        }
+
+        if (t->in_eof)
+            return -1;
+
+        //Once the transfer has moved its quantum the others on the worker
+        //get their turn, however much it has left
+        if (turn >= t->sched.quantum)
+            return 1;
+
+        //Only refill once the pipe is empty. That way EAGAIN from the splice
+        //below can only mean the socket has nothing to read, never that the
+        //pipe is full. Each fill asks for as much as the pipe can hold, the
+        //rest of the quantum and the bandwidth caps allow.
+        size_t want = t->pipe ? t->pipe->size : COPY_CHUNK;
+        if (want > t->sched.quantum - turn)
+            want = t->sched.quantum - turn;
+        int wait_ms;
+        want = sched_allow(&t->sched, want, now, &wait_ms);
+        if (!want) {
+            timer_add(&t->owner->wheel, &t->throttle, now, wait_ms, transfer_unthrottle);
+            return 0;
+        }
+        if (t->pipe)
+            n = splice(in, NULL, t->pipe->fd[1], NULL, want,
+                       SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        else
+            n = recv(in, t->buf, want, MSG_DONTWAIT);
+        if (n < 0)
+            goto check_errno;
+        sched_charge(&t->sched, n);
+        turn += n;
+        if (t->pipe && n > 0)
+            pipe_pool_account(t->pipe, in, want, n);
+        if (n == 0)
+            t->in_eof = 1;
+        t->pending = n;
+        t->bufoff = 0;
+    }
+    return 1;
+
+check_errno:
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+    if (errno == EINTR)
+        return 1;
+    log_limited(LEVEL_WARN, "Transfer %d:%d failed: %s",
+                t->info->infd, t->info->outfd, strerror(errno));
+    t->failed = 1;
+    return -1;
+}
+
+static void transfer_run(struct worker *w, struct transfer *t)
+{
+    if (t->dead)
+        return;
+    int res = transfer_pump(t, w->now);
+    if (res < 0) {
+        log_debug("transfer %d:%d finished on worker %d after %llu bytes",
+                  t->info->infd, t->info->outfd, w->id, (unsigned long long)t->bytes);
+        transfer_close(w, t);
+    } else if (res > 0 && !t->queued) {
+        TAILQ_INSERT_TAIL(&w->readyq, t, ready);
+        t->queued = 1;
+    }
+}
+
+#ifdef HAVE_IO_URING
+//In io_uring mode each worker submits recv/send operations for all of its
+//transfers in one batch per loop. Receives pick a buffer from a pool of
+//provided buffers only once data actually arrives, so idle transfers don't pin
+//any memory. Splice isn't used here since io_uring always punts it to a
+//blocking kernel thread.
+#define URING_ENTRIES 4096
+#define URING_BUFS 128
+#define URING_BUF_SIZE 32768
+#define URING_BGID 1
+
+//user_data values that aren't transfer pointers
+#define UDATA_WAKE 1
+#define UDATA_TICK 2
+#define UDATA_BUFFERS 3
+
+enum { OP_NONE = 0, OP_HDR, OP_RECV, OP_SEND };
+
+static int uring_provide_buffers(struct worker *w, int bid, int count)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (unsigned long)&w->bufs[(size_t)bid * URING_BUF_SIZE];
+    sqe->len = URING_BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UDATA_BUFFERS;
+    return 0;
+}
+
+static int uring_worker_init(struct worker *w)
+{
+    if (uring_init(&w->ring, URING_ENTRIES) < 0)
+        return -1;
+    w->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (!w->bufs) {
+        uring_exit(&w->ring);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    //hand the kernel the whole buffer pool up front, which also tells us if
+    //the kernel is new enough for provided buffers
+    struct io_uring_cqe *cqe;
+    if (uring_provide_buffers(w, 0, URING_BUFS) < 0 || uring_submit(&w->ring, 1) < 0 ||
+        !(cqe = uring_peek_cqe(&w->ring)))
+        goto fail;
+    int res = cqe->res;
+    uring_cqe_seen(&w->ring);
+    if (res < 0) {
+        errno = -res;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    {
+        int err = errno;
+        uring_exit(&w->ring);
+        free(w->bufs);
+        w->bufs = NULL;
+        errno = err;
+    }
+    return -1;
+}
+
+static void uring_transfer_finish(struct worker *w, struct transfer *t)
+{
+    if (t->bid >= 0)
+        uring_provide_buffers(w, t->bid, 1);
+    transfer_close(w, t);
+    free(t);
+}
+
+//queue the next operation for a transfer, there is only ever one in flight
+static void uring_transfer_queue(struct worker *w, struct transfer *t)
+{
+    //a receive waits for the bandwidth caps to allow it
+    size_t want = URING_BUF_SIZE;
+    if (t->hdroff >= t->hdrlen && !t->pending) {
+        int wait_ms;
+        want = sched_allow(&t->sched, want, w->now, &wait_ms);
+        if (!want) {
+            timer_add(&w->wheel, &t->throttle, w->now, wait_ms, transfer_unthrottle);
+            return;
+        }
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe) {
+        log_error("io_uring submission queue full, dropping transfer %d:%d",
+                  t->info->infd, t->info->outfd);
+        uring_transfer_finish(w, t);
+        return;
+    }
+
+    if (t->hdroff < t->hdrlen) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = t->info->outfd;
+        sqe->addr = (unsigned long)&t->hdr[t->hdroff];
+        sqe->len = t->hdrlen - t->hdroff;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        t->op = OP_HDR;
+    } else if (t->pending) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = t->info->outfd;
+        sqe->addr = (unsigned long)&t->buf[t->bufoff];
+        sqe->len = t->pending;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        t->op = OP_SEND;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = t->info->infd;
+        sqe->len = want;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BGID;
+        t->op = OP_RECV;
+    }
+    sqe->user_data = (unsigned long)t;
+}
+
+static void uring_release_buffer(struct worker *w, struct transfer *t)
+{
+    uring_provide_buffers(w, t->bid, 1);
+    t->bid = -1;
+    t->buf = NULL;
+
+    //the buffer is back in the pool before anything queued after it runs, so
+    //one transfer that came up empty handed can go again
+    struct transfer *waiting = TAILQ_FIRST(&w->readyq);
+    if (waiting) {
+        TAILQ_REMOVE(&w->readyq, waiting, ready);
+        waiting->queued = 0;
+        uring_transfer_queue(w, waiting);
+    }
+}
+
+static void uring_transfer_complete(struct worker *w, struct transfer *t,
+                                    struct io_uring_cqe *cqe)
+{
+    int op = t->op;
+    int res = cqe->res;
+    t->op = OP_NONE;
+
+    if (op == OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        t->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        t->buf = &w->bufs[(size_t)t->bid * URING_BUF_SIZE];
+    }
+
+    if (res == -ENOBUFS) {
+        //all buffers are busy, wait for another transfer to give one back
+        TAILQ_INSERT_TAIL(&w->readyq, t, ready);
+        t->queued = 1;
+        return;
+    }
+    if (res < 0 || (op == OP_RECV && res == 0)) {
+        if (res < 0) {
+            log_limited(LEVEL_WARN, "Transfer %d:%d failed: %s",
+                        t->info->infd, t->info->outfd, strerror(-res));
+            t->failed = 1;
+        }
+        log_debug("transfer %d:%d finished on worker %d after %llu bytes",
+                  t->info->infd, t->info->outfd, w->id, (unsigned long long)t->bytes);
+        uring_transfer_finish(w, t);
+        return;
+    }
+
+    t->active = w->now;
+    switch (op) {
+    case OP_HDR:
+        t->hdroff += res;
+        break;
+    case OP_RECV:
+        t->pending = res;
+        t->bufoff = 0;
+        sched_charge(&t->sched, res);
+        break;
+    case OP_SEND:
+        t->pending -= res;
+        t->bufoff += res;
+        t->bytes += res;
+        stats_add(STAT_BYTES, res);
+        if (!t->pending)
+            uring_release_buffer(w, t);
+        break;
+    }
+    uring_transfer_queue(w, t);
+}
+
+static void uring_transfer_start(struct worker *w, struct transfer *t)
+{
+    //io_uring polls for readiness itself. A socket marked O_NONBLOCK would
+    //hand us EAGAIN instead, so make sure both ends are blocking.
+    int fds[2] = { t->info->infd, t->info->outfd };
+    for (int i = 0; i < 2; ++i) {
+        int flags = fcntl(fds[i], F_GETFL, 0);
+        if (flags >= 0)
+            fcntl(fds[i], F_SETFL, flags & ~O_NONBLOCK);
+    }
+    uring_transfer_queue(w, t);
+}
+#endif
+
+//The idle timer isn't pushed back every time data moves, it just checks when
+//it fires and re-arms itself if the transfer did something in the meantime.
+static void transfer_idle(struct timer *timer)
+{
+    struct transfer *t = (struct transfer *)((char *)timer - offsetof(struct transfer, idle));
+    struct worker *w = t->owner;
+    if (w->now < t->active + idle_timeout_ms) {
+        timer_add(&w->wheel, &t->idle, w->now, t->active + idle_timeout_ms - w->now,
+                  transfer_idle);
+        return;
+    }
+    log_limited(LEVEL_WARN, "Transfer %d:%d idle for %d seconds, dropping it",
+                t->info->infd, t->info->outfd, idle_timeout_ms / 1000);
+    t->failed = 1;
+    stats_inc(STAT_TRANSFERS_IDLE);
+#ifdef HAVE_IO_URING
+    if (w->use_uring) {
+        //there may be an operation in flight, let it fail and finish the
+        //transfer through the usual completion path
+        shutdown(t->info->infd, SHUT_RDWR);
+        shutdown(t->info->outfd, SHUT_RDWR);
+        return;
+    }
+#endif
+    transfer_close(w, t);
+    free(t);
+}
+
+//the bandwidth caps let the transfer go on
+static void transfer_unthrottle(struct timer *timer)
+{
+    struct transfer *t = (struct transfer *)((char *)timer - offsetof(struct transfer, throttle));
+    struct worker *w = t->owner;
+#ifdef HAVE_IO_URING
+    if (w->use_uring) {
+        uring_transfer_queue(w, t);
+        return;
+    }
+#endif
+    transfer_run(w, t);
+    if (t->dead)
+        free(t);
+}
+
+static void transfer_start(struct worker *w, struct transfer_info *info)
+{
+    struct transfer *t = calloc(1, sizeof(struct transfer));
+    if (!t) {
+        log_error("Insufficient memory to start transfer");
+        budget_close(info->infd);
+        budget_close(info->outfd);
+        transfer_info_put(info);
+        return;
+    }
+    t->info = info;
+    t->owner = w;
+    LIST_INSERT_HEAD(&w->transfers, t, entries);
+
+    uint16_t fsize = htons(info->fnlen);
+    memcpy(t->hdr, &fsize, 2);
+    memcpy(&t->hdr[2], info->filename, info->fnlen);
+    t->hdrlen = 2 + info->fnlen;
+    t->bid = -1;
+    t->active = w->now;
+    sched_flow_init(&t->sched, info, w->now);
+    if (idle_timeout_ms)
+        timer_add(&w->wheel, &t->idle, w->now, idle_timeout_ms, transfer_idle);
+
+#ifdef HAVE_IO_URING
+    if (w->use_uring) {
+        uring_transfer_start(w, t);
+        return;
+    }
+#endif
+
+#ifdef USE_SPLICE
+    //when the pool is out of pipes this transfer copies through userspace
+    t->pipe = pipe_pool_get();
+#endif
+    if (!t->pipe) {
+        t->buf = malloc(COPY_CHUNK);
+        if (!t->buf) {
+            log_error("Insufficient memory for transfer buffer");
+            transfer_close(w, t);
+            free(t);
+            return;
+        }
+    }
+
+    if (set_nonblocking(info->infd) < 0 || set_nonblocking(info->outfd) < 0) {
+        log_error("Failed to make transfer sockets non blocking");
+        transfer_close(w, t);
+        free(t);
+        return;
+    }
+
+    //Edge triggered on both ends: the pump always runs until EAGAIN or until
+    //its budget is used up, in which case it goes on the ready list instead.
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = t;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, info->infd, &ev) < 0 ||
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, info->outfd, &ev) < 0) {
+        log_error("Failed epoll_ctl on transfer (%s)", strerror(errno));
+        transfer_close(w, t);
+        free(t);
+        return;
+    }
+
+    transfer_run(w, t);
+    if (t->dead)
+        free(t);
+}
+
+static void worker_accept_transfers(struct worker *w)
+{
+    uint64_t count;
+    if (read(w->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_error("Failed to read worker eventfd: %s", strerror(errno));
+
+    pthread_mutex_lock(&w->lock);
+    struct transfer_req *req = STAILQ_FIRST(&w->incoming);
+    STAILQ_INIT(&w->incoming);
+    pthread_mutex_unlock(&w->lock);
+
+    while (req) {
+        struct transfer_req *next = STAILQ_NEXT(req, entries);
+        transfer_start(w, req->info);
+        free(req);
+        req = next;
+    }
+}
+
+static void worker_epoll_loop(struct worker *w)
+{
+    struct epoll_event events[WORKER_EVENTS];
+    //transfers closed during a batch of events are freed once the batch is
+    //done, since the other end of the same transfer may still be in events
+    struct transfer *dead[WORKER_EVENTS + 1];
+
+    while (!stop) {
+        int timeout = TAILQ_EMPTY(&w->readyq) ? timer_wheel_timeout(&w->wheel, w->now, 100) : 0;
+        int nfds = epoll_wait(w->epfd, events, WORKER_EVENTS, timeout);
+        w->now = now_ms();
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("Failed epoll_wait in worker %d (%s)",
+                      w->id, strerror(errno));
+            break;
+        }
+
+        int ndead = 0;
+        for (int n = 0; n < nfds; n++) {
+            struct transfer *t = (struct transfer *)events[n].data.ptr;
+            if (!t) {
+                worker_accept_transfers(w);
+                continue;
+            }
+            if (t->dead)
+                continue;
+            transfer_run(w, t);
+            if (t->dead)
+                dead[ndead++] = t;
+        }
+
+        //give every transfer that ran out of budget another round, but only
+        //the ones that were waiting before this pass started
+        struct transfer *last = TAILQ_LAST(&w->readyq, transfer_list);
+        while (last && ndead < WORKER_EVENTS) {
+            struct transfer *t = TAILQ_FIRST(&w->readyq);
+            TAILQ_REMOVE(&w->readyq, t, ready);
+            t->queued = 0;
+            transfer_run(w, t);
+            if (t->dead)
+                dead[ndead++] = t;
+            if (t == last)
+                break;
+        }
+
+        for (int n = 0; n < ndead; n++)
+            free(dead[n]);
+
+        timer_wheel_advance(&w->wheel, w->now);
+    }
+}
+
+#ifdef HAVE_IO_URING
+static void uring_arm_wake(struct worker *w)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->evfd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UDATA_WAKE;
+}
+
+static void uring_arm_tick(struct worker *w)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (!sqe)
+        return;
+    w->tick.tv_sec = 0;
+    w->tick.tv_nsec = 100 * 1000 * 1000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&w->tick;
+    sqe->len = 1;
+    sqe->user_data = UDATA_TICK;
+}
+
+static void worker_uring_loop(struct worker *w)
+{
+    uring_arm_wake(w);
+    uring_arm_tick(w);
+
+    while (!stop) {
+        //one syscall submits everything queued by the previous pass and waits
+        //for the next completion
+        if (uring_submit(&w->ring, 1) < 0 && errno != EBUSY) {
+            log_error("Failed io_uring_enter in worker %d (%s)",
+                      w->id, strerror(errno));
+            break;
+        }
+
+        w->now = now_ms();
+        struct io_uring_cqe *ring_cqe;
+        while ((ring_cqe = uring_peek_cqe(&w->ring))) {
+            struct io_uring_cqe cqe = *ring_cqe;
+            uring_cqe_seen(&w->ring);
+
+            switch (cqe.user_data) {
+            case UDATA_WAKE:
+                worker_accept_transfers(w);
+                uring_arm_wake(w);
+                break;
+            case UDATA_TICK:
+                uring_arm_tick(w);
+                break;
+            case UDATA_BUFFERS:
+                if (cqe.res < 0)
+                    log_error("Failed to return buffer to worker %d: %s",
+                              w->id, strerror(-cqe.res));
+                break;
+            default:
+                uring_transfer_complete(w, (struct transfer *)cqe.user_data, &cqe);
+                break;
+            }
+        }
+        timer_wheel_advance(&w->wheel, w->now);
+    }
+}
+#endif
+
+static void *worker_main(void *opaque)
+{
+    struct worker *w = (struct worker *)opaque;
+
+    pid_t tid = syscall(SYS_gettid);
+    log_info("worker %d started as thread %d%s", w->id, tid,
+             w->use_uring ? " using io_uring" : "");
+
+#ifdef HAVE_IO_URING
+    if (w->use_uring) {
+        worker_uring_loop(w);
+        //tearing down the ring cancels whatever is still in flight, after
+        //that the transfers and their buffers can go
+        uring_exit(&w->ring);
+    } else
+#endif
+        worker_epoll_loop(w);
+
+    while (!LIST_EMPTY(&w->transfers)) {
+        struct transfer *t = LIST_FIRST(&w->transfers);
+        transfer_close(w, t);
+        free(t);
+    }
+
+#ifdef HAVE_IO_URING
+    free(w->bufs);
+#endif
+    log_info("worker %d exiting", w->id);
+    return NULL;
+}
+
+int workers_start(int count, int use_uring, int pin, int idle_ms)
+{
+    idle_timeout_ms = idle_ms;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1)
+        count = 1;
+    workers = calloc(count, sizeof(struct worker));
+    if (!workers) {
+        log_error("Insufficient memory for workers");
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        struct worker *w = &workers[i];
+        w->id = i;
+        pthread_mutex_init(&w->lock, NULL);
+        STAILQ_INIT(&w->incoming);
+        LIST_INIT(&w->transfers);
+        TAILQ_INIT(&w->readyq);
+        w->now = now_ms();
+        timer_wheel_init(&w->wheel, w->now);
+
+        w->epfd = epoll_create1(0);
+        if (w->epfd < 0) {
+            log_error("Failed to create worker epollfd (%s)", strerror(errno));
+            return -1;
+        }
+        w->evfd = eventfd(0, EFD_NONBLOCK);
+        if (w->evfd < 0) {
+            log_error("Failed to create worker eventfd (%s)", strerror(errno));
+            return -1;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev) < 0) {
+            log_error("Failed epoll_ctl on worker eventfd (%s)", strerror(errno));
+            return -1;
+        }
+
+        if (use_uring) {
+#ifdef HAVE_IO_URING
+            if (uring_worker_init(w) == 0)
+                w->use_uring = 1;
+            else
+                log_warn("io_uring not available (%s), worker %d using epoll",
+                         strerror(errno), i);
+#else
+            log_warn("Built without io_uring, worker %d using epoll", i);
+#endif
+        }
+
+        pthread_attr_t tattr;
+        pthread_attr_init(&tattr);
+        pthread_attr_setstacksize(&tattr, PTHREAD_STACK_MIN + 65536);
+        if (pthread_create(&w->thread, &tattr, worker_main, w) != 0) {
+            log_error("Failed to start worker %d", i);
+            pthread_attr_destroy(&tattr);
+            return -1;
+        }
+        pthread_attr_destroy(&tattr);
+        char thread_name[16];
+        snprintf(thread_name, 16, "worker-%d", i);
+        pthread_setname_np(w->thread, thread_name);
+        if (pin && ncpus > 0)
+            pin_thread(w->thread, i % ncpus);
+        nworkers++;
+    }
+    return 0;
+}
+
+int worker_submit(struct transfer_info *tr, int cpu)
+{
+    if (!nworkers)
+        return -1;
+    struct transfer_req *req = malloc(sizeof(struct transfer_req));
+    if (!req)
+        return -1;
+    req->info = tr;
+
+    unsigned int idx = cpu >= 0 ? (unsigned int)cpu :
+                       __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED);
+    struct worker *w = &workers[idx % nworkers];
+    pthread_mutex_lock(&w->lock);
+    STAILQ_INSERT_TAIL(&w->incoming, req, entries);
+    pthread_mutex_unlock(&w->lock);
+
+    uint64_t one = 1;
+    if (write(w->evfd, &one, sizeof(one)) < 0)
+        log_error("Failed to wake worker: %s", strerror(errno));
+    return 0;
+}
+
+void workers_join(void)
+{
+    for (int i = 0; i < nworkers; ++i) {
+        struct worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+
+        //anything handed over after the worker stopped looking
+        struct transfer_req *req;
+        while ((req = STAILQ_FIRST(&w->incoming))) {
+            STAILQ_REMOVE_HEAD(&w->incoming, entries);
+            budget_close(req->info->infd);
+            budget_close(req->info->outfd);
+            transfer_info_put(req->info);
+            free(req);
+        }
+        close(w->evfd);
+        close(w->epfd);
+        pthread_mutex_destroy(&w->lock);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "relay.h"
+
+//Event driven data plane. A fixed pool of worker threads, each with its own
+//epoll set, moves data for many transfers at once using non-blocking splice
+//(or a non-blocking read/write loop when built without USE_SPLICE).
+
+//Start count worker threads, returns 0 on success. With use_uring the workers
+//drive their transfers through io_uring instead of epoll when the kernel
+//supports it, falling back to epoll otherwise. With pin, worker i is pinned to
+//cpu i (modulo the number of cpus). Transfers that move no data for idle_ms
+//are dropped, 0 lets them sit forever.
+int workers_start(int count, int use_uring, int pin, int idle_ms);
+
+//Hand a matched pair over to one of the workers. The worker takes ownership of
+//the transfer info and both of its file descriptors. cpu picks the worker
+//pinned to that core so the transfer stays where it was accepted, -1 spreads
+//transfers over all workers.
+int worker_submit(struct transfer_info *tr, int cpu);
+
+//wait for the workers to exit (after stop is set) and close any transfers
+//still in flight
+void workers_join(void);
+
+#endif